@@ -0,0 +1,924 @@
+/**
+ * @file bench.c
+ * @brief Benchmark harness for the hot paths of waveform generation (make bench)
+ *
+ * Every benchmark runs a fixed piece of work on inputs that are generated
+ * from fixed seeds: sample reduction, drawing, the UP filter, deflate, the
+ * chunk CRC, whole PNG files and whole files of the synthetic corpus.  Each
+ * one is repeated until a sample takes at least SAMPLE_SECONDS, and the
+ * samples are reported as time per unit of work, so the figures do not
+ * depend on how long the run took and can be compared between commits.
+ * The fastest sample is the one recorded and compared, since interference
+ * from the rest of the machine only ever adds time; the median is printed
+ * next to it to show the spread.  Against a baseline file, every benchmark
+ * that got slower by more than the tolerance is reported and the run
+ * fails.
+ */
+
+// The UP filter loop and the chunk CRC are private to the PNG encoder, so
+// the encoder is compiled into the harness instead of being linked
+#include "../src/optimized_png.c"
+
+#include "stats.h"
+#include "threadpool.h"
+#include <dirent.h>
+#include <math.h>
+
+#define SAMPLE_SECONDS 0.05
+#define DEFAULT_SAMPLES 9
+#define DEFAULT_TOLERANCE 15.0
+#define BENCH_WIDTH 2048
+#define BENCH_HEIGHT 128
+#define BENCH_FRAMES (60 * 44100)
+#define DECODER_FRAMES 1152
+#define MAX_RESULTS 64
+#define CHECK_CASES 3000
+#define CHECK_MAX_FRAMES 20000
+#define CHECK_MAX_WIDTH 200
+#define CHECK_POOL_TASKS 400
+#define CHECK_POOL_SPINS 200000
+
+/**
+ * @brief Harness settings from the command line
+ */
+typedef struct {
+    const char *corpus;          /**< Directory of the synthetic MP3 corpus (NULL to skip) */
+    const char *baseline;        /**< Baseline to compare against (NULL for none) */
+    const char *write_baseline;  /**< File to record the results in (NULL for none) */
+    const char *filter;          /**< Only run benchmarks whose name contains this */
+    double tolerance;            /**< Allowed slowdown in percent */
+    unsigned int samples;        /**< Samples per benchmark */
+    bool check_only;             /**< Only check the kernels against their references */
+} bench_options_t;
+
+/**
+ * @brief Result of one benchmark
+ */
+typedef struct {
+    char name[64];     /**< Benchmark name */
+    const char *unit;  /**< Unit of the figures */
+    double median;     /**< Median time per unit of work over the samples */
+    double min;        /**< Fastest sample, the figure that is compared */
+} bench_result_t;
+
+/**
+ * @brief All results of a run
+ */
+typedef struct {
+    const bench_options_t *options; /**< Harness settings */
+    bench_result_t results[MAX_RESULTS]; /**< Results in the order run */
+    size_t count;                   /**< Number of results */
+} bench_run_t;
+
+/**
+ * @brief One call of a benchmark
+ *
+ * @param state Benchmark state
+ * @return true if successful, false if the work failed
+ */
+typedef bool (*bench_fn)(void *state);
+
+/**
+ * @brief Compare two doubles for qsort
+ *
+ * @param a First value
+ * @param b Second value
+ * @return Negative, zero or positive as a is less than, equal to or greater than b
+ */
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Time a benchmark and record its result
+ *
+ * One warm-up call also finds how many calls make a sample of at least
+ * SAMPLE_SECONDS; every sample then runs that many calls.
+ *
+ * @param run Results so far
+ * @param name Benchmark name
+ * @param unit Unit of the result, e.g. "ns/byte"
+ * @param scale Units of time per second, e.g. 1e9 for nanoseconds
+ * @param work Units of work done by one call
+ * @param fn Benchmark
+ * @param state Benchmark state
+ * @return true if successful (or filtered out), false if the work failed
+ */
+static bool measure(bench_run_t *run, const char *name, const char *unit, double scale, double work,
+                    bench_fn fn, void *state) {
+    const bench_options_t *options = run->options;
+    if (options->filter && !strstr(name, options->filter)) {
+        return true;
+    }
+    if (run->count == MAX_RESULTS) {
+        fprintf(stderr, "Too many benchmarks\n");
+        return false;
+    }
+
+    double start = waver_stats_now();
+    if (!fn(state)) {
+        fprintf(stderr, "Benchmark %s failed\n", name);
+        return false;
+    }
+    double once = waver_stats_now() - start;
+    unsigned long calls = once > 0.0 ? (unsigned long)ceil(SAMPLE_SECONDS / once) : 1000000;
+    if (calls < 1) {
+        calls = 1;
+    }
+
+    double *samples = malloc(options->samples * sizeof(double));
+    if (!samples) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    for (unsigned int s = 0; s < options->samples; s++) {
+        start = waver_stats_now();
+        for (unsigned long i = 0; i < calls; i++) {
+            if (!fn(state)) {
+                fprintf(stderr, "Benchmark %s failed\n", name);
+                free(samples);
+                return false;
+            }
+        }
+        samples[s] = (waver_stats_now() - start) / (double)calls / work * scale;
+    }
+    qsort(samples, options->samples, sizeof(double), compare_doubles);
+
+    bench_result_t *result = &run->results[run->count++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->unit = unit;
+    result->median = samples[options->samples / 2];
+    result->min = samples[0];
+    free(samples);
+
+    printf("  %-28s %12.4f %12.4f  %s\n", result->name, result->median, result->min, result->unit);
+    fflush(stdout);
+    return true;
+}
+
+/**
+ * @brief Next value of a linear congruential generator
+ *
+ * @param state Generator state
+ * @return 24 pseudo-random bits
+ */
+static uint32_t next_random(uint32_t *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+/**
+ * @brief Fill a buffer with music-like PCM: noise under a changing envelope
+ *
+ * Some blocks are at full scale so that -32768 shows up as well.
+ *
+ * @param pcm Interleaved samples to fill
+ * @param frames Number of sample frames
+ * @param channels Channels per frame
+ * @param seed Seed of the content
+ */
+static void fill_pcm(int16_t *pcm, size_t frames, unsigned int channels, uint32_t seed) {
+    uint32_t random = seed;
+    int32_t amplitude = 0;
+    for (size_t i = 0; i < frames; i++) {
+        if (i % 512 == 0) {
+            amplitude = next_random(&random) % 16 == 0 ? 32768 : (int32_t)(next_random(&random) % 32768);
+        }
+        for (unsigned int ch = 0; ch < channels; ch++) {
+            int32_t sample = (int32_t)(next_random(&random) % 65536) - 32768;
+            pcm[i * channels + ch] = (int16_t)(sample * amplitude / 32768);
+        }
+    }
+}
+
+/**
+ * @brief State of the sample reduction benchmarks
+ */
+typedef struct {
+    const int16_t *pcm;    /**< Interleaved samples */
+    size_t frames;         /**< Number of sample frames */
+    unsigned int channels; /**< Channels per frame */
+    bool scalar;           /**< Use the scalar reference instead of the SIMD kernels */
+} peaks_state_t;
+
+/**
+ * @brief Reduce the samples to column peaks in blocks of one MP3 frame
+ *
+ * @param state peaks_state_t
+ * @return true if successful, false on allocation failure
+ */
+static bool run_peaks(void *state) {
+    const peaks_state_t *s = state;
+    waver_peaks_t *peaks = waver_peaks_new(BENCH_WIDTH, s->frames, 1, 0);
+    if (!peaks) {
+        return false;
+    }
+    bool ok = true;
+    for (size_t i = 0; i < s->frames && ok; i += DECODER_FRAMES) {
+        size_t frames = s->frames - i < DECODER_FRAMES ? s->frames - i : DECODER_FRAMES;
+        const int16_t *pcm = s->pcm + i * s->channels;
+        ok = s->scalar ? waver_peaks_add_scalar(peaks, pcm, frames, s->channels)
+                       : waver_peaks_add(peaks, pcm, frames, s->channels);
+    }
+    waver_peaks_free(peaks);
+    return ok;
+}
+
+/**
+ * @brief Random PCM sample at a given scale, now and then a full-scale one
+ *
+ * @param random Generator state
+ * @param scale Largest magnitude of the ordinary samples (0 to 32768)
+ * @return Sample
+ */
+static int16_t check_sample(uint32_t *random, int32_t scale) {
+    static const int16_t EXTREMES[] = {INT16_MIN, INT16_MAX, INT16_MIN + 1, -1, 1};
+    if (next_random(random) % 128 == 0) {
+        return EXTREMES[next_random(random) % (sizeof(EXTREMES) / sizeof(EXTREMES[0]))];
+    }
+    return (int16_t)(((int32_t)(next_random(random) % 65536) - 32768) * scale / 32768);
+}
+
+/**
+ * @brief Compare waver_peaks_add() with waver_peaks_add_scalar() on one random layout
+ *
+ * Both accumulators get the same samples in the same blocks: odd lengths
+ * that start and end inside columns, at unaligned addresses, from a random
+ * first sample, and fewer or more samples than the layout expects.
+ *
+ * @param seed Seed of the case
+ * @param pcm Buffer of at least (CHECK_MAX_FRAMES + 4 * CHECK_MAX_WIDTH) * 2 + 8 samples
+ * @return true if both produced the same bins, false on a mismatch or allocation failure
+ */
+static bool check_peaks_case(uint32_t seed, int16_t *pcm) {
+    uint32_t random = seed;
+    unsigned int channels = 1 + next_random(&random) % 2;
+    unsigned int width = 1 + next_random(&random) % CHECK_MAX_WIDTH;
+    uint64_t expected = 1 + next_random(&random) % CHECK_MAX_FRAMES;
+    unsigned int split = 1 + next_random(&random) % 4;
+    uint64_t first = next_random(&random) % 4 == 0 ? next_random(&random) % expected : 0;
+    uint64_t frames = expected - first;
+    switch (next_random(&random) % 3) {
+        case 0:
+            frames -= next_random(&random) % frames;
+            break;
+        case 1:
+            frames += next_random(&random) % (4 * CHECK_MAX_WIDTH);
+            break;
+        default:
+            break;
+    }
+    int32_t scale = next_random(&random) % 8 == 0 ? 32768 : (int32_t)(next_random(&random) % 32769);
+    int16_t *samples = pcm + next_random(&random) % 8;
+    for (uint64_t i = 0; i < frames * channels; i++) {
+        samples[i] = check_sample(&random, scale);
+    }
+
+    waver_peaks_t *simd = waver_peaks_new(width, expected, split, first);
+    waver_peaks_t *scalar = waver_peaks_new(width, expected, split, first);
+    bool ok = simd && scalar;
+    for (uint64_t done = 0; ok && done < frames;) {
+        uint64_t block = 1 + next_random(&random) % (next_random(&random) % 3 == 0 ? 2000 : 40);
+        if (block > frames - done) {
+            block = frames - done;
+        }
+        const int16_t *start = samples + done * channels;
+        ok = waver_peaks_add(simd, start, (size_t)block, channels) &&
+             waver_peaks_add_scalar(scalar, start, (size_t)block, channels);
+        done += block;
+    }
+    if (ok) {
+        ok = simd->samples == scalar->samples && simd->bin == scalar->bin &&
+             simd->bin_remaining == scalar->bin_remaining &&
+             memcmp(simd->left, scalar->left, (simd->bin + 1) * sizeof(uint16_t)) == 0 &&
+             memcmp(simd->right, scalar->right, (simd->bin + 1) * sizeof(uint16_t)) == 0;
+        if (!ok) {
+            fprintf(stderr,
+                    "Peak kernels differ from the scalar reference: seed %u, %u channel%s, width %u, "
+                    "%llu expected samples, split %u, first sample %llu, %llu frames\n",
+                    seed, channels, channels == 1 ? "" : "s", width, (unsigned long long)expected, split,
+                    (unsigned long long)first, (unsigned long long)frames);
+        }
+    } else {
+        fprintf(stderr, "Memory allocation failed\n");
+    }
+    waver_peaks_free(simd);
+    waver_peaks_free(scalar);
+    return ok;
+}
+
+/**
+ * @brief Check the SIMD peak kernels against the scalar reference
+ *
+ * @return true if every case matched, false otherwise
+ */
+static bool check_peaks(void) {
+    int16_t *pcm = malloc(((CHECK_MAX_FRAMES + 4 * CHECK_MAX_WIDTH) * 2 + 8) * sizeof(int16_t));
+    if (!pcm) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    bool ok = true;
+    for (uint32_t seed = 1; ok && seed <= CHECK_CASES; seed++) {
+        ok = check_peaks_case(seed, pcm);
+    }
+    free(pcm);
+    if (ok) {
+        printf("Peak kernels match the scalar reference in %d random layouts\n", CHECK_CASES);
+    }
+    return ok;
+}
+
+/**
+ * @brief Tasks of the pool check that are running at once
+ */
+typedef struct {
+    atomic_size_t running; /**< Tasks running now */
+    atomic_size_t peak;    /**< Most tasks that were running at once */
+} check_pool_state_t;
+
+/**
+ * @brief Spin for a while, counting the tasks that overlap
+ *
+ * @param pool Thread pool running the task
+ * @param task Task whose context is the check_pool_state_t
+ * @return true
+ */
+static bool run_check_pool(threadpool_t *pool, const task_t *task) {
+    (void)pool;
+    check_pool_state_t *state = task->context;
+    size_t running = atomic_fetch_add(&state->running, 1) + 1;
+    size_t peak = atomic_load(&state->peak);
+    while (running > peak && !atomic_compare_exchange_weak(&state->peak, &peak, running)) {
+    }
+    volatile uint64_t sum = 0;
+    for (uint64_t i = 0; i < task->cost; i++) {
+        sum += i;
+    }
+    atomic_fetch_sub(&state->running, 1);
+    return true;
+}
+
+/**
+ * @brief Check that an adaptive pool runs no more tasks at once than it has active
+ *
+ * The tasks are all queued before the wait, as for a batch of files, so
+ * the workers parked above the active count see the pool stop while most
+ * of them are still queued.
+ *
+ * @return true if the tasks kept to the most workers the pool had active, false otherwise
+ */
+static bool check_pool(void) {
+    threadpool_t *pool = threadpool_init(0, WAVER_SCHEDULE_FIFO, THREADPOOL_ADAPTIVE);
+    if (!pool) {
+        fprintf(stderr, "Failed to create thread pool\n");
+        return false;
+    }
+    check_pool_state_t state;
+    atomic_init(&state.running, 0);
+    atomic_init(&state.peak, 0);
+    bool ok = true;
+    for (int i = 0; ok && i < CHECK_POOL_TASKS; i++) {
+        task_t task = {run_check_pool, NULL, NULL, CHECK_POOL_SPINS, &state, false};
+        ok = threadpool_submit(pool, &task);
+    }
+    threadpool_wait(pool);
+    size_t peak = atomic_load(&state.peak);
+    size_t active = pool->most_active;
+    ok = threadpool_destroy(pool) && ok;
+    if (!ok) {
+        fprintf(stderr, "Thread pool check failed\n");
+    } else if (peak > active) {
+        fprintf(stderr, "Thread pool ran %zu tasks at once with at most %zu worker%s active\n", peak, active,
+                active == 1 ? "" : "s");
+        ok = false;
+    } else {
+        printf("Thread pool ran at most %zu task%s at once with at most %zu worker%s active\n", peak,
+               peak == 1 ? "" : "s", active, active == 1 ? "" : "s");
+    }
+    return ok;
+}
+
+/**
+ * @brief State of the drawing benchmarks
+ */
+typedef struct {
+    waver_image_t *image;  /**< Image to draw into */
+    const uint16_t *left;  /**< Column peaks of the left channel (or mono) */
+    const uint16_t *right; /**< Column peaks of the right channel */
+    bool mono;             /**< Draw with waver_image_draw_point_mono() */
+} draw_state_t;
+
+/**
+ * @brief Draw every column of the image
+ *
+ * @param state draw_state_t
+ * @return true
+ */
+static bool run_draw(void *state) {
+    const draw_state_t *s = state;
+    for (unsigned int x = 0; x < s->image->width; x++) {
+        if (s->mono) {
+            waver_image_draw_point_mono(s->image, x, s->left[x]);
+        } else {
+            waver_image_draw_point(s->image, x, s->left[x], s->right[x]);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief State of the UP filter benchmark
+ */
+typedef struct {
+    const waver_image_t *image; /**< Image to filter */
+    unsigned char *previous;    /**< Scratch rows of line_width bytes */
+    unsigned char *current;
+    unsigned char *filtered;    /**< Filtered image, one filter byte per row */
+} filter_state_t;
+
+/**
+ * @brief Build and UP-filter every scanline, as the encoder does
+ *
+ * @param state filter_state_t
+ * @return true
+ */
+static bool run_filter(void *state) {
+    filter_state_t *s = state;
+    size_t stride = (size_t)s->image->line_width + 1;
+    for (unsigned int y = 0; y < s->image->height; y++) {
+        filter_row(s->image, y, true, &s->previous, &s->current, s->filtered + y * stride);
+    }
+    return true;
+}
+
+/**
+ * @brief State of the deflate benchmarks
+ */
+typedef struct {
+    const unsigned char *data; /**< Filtered scanlines */
+    size_t size;               /**< Bytes of data */
+    unsigned char *out;        /**< Room for the compressed data */
+    size_t out_size;           /**< Bytes of room in out */
+    z_stream stream;           /**< Stream reset between calls */
+    bool use_compress2;        /**< Use compress2() instead of the stream */
+    int level;                 /**< Compression level for compress2() */
+} deflate_state_t;
+
+/**
+ * @brief Compress the filtered scanlines in one go
+ *
+ * @param state deflate_state_t
+ * @return true if successful, false on a zlib error
+ */
+static bool run_deflate(void *state) {
+    deflate_state_t *s = state;
+    if (s->use_compress2) {
+        uLongf length = (uLongf)s->out_size;
+        return compress2(s->out, &length, s->data, (uLong)s->size, s->level) == Z_OK;
+    }
+    if (deflateReset(&s->stream) != Z_OK) {
+        return false;
+    }
+    s->stream.next_in = (Bytef *)s->data;
+    s->stream.avail_in = (uInt)s->size;
+    s->stream.next_out = s->out;
+    s->stream.avail_out = (uInt)s->out_size;
+    return deflate(&s->stream, Z_FINISH) == Z_STREAM_END;
+}
+
+/**
+ * @brief State of the CRC benchmarks
+ */
+typedef struct {
+    const unsigned char *data; /**< Bytes to checksum */
+    size_t size;               /**< Number of bytes */
+    bool zlib;                 /**< Use zlib's crc32() instead of the encoder's */
+    uint32_t crc;              /**< Result, kept so the work is not optimized away */
+} crc_state_t;
+
+/**
+ * @brief Checksum the data
+ *
+ * @param state crc_state_t
+ * @return true
+ */
+static bool run_crc(void *state) {
+    crc_state_t *s = state;
+    if (s->zlib) {
+        s->crc ^= (uint32_t)crc32(0L, s->data, (uInt)s->size);
+    } else {
+        s->crc ^= update_crc(0xffffffffL, s->data, s->size) ^ 0xffffffffL;
+    }
+    return true;
+}
+
+/**
+ * @brief State of the PNG file benchmarks
+ */
+typedef struct {
+    const waver_image_t *image;  /**< Image to save */
+    waver_png_options_t options; /**< Profile to save with */
+    waver_png_encoder_t *encoder; /**< Encoder reused between calls */
+} png_state_t;
+
+/**
+ * @brief Save the image as a PNG to /dev/null
+ *
+ * @param state png_state_t
+ * @return true if successful, false otherwise
+ */
+static bool run_png(void *state) {
+    png_state_t *s = state;
+    waver_color_t bg = {255, 255, 255, 0};
+    waver_color_t left = {0, 255, 153, 255};
+    waver_color_t right = {153, 255, 0, 255};
+    return waver_image_save_png(s->image, &bg, &left, &right, "/dev/null", &s->options, s->encoder, NULL);
+}
+
+/**
+ * @brief State of the whole-file benchmarks
+ */
+typedef struct {
+    const char *path;          /**< Corpus file */
+    const waver_args_t *args;  /**< Default settings */
+} generate_state_t;
+
+/**
+ * @brief Decode a corpus file and save its waveform to /dev/null
+ *
+ * @param state generate_state_t
+ * @return true if successful, false otherwise
+ */
+static bool run_generate(void *state) {
+    const generate_state_t *s = state;
+    return waver_generate_waveform(s->path, "/dev/null", s->args);
+}
+
+/**
+ * @brief Run the benchmarks that need no corpus
+ *
+ * @param run Results so far
+ * @return true if successful, false otherwise
+ */
+static bool run_kernels(bench_run_t *run) {
+    bool ok = false;
+    int16_t *mono = malloc(BENCH_FRAMES * sizeof(int16_t));
+    int16_t *stereo = malloc(BENCH_FRAMES * 2 * sizeof(int16_t));
+    uint16_t *left = malloc(BENCH_WIDTH * sizeof(uint16_t));
+    uint16_t *right = malloc(BENCH_WIDTH * sizeof(uint16_t));
+    waver_image_t *bitmap = waver_image_new(BENCH_WIDTH, BENCH_HEIGHT);
+    waver_image_t *spans = waver_image_new_spans(BENCH_WIDTH, BENCH_HEIGHT);
+    waver_peaks_t *peaks = waver_peaks_new(BENCH_WIDTH, BENCH_FRAMES, 1, 0);
+    waver_png_encoder_t *encoder = waver_png_encoder_new();
+    filter_state_t filter = {spans, NULL, NULL, NULL};
+    deflate_state_t deflate_states[3] = {{0}};
+    size_t line_width = spans ? spans->line_width : 0;
+    size_t filtered_size = (line_width + 1) * BENCH_HEIGHT;
+    unsigned char *out = NULL;
+    size_t out_size = compressBound((uLong)filtered_size);
+    int streams = 0;
+
+    filter.previous = malloc(line_width);
+    filter.current = malloc(line_width);
+    filter.filtered = malloc(filtered_size);
+    out = malloc(out_size);
+    if (!mono || !stereo || !left || !right || !bitmap || !spans || !peaks || !encoder ||
+        !filter.previous || !filter.current || !filter.filtered || !out) {
+        fprintf(stderr, "Memory allocation failed\n");
+        goto cleanup;
+    }
+
+    fill_pcm(mono, BENCH_FRAMES, 1, 1);
+    fill_pcm(stereo, BENCH_FRAMES, 2, 2);
+
+    // Sample reduction
+    peaks_state_t peaks_states[] = {
+        {mono, BENCH_FRAMES, 1, false},
+        {stereo, BENCH_FRAMES, 2, false},
+        {mono, BENCH_FRAMES, 1, true},
+        {stereo, BENCH_FRAMES, 2, true},
+    };
+    if (!measure(run, "peaks_mono", "ns/frame", 1e9, BENCH_FRAMES, run_peaks, &peaks_states[0]) ||
+        !measure(run, "peaks_stereo", "ns/frame", 1e9, BENCH_FRAMES, run_peaks, &peaks_states[1]) ||
+        !measure(run, "peaks_mono_scalar", "ns/frame", 1e9, BENCH_FRAMES, run_peaks, &peaks_states[2]) ||
+        !measure(run, "peaks_stereo_scalar", "ns/frame", 1e9, BENCH_FRAMES, run_peaks, &peaks_states[3])) {
+        goto cleanup;
+    }
+
+    // The column peaks of the stereo samples feed everything after this
+    if (!waver_peaks_add(peaks, stereo, BENCH_FRAMES, 2)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        goto cleanup;
+    }
+    waver_peaks_finish(peaks, left, right);
+
+    // Drawing
+    draw_state_t draw_states[] = {
+        {bitmap, left, right, false},
+        {spans, left, right, false},
+        {bitmap, left, NULL, true},
+        {spans, left, NULL, true},
+    };
+    if (!measure(run, "draw_point_bitmap", "ns/column", 1e9, BENCH_WIDTH, run_draw, &draw_states[0]) ||
+        !measure(run, "draw_point_spans", "ns/column", 1e9, BENCH_WIDTH, run_draw, &draw_states[1]) ||
+        !measure(run, "draw_point_mono_bitmap", "ns/column", 1e9, BENCH_WIDTH, run_draw, &draw_states[2]) ||
+        !measure(run, "draw_point_mono_spans", "ns/column", 1e9, BENCH_WIDTH, run_draw, &draw_states[3])) {
+        goto cleanup;
+    }
+
+    // Leave the stereo waveform in the span image for the encoder benchmarks
+    run_draw(&draw_states[1]);
+    if (!measure(run, "filter_up", "ns/byte", 1e9, (double)filtered_size, run_filter, &filter)) {
+        goto cleanup;
+    }
+    run_filter(&filter);
+
+    // Deflate of the filtered image: compress2() and the profiles' streams
+    deflate_states[0] = (deflate_state_t){filter.filtered, filtered_size, out, out_size, {0}, true, 6};
+    deflate_states[1] = (deflate_state_t){filter.filtered, filtered_size, out, out_size, {0}, false, 1};
+    deflate_states[2] = (deflate_state_t){filter.filtered, filtered_size, out, out_size, {0}, false, 6};
+    for (streams = 1; streams < 3; streams++) {
+        if (deflateInit2(&deflate_states[streams].stream, deflate_states[streams].level, Z_DEFLATED, 15, 8,
+                         Z_RLE) != Z_OK) {
+            fprintf(stderr, "Failed to set up deflate\n");
+            goto cleanup;
+        }
+    }
+    if (!measure(run, "compress2_default_6", "ns/byte", 1e9, (double)filtered_size, run_deflate,
+                 &deflate_states[0]) ||
+        !measure(run, "deflate_rle_1", "ns/byte", 1e9, (double)filtered_size, run_deflate, &deflate_states[1]) ||
+        !measure(run, "deflate_rle_6", "ns/byte", 1e9, (double)filtered_size, run_deflate, &deflate_states[2])) {
+        goto cleanup;
+    }
+
+    // Chunk CRC over the same bytes
+    crc_state_t crc_states[] = {
+        {filter.filtered, filtered_size, false, 0},
+        {filter.filtered, filtered_size, true, 0},
+    };
+    if (!measure(run, "update_crc", "ns/byte", 1e9, (double)filtered_size, run_crc, &crc_states[0]) ||
+        !measure(run, "crc32_zlib", "ns/byte", 1e9, (double)filtered_size, run_crc, &crc_states[1])) {
+        goto cleanup;
+    }
+
+    // Whole PNG files
+    png_state_t png_states[] = {
+        {spans, {WAVER_PNG_PROFILE_FAST, WAVER_PNG_DEFLATE_ZLIB, false}, encoder},
+        {spans, {WAVER_PNG_PROFILE_BALANCED, WAVER_PNG_DEFLATE_ZLIB, false}, encoder},
+        {spans, {WAVER_PNG_PROFILE_SMALLEST, WAVER_PNG_DEFLATE_ZLIB, false}, encoder},
+    };
+    if (!measure(run, "png_fast", "us/image", 1e6, 1.0, run_png, &png_states[0]) ||
+        !measure(run, "png_balanced", "us/image", 1e6, 1.0, run_png, &png_states[1]) ||
+        !measure(run, "png_smallest", "us/image", 1e6, 1.0, run_png, &png_states[2])) {
+        goto cleanup;
+    }
+    ok = true;
+
+cleanup:
+    for (int i = 1; i < streams; i++) {
+        deflateEnd(&deflate_states[i].stream);
+    }
+    free(out);
+    free(filter.filtered);
+    free(filter.current);
+    free(filter.previous);
+    waver_png_encoder_free(encoder);
+    waver_peaks_free(peaks);
+    waver_image_free(spans);
+    waver_image_free(bitmap);
+    free(right);
+    free(left);
+    free(stereo);
+    free(mono);
+    return ok;
+}
+
+/**
+ * @brief Keep only MP3 files when scanning the corpus
+ *
+ * @param entry Directory entry
+ * @return Nonzero if the entry is an MP3 file
+ */
+static int is_mp3(const struct dirent *entry) {
+    size_t length = strlen(entry->d_name);
+    return length > 4 && strcmp(entry->d_name + length - 4, ".mp3") == 0;
+}
+
+/**
+ * @brief Run waver_generate_waveform() on every file of the corpus
+ *
+ * @param run Results so far
+ * @param corpus Corpus directory
+ * @return true if successful, false otherwise
+ */
+static bool run_corpus(bench_run_t *run, const char *corpus) {
+    struct dirent **entries = NULL;
+    int count = scandir(corpus, &entries, is_mp3, alphasort);
+    if (count <= 0) {
+        fprintf(stderr, "No MP3 files in the corpus directory: %s\n", corpus);
+        free(entries);
+        return false;
+    }
+
+    bool ok = true;
+    waver_args_t *args = NULL;
+    for (int i = 0; i < count && ok; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", corpus, entries[i]->d_name);
+        if (!args) {
+            char *argv[] = {"waver", "--quiet", "--overwrite", path, NULL};
+            args = waver_args_parse(4, argv);
+            if (!args) {
+                ok = false;
+                break;
+            }
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "generate_%.*s", (int)(strlen(entries[i]->d_name) - 4), entries[i]->d_name);
+        generate_state_t state = {path, args};
+        ok = measure(run, name, "ms/file", 1e3, 1.0, run_generate, &state);
+    }
+
+    waver_args_free(args);
+    for (int i = 0; i < count; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    return ok;
+}
+
+/**
+ * @brief Record the results as a baseline
+ *
+ * @param run Results
+ * @param path File to write
+ * @return true if successful, false otherwise
+ */
+static bool write_baseline(const bench_run_t *run, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to write baseline: %s\n", path);
+        return false;
+    }
+    fprintf(fp, "# waver benchmark baseline: name fastest-sample unit\n");
+    for (size_t i = 0; i < run->count; i++) {
+        const bench_result_t *result = &run->results[i];
+        fprintf(fp, "%s %.6f %s\n", result->name, result->min, result->unit);
+    }
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write baseline: %s\n", path);
+        return false;
+    }
+    printf("Baseline written to %s\n", path);
+    return true;
+}
+
+/**
+ * @brief Compare the results with a baseline
+ *
+ * Benchmarks missing from either side are listed but never fail the run.
+ *
+ * @param run Results
+ * @param path Baseline file
+ * @param tolerance Allowed slowdown in percent
+ * @return Number of regressions, or -1 if the baseline cannot be read
+ */
+static int compare_baseline(const bench_run_t *run, const char *path, double tolerance) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    bool seen[MAX_RESULTS] = {false};
+    int regressions = 0;
+    char line[256];
+    printf("\nAgainst %s (tolerance %.0f%%):\n", path, tolerance);
+    while (fgets(line, sizeof(line), fp)) {
+        char name[64];
+        char unit[32];
+        double baseline;
+        if (line[0] == '#' || sscanf(line, "%63s %lf %31s", name, &baseline, unit) != 3) {
+            continue;
+        }
+
+        const bench_result_t *result = NULL;
+        for (size_t i = 0; i < run->count; i++) {
+            if (strcmp(run->results[i].name, name) == 0) {
+                result = &run->results[i];
+                seen[i] = true;
+                break;
+            }
+        }
+        if (!result) {
+            if (!run->options->filter) {
+                printf("  %-28s not run\n", name);
+            }
+            continue;
+        }
+
+        double change = baseline > 0.0 ? (result->min / baseline - 1.0) * 100.0 : 0.0;
+        bool regressed = change > tolerance;
+        regressions += regressed;
+        printf("  %-28s %12.4f -> %12.4f  %-9s %+7.1f%%%s\n", name, baseline, result->min, unit, change,
+               regressed ? "  REGRESSION" : "");
+    }
+    fclose(fp);
+
+    for (size_t i = 0; i < run->count; i++) {
+        if (!seen[i]) {
+            printf("  %-28s not in the baseline\n", run->results[i].name);
+        }
+    }
+    return regressions;
+}
+
+/**
+ * @brief Print the usage of the harness
+ */
+static void print_usage(void) {
+    printf("Usage: bench [options]\n"
+           "\n"
+           "  --corpus <dir>           Also time whole files of the synthetic MP3 corpus\n"
+           "  --baseline <file>        Fail if a benchmark is slower than in this file\n"
+           "  --write-baseline <file>  Record the results in this file\n"
+           "  --tolerance <percent>    Allowed slowdown against the baseline (default: %.0f)\n"
+           "  --samples <number>       Samples per benchmark, fastest compared (default: %d)\n"
+           "  --filter <text>          Only run benchmarks whose name contains text\n"
+           "  --check                  Only check the SIMD kernels and the thread pool\n"
+           "  -h, --help               Display this help message\n",
+           DEFAULT_TOLERANCE, DEFAULT_SAMPLES);
+}
+
+/**
+ * @brief Run the benchmarks
+ *
+ * @param argc Argument count
+ * @param argv Argument values
+ * @return 0 if successful, 1 on a failure or a regression
+ */
+int main(int argc, char *argv[]) {
+    bench_options_t options = {NULL, NULL, NULL, NULL, DEFAULT_TOLERANCE, DEFAULT_SAMPLES, false};
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage();
+            return 0;
+        } else if (strcmp(argv[i], "--check") == 0) {
+            options.check_only = true;
+            continue;
+        } else if (value && strcmp(argv[i], "--corpus") == 0) {
+            options.corpus = value;
+        } else if (value && strcmp(argv[i], "--baseline") == 0) {
+            options.baseline = value;
+        } else if (value && strcmp(argv[i], "--write-baseline") == 0) {
+            options.write_baseline = value;
+        } else if (value && strcmp(argv[i], "--filter") == 0) {
+            options.filter = value;
+        } else if (value && strcmp(argv[i], "--tolerance") == 0) {
+            options.tolerance = atof(value);
+        } else if (value && strcmp(argv[i], "--samples") == 0 && atoi(value) > 0) {
+            options.samples = (unsigned int)atoi(value);
+        } else {
+            fprintf(stderr, "Invalid option: %s\n", argv[i]);
+            print_usage();
+            return 1;
+        }
+        i++;
+    }
+
+    // Timing kernels that give wrong answers would be pointless
+    if (!check_peaks() || !check_pool()) {
+        return 1;
+    }
+    if (options.check_only) {
+        return 0;
+    }
+
+    bench_run_t run = {&options, {{{0}, NULL, 0.0, 0.0}}, 0};
+    printf("\n  %-28s %12s %12s  %s\n", "benchmark", "median", "fastest", "unit");
+    if (!run_kernels(&run) || (options.corpus && !run_corpus(&run, options.corpus))) {
+        return 1;
+    }
+
+    if (options.write_baseline && !write_baseline(&run, options.write_baseline)) {
+        return 1;
+    }
+    if (options.baseline) {
+        int regressions = compare_baseline(&run, options.baseline, options.tolerance);
+        if (regressions < 0) {
+            printf("\nNo baseline at %s; record one with make bench-baseline\n", options.baseline);
+        } else if (regressions > 0) {
+            fflush(stdout);
+            fprintf(stderr, "\n*** %d benchmark%s slower than the baseline by more than %.0f%% ***\n",
+                    regressions, regressions == 1 ? "" : "s", options.tolerance);
+            return 1;
+        } else {
+            printf("\nNo regressions\n");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,350 @@
+/**
+ * @file compare.c
+ * @brief Error and speed of the approximate qualities against exact rendering (make compare)
+ *
+ * Every file is rendered through libwaver at --quality=exact and at each
+ * approximate quality, and the column peaks are compared as the bar heights
+ * they would be drawn with.  The error of a column is the difference in
+ * pixels between the two bars (both bars of stereo files count), which is
+ * what a listener looking at the image would see.  The times are the
+ * fastest of several runs, as in the benchmark harness.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "libwaver.h"
+#include "stats.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_WIDTH 2048
+#define DEFAULT_HEIGHT 128
+#define DEFAULT_RUNS 3
+
+/**
+ * @brief Settings from the command line
+ */
+typedef struct {
+    unsigned int width;  /**< Columns to render */
+    unsigned int height; /**< Image height the error is measured at */
+    unsigned int runs;   /**< Runs per file and quality, fastest kept */
+} compare_options_t;
+
+/**
+ * @brief Error and time of one quality on one or more files
+ */
+typedef struct {
+    double exact_seconds;   /**< Time to render exactly */
+    double seconds;         /**< Time to render at this quality */
+    double error_pixels;    /**< Sum of the bar errors in pixels */
+    unsigned long bars;     /**< Number of bars compared */
+    unsigned long within;   /**< Bars at most one pixel off */
+    unsigned int max_error; /**< Largest bar error in pixels */
+    unsigned long *counts;  /**< Bars per error in pixels (height / 2 + 1 entries) */
+} compare_result_t;
+
+// Approximate qualities compared against exact rendering
+static const waver_quality_t QUALITIES[] = {WAVER_QUALITY_PREVIEW, WAVER_QUALITY_ENVELOPE};
+static const char *const QUALITY_NAMES[] = {"exact", "preview", "envelope"};
+#define QUALITY_COUNT (sizeof(QUALITIES) / sizeof(QUALITIES[0]))
+
+/**
+ * @brief Print the usage message
+ */
+static void print_usage(void) {
+    printf("Usage: compare [options] files_or_directories...\n"
+           "\n"
+           "  --width <pixels>   Columns to render (default: %d)\n"
+           "  --height <pixels>  Image height the error is measured at (default: %d)\n"
+           "  --runs <number>    Runs per file and quality, fastest kept (default: %d)\n"
+           "  -h, --help         Display this help message\n",
+           DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_RUNS);
+}
+
+/**
+ * @brief Read a whole file into memory
+ *
+ * @param path File to read
+ * @param size Receives the size in bytes
+ * @return Contents (free with free()), or NULL on error
+ */
+static void *read_file(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    void *data = NULL;
+    long length = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if (length > 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = malloc((size_t)length);
+        if (data && fread(data, 1, (size_t)length, file) != (size_t)length) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+    *size = length > 0 ? (size_t)length : 0;
+    return data;
+}
+
+/**
+ * @brief Render column peaks several times and keep the fastest time
+ *
+ * @param data Audio data
+ * @param size Size of data in bytes
+ * @param options Render options
+ * @param runs Number of runs
+ * @param left Receives the peaks for left or mono
+ * @param right Receives the peaks for right
+ * @param channel_count Receives the number of channels
+ * @param seconds Receives the fastest time
+ * @return true if every run succeeded, false otherwise
+ */
+static bool render_timed(const void *data, size_t size, const waver_render_options_t *options, unsigned int runs,
+                         uint16_t *left, uint16_t *right, unsigned int *channel_count, double *seconds) {
+    *seconds = 0.0;
+    for (unsigned int run = 0; run < runs; run++) {
+        double start = waver_stats_now();
+        if (!waver_render_peaks(data, size, options, left, right, channel_count)) {
+            return false;
+        }
+        double elapsed = waver_stats_now() - start;
+        if (run == 0 || elapsed < *seconds) {
+            *seconds = elapsed;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Add the bar errors of one rendering to a result
+ *
+ * @param result Result to add to
+ * @param options Compare settings
+ * @param exact Exact peaks
+ * @param approximate Approximate peaks of the same channel
+ */
+static void add_errors(compare_result_t *result, const compare_options_t *options,
+                       const uint16_t *exact, const uint16_t *approximate) {
+    unsigned int center = options->height / 2;
+    for (unsigned int x = 0; x < options->width; x++) {
+        // The same scaling as waver_image_draw_peaks()
+        int exact_bar = (int)((exact[x] * center + 16384) >> 15);
+        int approximate_bar = (int)((approximate[x] * center + 16384) >> 15);
+        unsigned int error = (unsigned int)abs(exact_bar - approximate_bar);
+        result->error_pixels += error;
+        result->bars++;
+        result->within += error <= 1;
+        result->max_error = error > result->max_error ? error : result->max_error;
+        result->counts[error <= center ? error : center]++;
+    }
+}
+
+/**
+ * @brief Bar error in pixels that a share of the bars do not exceed
+ *
+ * @param result Result to read
+ * @param center Largest possible error
+ * @param share Share of the bars, such as 0.95
+ * @return The error in pixels
+ */
+static unsigned int error_percentile(const compare_result_t *result, unsigned int center, double share) {
+    unsigned long seen = 0;
+    for (unsigned int error = 0; error <= center; error++) {
+        seen += result->counts[error];
+        if (seen >= share * result->bars) {
+            return error;
+        }
+    }
+    return center;
+}
+
+/**
+ * @brief Print one line of the report
+ *
+ * @param name File name or "all"
+ * @param quality Quality the line is for
+ * @param result Error and time to print
+ * @param options Compare settings
+ */
+static void print_result(const char *name, waver_quality_t quality, const compare_result_t *result,
+                         const compare_options_t *options) {
+    unsigned int center = options->height / 2;
+    printf("  %-28s %-9s %9.1f %9.1f %8.1fx %8.2f %6u %6u %9.1f%%\n", name, QUALITY_NAMES[quality],
+           result->exact_seconds * 1e3, result->seconds * 1e3,
+           result->seconds > 0.0 ? result->exact_seconds / result->seconds : 0.0,
+           result->bars ? result->error_pixels / result->bars : 0.0, error_percentile(result, center, 0.95),
+           result->max_error, result->bars ? 100.0 * result->within / result->bars : 0.0);
+}
+
+/**
+ * @brief Compare every approximate quality with exact rendering on one file
+ *
+ * @param path File to compare
+ * @param options Compare settings
+ * @param totals Results over all files, one per approximate quality
+ * @return true if successful, false if the file could not be read or rendered
+ */
+static bool compare_file(const char *path, const compare_options_t *options, compare_result_t *totals) {
+    size_t size = 0;
+    void *data = read_file(path, &size);
+    if (!data) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return false;
+    }
+
+    unsigned int width = options->width;
+    uint16_t *peaks = calloc(4 * (size_t)width, sizeof(uint16_t));
+    unsigned long *counts = calloc(options->height / 2 + 1, sizeof(unsigned long));
+    bool ok = peaks && counts;
+    uint16_t *exact_left = peaks;
+    uint16_t *exact_right = peaks + width;
+    uint16_t *left = peaks + 2 * (size_t)width;
+    uint16_t *right = peaks + 3 * (size_t)width;
+
+    waver_render_options_t render;
+    waver_render_options_init(&render);
+    render.width = width;
+    unsigned int channels = 0;
+    double exact_seconds = 0.0;
+    ok = ok && render_timed(data, size, &render, options->runs, exact_left, exact_right, &channels, &exact_seconds);
+
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    for (size_t q = 0; ok && q < QUALITY_COUNT; q++) {
+        render.quality = QUALITIES[q];
+        compare_result_t result = {exact_seconds, 0.0, 0.0, 0, 0, 0, counts};
+        memset(counts, 0, (options->height / 2 + 1) * sizeof(unsigned long));
+        unsigned int approximate_channels = 0;
+        ok = render_timed(data, size, &render, options->runs, left, right, &approximate_channels, &result.seconds);
+        if (!ok) {
+            break;
+        }
+        add_errors(&result, options, exact_left, left);
+        if (channels > 1) {
+            add_errors(&result, options, exact_right, right);
+        }
+        print_result(name, QUALITIES[q], &result, options);
+
+        compare_result_t *total = &totals[q];
+        total->exact_seconds += result.exact_seconds;
+        total->seconds += result.seconds;
+        total->error_pixels += result.error_pixels;
+        total->bars += result.bars;
+        total->within += result.within;
+        total->max_error = result.max_error > total->max_error ? result.max_error : total->max_error;
+        for (unsigned int error = 0; error <= options->height / 2; error++) {
+            total->counts[error] += counts[error];
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Cannot render %s\n", path);
+    }
+
+    free(counts);
+    free(peaks);
+    free(data);
+    return ok;
+}
+
+/**
+ * @brief Whether a directory entry is an MP3 or WAV file
+ *
+ * @param entry Directory entry
+ * @return Non-zero for files ending in .mp3 or .wav
+ */
+static int is_audio(const struct dirent *entry) {
+    size_t length = strlen(entry->d_name);
+    return length > 4 && (strcmp(entry->d_name + length - 4, ".mp3") == 0 ||
+                          strcmp(entry->d_name + length - 4, ".wav") == 0);
+}
+
+/**
+ * @brief Compare a file, or every MP3 and WAV file in a directory
+ *
+ * @param path File or directory
+ * @param options Compare settings
+ * @param totals Results over all files, one per approximate quality
+ * @return true if successful, false otherwise
+ */
+static bool compare_path(const char *path, const compare_options_t *options, compare_result_t *totals) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return compare_file(path, options, totals);
+    }
+    closedir(dir);
+
+    struct dirent **entries = NULL;
+    int count = scandir(path, &entries, is_audio, alphasort);
+    bool ok = count >= 0;
+    for (int i = 0; i < count; i++) {
+        char file[4096];
+        snprintf(file, sizeof(file), "%s/%s", path, entries[i]->d_name);
+        ok = ok && compare_file(file, options, totals);
+        free(entries[i]);
+    }
+    free(entries);
+    return ok;
+}
+
+/**
+ * @brief Compare the approximate qualities with exact rendering
+ *
+ * @param argc Argument count
+ * @param argv Argument values
+ * @return 0 if successful, 1 on a failure
+ */
+int main(int argc, char *argv[]) {
+    compare_options_t options = {DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_RUNS};
+    int first_path = argc;
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage();
+            return 0;
+        } else if (value && strcmp(argv[i], "--width") == 0 && atoi(value) >= 16) {
+            options.width = (unsigned int)atoi(value);
+        } else if (value && strcmp(argv[i], "--height") == 0 && atoi(value) >= 6) {
+            options.height = (unsigned int)atoi(value);
+        } else if (value && strcmp(argv[i], "--runs") == 0 && atoi(value) > 0) {
+            options.runs = (unsigned int)atoi(value);
+        } else if (argv[i][0] != '-') {
+            first_path = i;
+            break;
+        } else {
+            fprintf(stderr, "Invalid option: %s\n", argv[i]);
+            print_usage();
+            return 1;
+        }
+        i++;
+    }
+    if (first_path == argc) {
+        print_usage();
+        return 1;
+    }
+
+    compare_result_t totals[QUALITY_COUNT];
+    memset(totals, 0, sizeof(totals));
+    bool ok = true;
+    for (size_t q = 0; q < QUALITY_COUNT; q++) {
+        totals[q].counts = calloc(options.height / 2 + 1, sizeof(unsigned long));
+        ok = ok && totals[q].counts;
+    }
+
+    printf("  %-28s %-9s %9s %9s %9s %8s %6s %6s %10s\n", "file", "quality", "exact ms", "ms", "speedup",
+           "mean px", "p95 px", "max px", "within 1");
+    for (int i = first_path; ok && i < argc; i++) {
+        ok = compare_path(argv[i], &options, totals);
+    }
+    for (size_t q = 0; ok && q < QUALITY_COUNT; q++) {
+        if (totals[q].bars) {
+            print_result("all", QUALITIES[q], &totals[q], &options);
+        }
+    }
+
+    for (size_t q = 0; q < QUALITY_COUNT; q++) {
+        free(totals[q].counts);
+    }
+    return ok ? 0 : 1;
+}
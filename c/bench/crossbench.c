@@ -0,0 +1,825 @@
+/**
+ * @file crossbench.c
+ * @brief The Waver implementations against each other on one corpus (make bench-waver)
+ *
+ * Every implementation given with --waver is run as a separate process over
+ * the same copy of the corpus at each thread count, a few times, and the
+ * fastest run is reported with its files per second; the peak resident set
+ * is the largest of the runs (from wait4()), the output size the total of
+ * the PNGs written.  The first implementation at the first thread count is
+ * the reference: every other run's PNGs are decoded and compared with its
+ * images pixel by pixel, as straight RGBA (fully transparent pixels compare
+ * equal whatever their color, since an encoder may premultiply them away).
+ * Any difference, or any run that fails, makes the harness fail.
+ *
+ * Implementations are told the thread count in their own way: the C one
+ * takes --threads, the Rust one sizes its rayon pool from
+ * RAYON_NUM_THREADS, and the Swift one leaves it to Grand Central
+ * Dispatch, so it runs once, at its own choice.
+ */
+
+// wait4() is a BSD extension
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define DEFAULT_RUNS 3
+#define DEFAULT_COPIES 4
+#define DEFAULT_THREADS "1,2,4"
+#define MAX_WAVERS 8
+#define MAX_THREAD_COUNTS 16
+#define PATH_LENGTH 4096
+#define MAX_PNG_PIXELS (64u * 1024 * 1024)
+
+/**
+ * @brief How an implementation is told how many threads to use
+ */
+typedef enum {
+    THREADS_FLAG,  /**< --threads <count> on the command line */
+    THREADS_RAYON, /**< RAYON_NUM_THREADS in the environment */
+    THREADS_NONE   /**< Not at all: run once with its own choice */
+} thread_style_t;
+
+/**
+ * @brief One implementation to run
+ */
+typedef struct {
+    const char *path;     /**< Executable */
+    const char *name;     /**< Name in the report (file name of the executable) */
+    thread_style_t style; /**< How it takes the thread count */
+} waver_impl_t;
+
+/**
+ * @brief Settings from the command line
+ */
+typedef struct {
+    const char *corpus;                          /**< Directory of the MP3 corpus */
+    const char *work;                            /**< Scratch directory (NULL for a temporary one) */
+    waver_impl_t wavers[MAX_WAVERS];             /**< Implementations, the first one the reference */
+    size_t waver_count;                          /**< Number of implementations */
+    unsigned int threads[MAX_THREAD_COUNTS];     /**< Thread counts */
+    size_t thread_count;                         /**< Number of thread counts */
+    unsigned int runs;                           /**< Runs per implementation and thread count */
+    unsigned int copies;                         /**< Copies of the corpus in the scratch directory */
+} crossbench_options_t;
+
+/**
+ * @brief A decoded image
+ */
+typedef struct {
+    uint32_t width;  /**< Width in pixels */
+    uint32_t height; /**< Height in pixels */
+    uint8_t *rgba;   /**< Pixels, 4 bytes each, rows top to bottom */
+} rgba_image_t;
+
+/**
+ * @brief The files every implementation renders
+ */
+typedef struct {
+    char **inputs;            /**< Paths of the audio files in the scratch directory, sorted */
+    size_t count;             /**< Number of files */
+    uint64_t input_bytes;     /**< Total size of the files */
+    rgba_image_t *reference;  /**< Images of the reference run, one per file */
+} crossbench_work_t;
+
+/**
+ * @brief Print the usage message
+ */
+static void print_usage(void) {
+    printf("Usage: crossbench [options] --waver <path[:style]>...\n"
+           "\n"
+           "  --waver <path[:style]>  Implementation to run; style is how it takes the\n"
+           "                          thread count: flag (--threads, the default),\n"
+           "                          rayon (RAYON_NUM_THREADS) or none (run once)\n"
+           "  --corpus <dir>          Directory of MP3 files (default: bench/corpus)\n"
+           "  --threads <list>        Comma-separated thread counts (default: %s)\n"
+           "  --runs <number>         Runs per thread count, fastest kept (default: %d)\n"
+           "  --copies <number>       Copies of the corpus to render per run (default: %d)\n"
+           "  --work <dir>            Scratch directory, emptied of PNGs between runs\n"
+           "                          (default: a new one under $TMPDIR)\n"
+           "  -h, --help              Display this help message\n",
+           DEFAULT_THREADS, DEFAULT_RUNS, DEFAULT_COPIES);
+}
+
+/**
+ * @brief Parse a comma-separated list of thread counts
+ *
+ * @param list List such as "1,2,4"
+ * @param options Receives the counts
+ * @return true if successful, false if the list is empty, too long or not numbers
+ */
+static bool parse_threads(const char *list, crossbench_options_t *options) {
+    options->thread_count = 0;
+    const char *item = list;
+    while (*item) {
+        char *end;
+        unsigned long count = strtoul(item, &end, 10);
+        if (end == item || count == 0 || count > 1024 || (*end != ',' && *end != '\0') ||
+            options->thread_count == MAX_THREAD_COUNTS) {
+            return false;
+        }
+        options->threads[options->thread_count++] = (unsigned int)count;
+        item = *end ? end + 1 : end;
+    }
+    return options->thread_count > 0;
+}
+
+/**
+ * @brief Parse an implementation given as path[:style]
+ *
+ * @param spec Argument of --waver
+ * @param waver Receives the implementation (its strings point into spec)
+ * @return true if successful, false if the style is unknown
+ */
+static bool parse_waver(char *spec, waver_impl_t *waver) {
+    waver->style = THREADS_FLAG;
+    char *colon = strrchr(spec, ':');
+    if (colon) {
+        const char *style = colon + 1;
+        if (strcmp(style, "flag") == 0) {
+            waver->style = THREADS_FLAG;
+        } else if (strcmp(style, "rayon") == 0) {
+            waver->style = THREADS_RAYON;
+        } else if (strcmp(style, "none") == 0) {
+            waver->style = THREADS_NONE;
+        } else {
+            return false;
+        }
+        *colon = '\0';
+    }
+    waver->path = spec;
+    const char *slash = strrchr(spec, '/');
+    waver->name = slash ? slash + 1 : spec;
+    return *spec != '\0';
+}
+
+/**
+ * @brief Seconds on the monotonic clock
+ *
+ * @return Current time in seconds
+ */
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Make one path from a directory and a name
+ *
+ * @param dir Directory
+ * @param name Name in the directory
+ * @return New string (free with free()), or NULL on allocation failure
+ */
+static char *join_path(const char *dir, const char *name) {
+    size_t length = strlen(dir) + 1 + strlen(name) + 1;
+    char *path = malloc(length);
+    if (path) {
+        snprintf(path, length, "%s/%s", dir, name);
+    }
+    return path;
+}
+
+/**
+ * @brief Hard-link a file, or copy it if it cannot be linked
+ *
+ * @param source Existing file
+ * @param target New file
+ * @return true if successful, false otherwise
+ */
+static bool link_or_copy(const char *source, const char *target) {
+    if (link(source, target) == 0) {
+        return true;
+    }
+    FILE *in = fopen(source, "rb");
+    FILE *out = in ? fopen(target, "wb") : NULL;
+    bool success = in && out;
+    char buffer[65536];
+    size_t length;
+    while (success && (length = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        success = fwrite(buffer, 1, length, out) == length;
+    }
+    success = success && !ferror(in);
+    if (out && fclose(out) != 0) {
+        success = false;
+    }
+    if (in) {
+        fclose(in);
+    }
+    return success;
+}
+
+/**
+ * @brief Whether a directory entry is an MP3 file by its name
+ *
+ * @param entry Directory entry
+ * @return Non-zero for names ending in .mp3
+ */
+static int is_mp3(const struct dirent *entry) {
+    size_t length = strlen(entry->d_name);
+    return length > 4 && strcmp(entry->d_name + length - 4, ".mp3") == 0;
+}
+
+/**
+ * @brief Fill the scratch directory with copies of the corpus
+ *
+ * Copies are hard links where possible, named <copy>-<name>, all in one
+ * directory so every implementation finds them the same way.
+ *
+ * @param options Settings
+ * @param work Receives the files
+ * @return true if successful, false otherwise
+ */
+static bool prepare_work(const crossbench_options_t *options, crossbench_work_t *work) {
+    struct dirent **entries;
+    int found = scandir(options->corpus, &entries, is_mp3, alphasort);
+    if (found < 0) {
+        fprintf(stderr, "Cannot read the corpus directory: %s\n", options->corpus);
+        return false;
+    }
+    if (found == 0) {
+        fprintf(stderr, "No MP3 files in the corpus directory: %s\n", options->corpus);
+        free(entries);
+        return false;
+    }
+
+    bool success = true;
+    work->count = 0;
+    work->input_bytes = 0;
+    work->inputs = calloc((size_t)found * options->copies, sizeof(*work->inputs));
+    work->reference = calloc((size_t)found * options->copies, sizeof(*work->reference));
+    if (!work->inputs || !work->reference) {
+        fprintf(stderr, "Memory allocation failed\n");
+        success = false;
+    }
+    for (unsigned int copy = 0; success && copy < options->copies; copy++) {
+        for (int i = 0; success && i < found; i++) {
+            char *source = join_path(options->corpus, entries[i]->d_name);
+            char name[PATH_LENGTH];
+            snprintf(name, sizeof(name), "%u-%s", copy + 1, entries[i]->d_name);
+            char *target = join_path(options->work, name);
+            struct stat info;
+            if (!source || !target) {
+                fprintf(stderr, "Memory allocation failed\n");
+                success = false;
+            } else if (stat(source, &info) != 0 || (unlink(target) != 0 && errno != ENOENT) ||
+                       !link_or_copy(source, target)) {
+                fprintf(stderr, "Cannot copy %s to %s\n", source, target);
+                success = false;
+            } else {
+                work->inputs[work->count++] = target;
+                work->input_bytes += (uint64_t)info.st_size;
+                target = NULL;
+            }
+            free(source);
+            free(target);
+        }
+    }
+    for (int i = 0; i < found; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    return success;
+}
+
+/**
+ * @brief Free the files and reference images
+ *
+ * @param work Files
+ */
+static void free_work(crossbench_work_t *work) {
+    for (size_t i = 0; i < work->count; i++) {
+        free(work->inputs[i]);
+        if (work->reference) {
+            free(work->reference[i].rgba);
+        }
+    }
+    free(work->inputs);
+    free(work->reference);
+}
+
+/**
+ * @brief Remove the outputs of a run, so the next one writes new files too
+ *
+ * @param work Files
+ */
+static void remove_outputs(const crossbench_work_t *work) {
+    char path[PATH_LENGTH];
+    for (size_t i = 0; i < work->count; i++) {
+        snprintf(path, sizeof(path), "%s.png", work->inputs[i]);
+        unlink(path);
+    }
+}
+
+/**
+ * @brief Run an implementation once over the scratch directory
+ *
+ * @param waver Implementation
+ * @param threads Thread count (ignored for THREADS_NONE)
+ * @param dir Scratch directory
+ * @param seconds Receives the wall time of the process
+ * @param rss_kib Receives its peak resident set in KiB
+ * @return true if it exited with status 0
+ */
+static bool run_waver(const waver_impl_t *waver, unsigned int threads, const char *dir, double *seconds,
+                      long *rss_kib) {
+    char count[16];
+    snprintf(count, sizeof(count), "%u", threads);
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Cannot start %s: %s\n", waver->path, strerror(errno));
+        return false;
+    }
+    if (pid == 0) {
+        // Per-file messages would only time the terminal
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+        if (waver->style == THREADS_FLAG) {
+            execl(waver->path, waver->path, "--quiet", "--threads", count, dir, (char *)NULL);
+        } else {
+            if (waver->style == THREADS_RAYON) {
+                setenv("RAYON_NUM_THREADS", count, 1);
+            }
+            execl(waver->path, waver->path, "--quiet", dir, (char *)NULL);
+        }
+        fprintf(stderr, "Cannot run %s: %s\n", waver->path, strerror(errno));
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    pid_t done;
+    while ((done = wait4(pid, &status, 0, &usage)) < 0 && errno == EINTR) {
+    }
+    *seconds = now_seconds() - start;
+    if (done != pid) {
+        return false;
+    }
+#ifdef __APPLE__
+    *rss_kib = usage.ru_maxrss / 1024;  // Bytes on macOS
+#else
+    *rss_kib = usage.ru_maxrss;
+#endif
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * @brief Read a big-endian 32-bit value
+ *
+ * @param bytes Four bytes
+ * @return Value
+ */
+static uint32_t read_be32(const uint8_t *bytes) {
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+/**
+ * @brief The Paeth predictor of PNG filter type 4
+ *
+ * @param left Byte to the left
+ * @param up Byte above
+ * @param corner Byte above to the left
+ * @return Whichever of the three is closest to left + up - corner
+ */
+static uint8_t paeth(uint8_t left, uint8_t up, uint8_t corner) {
+    int estimate = left + up - corner;
+    int to_left = abs(estimate - left);
+    int to_up = abs(estimate - up);
+    int to_corner = abs(estimate - corner);
+    if (to_left <= to_up && to_left <= to_corner) {
+        return left;
+    }
+    return to_up <= to_corner ? up : corner;
+}
+
+/**
+ * @brief Undo the filter of one scanline in place
+ *
+ * @param filter Filter type byte
+ * @param row Scanline
+ * @param previous Scanline above, already unfiltered (NULL for the first)
+ * @param length Bytes in a scanline
+ * @param bpp Bytes per pixel, at least 1
+ * @return true if successful, false for an unknown filter type
+ */
+static bool unfilter_row(uint8_t filter, uint8_t *row, const uint8_t *previous, size_t length, size_t bpp) {
+    for (size_t i = 0; i < length; i++) {
+        uint8_t left = i >= bpp ? row[i - bpp] : 0;
+        uint8_t up = previous ? previous[i] : 0;
+        uint8_t corner = previous && i >= bpp ? previous[i - bpp] : 0;
+        switch (filter) {
+            case 0:
+                break;
+            case 1:
+                row[i] = (uint8_t)(row[i] + left);
+                break;
+            case 2:
+                row[i] = (uint8_t)(row[i] + up);
+                break;
+            case 3:
+                row[i] = (uint8_t)(row[i] + (left + up) / 2);
+                break;
+            case 4:
+                row[i] = (uint8_t)(row[i] + paeth(left, up, corner));
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Decode a PNG file to RGBA
+ *
+ * Handles every color type at 1, 2, 4 and 8 bits per sample without
+ * interlacing, which covers what the implementations write: 2-bit
+ * palettes from C and Rust, 8-bit RGBA from Swift.
+ *
+ * @param path PNG file
+ * @param image Receives the image (free rgba with free())
+ * @return true if successful, false if the file is missing or not a PNG this handles
+ */
+static bool decode_png(const char *path, rgba_image_t *image) {
+    static const uint8_t SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    image->rgba = NULL;
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+
+    uint8_t header[8];
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint8_t depth = 0;
+    uint8_t color_type = 0;
+    uint8_t palette[256][4];
+    memset(palette, 0, sizeof(palette));
+    for (int i = 0; i < 256; i++) {
+        palette[i][3] = 255;
+    }
+    int transparent[3] = {-1, -1, -1};
+    uint8_t *idat = NULL;
+    size_t idat_size = 0;
+    bool success = fread(header, 1, sizeof(header), file) == sizeof(header) &&
+                   memcmp(header, SIGNATURE, sizeof(SIGNATURE)) == 0;
+    bool ended = false;
+    while (success && !ended) {
+        uint8_t chunk[8];
+        if (fread(chunk, 1, sizeof(chunk), file) != sizeof(chunk)) {
+            success = false;
+            break;
+        }
+        uint32_t length = read_be32(chunk);
+        uint8_t *data = length <= 0x7fffffffu ? malloc(length + 4u) : NULL;
+        if (!data || fread(data, 1, length + 4u, file) != length + 4u) {
+            free(data);
+            success = false;
+            break;
+        }
+        if (memcmp(chunk + 4, "IHDR", 4) == 0 && length >= 13) {
+            width = read_be32(data);
+            height = read_be32(data + 4);
+            depth = data[8];
+            color_type = data[9];
+            // Only 8 bits and below, no interlacing
+            success = width > 0 && height > 0 && (uint64_t)width * height <= MAX_PNG_PIXELS &&
+                      (depth == 1 || depth == 2 || depth == 4 || depth == 8) && data[12] == 0;
+        } else if (memcmp(chunk + 4, "PLTE", 4) == 0) {
+            for (uint32_t i = 0; i < length / 3 && i < 256; i++) {
+                memcpy(palette[i], data + 3 * i, 3);
+            }
+        } else if (memcmp(chunk + 4, "tRNS", 4) == 0) {
+            if (color_type == 3) {
+                for (uint32_t i = 0; i < length && i < 256; i++) {
+                    palette[i][3] = data[i];
+                }
+            } else {
+                for (uint32_t i = 0; i < 3 && 2 * i + 1 < length; i++) {
+                    transparent[i] = data[2 * i + 1];
+                }
+            }
+        } else if (memcmp(chunk + 4, "IDAT", 4) == 0) {
+            uint8_t *grown = realloc(idat, idat_size + length);
+            if (!grown) {
+                success = false;
+            } else {
+                idat = grown;
+                memcpy(idat + idat_size, data, length);
+                idat_size += length;
+            }
+        } else if (memcmp(chunk + 4, "IEND", 4) == 0) {
+            ended = true;
+        }
+        free(data);
+    }
+    fclose(file);
+
+    static const unsigned int CHANNELS[7] = {1, 0, 3, 1, 2, 0, 4};
+    unsigned int channels = color_type <= 6 ? CHANNELS[color_type] : 0;
+    success = success && ended && width > 0 && channels > 0 && (depth == 8 || color_type == 0 || color_type == 3);
+    size_t row_length = success ? ((size_t)width * channels * depth + 7) / 8 : 0;
+    size_t bpp = (channels * depth + 7) / 8;
+    uLongf raw_size = (uLongf)((row_length + 1) * height);
+    uint8_t *raw = success ? malloc(raw_size) : NULL;
+    image->rgba = success ? malloc((size_t)width * height * 4) : NULL;
+    if (!raw || !image->rgba || uncompress(raw, &raw_size, idat, idat_size) != Z_OK ||
+        raw_size != (row_length + 1) * height) {
+        success = false;
+    }
+
+    for (uint32_t y = 0; success && y < height; y++) {
+        uint8_t *row = raw + y * (row_length + 1);
+        const uint8_t *previous = y > 0 ? raw + (y - 1) * (row_length + 1) + 1 : NULL;
+        if (!unfilter_row(row[0], row + 1, previous, row_length, bpp)) {
+            success = false;
+            break;
+        }
+        row++;
+        uint8_t *out = image->rgba + (size_t)y * width * 4;
+        for (uint32_t x = 0; x < width; x++, out += 4) {
+            unsigned int sample[4];
+            if (depth == 8) {
+                for (unsigned int c = 0; c < channels; c++) {
+                    sample[c] = row[x * channels + c];
+                }
+            } else {
+                // One channel packed several to a byte, first pixel in the high bits
+                unsigned int per_byte = 8u / depth;
+                unsigned int shift = 8u - depth * (x % per_byte + 1);
+                sample[0] = (row[x / per_byte] >> shift) & ((1u << depth) - 1);
+            }
+            switch (color_type) {
+                case 0: {
+                    unsigned int gray = sample[0] * 255u / ((1u << depth) - 1);
+                    out[0] = out[1] = out[2] = (uint8_t)gray;
+                    out[3] = transparent[0] == (int)sample[0] ? 0 : 255;
+                    break;
+                }
+                case 2:
+                    out[0] = (uint8_t)sample[0];
+                    out[1] = (uint8_t)sample[1];
+                    out[2] = (uint8_t)sample[2];
+                    out[3] = transparent[0] == (int)sample[0] && transparent[1] == (int)sample[1] &&
+                                     transparent[2] == (int)sample[2]
+                                 ? 0
+                                 : 255;
+                    break;
+                case 3:
+                    memcpy(out, palette[sample[0]], 4);
+                    break;
+                case 4:
+                    out[0] = out[1] = out[2] = (uint8_t)sample[0];
+                    out[3] = (uint8_t)sample[1];
+                    break;
+                default:
+                    for (unsigned int c = 0; c < 4; c++) {
+                        out[c] = (uint8_t)sample[c];
+                    }
+                    break;
+            }
+            if (out[3] == 0) {
+                out[0] = out[1] = out[2] = 0;
+            }
+        }
+    }
+
+    free(idat);
+    free(raw);
+    if (!success) {
+        free(image->rgba);
+        image->rgba = NULL;
+        return false;
+    }
+    image->width = width;
+    image->height = height;
+    return true;
+}
+
+/**
+ * @brief Measure the outputs of a run and compare them with the reference
+ *
+ * @param work Files; with keep set, receives the images as the reference
+ * @param keep Whether this is the reference run
+ * @param output_bytes Receives the total size of the PNGs
+ * @return Number of files whose image matches (or was decoded, for the reference)
+ */
+static size_t check_outputs(crossbench_work_t *work, bool keep, uint64_t *output_bytes) {
+    char path[PATH_LENGTH];
+    size_t matching = 0;
+    *output_bytes = 0;
+    for (size_t i = 0; i < work->count; i++) {
+        snprintf(path, sizeof(path), "%s.png", work->inputs[i]);
+        struct stat info;
+        if (stat(path, &info) == 0) {
+            *output_bytes += (uint64_t)info.st_size;
+        }
+        rgba_image_t image;
+        if (!decode_png(path, &image)) {
+            printf("    %s: no image or not a PNG this can decode\n", path);
+            continue;
+        }
+        if (keep) {
+            work->reference[i] = image;
+            matching++;
+            continue;
+        }
+
+        const rgba_image_t *reference = &work->reference[i];
+        if (!reference->rgba) {
+            printf("    %s: no reference image\n", path);
+        } else if (image.width != reference->width || image.height != reference->height) {
+            printf("    %s: %ux%u instead of %ux%u\n", path, image.width, image.height, reference->width,
+                   reference->height);
+        } else {
+            size_t pixels = (size_t)image.width * image.height;
+            size_t different = 0;
+            size_t first = 0;
+            for (size_t p = 0; p < pixels; p++) {
+                if (memcmp(image.rgba + 4 * p, reference->rgba + 4 * p, 4) != 0 && different++ == 0) {
+                    first = p;
+                }
+            }
+            if (different == 0) {
+                matching++;
+            } else {
+                printf("    %s: %zu of %zu pixels differ, the first at %zu,%zu\n", path, different, pixels,
+                       first % image.width, first / image.width);
+            }
+        }
+        free(image.rgba);
+    }
+    return matching;
+}
+
+/**
+ * @brief Run every implementation at every thread count and print the table
+ *
+ * @param options Settings
+ * @param work Files
+ * @return true if every run succeeded and matched the reference
+ */
+static bool run_all(const crossbench_options_t *options, crossbench_work_t *work) {
+    bool success = true;
+    bool have_reference = false;
+    printf("%-16s %7s %9s %9s %9s %11s %11s\n", "implementation", "threads", "fastest s", "files/s", "RSS MiB",
+           "output KiB", "identical");
+    for (size_t w = 0; w < options->waver_count; w++) {
+        const waver_impl_t *waver = &options->wavers[w];
+        size_t thread_counts = waver->style == THREADS_NONE ? 1 : options->thread_count;
+        for (size_t t = 0; t < thread_counts; t++) {
+            unsigned int threads = options->threads[t];
+            double fastest = 0.0;
+            long peak_kib = 0;
+            bool ran = true;
+            for (unsigned int run = 0; ran && run < options->runs; run++) {
+                remove_outputs(work);
+                double seconds;
+                long rss_kib = 0;
+                ran = run_waver(waver, threads, options->work, &seconds, &rss_kib);
+                if (run == 0 || seconds < fastest) {
+                    fastest = seconds;
+                }
+                if (rss_kib > peak_kib) {
+                    peak_kib = rss_kib;
+                }
+            }
+            char label[16];
+            snprintf(label, sizeof(label), waver->style == THREADS_NONE ? "auto" : "%u", threads);
+            if (!ran) {
+                printf("%-16s %7s  failed\n", waver->name, label);
+                success = false;
+                continue;
+            }
+
+            // The outputs of the last run are still there
+            uint64_t output_bytes;
+            bool keep = !have_reference;
+            size_t matching = check_outputs(work, keep, &output_bytes);
+            have_reference = have_reference || matching > 0;
+            if (matching != work->count) {
+                success = false;
+            }
+            char identical[32];
+            snprintf(identical, sizeof(identical), keep ? "reference" : "%zu/%zu", matching, work->count);
+            printf("%-16s %7s %9.3f %9.1f %9.1f %11.1f %11s\n", waver->name, label, fastest,
+                   fastest > 0.0 ? (double)work->count / fastest : 0.0, (double)peak_kib / 1024.0,
+                   (double)output_bytes / 1024.0, identical);
+            fflush(stdout);
+        }
+    }
+    return success;
+}
+
+/**
+ * @brief Remove the scratch directory made for the run
+ *
+ * @param work Files (and their outputs) to remove
+ * @param dir Directory to remove once empty
+ */
+static void remove_work(const crossbench_work_t *work, const char *dir) {
+    remove_outputs(work);
+    for (size_t i = 0; i < work->count; i++) {
+        unlink(work->inputs[i]);
+    }
+    rmdir(dir);
+}
+
+int main(int argc, char *argv[]) {
+    crossbench_options_t options = {
+        .corpus = "bench/corpus",
+        .work = NULL,
+        .waver_count = 0,
+        .runs = DEFAULT_RUNS,
+        .copies = DEFAULT_COPIES,
+    };
+    parse_threads(DEFAULT_THREADS, &options);
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage();
+            return 0;
+        } else if (strcmp(arg, "--waver") == 0 && has_value) {
+            if (options.waver_count == MAX_WAVERS || !parse_waver(argv[++i], &options.wavers[options.waver_count])) {
+                fprintf(stderr, "Invalid --waver: %s\n", argv[i]);
+                return 1;
+            }
+            options.waver_count++;
+        } else if (strcmp(arg, "--corpus") == 0 && has_value) {
+            options.corpus = argv[++i];
+        } else if (strcmp(arg, "--work") == 0 && has_value) {
+            options.work = argv[++i];
+        } else if (strcmp(arg, "--threads") == 0 && has_value) {
+            if (!parse_threads(argv[++i], &options)) {
+                fprintf(stderr, "Invalid thread counts: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((strcmp(arg, "--runs") == 0 || strcmp(arg, "--copies") == 0) && has_value) {
+            int value = atoi(argv[++i]);
+            if (value < 1) {
+                fprintf(stderr, "%s must be at least 1\n", arg);
+                return 1;
+            }
+            *(strcmp(arg, "--runs") == 0 ? &options.runs : &options.copies) = (unsigned int)value;
+        } else {
+            fprintf(stderr, "Invalid option: %s\n", arg);
+            print_usage();
+            return 1;
+        }
+    }
+    if (options.waver_count == 0) {
+        fprintf(stderr, "No implementation given with --waver\n");
+        print_usage();
+        return 1;
+    }
+
+    char temporary[PATH_LENGTH];
+    bool made_work = false;
+    if (!options.work) {
+        const char *tmpdir = getenv("TMPDIR");
+        snprintf(temporary, sizeof(temporary), "%s/waver-crossbench-XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+        if (!mkdtemp(temporary)) {
+            fprintf(stderr, "Cannot make a scratch directory: %s\n", temporary);
+            return 1;
+        }
+        options.work = temporary;
+        made_work = true;
+    } else if (mkdir(options.work, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot make the scratch directory: %s\n", options.work);
+        return 1;
+    }
+
+    crossbench_work_t work = {0};
+    bool success = prepare_work(&options, &work);
+    if (success) {
+        printf("Corpus: %s, %u cop%s of %zu files (%.1f MiB per run), fastest of %u runs\n\n", options.corpus,
+               options.copies, options.copies == 1 ? "y" : "ies", work.count / options.copies,
+               (double)work.input_bytes / (1024.0 * 1024.0), options.runs);
+        success = run_all(&options, &work);
+        printf(success ? "\nEvery output matches the reference\n"
+                       : "\n*** Some runs failed or differ from the reference ***\n");
+    }
+    if (made_work) {
+        remove_work(&work, options.work);
+    }
+    free_work(&work);
+    return success ? 0 : 1;
+}
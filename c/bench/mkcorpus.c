@@ -0,0 +1,242 @@
+/**
+ * @file mkcorpus.c
+ * @brief Generate the synthetic MP3 corpus used by the benchmark harness
+ *
+ * Every file is a valid MPEG-1 Layer III stream at 44.1 kHz whose
+ * granules carry only count1 (quadruple) spectral values, so they can be
+ * written without Huffman big-value tables.  The global gain follows a slow
+ * envelope with some noise, which gives waveforms with real structure.
+ * Everything is derived from a fixed seed per file, so the corpus is the
+ * same byte for byte on every machine and every run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#define SAMPLE_RATE 44100
+#define SAMPLES_PER_FRAME 1152
+#define MAX_FRAME_SIZE 1441
+#define CBR_BITRATE_INDEX 9
+
+// Bitrates in kbit/s by bitrate index for MPEG-1 Layer III
+static const int BITRATES[15] = {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320};
+
+/**
+ * @brief One file of the corpus
+ */
+typedef struct {
+    const char *name;     /**< File name inside the corpus directory */
+    double seconds;       /**< Length of the audio */
+    unsigned int channels; /**< 1 for mono, 2 for joint stereo */
+    bool vbr;             /**< Random bitrate per frame behind a Xing header */
+    uint32_t seed;        /**< Seed of the content */
+} corpus_file_t;
+
+// Mono and stereo, CBR and VBR, short and long
+static const corpus_file_t CORPUS[] = {
+    {"mono_cbr_short.mp3", 15.0, 1, false, 1},
+    {"mono_vbr_short.mp3", 15.0, 1, true, 2},
+    {"stereo_cbr_short.mp3", 15.0, 2, false, 3},
+    {"stereo_vbr_short.mp3", 15.0, 2, true, 4},
+    {"mono_cbr_long.mp3", 240.0, 1, false, 5},
+    {"mono_vbr_long.mp3", 240.0, 1, true, 6},
+    {"stereo_cbr_long.mp3", 240.0, 2, false, 7},
+    {"stereo_vbr_long.mp3", 240.0, 2, true, 8},
+};
+
+/**
+ * @brief Bit writer over a zeroed frame buffer
+ */
+typedef struct {
+    uint8_t *data;  /**< Frame buffer */
+    size_t bit;     /**< Next bit to write */
+} bit_writer_t;
+
+/**
+ * @brief Write the low bits of a value, most significant first
+ *
+ * @param writer Bit writer
+ * @param value Value to write
+ * @param bits Number of bits
+ */
+static void put_bits(bit_writer_t *writer, uint32_t value, int bits) {
+    for (int i = bits - 1; i >= 0; i--) {
+        if ((value >> i) & 1) {
+            writer->data[writer->bit >> 3] |= (uint8_t)(0x80 >> (writer->bit & 7));
+        }
+        writer->bit++;
+    }
+}
+
+/**
+ * @brief Next value of a linear congruential generator
+ *
+ * @param state Generator state
+ * @return 24 pseudo-random bits
+ */
+static uint32_t next_random(uint32_t *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+/**
+ * @brief Write the 4-byte frame header
+ *
+ * @param writer Bit writer at the start of the frame
+ * @param bitrate_index Bitrate index
+ * @param padding Whether the frame has a padding byte
+ * @param channels 1 for mono, 2 for joint stereo
+ */
+static void put_header(bit_writer_t *writer, int bitrate_index, int padding, unsigned int channels) {
+    put_bits(writer, 0xFFFB, 16);              // sync, MPEG-1, Layer III, no CRC
+    put_bits(writer, (uint32_t)bitrate_index, 4);
+    put_bits(writer, 0, 2);                    // 44.1 kHz
+    put_bits(writer, (uint32_t)padding, 1);
+    put_bits(writer, 0, 1);                    // private
+    put_bits(writer, channels == 1 ? 3 : 0, 2); // mono or stereo
+    put_bits(writer, 0, 2);                    // mode extension
+    put_bits(writer, 0, 1);                    // not copyrighted
+    put_bits(writer, 1, 1);                    // original
+    put_bits(writer, 0, 2);                    // no emphasis
+}
+
+/**
+ * @brief Write the side information and main data of one audio frame
+ *
+ * @param writer Bit writer just after the header
+ * @param file File being generated
+ * @param frame Index of the frame
+ * @param frame_count Number of audio frames in the file
+ * @param random Generator state
+ */
+static void put_audio(bit_writer_t *writer, const corpus_file_t *file, int frame, int frame_count,
+                      uint32_t *random) {
+    unsigned int channels = file->channels;
+    int gain[2][2];
+    int quads[2][2];
+    int signs[2][2];
+
+    for (int gr = 0; gr < 2; gr++) {
+        for (unsigned int ch = 0; ch < channels; ch++) {
+            double t = (frame * 2 + gr) / (double)(frame_count * 2);
+            double envelope = 0.5 + 0.5 * sin(t * 6.283 * (3 + ch) + ch);
+            envelope *= 0.6 + 0.4 * ((next_random(random) % 1000) / 1000.0);
+            gain[gr][ch] = 140 + (int)(envelope * 62);
+            quads[gr][ch] = (int)(next_random(random) % 4);
+            signs[gr][ch] = (int)(next_random(random) & 15);
+        }
+    }
+
+    // main_data_begin, private bits, scfsi
+    put_bits(writer, 0, 9);
+    put_bits(writer, 0, channels == 1 ? 5 : 3);
+    put_bits(writer, 0, channels == 1 ? 4 : 8);
+    for (int gr = 0; gr < 2; gr++) {
+        for (unsigned int ch = 0; ch < channels; ch++) {
+            put_bits(writer, (uint32_t)(quads[gr][ch] * 4 + 8), 12); // part2_3_length
+            put_bits(writer, 0, 9);                                  // big_values
+            put_bits(writer, (uint32_t)gain[gr][ch], 8);             // global_gain
+            put_bits(writer, 0, 4);                                  // scalefac_compress
+            put_bits(writer, 0, 1);                                  // no window switching
+            put_bits(writer, 0, 15);                                 // table_select
+            put_bits(writer, 0, 4);                                  // region0_count
+            put_bits(writer, 0, 3);                                  // region1_count
+            put_bits(writer, 0, 1);                                  // preflag
+            put_bits(writer, 0, 1);                                  // scalefac_scale
+            put_bits(writer, 1, 1);                                  // count1table_select
+        }
+    }
+
+    // count1 quadruples with table B: 1111 is (0,0,0,0) and 0000 is (1,1,1,1)
+    for (int gr = 0; gr < 2; gr++) {
+        for (unsigned int ch = 0; ch < channels; ch++) {
+            for (int k = 0; k < quads[gr][ch]; k++) {
+                put_bits(writer, 15, 4);
+            }
+            put_bits(writer, 0, 4);
+            put_bits(writer, (uint32_t)signs[gr][ch], 4);
+        }
+    }
+}
+
+/**
+ * @brief Write one file of the corpus
+ *
+ * @param directory Corpus directory
+ * @param file File to write
+ * @return true if successful, false otherwise
+ */
+static bool write_file(const char *directory, const corpus_file_t *file) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, file->name);
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to create %s\n", path);
+        return false;
+    }
+
+    uint32_t random = file->seed;
+    int frame_count = (int)(file->seconds * SAMPLE_RATE / SAMPLES_PER_FRAME);
+    int side_info = file->channels == 1 ? 17 : 32;
+    long remainder = 0;
+    bool ok = true;
+
+    // A VBR file starts with a Xing frame that carries the frame count
+    for (int frame = file->vbr ? -1 : 0; frame < frame_count && ok; frame++) {
+        int bitrate_index = file->vbr && frame >= 0 ? 1 + (int)(next_random(&random) % 14) : CBR_BITRATE_INDEX;
+        long numerator = 144000L * BITRATES[bitrate_index];
+        int padding = 0;
+        remainder += numerator % SAMPLE_RATE;
+        if (remainder >= SAMPLE_RATE) {
+            remainder -= SAMPLE_RATE;
+            padding = 1;
+        }
+        size_t size = (size_t)(numerator / SAMPLE_RATE + padding);
+
+        uint8_t data[MAX_FRAME_SIZE] = {0};
+        bit_writer_t writer = {data, 0};
+        put_header(&writer, bitrate_index, padding, file->channels);
+        if (frame < 0) {
+            uint8_t *xing = data + 4 + side_info;
+            memcpy(xing, "Xing", 4);
+            xing[7] = 3; // frame count and byte count present
+            xing[8] = (uint8_t)(frame_count >> 24);
+            xing[9] = (uint8_t)(frame_count >> 16);
+            xing[10] = (uint8_t)(frame_count >> 8);
+            xing[11] = (uint8_t)frame_count;
+        } else {
+            put_audio(&writer, file, frame, frame_count, &random);
+        }
+        ok = fwrite(data, 1, size, fp) == size;
+    }
+
+    if (fclose(fp) != 0 || !ok) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Write every file of the corpus into the given directory
+ *
+ * @param argc Argument count
+ * @param argv Argument values (the corpus directory)
+ * @return 0 if successful, 1 otherwise
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: mkcorpus <directory>\n");
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(CORPUS) / sizeof(CORPUS[0]); i++) {
+        if (!write_file(argv[1], &CORPUS[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+/**
+ * @file atlas.h
+ * @brief Outputs made once per directory instead of once per track (--atlas)
+ *
+ * A web player that fetches one image per track makes a request per play
+ * and another to preload the next track.  An atlas gives the whole
+ * directory two files instead:
+ *
+ *     waveforms.png   every track's image, one band of --height rows each
+ *     waveforms.json  index: where each track's band starts, and/or a
+ *                     short peaks array per track to draw client-side
+ *
+ * The index looks like this (fields of a kind that was not asked for
+ * are left out):
+ *
+ *     {"version":1,"image":"waveforms.png","width":2048,"height":128,
+ *      "columns":256,"tracks":[
+ *       {"file":"01 Intro.mp3","y":0,"channels":2,"peaks":"<base64>"},
+ *       ...]}
+ *
+ * Tracks are sorted by file name.  "peaks" holds one byte per column,
+ * 255 being full scale, left (or mono) columns first and then right
+ * ones for stereo.
+ *
+ * The tracks of a directory are decoded by the thread pool like any other
+ * files, each into its own slot.  The directory scan and every track hold
+ * a reference to the atlas; whichever lets go last writes the outputs.
+ */
+
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <stdbool.h>
+#include "waver.h"
+
+#define WAVER_ATLAS_IMAGE "waveforms.png"  /**< Name of the atlas image inside each directory */
+#define WAVER_ATLAS_INDEX "waveforms.json" /**< Name of the index inside each directory */
+#define WAVER_ATLAS_VERSION 1              /**< Bumped on incompatible index changes */
+
+typedef struct waver_atlas_t waver_atlas_t;
+typedef struct waver_atlas_track_t waver_atlas_track_t;
+
+/**
+ * @brief Parse the list of atlas outputs given on the command line
+ *
+ * @param list Comma-separated kinds ("png" and/or "peaks")
+ * @param kinds Receives the waver_atlas_kind_t flags
+ * @return true if successful, false on an unknown or missing kind
+ */
+bool waver_atlas_parse(const char *list, unsigned int *kinds);
+
+/**
+ * @brief Whether a directory already has an atlas index
+ *
+ * @param dir_path Path of the directory
+ * @return true if its index exists
+ */
+bool waver_atlas_exists(const char *dir_path);
+
+/**
+ * @brief Start the atlas of one directory
+ *
+ * The caller holds the first reference and lets go of it with
+ * waver_atlas_release() once every track has been added.
+ *
+ * @param dir_path Path of the directory
+ * @param args Command-line arguments (kinds, size, colors, PNG settings)
+ * @return New atlas or NULL on allocation failure
+ */
+waver_atlas_t *waver_atlas_new(const char *dir_path, const waver_args_t *args);
+
+/**
+ * @brief Add a track to an atlas
+ *
+ * Takes a reference to the atlas for the track, which
+ * waver_atlas_render() drops.  Only one thread may add tracks.
+ *
+ * @param atlas Atlas of the directory
+ * @param name File name of the track in the directory
+ * @return Slot of the track or NULL on allocation failure
+ */
+waver_atlas_track_t *waver_atlas_add(waver_atlas_t *atlas, const char *name);
+
+/**
+ * @brief Decode a track into its slot and drop its reference
+ *
+ * A track that cannot be decoded is left out of the outputs.
+ *
+ * @param track Slot from waver_atlas_add()
+ * @param input_path Path to the audio file of the track
+ * @param context State reused between files (NULL to use temporary state)
+ * @return true if successful, false if the track or (as the last reference) the outputs failed
+ */
+bool waver_atlas_render(waver_atlas_track_t *track, const char *input_path, waver_context_t *context);
+
+/**
+ * @brief Drop a reference to an atlas, writing and freeing it if it was the last
+ *
+ * @param atlas Atlas of the directory
+ * @return true if successful, false if the outputs could not be written
+ */
+bool waver_atlas_release(waver_atlas_t *atlas);
+
+#endif /* ATLAS_H */
@@ -0,0 +1,53 @@
+/**
+ * @file console.h
+ * @brief Console output that does not make the workers wait for the terminal
+ *
+ * waver_print_stdout(), waver_print_stderr() and waver_print_verbose()
+ * format their message on the calling thread and append it to a ring
+ * buffer owned by that thread.  A writer thread, started with the first
+ * message, drains the rings in batches: one fwrite() per run of messages
+ * bound for the same stream and one fflush() per pass.  Appending takes no
+ * lock, so a worker only waits for the console when its own ring is full,
+ * that is when the terminal or pipe cannot keep up at all.
+ *
+ * The messages of one thread come out in the order they were printed;
+ * those of different threads interleave by whole lines.  Anything that
+ * writes to stdout or stderr directly calls waver_console_flush() first,
+ * so it does not overtake messages that are still queued.
+ */
+
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <stdarg.h>
+
+/**
+ * @brief Stream a console message is bound for
+ */
+typedef enum {
+    WAVER_CONSOLE_STDOUT = 0, /**< Standard output */
+    WAVER_CONSOLE_STDERR      /**< Standard error */
+} waver_console_stream_t;
+
+/**
+ * @brief Queue one line for the writer thread
+ *
+ * Safe to call from any thread.  A line break is appended to the message.
+ * Falls back to writing the line directly if the writer thread or the
+ * ring of the calling thread cannot be set up.
+ *
+ * @param stream Stream the line is bound for
+ * @param format Format string
+ * @param ap Additional arguments
+ */
+void waver_console_vprint(waver_console_stream_t stream, const char *format, va_list ap);
+
+/**
+ * @brief Wait until every line queued so far has been written and flushed
+ *
+ * Also flushes stdout, so callers that printed to it directly can use this
+ * in place of fflush(stdout).
+ */
+void waver_console_flush(void);
+
+#endif /* CONSOLE_H */
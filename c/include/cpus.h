@@ -0,0 +1,70 @@
+/**
+ * @file cpus.h
+ * @brief CPUs the process may actually use, and where its threads spend their time
+ *
+ * The number of online processors overstates what a process gets in a
+ * container: the CPU affinity mask may allow only some of them, and a
+ * cgroup CPU quota (cpu.max in cgroup v2, cpu.cfs_quota_us in v1) may
+ * allow the equivalent of fewer still.  A pool sized to the online count
+ * then runs many more threads than it can keep busy, which only adds
+ * context switches and memory.
+ *
+ * Whether more threads than CPUs would help depends on how much of each
+ * task is spent waiting: the time of a thread splits into CPU time,
+ * time runnable but waiting for a CPU (from /proc/thread-self/schedstat,
+ * where the kernel keeps it), and the rest, which is time blocked, mostly
+ * on I/O.
+ */
+
+#ifndef CPUS_H
+#define CPUS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Time one thread has spent so far
+ */
+typedef struct {
+    uint64_t wall_ns;     /**< Monotonic clock */
+    uint64_t cpu_ns;      /**< CPU time of the thread */
+    uint64_t waiting_ns;  /**< Time runnable but not running (0 if the kernel does not report it) */
+} waver_thread_times_t;
+
+/**
+ * @brief Number of CPUs the process can use
+ *
+ * @return Smallest of the online processors, the CPUs in the affinity mask
+ *         and the cgroup CPU quota rounded up (2 if nothing is known)
+ */
+size_t waver_cpus_available(void);
+
+/**
+ * @brief Pin the calling thread to one of the CPUs the process may run on
+ *
+ * @param index Index of the thread; threads are dealt over the allowed CPUs in turn
+ * @return true if successful, false if the affinity could not be read or set
+ */
+bool waver_cpus_pin(size_t index);
+
+/**
+ * @brief Open the schedstat file of the calling thread
+ *
+ * The file stays bound to the thread that opened it, so a thread that
+ * reads its times around every task opens it once and keeps it.
+ *
+ * @return File descriptor, or -1 if the kernel does not provide the file
+ */
+int waver_thread_schedstat_open(void);
+
+/**
+ * @brief Read the times of the calling thread
+ *
+ * @param times Receives the times
+ * @param schedstat Descriptor from waver_thread_schedstat_open() for the
+ *                  calling thread, or -1 to leave the waiting time at 0
+ */
+void waver_thread_times(waver_thread_times_t *times, int schedstat);
+
+#endif /* CPUS_H */
@@ -0,0 +1,126 @@
+/**
+ * @file dedup.h
+ * @brief Drawing each distinct audio stream once per run (--dedup)
+ *
+ * Libraries hold many copies of the same audio: one master on several
+ * compilations, re-imports, the same album in two users' folders.  Each
+ * copy used to be decoded and drawn on its own.  With --dedup every file
+ * is fingerprinted before it is decoded, from the mapping the decoder
+ * then reads: a 64-bit xxHash of the audio payload and its length.  Tags
+ * are left out of it (ID3v2 at the start; APEv2, Lyrics3v2, ID3v1 and
+ * ID3v1 extended at the end; everything but the format and data chunks
+ * of a WAV), so re-tagging a copy does not make it look different.
+ *
+ * The first file with a fingerprint claims it and is drawn as usual;
+ * another worker that finds the same fingerprint waits until it is done,
+ * then hard-links (or copies) its images instead of decoding.  If the
+ * first file fails, the next one with the fingerprint draws it instead.
+ * The fingerprint is seeded with the render parameters, so one table
+ * never mixes images of different sizes or colors.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "waver.h"
+
+/**
+ * @brief One distinct audio stream seen in the run
+ */
+typedef struct waver_dedup_entry_t waver_dedup_entry_t;
+
+/**
+ * @brief Hash of the audio payload of a file, leaving out its tags
+ *
+ * @param data Contents of the file
+ * @param size Size of the file
+ * @param seed Seed of the hash (such as a hash of the render parameters)
+ * @param length Receives the number of bytes hashed
+ * @return Hash of the payload
+ */
+uint64_t waver_dedup_fingerprint(const uint8_t *data, size_t size, uint64_t seed, uint64_t *length);
+
+/**
+ * @brief Create an empty table of audio streams
+ *
+ * @param mode Whether images are reused as hard links or as copies
+ * @param params Hash of the render parameters of the run
+ * @return New table or NULL on allocation failure
+ */
+waver_dedup_t *waver_dedup_new(waver_dedup_mode_t mode, uint64_t params);
+
+/**
+ * @brief Free a table and everything it recorded
+ *
+ * @param dedup Table (may be NULL)
+ */
+void waver_dedup_free(waver_dedup_t *dedup);
+
+/**
+ * @brief Look up the audio stream of a file, claiming it if it is new
+ *
+ * Waits while another file with the same fingerprint is being drawn.
+ * A stream whose images have changed since (under --watch) is claimed
+ * again.
+ *
+ * @param dedup Table
+ * @param data Contents of the file
+ * @param size Size of the file
+ * @param render Receives true if the caller must draw the file and then
+ *               call waver_dedup_finish(), false if its images can be reused
+ * @return Entry of the stream, or NULL on allocation failure (draw the file without the table)
+ */
+waver_dedup_entry_t *waver_dedup_claim(waver_dedup_t *dedup, const uint8_t *data, size_t size, bool *render);
+
+/**
+ * @brief Record the images of a stream the caller has claimed and drawn
+ *
+ * @param dedup Table
+ * @param entry Entry returned by waver_dedup_claim() with render set
+ * @param paths Paths of the images, one per output of the file
+ * @param count Number of paths
+ * @param success Whether every image was written (if not, the next copy is drawn instead)
+ * @param seconds Time the file took to decode and draw
+ */
+void waver_dedup_finish(waver_dedup_t *dedup, waver_dedup_entry_t *entry, const char *const *paths, size_t count,
+                        bool success, double seconds);
+
+/**
+ * @brief Give an output of a file the image already drawn for the same output of its stream
+ *
+ * Safe while another file claims the entry again (under --watch): the
+ * image is looked up under the table's lock.
+ *
+ * @param dedup Table
+ * @param entry Entry returned by waver_dedup_claim() without render set
+ * @param index Index of the output
+ * @param path Path of the output (replaced if it exists)
+ * @param source Receives the path of the image reused
+ * @param source_size Size of the source buffer
+ * @return true if successful, false otherwise
+ */
+bool waver_dedup_reuse(waver_dedup_t *dedup, const waver_dedup_entry_t *entry, size_t index, const char *path,
+                       char *source, size_t source_size);
+
+/**
+ * @brief Remove an output about to be written again if it is linked elsewhere
+ *
+ * Writing a hard-linked image in place would change every link to it, so
+ * it is unlinked first and written as a file of its own.
+ *
+ * @param path Path of the output
+ */
+void waver_dedup_unshare(const char *path);
+
+/**
+ * @brief Print how many files were drawn from another copy and the time it saved
+ *
+ * @param dedup Table (may be NULL)
+ * @param args Command-line arguments
+ */
+void waver_dedup_report(const waver_dedup_t *dedup, const waver_args_t *args);
+
+#endif /* DEDUP_H */
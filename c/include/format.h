@@ -0,0 +1,120 @@
+/**
+ * @file format.h
+ * @brief Audio formats the peak reduction can be fed from
+ *
+ * Each format recognises its files by their first bytes and reduces a
+ * whole file to per-column peaks (and sidecar bins), decoding it first if
+ * it has to.  MP3 is decoded by minimp3 (audio.c); PCM in a WAV, RF64 or
+ * BW64 container is read straight from the mapping (wav.c).  Another
+ * format, such as FLAC, needs a probe and a decode function and an entry
+ * in waver_format_detect().
+ */
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "waver.h"
+#include "input.h"
+#include "sidecar.h"
+#include "stats.h"
+
+// Bytes from the start of a file that are enough to tell the formats apart
+#define WAVER_FORMAT_PROBE_BYTES 12
+
+/**
+ * @brief Column peaks for one image width
+ */
+typedef struct {
+    unsigned int width; /**< Number of columns */
+    uint16_t *left;     /**< Peak per column for left/mono (width entries) */
+    uint16_t *right;    /**< Peak per column for right (width entries) */
+} waver_column_peaks_t;
+
+/**
+ * @brief How a file should be decoded
+ */
+typedef struct {
+    waver_decoder_t decoder;     /**< MP3 decoder build to use */
+    bool single_pass;            /**< Take the length from the headers instead of scanning */
+    unsigned int decode_threads; /**< Threads to decode this one file with */
+    waver_quality_t quality;     /**< Decode everything, a sample of frames or only the spectrum */
+} waver_decode_options_t;
+
+/**
+ * @brief Reduce a whole file to column peaks for one or more image widths
+ *
+ * @param input_path Path to the input audio file (NULL if input is the caller's memory)
+ * @param input Mapping of the file, or NULL to let the format open it
+ * @param layouts Column peaks to fill, one per image width
+ * @param layout_count Number of layouts
+ * @param options Decoder, single-pass and thread settings
+ * @param sidecar Receives the sidecar bins of the file, or NULL to skip them
+ * @param channel_count Receives the number of channels drawn (1 or 2)
+ * @param timing Receives the phase times, input size and audio length, or NULL
+ * @return true if successful, false otherwise
+ */
+typedef bool (*waver_format_decode_fn)(const char *input_path, const waver_input_t *input,
+                                       waver_column_peaks_t *layouts, size_t layout_count,
+                                       const waver_decode_options_t *options,
+                                       waver_sidecar_builder_t **sidecar, unsigned int *channel_count,
+                                       waver_file_stats_t *timing);
+
+/**
+ * @brief Function table for one audio format
+ */
+typedef struct {
+    const char *name;  /**< Short name reported in verbose output */
+    bool (*probe)(const uint8_t *data, size_t size); /**< Whether the first bytes of a file are this format */
+    waver_format_decode_fn decode; /**< Reduce a file to column peaks */
+} waver_format_t;
+
+/**
+ * @brief Pick the format of a file from its first bytes
+ *
+ * Anything no other format claims is taken to be MP3, which minimp3 finds
+ * by scanning for frame headers.
+ *
+ * @param data First bytes of the file (at least WAVER_FORMAT_PROBE_BYTES if it is that long)
+ * @param size Number of bytes in data
+ * @return The format (never NULL)
+ */
+const waver_format_t *waver_format_detect(const uint8_t *data, size_t size);
+
+/**
+ * @brief Allocate zeroed column peak arrays shaped like another set
+ *
+ * @param layouts Layouts to copy the widths from
+ * @param count Number of layouts
+ * @param copy Layouts to fill (count entries)
+ * @return Single allocation holding all arrays (free it to release them), or NULL
+ */
+uint16_t *waver_column_peaks_alloc(const waver_column_peaks_t *layouts, size_t count, waver_column_peaks_t *copy);
+
+/**
+ * @brief Reduce an audio file to column peaks the way its outputs would be drawn
+ *
+ * Used for outputs that are not one image per file (--atlas).  With
+ * --peaks an up-to-date sidecar named after output_path is read instead
+ * of decoding, or written after decoding.
+ *
+ * @param input_path Path to the input audio file
+ * @param output_path Path of the output whose sidecar may be used or written (--peaks)
+ * @param args Command-line arguments
+ * @param layouts Column peaks to fill, one per width
+ * @param layout_count Number of layouts
+ * @param channel_count Receives the number of channels (1 or 2)
+ * @param context State reused between files, whose accumulator gets the timing (NULL for none)
+ * @return true if successful, false otherwise
+ */
+bool waver_file_column_peaks(const char *input_path, const char *output_path, const waver_args_t *args,
+                             waver_column_peaks_t *layouts, size_t layout_count, unsigned int *channel_count,
+                             waver_context_t *context);
+
+// Formats compiled into waver
+extern const waver_format_t waver_format_mp3;
+extern const waver_format_t waver_format_wav;
+
+#endif /* FORMAT_H */
@@ -0,0 +1,72 @@
+/**
+ * @file input.h
+ * @brief Memory-mapped audio input with read-ahead hints
+ *
+ * The decoder reads each file straight from a read-only mapping.  The
+ * kernel is told that the file will be read once, front to back, so it can
+ * read ahead in large blocks, and the pages a decoder has moved past are
+ * dropped from the mapping and the page cache again, so that a run over a
+ * whole library does not push everything else out of memory.
+ */
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief A mapped input file
+ */
+typedef struct {
+    const uint8_t *data; /**< Start of the mapping */
+    size_t size;         /**< Size of the file and the mapping */
+    int fd;              /**< Open file, kept for posix_fadvise() (-1 for memory the caller owns) */
+} waver_input_t;
+
+/**
+ * @brief Map a file for sequential reading
+ *
+ * @param path Path of the file
+ * @param input Receives the mapping
+ * @return true if successful, false if the file cannot be opened or mapped
+ */
+bool waver_input_open(const char *path, waver_input_t *input);
+
+/**
+ * @brief Drop a range of the file that will not be read again
+ *
+ * Only whole pages inside [offset, end) are released.  Reading them again
+ * is still allowed; they are simply read from the file once more.  Memory
+ * the caller owns (fd -1) is left alone.
+ *
+ * @param input Mapped file
+ * @param offset First byte of the range
+ * @param end One past the last byte of the range
+ */
+void waver_input_release(const waver_input_t *input, size_t offset, size_t end);
+
+/**
+ * @brief Read the start of a file into the page cache ahead of its decoder
+ *
+ * Used by the prefetch stage (--io-threads), so the thread that blocks on
+ * slow storage is not the one that is going to decode the file.  The
+ * bytes read are discarded; the decoder's mapping then finds them cached.
+ *
+ * @param path Path of the file
+ * @param buffer Scratch space for the reads
+ * @param buffer_size Size of buffer
+ * @param limit Read at most this many bytes; the kernel reads the rest ahead while decoding
+ * @return true if the file could be read, false otherwise
+ */
+bool waver_input_prefetch(const char *path, void *buffer, size_t buffer_size, uint64_t limit);
+
+/**
+ * @brief Unmap a file and drop it from the page cache
+ *
+ * @param input Mapped file
+ */
+void waver_input_close(waver_input_t *input);
+
+#endif /* INPUT_H */
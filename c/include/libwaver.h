@@ -0,0 +1,89 @@
+/**
+ * @file libwaver.h
+ * @brief Embeddable waveform rendering from MP3 or WAV data in memory
+ *
+ * The entry points of libwaver.a and libwaver.so for programs that have
+ * the audio in memory already, such as an upload service.  Nothing here
+ * reads or writes files, prints, or keeps global state: every call works
+ * only on its arguments, so any number of threads may render at once as
+ * long as each uses its own context (or none).
+ */
+
+#ifndef LIBWAVER_H
+#define LIBWAVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "waver.h"
+
+/**
+ * @brief How to render one waveform
+ */
+typedef struct {
+    unsigned int width;           /**< Width of the image in pixels (at least 16) */
+    unsigned int height;          /**< Height of the image in pixels (even, at least 6) */
+    waver_color_t left_color;     /**< Color for left channel (and mono) */
+    waver_color_t right_color;    /**< Color for right channel */
+    waver_color_t bg_color;       /**< Background color */
+    waver_decoder_t decoder;      /**< MP3 decoder build to use */
+    bool single_pass;             /**< Take the length from the MP3 headers instead of scanning */
+    waver_quality_t quality;      /**< Exact peaks or a preview from a sample of MP3 frames */
+    unsigned int decode_threads;  /**< Threads to decode a long input with (0 or 1 for the calling thread only) */
+    waver_png_options_t png;      /**< PNG compression profile and deflate implementation */
+} waver_render_options_t;
+
+/**
+ * @brief Fill in the same defaults the command line uses
+ *
+ * @param options Options to initialize
+ */
+void waver_render_options_init(waver_render_options_t *options);
+
+/**
+ * @brief Decode MP3 or WAV data into one peak per image column
+ *
+ * @param data MP3 or PCM WAV data (not modified, and only read during the call)
+ * @param size Size of data in bytes
+ * @param options Width, decoder and decode threads to use
+ * @param left Receives the peak per column for left or mono (options->width entries)
+ * @param right Receives the peak per column for right (options->width entries, zero for mono)
+ * @param channel_count Receives 1 for mono or 2 for stereo
+ * @return true if successful, false if the data cannot be decoded
+ */
+bool waver_render_peaks(const void *data, size_t size, const waver_render_options_t *options,
+                        uint16_t *left, uint16_t *right, unsigned int *channel_count);
+
+/**
+ * @brief Render MP3 or WAV data as a PNG passed to a callback in pieces
+ *
+ * @param data MP3 or PCM WAV data (not modified, and only read during the call)
+ * @param size Size of data in bytes
+ * @param options Size, colors, decoder and PNG settings
+ * @param context Image and encoder reused between calls on one thread (NULL for temporary state)
+ * @param write Receives the PNG in pieces, in order
+ * @param write_context Passed to write
+ * @return true if successful, false otherwise (including when write fails)
+ */
+bool waver_render_png(const void *data, size_t size, const waver_render_options_t *options,
+                      waver_context_t *context, waver_write_fn write, void *write_context);
+
+/**
+ * @brief Render MP3 or WAV data as a PNG into a caller-provided buffer
+ *
+ * When the buffer is too small the PNG is still encoded to the end to
+ * learn its size, so the call can be repeated with a buffer that fits.
+ *
+ * @param data MP3 or PCM WAV data (not modified, and only read during the call)
+ * @param size Size of data in bytes
+ * @param options Size, colors, decoder and PNG settings
+ * @param context Image and encoder reused between calls on one thread (NULL for temporary state)
+ * @param buffer Receives the PNG
+ * @param capacity Size of buffer in bytes
+ * @param png_size Receives the size of the PNG (larger than capacity if it did not fit, 0 on other errors)
+ * @return true if the PNG is in buffer, false otherwise
+ */
+bool waver_render_png_buffer(const void *data, size_t size, const waver_render_options_t *options,
+                             waver_context_t *context, void *buffer, size_t capacity, size_t *png_size);
+
+#endif /* LIBWAVER_H */
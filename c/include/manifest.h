@@ -0,0 +1,237 @@
+/**
+ * @file manifest.h
+ * @brief Record of what an incremental run has rendered (--incremental)
+ *
+ * Every directory given on the command line gets a manifest file that
+ * lists the audio files found under it, each with the size, modification
+ * time and inode it had when its outputs were made, plus the modification
+ * time of every directory.  A later run only has to stat() a file to know
+ * whether its outputs are still current, and with --trust-dir-mtimes it
+ * does not even read a directory whose modification time has not moved.
+ * Outputs are named from the input path and the output specs, so the
+ * render parameters are kept as one hash; when they change, every file is
+ * rendered again.
+ *
+ * File layout (all fields in the writer's byte order, checked on open):
+ *
+ *     waver_manifest_header_t                     64 bytes
+ *     waver_manifest_directory_t[directory_count] 40 bytes each, sorted by path
+ *     waver_manifest_file_t[file_count]           40 bytes each, grouped by directory
+ *     names                                       NUL-terminated names
+ *
+ * Directory names are relative to the root ("" for the root itself) and
+ * file names are relative to their directory.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "waver.h"
+
+#define WAVER_MANIFEST_MAGIC "WAVERMAN"       /**< First 8 bytes of every manifest */
+#define WAVER_MANIFEST_VERSION 1              /**< Bumped on incompatible layout changes */
+#define WAVER_MANIFEST_BYTE_ORDER 0x01020304u /**< Written as a native uint32_t */
+#define WAVER_MANIFEST_NAME ".waver-manifest" /**< File name inside each root */
+#define WAVER_MANIFEST_NO_PARENT UINT32_MAX   /**< Parent of the root directory */
+#define WAVER_MANIFEST_COMPLETE 1u            /**< Directory flag: every file has current outputs */
+
+/**
+ * @brief Fixed header at the start of a manifest
+ */
+typedef struct {
+    char magic[8];            /**< WAVER_MANIFEST_MAGIC (not NUL terminated) */
+    uint32_t version;         /**< WAVER_MANIFEST_VERSION */
+    uint32_t byte_order;      /**< WAVER_MANIFEST_BYTE_ORDER in the writer's order */
+    uint32_t header_size;     /**< sizeof(waver_manifest_header_t) */
+    uint32_t reserved;        /**< Zero */
+    uint64_t params;          /**< Hash of the render parameters (waver_manifest_params()) */
+    uint64_t directory_count; /**< Entries in the directory table */
+    uint64_t file_count;      /**< Entries in the file table */
+    uint64_t names_size;      /**< Bytes of names */
+    uint64_t reserved2;       /**< Zero */
+} waver_manifest_header_t;
+
+/**
+ * @brief One directory in a manifest
+ */
+typedef struct {
+    int64_t mtime_ns;     /**< Modification time before it was read, in nanoseconds */
+    uint64_t name;        /**< Offset of the path relative to the root in the names */
+    uint32_t parent;      /**< Index of the parent directory (WAVER_MANIFEST_NO_PARENT for the root) */
+    uint32_t first_file;  /**< Index of the first file of the directory */
+    uint32_t file_count;  /**< Number of files in the directory */
+    uint32_t flags;       /**< WAVER_MANIFEST_COMPLETE if every file has current outputs */
+    uint64_t reserved;    /**< Zero */
+} waver_manifest_directory_t;
+
+/**
+ * @brief Identity of an input file when its outputs were made
+ */
+typedef struct {
+    uint64_t size;        /**< Size in bytes */
+    int64_t mtime_ns;     /**< Modification time in nanoseconds */
+    uint64_t inode;       /**< Inode number (changes when a file is replaced) */
+} waver_manifest_stamp_t;
+
+/**
+ * @brief One audio file in a manifest
+ */
+typedef struct {
+    waver_manifest_stamp_t stamp; /**< Identity when its outputs were made */
+    uint64_t name;                /**< Offset of the name in the names */
+    uint64_t reserved;            /**< Zero */
+} waver_manifest_file_t;
+
+/**
+ * @brief What waver_manifest_check() found out about a file
+ */
+typedef enum {
+    WAVER_MANIFEST_NEW = 0,   /**< Not in the manifest: outputs may exist but are not known to be current */
+    WAVER_MANIFEST_UNCHANGED, /**< Outputs are current; the file has been carried over */
+    WAVER_MANIFEST_CHANGED    /**< Outputs are stale and must be made again */
+} waver_manifest_state_t;
+
+/**
+ * @brief Modification time of a stat() result in nanoseconds
+ *
+ * @param st Result of stat()
+ * @return Nanoseconds since the epoch
+ */
+int64_t waver_manifest_mtime_ns(const struct stat *st);
+
+/**
+ * @brief Identity of a file from its stat() result
+ *
+ * @param st Result of stat()
+ * @param stamp Receives the size, modification time and inode
+ */
+void waver_manifest_stamp(const struct stat *st, waver_manifest_stamp_t *stamp);
+
+typedef struct waver_manifest_t waver_manifest_t;
+typedef struct waver_manifest_dir_t waver_manifest_dir_t;
+
+/**
+ * @brief Receives each subdirectory of an unchanged directory
+ *
+ * @param context Caller state passed to waver_manifest_carry_dir()
+ * @param path Path of the subdirectory (the root path joined with its relative path)
+ */
+typedef void (*waver_manifest_dir_fn)(void *context, const char *path);
+
+/**
+ * @brief Hash of everything that decides the outputs of a file
+ *
+ * Covers the size and colors of the default output, every output spec and
+ * whether sidecars are written, but not the PNG profile, which only changes
+ * how the same pixels are compressed.
+ *
+ * @param args Command-line arguments
+ * @return Hash of the render parameters
+ */
+uint64_t waver_manifest_params(const waver_args_t *args);
+
+/**
+ * @brief Load the manifest of a root directory, or start an empty one
+ *
+ * A missing, unreadable or invalid manifest file is treated as empty.
+ *
+ * @param root Directory given on the command line
+ * @param params Hash of the render parameters of this run
+ * @return Manifest or NULL on allocation failure
+ */
+waver_manifest_t *waver_manifest_open(const char *root, uint64_t params);
+
+/**
+ * @brief Start the record of one directory
+ *
+ * @param manifest Manifest of the root the directory is under
+ * @param path Path of the directory (the root path or a path built from it)
+ * @param mtime_ns Modification time of the directory, taken before reading it
+ * @return Record to add the directory's files to, or NULL on allocation failure
+ */
+waver_manifest_dir_t *waver_manifest_begin_dir(waver_manifest_t *manifest, const char *path, int64_t mtime_ns);
+
+/**
+ * @brief Carry a directory over unread if nothing in it can have changed
+ *
+ * That is the case when the directory was complete in the loaded manifest,
+ * has kept its modification time and the render parameters are the same.
+ * Its files are then copied to the new manifest and fn is called for each
+ * of its subdirectories.
+ *
+ * @param dir Record of the directory
+ * @param fn Receives every subdirectory
+ * @param context Passed to fn
+ * @param files Receives the number of files carried over
+ * @return true if the directory was carried over, false if it has to be read
+ */
+bool waver_manifest_carry_dir(waver_manifest_dir_t *dir, waver_manifest_dir_fn fn, void *context, size_t *files);
+
+/**
+ * @brief Check one file of a directory against the loaded manifest
+ *
+ * An unchanged file is copied to the new manifest right away.  A file
+ * whose outputs are gone is stale however its identity compares.
+ *
+ * @param dir Record of the directory
+ * @param name Name of the file in the directory
+ * @param stamp Current identity of the file
+ * @param outputs_exist Whether every output of the file is there
+ * @return Whether the outputs of the file are current
+ */
+waver_manifest_state_t waver_manifest_check(waver_manifest_dir_t *dir, const char *name,
+                                            const waver_manifest_stamp_t *stamp, bool outputs_exist);
+
+/**
+ * @brief Record a file whose outputs have been made
+ *
+ * @param dir Record of the directory
+ * @param name Name of the file in the directory
+ * @param stamp Identity of the file before its outputs were made
+ * @return true if successful, false on allocation failure (the directory is marked incomplete)
+ */
+bool waver_manifest_record(waver_manifest_dir_t *dir, const char *name, const waver_manifest_stamp_t *stamp);
+
+/**
+ * @brief Mark a directory as not complete, so it is read again next time
+ *
+ * @param dir Record of the directory
+ */
+void waver_manifest_fail(waver_manifest_dir_t *dir);
+
+/**
+ * @brief Add time spent deciding which files to skip
+ *
+ * @param manifest Manifest
+ * @param seconds Time spent in stat() and lookups
+ */
+void waver_manifest_add_check_time(waver_manifest_t *manifest, double seconds);
+
+/**
+ * @brief Print how many files were skipped and how long the checks took
+ *
+ * @param manifest Manifest after the run
+ * @param args Command-line arguments (for quiet)
+ */
+void waver_manifest_report(const waver_manifest_t *manifest, const waver_args_t *args);
+
+/**
+ * @brief Replace the manifest file with the directories and files of this run
+ *
+ * @param manifest Manifest after every task has finished
+ * @return true if successful, false otherwise
+ */
+bool waver_manifest_write(waver_manifest_t *manifest);
+
+/**
+ * @brief Free a manifest
+ *
+ * @param manifest Manifest (may be NULL)
+ */
+void waver_manifest_free(waver_manifest_t *manifest);
+
+#endif /* MANIFEST_H */
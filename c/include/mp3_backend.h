@@ -0,0 +1,62 @@
+/**
+ * @file mp3_backend.h
+ * @brief Runtime selectable minimp3 decoder builds
+ *
+ * minimp3 is a header-only library whose SIMD support is chosen at compile
+ * time.  To let a single waver binary use the fastest decoder available on
+ * the host, the library is compiled several times into separate translation
+ * units (scalar, SSE2/NEON and, on x86-64, AVX2), each with its public
+ * symbols renamed.  This module exposes those builds through a small table
+ * of function pointers and picks one based on the CPU at runtime.
+ */
+
+#ifndef MP3_BACKEND_H
+#define MP3_BACKEND_H
+
+#include "waver.h"
+#include "minimp3_ex.h"
+
+/**
+ * @brief Function table for one compiled build of minimp3
+ */
+typedef struct {
+    const char *name;   /**< Short name reported in verbose output */
+    int (*ex_open)(mp3dec_ex_t *dec, const char *file_name, int flags);
+    int (*ex_open_buf)(mp3dec_ex_t *dec, const uint8_t *buf, size_t buf_size, int flags);
+    int (*ex_seek)(mp3dec_ex_t *dec, uint64_t position);
+    size_t (*ex_read)(mp3dec_ex_t *dec, mp3d_sample_t *buf, size_t samples);
+    void (*ex_close)(mp3dec_ex_t *dec);
+    int (*decode_frame)(mp3dec_t *dec, const uint8_t *mp3, int mp3_bytes, mp3d_sample_t *pcm,
+                        mp3dec_frame_info_t *info);
+    int (*envelope_frame)(mp3dec_t *dec, const uint8_t *mp3, int mp3_bytes, float *energy,
+                          mp3dec_frame_info_t *info);
+} waver_mp3_backend_t;
+
+/**
+ * @brief Select the decoder build to use for the requested mode
+ *
+ * WAVER_DECODER_SIMD picks the fastest build the running CPU supports,
+ * falling back to the scalar build if no SIMD build is usable.
+ *
+ * @param decoder Requested decoder mode
+ * @return The selected backend (never NULL)
+ */
+const waver_mp3_backend_t *waver_mp3_backend_select(waver_decoder_t decoder);
+
+/**
+ * @brief Parse a decoder mode name as given on the command line
+ *
+ * @param name Mode name ("scalar" or "simd")
+ * @param decoder Output decoder mode
+ * @return true if successful, false otherwise
+ */
+bool waver_mp3_backend_parse(const char *name, waver_decoder_t *decoder);
+
+// Backends compiled in the per-variant translation units
+extern const waver_mp3_backend_t waver_mp3_backend_scalar;
+extern const waver_mp3_backend_t waver_mp3_backend_simd;
+#ifdef WAVER_HAVE_AVX2
+extern const waver_mp3_backend_t waver_mp3_backend_avx2;
+#endif
+
+#endif /* MP3_BACKEND_H */
@@ -0,0 +1,31 @@
+/**
+ * @file server.h
+ * @brief On-demand waveform rendering over HTTP (--serve)
+ *
+ * Answers GET and HEAD requests for the output a batch run would write
+ * next to a track, such as /album/song.mp3.png, rendering it on the
+ * thread pool the first time it is asked for.  The PNG is then written
+ * next to the track (the on-disk cache, shared with batch runs) and kept
+ * in a bounded in-memory cache.  Every request costs one stat() of the
+ * track, which also tells whether a cached PNG is still current; the ETag
+ * and Last-Modified headers follow from that stat() alone, so conditional
+ * requests are answered without reading anything.  Concurrent requests
+ * for a track that is being rendered wait for that render instead of
+ * starting their own.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+#include "waver.h"
+
+/**
+ * @brief Serve the waveforms of the directory on the command line until SIGINT or SIGTERM
+ *
+ * @param args Command-line arguments (serve address, cache size, outputs and threads)
+ * @return true if the server ran and stopped on a signal, false if it could not start
+ */
+bool waver_serve(const waver_args_t *args);
+
+#endif /* SERVER_H */
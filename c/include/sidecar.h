@@ -0,0 +1,200 @@
+/**
+ * @file sidecar.h
+ * @brief Persistent multi-resolution peak cache (.peaks sidecar files)
+ *
+ * A sidecar holds the minimum and maximum sample of every 64 samples of a
+ * track, plus power-of-two coarser levels built from those bins.  It lets a
+ * later run draw a waveform at any width, height or palette without decoding
+ * the audio again.
+ *
+ * File layout (all fields in the writer's byte order, checked on open):
+ *
+ *     waver_sidecar_header_t                 64 bytes
+ *     waver_sidecar_level_t[level_count]     16 bytes each
+ *     level data                             per level, bins * channels
+ *                                            waver_minmax_t, 8-byte aligned
+ *
+ * Level 0 has one bin per bin_samples samples (the last bin may be short),
+ * and every level above has half as many bins (rounded up), down to a
+ * single bin.  The file is meant to be mapped and read in place.
+ */
+
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAVER_SIDECAR_MAGIC "WAVERPKS"     /**< First 8 bytes of every sidecar */
+#define WAVER_SIDECAR_VERSION 1            /**< Bumped on incompatible layout changes */
+#define WAVER_SIDECAR_BYTE_ORDER 0x01020304u /**< Written as a native uint32_t */
+#define WAVER_SIDECAR_BIN_SAMPLES 64       /**< Samples per level-0 bin */
+#define WAVER_SIDECAR_EXTENSION ".peaks"   /**< Replaces .png in the output name */
+
+/**
+ * @brief Smallest and largest sample of one bin of one channel
+ */
+typedef struct {
+    int16_t min; /**< Smallest sample */
+    int16_t max; /**< Largest sample */
+} waver_minmax_t;
+
+/**
+ * @brief Fixed header at the start of a sidecar
+ */
+typedef struct {
+    char magic[8];          /**< WAVER_SIDECAR_MAGIC (not NUL terminated) */
+    uint32_t version;       /**< WAVER_SIDECAR_VERSION */
+    uint32_t byte_order;    /**< WAVER_SIDECAR_BYTE_ORDER in the writer's order */
+    uint32_t header_size;   /**< sizeof(waver_sidecar_header_t) */
+    uint32_t channels;      /**< Channels per bin (1 or 2) */
+    uint32_t sample_rate;   /**< Sample rate of the source in Hz */
+    uint32_t bin_samples;   /**< Samples per level-0 bin */
+    uint64_t total_samples; /**< Samples per channel in the source */
+    uint64_t source_size;   /**< Size of the source file in bytes */
+    int64_t source_mtime;   /**< Modification time of the source (seconds) */
+    uint32_t level_count;   /**< Entries in the level table */
+    uint32_t reserved;      /**< Zero */
+} waver_sidecar_header_t;
+
+/**
+ * @brief Location of one level in a sidecar
+ */
+typedef struct {
+    uint64_t offset; /**< Byte offset of the level data from the start of the file */
+    uint64_t bins;   /**< Number of bins in the level */
+} waver_sidecar_level_t;
+
+/**
+ * @brief Level-0 bins collected while decoding
+ *
+ * A builder may start at any sample, so that segments decoded on separate
+ * threads can each fill their own builder and be appended afterwards.
+ * Bins stay aligned to multiples of bin_samples of the whole track.
+ */
+typedef struct {
+    unsigned int channels;    /**< Channels per bin (1 or 2) */
+    unsigned int sample_rate; /**< Sample rate in Hz */
+    uint64_t first_sample;    /**< First sample (per channel) accumulated */
+    uint64_t samples;         /**< Samples (per channel) accumulated so far */
+    waver_minmax_t *bins;     /**< Bins starting at bin first_sample / bin_samples */
+    size_t capacity;          /**< Allocated bins */
+} waver_sidecar_builder_t;
+
+/**
+ * @brief A sidecar mapped for reading
+ */
+typedef struct {
+    const waver_sidecar_header_t *header; /**< Header in the mapping */
+    const waver_sidecar_level_t *levels;  /**< Level table in the mapping */
+    const uint8_t *data;                  /**< Start of the mapping */
+    size_t size;                          /**< Size of the mapping */
+} waver_sidecar_t;
+
+/**
+ * @brief Sidecar path for an output image path
+ *
+ * A trailing .png is replaced by .peaks; any other name gets .peaks appended.
+ *
+ * @param output_path Path of the output PNG
+ * @param buffer Buffer for the sidecar path
+ * @param size Size of the buffer
+ * @return true if successful, false if the path does not fit
+ */
+bool waver_sidecar_path(const char *output_path, char *buffer, size_t size);
+
+/**
+ * @brief Create a builder
+ *
+ * @param channels Channels to record (only the first two are used)
+ * @param sample_rate Sample rate in Hz
+ * @param first_sample First sample (per channel) that will be added
+ * @return New builder or NULL on error
+ */
+waver_sidecar_builder_t *waver_sidecar_builder_new(unsigned int channels, unsigned int sample_rate,
+                                                   uint64_t first_sample);
+
+/**
+ * @brief Free a builder
+ *
+ * @param builder Builder to free (may be NULL)
+ */
+void waver_sidecar_builder_free(waver_sidecar_builder_t *builder);
+
+/**
+ * @brief Add a block of interleaved PCM samples to a builder
+ *
+ * @param builder Builder
+ * @param pcm Interleaved PCM samples
+ * @param frames Number of sample frames (samples per channel) in pcm
+ * @param channels Channels in pcm
+ * @return true if successful, false on allocation failure
+ */
+bool waver_sidecar_builder_add(waver_sidecar_builder_t *builder, const int16_t *pcm, size_t frames,
+                               unsigned int channels);
+
+/**
+ * @brief Append a builder that continues where another one stops
+ *
+ * @param builder Builder to extend
+ * @param next Builder whose first sample follows the last sample of builder
+ * @return true if successful, false if the builders do not line up or on allocation failure
+ */
+bool waver_sidecar_builder_append(waver_sidecar_builder_t *builder, const waver_sidecar_builder_t *next);
+
+/**
+ * @brief Build the pyramid and write a sidecar
+ *
+ * The file is written under a temporary name and renamed into place.
+ *
+ * @param path Path of the sidecar
+ * @param builder Builder holding the whole track (first_sample 0)
+ * @param source_size Size of the source file in bytes
+ * @param source_mtime Modification time of the source file
+ * @return true if successful, false otherwise
+ */
+bool waver_sidecar_write(const char *path, const waver_sidecar_builder_t *builder,
+                         uint64_t source_size, int64_t source_mtime);
+
+/**
+ * @brief Map and validate a sidecar
+ *
+ * @param path Path of the sidecar
+ * @return Mapped sidecar, or NULL if it is missing, unreadable or invalid
+ */
+waver_sidecar_t *waver_sidecar_open(const char *path);
+
+/**
+ * @brief Check that a sidecar was made from the given source file
+ *
+ * @param sidecar Mapped sidecar
+ * @param source_size Size of the source file in bytes
+ * @param source_mtime Modification time of the source file
+ * @return true if the sidecar is up to date
+ */
+bool waver_sidecar_matches(const waver_sidecar_t *sidecar, uint64_t source_size, int64_t source_mtime);
+
+/**
+ * @brief Peak amplitude of every image column
+ *
+ * Columns follow waver_column_start() for the stored sample count.  Each
+ * column is covered by the fewest pyramid bins that span its level-0 bins,
+ * so a column may include up to bin_samples - 1 samples of its neighbours.
+ *
+ * @param sidecar Mapped sidecar
+ * @param width Number of columns
+ * @param left Output peaks for left/mono (width entries)
+ * @param right Output peaks for right (width entries, zero for mono)
+ */
+void waver_sidecar_column_peaks(const waver_sidecar_t *sidecar, unsigned int width,
+                                uint16_t *left, uint16_t *right);
+
+/**
+ * @brief Unmap a sidecar
+ *
+ * @param sidecar Sidecar to close (may be NULL)
+ */
+void waver_sidecar_close(waver_sidecar_t *sidecar);
+
+#endif /* SIDECAR_H */
@@ -0,0 +1,96 @@
+/**
+ * @file stats.h
+ * @brief Per-phase timing of waveform generation (--stats, --stats-json)
+ *
+ * Every file gets one record of the time spent in each phase.  Records are
+ * appended to an accumulator owned by the thread that made them, so
+ * collecting them needs no locks; the accumulators of all threads are
+ * merged once the work is done and summarized as totals, percentiles and
+ * throughput.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "waver.h"
+
+/**
+ * @brief Phases of generating the waveforms of one file
+ */
+typedef enum {
+    WAVER_PHASE_OPEN = 0,   /**< Opening, mapping and closing the input, building the frame index */
+    WAVER_PHASE_DECODE,     /**< MP3 frame decoding */
+    WAVER_PHASE_PEAKS,      /**< Reducing samples to column peaks and sidecar bins */
+    WAVER_PHASE_DRAW,       /**< Drawing column peaks into the images */
+    WAVER_PHASE_FILTER,     /**< Building and filtering PNG scanlines */
+    WAVER_PHASE_COMPRESS,   /**< Deflating scanlines */
+    WAVER_PHASE_WRITE,      /**< Writing PNG files, including chunk CRCs */
+    WAVER_PHASE_COUNT       /**< Number of phases */
+} waver_phase_t;
+
+/**
+ * @brief Timing of one file
+ */
+typedef struct {
+    double seconds[WAVER_PHASE_COUNT]; /**< Time per phase (summed over decode segments) */
+    uint64_t input_bytes;              /**< Bytes of audio decoded (0 when drawn from a sidecar) */
+    double audio_seconds;              /**< Length of the audio decoded */
+} waver_file_stats_t;
+
+/**
+ * @brief Timing records collected by one thread
+ */
+struct waver_stats_t {
+    waver_file_stats_t *files; /**< One record per file */
+    size_t count;              /**< Number of records */
+    size_t capacity;           /**< Allocated records */
+};
+
+/**
+ * @brief Current time of the monotonic clock
+ *
+ * @return Seconds since an arbitrary starting point
+ */
+double waver_stats_now(void);
+
+/**
+ * @brief Append the record of one file
+ *
+ * @param stats Accumulator of the calling thread
+ * @param file Record to append (copied)
+ * @return true if successful, false on allocation failure
+ */
+bool waver_stats_add(waver_stats_t *stats, const waver_file_stats_t *file);
+
+/**
+ * @brief Append all records of another accumulator
+ *
+ * @param stats Accumulator to append to
+ * @param other Accumulator to copy the records from
+ * @return true if successful, false on allocation failure
+ */
+bool waver_stats_merge(waver_stats_t *stats, const waver_stats_t *other);
+
+/**
+ * @brief Free the records of an accumulator and empty it
+ *
+ * @param stats Accumulator
+ */
+void waver_stats_free(waver_stats_t *stats);
+
+/**
+ * @brief Print the summary for --stats and write the file for --stats-json
+ *
+ * @param args Command-line arguments (stats and stats_json)
+ * @param stats Records of all files
+ * @param wall_seconds Elapsed time of the whole run
+ * @param threads Most worker threads that ran tasks at once
+ * @return true if successful, false if the JSON file could not be written
+ */
+bool waver_stats_report(const waver_args_t *args, const waver_stats_t *stats, double wall_seconds,
+                        size_t threads);
+
+#endif /* STATS_H */
@@ -10,53 +10,240 @@
 #include <stdbool.h>
 #include <stddef.h>
 
-// Forward declarations for waver structures
-typedef struct waver_args_t waver_args_t;
+#include <stdatomic.h>
+#include <stdint.h>
+#include "waver.h"
+#include "stats.h"
 
-// The task structure represents a file to be processed
-typedef struct {
-    char *file_path;           // Path to the audio file
+// Options of threadpool_init()
+enum {
+    THREADPOOL_ADAPTIVE = 1 << 0, // With an automatic size, run more workers while tasks wait on I/O
+    THREADPOOL_PIN = 1 << 1,      // Pin each worker to one of the CPUs the process may use
+};
+
+// Forward declarations for thread pool structures
+typedef struct threadpool_t threadpool_t;
+typedef struct task_t task_t;
+
+// Function that carries out a task; returns false if the task failed
+typedef bool (*task_fn)(threadpool_t *pool, const task_t *task);
+
+// The task structure represents one unit of work, usually a file to be processed
+struct task_t {
+    task_fn run;               // Function that carries out the task
+    const char *file_path;     // Path to the audio file (may be NULL)
     const waver_args_t *args;  // Command-line arguments (shared)
-} task_t;
+    uint64_t cost;             // Expected work (file size, or spin iterations for benchmark tasks)
+    void *context;             // State shared by related tasks (may be NULL)
+    bool prefetched;           // Handed over by the prefetch stage (counts in pool->prefetched)
+};
 
-// Thread pool structure
+// Tasks waiting for one worker; other workers steal from it when idle
+// (a ring buffer in FIFO order, or a max-heap on cost for largest-first)
+typedef struct {
+    pthread_mutex_t mutex;     // Held only to push or pop one task
+    task_t *tasks;             // Ring buffer or heap of tasks, grown when full
+    size_t capacity;           // Capacity of the buffer
+    size_t head;               // Index of the oldest task (always 0 for a heap)
+    atomic_size_t count;       // Tasks in the queue (read without the lock to skip empty queues)
+    atomic_uint_fast64_t top_cost; // Cost of the next task of a heap (read without the lock)
+} task_queue_t;
+
+// A block of task paths; freed once its last path is done with
+typedef struct {
+    atomic_size_t references;  // Paths still in use, plus one while paths are added
+    size_t used;               // Bytes of data handed out
+    size_t size;               // Bytes of data
+    char data[];               // Each path is preceded by a pointer to its block
+} path_block_t;
+
+// Hands out copies of task paths from large blocks instead of one
+// allocation per path
 typedef struct {
-    task_t *queue;             // Task queue
-    size_t queue_size;         // Size of the queue
-    size_t queue_capacity;     // Capacity of the queue
-    size_t head;               // Head of the queue
-    size_t tail;               // Tail of the queue
-    
-    pthread_t *threads;        // Worker threads
+    path_block_t *block;       // Block paths are added to (NULL until the first)
+} path_arena_t;
+
+// A worker thread and the queue it serves first
+typedef struct {
+    threadpool_t *pool;        // Pool the worker belongs to
+    size_t index;              // Index of the worker and its queue
+    pthread_t thread;          // Worker thread
+    waver_context_t *context;  // Image and encoder state reused by every file task
+    int schedstat;             // The worker's schedstat, open for its task times (adaptive only, -1 if not)
+    path_arena_t paths;        // Paths of the tasks this worker adds
+    waver_stats_t stats;       // Timing of the files this worker ran (--stats only)
+    uint64_t *costs;           // Cost of each file task run (largest-first only)
+    size_t cost_count;         // Entries in costs
+    size_t cost_capacity;      // Allocated entries in costs
+    uint64_t busy_cost;        // Sum of costs
+    double busy_seconds;       // Time spent running those tasks
+} worker_t;
+
+// Thread pool structure
+struct threadpool_t {
+    task_queue_t *queues;      // One task queue per worker
+    worker_t *workers;         // Worker threads
     size_t num_threads;        // Number of threads
-    
-    pthread_mutex_t queue_mutex;   // Mutex for queue access
-    pthread_cond_t queue_not_empty; // Condition for queue not empty
-    pthread_cond_t queue_not_full;  // Condition for queue not full
-    
-    bool stop;                 // Flag to stop workers
-    size_t completed_tasks;    // Number of completed tasks
-    size_t failed_tasks;       // Number of failed tasks
-    pthread_mutex_t stats_mutex; // Mutex for stats access
-} threadpool_t;
+    waver_schedule_t schedule; // Order in which queued tasks run
+    bool joined;               // Workers have been stopped and joined
+    atomic_size_t next_queue;  // Round-robin queue for tasks added from outside the pool
+    path_arena_t paths;        // Paths of tasks added from outside the pool
+    pthread_mutex_t paths_mutex; // Mutex for paths
+
+    atomic_size_t queued;      // Tasks in all queues
+    atomic_size_t pending;     // Tasks added but not finished yet (queued or running)
+    atomic_size_t sleepers;    // Workers waiting for work
+    atomic_size_t running;     // Tasks running now
+    atomic_size_t peak_running; // Most tasks that were running at once
+    pthread_mutex_t idle_mutex; // Mutex for sleeping and waking workers
+    pthread_cond_t work_available; // Condition for new work or shutdown
+
+    // Workers at or above active_threads park until it grows (or a stopped
+    // pool has finished every task); an adaptive pool moves it between 1 and num_threads, seeking
+    // enough workers that the CPUs stay busy while some of them wait on I/O
+    atomic_size_t active_threads;  // Workers taking tasks
+    pthread_cond_t resumed;        // Condition for parked workers (under idle_mutex)
+    bool adaptive;                 // Adjust active_threads from the measured task times
+    bool pin;                      // Pin each worker to one CPU
+    size_t cpus;                   // CPUs available when the pool was made
+    atomic_uint_fast64_t sample_wall_ns;    // Wall time of the tasks since the last adjustment
+    atomic_uint_fast64_t sample_cpu_ns;     // CPU time of those tasks
+    atomic_uint_fast64_t sample_waiting_ns; // Time they were runnable but had no CPU
+    atomic_uint_fast64_t adjust_at_ns;      // Monotonic time of the next adjustment
+    pthread_mutex_t adjust_mutex;  // Held by the worker making an adjustment
+    size_t fewest_active;          // Least and most workers active so far (under adjust_mutex)
+    size_t most_active;
+
+    atomic_bool stop;          // Flag to stop workers once all work is done
+    atomic_size_t completed_tasks; // Number of completed tasks
+    atomic_size_t failed_tasks;    // Number of failed tasks
+
+    // Prefetch stage (threadpool_start_prefetch()): file tasks wait here
+    // until an I/O thread has read their input, then go to the workers
+    task_queue_t prefetch_queue;   // File tasks waiting to be read ahead
+    pthread_t *io_threads;         // Threads reading ahead (NULL without a prefetch stage)
+    size_t io_thread_count;        // Number of I/O threads
+    size_t prefetch_depth;         // Most files read ahead that no worker has taken yet
+    atomic_size_t prefetched;      // Files read ahead (or being read) that no worker has taken yet
+    bool prefetch_stop;            // Set once the workers are gone
+    pthread_mutex_t prefetch_mutex; // Mutex for sleeping and waking the I/O threads
+    pthread_cond_t prefetch_wanted; // Condition for a file to read, room ahead, or the stop
+
+    waver_writer_t *writer;        // Writer stage for the PNGs of file tasks (may be NULL)
+    waver_dedup_t *dedup;          // Audio drawn so far, for --dedup (may be NULL)
+};
+
+/**
+ * @brief Number of threads to use when none was requested
+ *
+ * @return Number of CPUs the process can use (see waver_cpus_available())
+ */
+size_t threadpool_default_threads(void);
 
 /**
  * @brief Initialize a thread pool with specified number of threads
  * 
+ * With THREADPOOL_ADAPTIVE and an automatic size the pool starts one
+ * worker per available CPU but creates several times as many.  Every
+ * quarter of a second or so the time of the tasks since the last look is
+ * split into CPU time, time waiting for a CPU and time blocked: a pool
+ * whose tasks mostly block wakes another worker, one whose tasks wait for
+ * a CPU parks one, and one back to mostly computing returns towards one
+ * worker per CPU.
+ *
  * @param num_threads Number of worker threads to create (0 for auto)
+ * @param schedule Order in which queued tasks run
+ * @param flags THREADPOOL_ADAPTIVE and THREADPOOL_PIN, or 0
  * @return Pointer to thread pool or NULL on error
  */
-threadpool_t *threadpool_init(size_t num_threads);
+threadpool_t *threadpool_init(size_t num_threads, waver_schedule_t schedule, unsigned int flags);
 
 /**
  * @brief Add a task to the thread pool
+ *
+ * A task added by a worker goes to that worker's own queue; others are
+ * spread over the queues in turn.  The pool keeps its own copy of
+ * task->file_path.
+ *
+ * @param pool Thread pool
+ * @param task Task to add (copied)
+ * @return true if successful, false otherwise
+ */
+bool threadpool_submit(threadpool_t *pool, const task_t *task);
+
+/**
+ * @brief Read the input of file tasks ahead on threads of their own
+ *
+ * From then on file tasks first go to a queue of their own, in the order
+ * of the pool's schedule, where the I/O threads read the start of each
+ * file into the page cache before handing it on to the workers.  At most
+ * depth files are read ahead of the workers, so a long batch does not
+ * push the first files out of the cache before they are decoded.  Must
+ * be called before any file task is added.
+ *
+ * @param pool Thread pool
+ * @param threads Number of I/O threads
+ * @param depth Most files read ahead that no worker has taken yet (0 for two per worker)
+ * @return true if successful, false otherwise
+ */
+bool threadpool_start_prefetch(threadpool_t *pool, size_t threads, size_t depth);
+
+/**
+ * @brief Add a file to the thread pool
  * 
  * @param pool Thread pool
  * @param file_path Path to the audio file to process
  * @param args Command-line arguments (shared)
+ * @param size Size of the file in bytes (its cost for largest-first scheduling)
  * @return true if successful, false otherwise
  */
-bool threadpool_add_task(threadpool_t *pool, const char *file_path, const waver_args_t *args);
+bool threadpool_add_task(threadpool_t *pool, const char *file_path, const waver_args_t *args, uint64_t size);
+
+/**
+ * @brief Image and encoder state of the worker running the current task
+ *
+ * @return Context of the calling worker, or NULL outside a pool or if it has none
+ */
+waver_context_t *threadpool_worker_context(void);
+
+/**
+ * @brief Wait for all tasks to complete and stop the workers
+ *
+ * The pool can still be inspected (threadpool_makespan()) until it is
+ * destroyed, but no tasks can be added.
+ *
+ * @param pool Thread pool
+ */
+void threadpool_wait(threadpool_t *pool);
+
+/**
+ * @brief Model the makespan of the file tasks a stopped pool has run
+ *
+ * This is not a forecast: it replays the tasks after the fact.  Each one
+ * is assumed to take time proportional to its cost, at the average rate
+ * measured over all of them in this run, and they are assigned largest
+ * first to whichever of the workers is free first, as many workers as
+ * the run really had running tasks at once.
+ *
+ * @param pool Thread pool after threadpool_wait() (largest-first only)
+ * @param modelled Receives the makespan of the model in seconds
+ * @param lower_bound Receives the larger of the busy time per worker and the longest task
+ * @param workers Receives the number of workers modelled
+ * @return true if there were tasks to model, false otherwise (or if not largest-first)
+ */
+bool threadpool_makespan(const threadpool_t *pool, double *modelled, double *lower_bound, size_t *workers);
+
+/**
+ * @brief Collect the file timings the workers of a stopped pool recorded
+ *
+ * Each worker appends to its own accumulator while it runs, so nothing is
+ * shared until the workers have been joined.
+ *
+ * @param pool Thread pool after threadpool_wait()
+ * @param stats Accumulator to append the records of every worker to
+ * @return true if successful, false on allocation failure
+ */
+bool threadpool_collect_stats(const threadpool_t *pool, waver_stats_t *stats);
 
 /**
  * @brief Wait for all tasks to complete and destroy the thread pool
@@ -75,4 +262,15 @@ bool threadpool_destroy(threadpool_t *pool);
  */
 bool waver_process_files_parallel(const waver_args_t *args, size_t num_threads);
 
+/**
+ * @brief Measure how task throughput scales with the number of threads
+ *
+ * Runs a batch of empty tasks and a batch of short busy tasks on pools of
+ * 1, 2, 4, ... up to max_threads threads and prints the rates to stdout.
+ *
+ * @param max_threads Largest pool to measure
+ * @return true if successful, false otherwise
+ */
+bool threadpool_benchmark(size_t max_threads);
+
 #endif /* THREADPOOL_H */
\ No newline at end of file
@@ -0,0 +1,77 @@
+/**
+ * @file tree.h
+ * @brief Library index for the web player, built during the scan (--tree)
+ *
+ * Music.js browses the library through MusicList.js, which Music.py makes
+ * with a walk of its own.  The directory tasks of the thread pool already
+ * read every directory, so each one records what Music.py looks for as it
+ * goes, and the index is written once the run is over, byte for byte what
+ * Music.py would print for the same tree:
+ *
+ *     // Simple Web Audio Player - Copyright Michael Sinz
+ *
+ *     const mp3 = {"Folders":{"Album":{"Cover":2,"Files":["01 Intro"]},
+ *     ...}};
+ *
+ * As in Music.py, the files of the root itself are not listed, hidden
+ * files and directories are left out, "Files" holds the names ending in
+ * ".mp3" without that extension, "Cover" is 1 with a Cover.jpg and 2 with
+ * a Back.jpg as well, directories without MP3s anywhere below them are
+ * pruned, keys are sorted and a line break follows every "},".
+ */
+
+#ifndef TREE_H
+#define TREE_H
+
+#include <stdbool.h>
+
+typedef struct waver_tree_t waver_tree_t;
+typedef struct waver_tree_dir_t waver_tree_dir_t;
+
+/**
+ * @brief Start an empty index of one root directory
+ *
+ * @param root Directory given on the command line
+ * @return New index or NULL on allocation failure
+ */
+waver_tree_t *waver_tree_new(const char *root);
+
+/**
+ * @brief Start the record of one directory
+ *
+ * Safe to call from any thread.  Hidden directories and those below them
+ * get no record.
+ *
+ * @param tree Index of the root
+ * @param path Path of the directory (the root path or a path built from it)
+ * @return Record to add the directory's files to, or NULL if it is not indexed
+ */
+waver_tree_dir_t *waver_tree_begin_dir(waver_tree_t *tree, const char *path);
+
+/**
+ * @brief Note one file (not a directory) of a directory
+ *
+ * Only the thread that began the record may add to it.
+ *
+ * @param dir Record of the directory
+ * @param name Name of the file
+ */
+void waver_tree_add_file(waver_tree_dir_t *dir, const char *name);
+
+/**
+ * @brief Write the index once every directory has been read
+ *
+ * @param tree Index of the root
+ * @param path File to write ("-" for stdout)
+ * @return true if successful, false otherwise (also if a record ran out of memory)
+ */
+bool waver_tree_write(waver_tree_t *tree, const char *path);
+
+/**
+ * @brief Free an index
+ *
+ * @param tree Index (may be NULL)
+ */
+void waver_tree_free(waver_tree_t *tree);
+
+#endif /* TREE_H */
@@ -0,0 +1,86 @@
+/**
+ * @file watch.h
+ * @brief Change notification for watched directories (--watch)
+ *
+ * Directories are added one at a time, as the thread pool scans them, so
+ * setting up the watch needs no walk of its own and no change made while
+ * a directory is being scanned is missed.  On Linux the kernel reports
+ * changes through inotify.  Elsewhere every watched directory is stat()ed
+ * once per poll and only directories whose modification time moved are
+ * read again; that sees files being added, created or renamed but not
+ * files rewritten in place.
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdbool.h>
+
+/**
+ * @brief What changed in a watched directory
+ */
+typedef enum {
+    WAVER_WATCH_FILE = 0,   /**< A file was written and closed, or moved in */
+    WAVER_WATCH_DIRECTORY,  /**< A directory was created or moved in */
+    WAVER_WATCH_OVERFLOW    /**< Changes were lost; every directory needs scanning again */
+} waver_watch_event_t;
+
+/**
+ * @brief Receives one change
+ *
+ * @param context Caller state passed to waver_watch_poll()
+ * @param event What changed
+ * @param path Path of the file or directory (NULL for WAVER_WATCH_OVERFLOW)
+ */
+typedef void (*waver_watch_fn)(void *context, waver_watch_event_t event, const char *path);
+
+typedef struct waver_watch_t waver_watch_t;
+
+/**
+ * @brief Create an empty watch
+ *
+ * @return New watch or NULL on error (for example no inotify instances left)
+ */
+waver_watch_t *waver_watch_new(void);
+
+/**
+ * @brief Start watching one directory (not its subdirectories)
+ *
+ * Safe to call from any thread.  Adding a directory again only updates
+ * its path.
+ *
+ * @param watch Watch
+ * @param path Path of the directory
+ * @return true if successful, false if the directory cannot be watched
+ */
+bool waver_watch_add(waver_watch_t *watch, const char *path);
+
+/**
+ * @brief Wait for changes and report them
+ *
+ * Only one thread may poll a watch.
+ *
+ * @param watch Watch
+ * @param timeout_ms Longest time to wait for a change
+ * @param fn Receives every change
+ * @param context Passed to fn
+ * @return true if successful (also on a timeout or a signal), false on error
+ */
+bool waver_watch_poll(waver_watch_t *watch, int timeout_ms, waver_watch_fn fn, void *context);
+
+/**
+ * @brief Number of directories being watched
+ *
+ * @param watch Watch
+ * @return Number of directories
+ */
+unsigned int waver_watch_count(waver_watch_t *watch);
+
+/**
+ * @brief Stop watching and free a watch
+ *
+ * @param watch Watch (may be NULL)
+ */
+void waver_watch_free(waver_watch_t *watch);
+
+#endif /* WATCH_H */
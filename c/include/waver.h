@@ -23,6 +23,12 @@
 typedef struct waver_args_t waver_args_t;
 typedef struct waver_image_t waver_image_t;
 typedef struct waver_color_t waver_color_t;
+typedef struct waver_peaks_t waver_peaks_t;
+typedef struct waver_png_encoder_t waver_png_encoder_t;
+typedef struct waver_context_t waver_context_t;
+typedef struct waver_writer_t waver_writer_t;
+typedef struct waver_dedup_t waver_dedup_t;
+typedef struct waver_stats_t waver_stats_t;
 
 /**
  * @brief RGBA color representation
@@ -34,6 +40,120 @@ struct waver_color_t {
     uint8_t alpha;  /**< Alpha component (0-255) */
 };
 
+/**
+ * @brief MP3 decoder build selection
+ */
+typedef enum {
+    WAVER_DECODER_SIMD = 0,   /**< Fastest SIMD build the CPU supports (default) */
+    WAVER_DECODER_SCALAR = 1  /**< Portable scalar build */
+} waver_decoder_t;
+
+/**
+ * @brief Order in which the thread pool runs files
+ */
+typedef enum {
+    WAVER_SCHEDULE_FIFO = 0,         /**< Roughly in the order they are found (default) */
+    WAVER_SCHEDULE_LARGEST_FIRST = 1 /**< Largest files found so far first */
+} waver_schedule_t;
+
+/**
+ * @brief How input files are read
+ */
+typedef enum {
+    WAVER_INPUT_MMAP = 0, /**< Mapped by waver with read-ahead hints, released as decoded (default) */
+    WAVER_INPUT_FILE = 1  /**< Opened by minimp3's own file reader */
+} waver_input_mode_t;
+
+/**
+ * @brief How closely the peaks follow the audio
+ */
+typedef enum {
+    WAVER_QUALITY_EXACT = 0,   /**< Every frame decoded (default) */
+    WAVER_QUALITY_PREVIEW = 1, /**< A few MP3 frames decoded per column, the rest skipped */
+    WAVER_QUALITY_ENVELOPE = 2 /**< Peaks estimated from the MP3 spectrum, no synthesis (experimental) */
+} waver_quality_t;
+
+/**
+ * @brief How a file with the same audio as one already drawn gets its images (--dedup)
+ */
+typedef enum {
+    WAVER_DEDUP_OFF = 0,  /**< Every file is decoded and drawn (default) */
+    WAVER_DEDUP_LINK = 1, /**< Hard links to the images already drawn, copies across filesystems */
+    WAVER_DEDUP_COPY = 2  /**< Copies of the images already drawn */
+} waver_dedup_mode_t;
+
+/**
+ * @brief Outputs written once per directory by --atlas (combined as flags)
+ */
+typedef enum {
+    WAVER_ATLAS_PNG = 1,  /**< One PNG with a band per track, located through the JSON index */
+    WAVER_ATLAS_PEAKS = 2 /**< A short peaks array per track in the JSON index */
+} waver_atlas_kind_t;
+
+/**
+ * @brief PNG compression profile
+ *
+ * A profile is a list of candidate encodings (row filter plus deflate
+ * level and strategy).  The encoder compresses the image once per
+ * candidate, keeps the smallest result and writes only that one.
+ */
+typedef enum {
+    WAVER_PNG_PROFILE_BALANCED = 0, /**< Run-length UP and level 6 NONE, smaller kept (default) */
+    WAVER_PNG_PROFILE_FAST = 1,     /**< Single run-length UP pass */
+    WAVER_PNG_PROFILE_SMALLEST = 2  /**< Every filter and strategy at level 9, smallest kept */
+} waver_png_profile_t;
+
+/**
+ * @brief Deflate implementation used for PNG image data
+ */
+typedef enum {
+    WAVER_PNG_DEFLATE_ZLIB = 0,      /**< zlib, streamed one scanline at a time (default) */
+    WAVER_PNG_DEFLATE_LIBDEFLATE = 1 /**< libdeflate on the whole image (built with LIBDEFLATE=1) */
+} waver_png_deflate_t;
+
+/**
+ * @brief PNG encoder settings
+ */
+typedef struct {
+    waver_png_profile_t profile; /**< Candidate encodings to try */
+    waver_png_deflate_t deflate; /**< Deflate implementation */
+    bool timing;                 /**< Measure the filter and compress time of each image (per scanline) */
+} waver_png_options_t;
+
+/**
+ * @brief Receives encoded output in pieces, in order
+ *
+ * @param context Caller state passed along with the callback
+ * @param data Bytes to write
+ * @param size Number of bytes
+ * @return true to go on, false to stop encoding with an error
+ */
+typedef bool (*waver_write_fn)(void *context, const void *data, size_t size);
+
+/**
+ * @brief What the PNG encoder did for one image
+ */
+typedef struct {
+    size_t bytes;           /**< Size of the PNG in bytes */
+    double seconds;         /**< Time spent encoding and writing */
+    unsigned int passes;    /**< Compression passes run, including the one written */
+    const char *encoding;   /**< Name of the candidate that was kept */
+    double filter_seconds;  /**< Time spent building and filtering scanlines (with timing) */
+    double compress_seconds; /**< Time spent in deflate (with timing) */
+} waver_png_stats_t;
+
+/**
+ * @brief One output image produced from each input file
+ */
+typedef struct {
+    unsigned int width;           /**< Width of the output image in pixels */
+    unsigned int height;          /**< Height of the output image in pixels */
+    waver_color_t left_color;     /**< Color for left channel (and mono) */
+    waver_color_t right_color;    /**< Color for right channel */
+    waver_color_t bg_color;       /**< Background color */
+    char *suffix;                 /**< Appended to the input path to name the output */
+} waver_output_spec_t;
+
 /**
  * @brief Command-line argument structure
  */
@@ -50,20 +170,74 @@ struct waver_args_t {
     bool overwrite;               /**< Overwrite existing output files */
     bool quiet;                   /**< Suppress most output */
     bool verbose;                 /**< Print additional information */
-    unsigned int threads;         /**< Number of threads to use (0 for auto) */
+    unsigned int threads;         /**< Number of threads to use (0 for auto, adapting to how much of each file is I/O) */
+    bool pin_threads;             /**< Pin each worker thread to one CPU */
+    unsigned int io_threads;      /**< Threads reading input ahead of the workers (0 for none) */
+    unsigned int prefetch_depth;  /**< Files read ahead that no worker has taken yet (0 for two per worker) */
+    unsigned int write_threads;   /**< Threads writing the finished PNGs (0 to write them on the workers) */
+    unsigned int write_depth;     /**< PNGs that may wait to be written (0 for four per worker) */
+    bool scheduler_benchmark;     /**< Measure the thread pool instead of processing files */
+    waver_schedule_t schedule;    /**< Order in which the thread pool runs files */
+    waver_decoder_t decoder;      /**< MP3 decoder build to use */
+    waver_input_mode_t input;     /**< How input files are read */
+    bool single_pass;             /**< Take the length from the MP3 headers instead of scanning */
+    waver_quality_t quality;      /**< Exact peaks or a preview from a sample of MP3 frames */
+    bool peaks;                   /**< Write .peaks sidecars and draw from them when up to date */
+    unsigned int atlas;           /**< waver_atlas_kind_t flags of the outputs per directory (0 for one image per file) */
+    unsigned int atlas_columns;   /**< Peaks per channel of each track in the atlas index */
+    char *tree;                   /**< Write the web player's library index (as Music.py does) to this file ("-" for stdout) */
+    bool watch;                   /**< Keep running and render files added to or changed in the directories */
+    bool incremental;             /**< Skip files a directory's manifest shows as unchanged */
+    bool trust_dir_mtimes;        /**< Do not read directories whose modification time is unchanged */
+    waver_dedup_mode_t dedup;     /**< Reuse the images of files with the same audio */
+    char *serve;                  /**< Answer HTTP requests for outputs on this [host:]port instead of rendering all */
+    unsigned int cache_mb;        /**< Megabytes of rendered images the server keeps in memory */
+    bool stats;                   /**< Print per-phase timing and throughput at the end */
+    char *stats_json;             /**< Write the same as JSON to this file ("-" for stdout) */
+    waver_png_options_t png;      /**< PNG compression profile and deflate implementation */
+    waver_output_spec_t *output_specs; /**< Outputs per input (replaces the single default output) */
+    unsigned int output_spec_count;    /**< Number of output specs */
     char **audio_paths;           /**< Audio files or directories to process */
     unsigned int path_count;      /**< Number of paths in the audio_paths array */
 };
 
 /**
  * @brief Waveform image representation
+ *
+ * A bitmap image keeps every 2-bit pixel in pixels.  A span image (made by
+ * waver_image_new_spans()) keeps only the vertical extents of each column:
+ * rows [span_top, span_split) use the left color and rows
+ * [span_split, span_bottom) the right color.  Its scanlines are built on
+ * demand by waver_image_row().
  */
 struct waver_image_t {
     unsigned int width;     /**< Width of the image in pixels */
     unsigned int height;    /**< Height of the image in pixels */
     unsigned int center;    /**< Vertical center line position */
     unsigned int line_width; /**< Width of a line in bytes (due to 2-bit pixels) */
-    uint8_t *pixels;        /**< Pixel data stored as channel indices */
+    uint8_t *pixels;        /**< Pixel data stored as channel indices (NULL for spans) */
+    uint32_t *span_top;     /**< First row drawn per column (span images only) */
+    uint32_t *span_split;   /**< First row in the right color per column (span images only) */
+    uint32_t *span_bottom;  /**< One past the last row drawn per column (span images only) */
+    unsigned int span_first_row; /**< Rows above this are empty (span images only) */
+    unsigned int span_end_row;   /**< Rows from this one down are empty (span images only) */
+    unsigned int span_capacity;  /**< Columns the span arrays have room for (span images only) */
+};
+
+/**
+ * @brief Per-column peak accumulator filled while decoding
+ */
+struct waver_peaks_t {
+    unsigned int width;          /**< Number of image columns */
+    unsigned int split;          /**< Bins per column (more than 1 if the length is estimated) */
+    unsigned int first_column;   /**< Column holding the first accumulated sample */
+    uint64_t expected_samples;   /**< Samples per channel the bins were laid out for */
+    uint64_t samples;            /**< Samples per channel accumulated so far */
+    uint16_t *left;              /**< Peak per bin for left channel (and mono) */
+    uint16_t *right;             /**< Peak per bin for right channel */
+    size_t capacity;             /**< Number of allocated bins */
+    size_t bin;                  /**< Bin currently being filled */
+    uint64_t bin_remaining;      /**< Samples still missing from the current bin */
 };
 
 // Channel types for waveform images
@@ -137,6 +311,40 @@ bool waver_color_parse(const char *color_str, waver_color_t *color);
  */
 waver_image_t *waver_image_new(unsigned int width, unsigned int height);
 
+/**
+ * @brief Create a new waveform image that stores per-column spans
+ *
+ * Uses 12 bytes per column instead of a bitmap of width * height / 4
+ * bytes.  Drawing a column again replaces it rather than adding to it.
+ *
+ * @param width Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @return New image or NULL on error
+ */
+waver_image_t *waver_image_new_spans(unsigned int width, unsigned int height);
+
+/**
+ * @brief Clear a span image for reuse, possibly at a different size
+ *
+ * The span arrays are only reallocated when the new width is larger than
+ * any width the image has had before.
+ *
+ * @param image Span image made by waver_image_new_spans()
+ * @param width Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @return true if successful, false on invalid dimensions or allocation failure
+ */
+bool waver_image_reset_spans(waver_image_t *image, unsigned int width, unsigned int height);
+
+/**
+ * @brief Get one packed 2-bit scanline of an image
+ *
+ * @param image Image to read
+ * @param y Row to get
+ * @param row Output buffer of line_width bytes
+ */
+void waver_image_row(const waver_image_t *image, unsigned int y, uint8_t *row);
+
 /**
  * @brief Free memory allocated for an image
  *
@@ -163,6 +371,19 @@ void waver_image_draw_point(waver_image_t *image, unsigned int x, const unsigned
  */
 void waver_image_draw_point_mono(waver_image_t *image, unsigned int x, const unsigned int mono);
 
+/**
+ * @brief Draw a range of columns of the waveform from per-column peaks
+ *
+ * @param image Image to draw to
+ * @param left Max amplitude per column for left (or mono)
+ * @param right Max amplitude per column for right (ignored for mono)
+ * @param channel_count Number of channels (1 for mono)
+ * @param first_column First column to draw
+ * @param end_column One past the last column to draw
+ */
+void waver_image_draw_peaks(waver_image_t *image, const uint16_t *left, const uint16_t *right,
+                            unsigned int channel_count, unsigned int first_column, unsigned int end_column);
+
 /**
  * @brief Save the waveform image as a PNG file with 2-bit color depth
  *
@@ -181,10 +402,200 @@ bool waver_image_save_optimized_png(
     const char *output_path
 );
 
+/**
+ * @brief Save the waveform image as a PNG file using the given encoder settings
+ *
+ * @param image Image to save
+ * @param bg_color Background color
+ * @param left_color Left channel color
+ * @param right_color Right channel color
+ * @param output_path Path to save the PNG to
+ * @param options Encoder settings (NULL for the defaults)
+ * @param encoder Reusable encoder state (NULL to set up and free temporary state)
+ * @param stats Receives what the encoder did (may be NULL)
+ * @return true if successful, false otherwise
+ */
+bool waver_image_save_png(
+    const waver_image_t *image,
+    const waver_color_t *bg_color,
+    const waver_color_t *left_color,
+    const waver_color_t *right_color,
+    const char *output_path,
+    const waver_png_options_t *options,
+    waver_png_encoder_t *encoder,
+    waver_png_stats_t *stats
+);
+
+/**
+ * @brief Encode the waveform image as a PNG and pass it to a callback
+ *
+ * Works like waver_image_save_png(), but nothing touches the filesystem:
+ * the zlib path hands over each chunk as it is compressed, so the whole
+ * PNG never has to be held in memory.
+ *
+ * @param image Image to encode
+ * @param bg_color Background color
+ * @param left_color Left channel color
+ * @param right_color Right channel color
+ * @param write Receives the PNG in pieces, in order
+ * @param write_context Passed to write
+ * @param options Encoder settings (NULL for the defaults)
+ * @param encoder Reusable encoder state (NULL to set up and free temporary state)
+ * @param stats Receives what the encoder did (may be NULL)
+ * @return true if successful, false otherwise (including when write fails)
+ */
+bool waver_image_encode_png(
+    const waver_image_t *image,
+    const waver_color_t *bg_color,
+    const waver_color_t *left_color,
+    const waver_color_t *right_color,
+    waver_write_fn write,
+    void *write_context,
+    const waver_png_options_t *options,
+    waver_png_encoder_t *encoder,
+    waver_png_stats_t *stats
+);
+
+/**
+ * @brief Create reusable PNG encoder state
+ *
+ * An encoder keeps its deflate streams and scanline buffers between
+ * images, so a thread that saves many PNGs sets them up only once.  An
+ * encoder must not be used by two threads at the same time.
+ *
+ * @return New encoder or NULL on allocation failure
+ */
+waver_png_encoder_t *waver_png_encoder_new(void);
+
+/**
+ * @brief Free PNG encoder state
+ *
+ * @param encoder Encoder to free (may be NULL)
+ */
+void waver_png_encoder_free(waver_png_encoder_t *encoder);
+
+/**
+ * @brief Parse a PNG profile name as given on the command line
+ *
+ * @param name Profile name ("fast", "balanced" or "smallest")
+ * @param profile Output profile
+ * @return true if successful, false otherwise
+ */
+bool waver_png_profile_parse(const char *name, waver_png_profile_t *profile);
+
+/**
+ * @brief Parse a deflate implementation name as given on the command line
+ *
+ * @param name Implementation name ("zlib" or "libdeflate")
+ * @param deflate Output implementation
+ * @return true if successful, false if unknown or not built in
+ */
+bool waver_png_deflate_parse(const char *name, waver_png_deflate_t *deflate);
+
+/**
+ * @brief Name of a PNG profile
+ *
+ * @param profile Profile
+ * @return Name as accepted by waver_png_profile_parse()
+ */
+const char *waver_png_profile_name(waver_png_profile_t profile);
+
+// Peak accumulation functions
+/**
+ * @brief First sample (per channel) of a pixel column
+ *
+ * @param total_samples Samples per channel in the whole file
+ * @param width Number of columns
+ * @param column Column index
+ * @return Index of the first sample of the column
+ */
+uint64_t waver_column_start(uint64_t total_samples, unsigned int width, uint64_t column);
+
+/**
+ * @brief Create a new peak accumulator
+ *
+ * @param width Number of image columns
+ * @param expected_samples Expected number of samples per channel
+ * @param split Bins per column (1 when expected_samples is exact)
+ * @param first_sample First sample (per channel) that will be accumulated
+ * @return New accumulator or NULL on error
+ */
+waver_peaks_t *waver_peaks_new(unsigned int width, uint64_t expected_samples, unsigned int split,
+                               uint64_t first_sample);
+
+/**
+ * @brief Free memory allocated for a peak accumulator
+ *
+ * @param peaks Accumulator to free
+ */
+void waver_peaks_free(waver_peaks_t *peaks);
+
+/**
+ * @brief Accumulate a block of interleaved PCM samples
+ *
+ * Uses SIMD kernels specialized for mono and stereo where available.
+ *
+ * @param peaks Peak accumulator
+ * @param pcm Interleaved PCM samples
+ * @param frames Number of sample frames (samples per channel) in pcm
+ * @param channels Channels in pcm; only the first two are used
+ * @return true if successful, false on allocation failure
+ */
+bool waver_peaks_add(waver_peaks_t *peaks, const int16_t *pcm, size_t frames, unsigned int channels);
+
+/**
+ * @brief Scalar reference implementation of waver_peaks_add()
+ *
+ * @param peaks Peak accumulator
+ * @param pcm Interleaved PCM samples
+ * @param frames Number of sample frames (samples per channel) in pcm
+ * @param channels Channels in pcm; only the first two are used
+ * @return true if successful, false on allocation failure
+ */
+bool waver_peaks_add_scalar(waver_peaks_t *peaks, const int16_t *pcm, size_t frames, unsigned int channels);
+
+/**
+ * @brief Move past samples without accumulating them
+ *
+ * @param peaks Peak accumulator
+ * @param frames Number of sample frames (samples per channel) to skip
+ * @return true if successful, false on allocation failure
+ */
+bool waver_peaks_skip(waver_peaks_t *peaks, uint64_t frames);
+
+/**
+ * @brief Reduce the accumulated bins to one peak per image column
+ *
+ * Writes columns first_column to width - 1, assuming the expected sample
+ * count was right.  Column first_column is partial if the accumulator did
+ * not start on a column boundary.
+ *
+ * @param peaks Peak accumulator
+ * @param left Output column peaks for left/mono (width entries)
+ * @param right Output column peaks for right (width entries)
+ */
+void waver_peaks_finish(const waver_peaks_t *peaks, uint16_t *left, uint16_t *right);
+
+/**
+ * @brief Re-bin the accumulated bins onto the layout for the real length
+ *
+ * Used instead of waver_peaks_finish() when fewer or more samples were
+ * accumulated than expected.
+ *
+ * @param peaks Peak accumulator (starting at column 0)
+ * @param left Output column peaks for left/mono (width entries)
+ * @param right Output column peaks for right (width entries)
+ */
+void waver_peaks_rebin(const waver_peaks_t *peaks, uint16_t *left, uint16_t *right);
+
 // Audio functions
 /**
  * @brief Generate a waveform from an audio file
  *
+ * With output specs the file is decoded once and every spec gets its own
+ * image, named by appending its suffix to input_path; output_path is then
+ * only used when there are no specs.
+ *
  * @param input_path Path to the input audio file
  * @param output_path Path to save the output PNG
  * @param args Command-line arguments
@@ -196,6 +607,84 @@ bool waver_generate_waveform(
     const waver_args_t *args
 );
 
+/**
+ * @brief Generate a waveform from an audio file, reusing per-thread state
+ *
+ * Works like waver_generate_waveform(), but draws into the image and
+ * encodes with the PNG encoder kept in context instead of setting up new
+ * ones for every file.  With --stats or --stats-json the timing of the
+ * file is added to the context's accumulator.
+ *
+ * @param input_path Path to the input audio file
+ * @param output_path Path to save the output PNG
+ * @param args Command-line arguments
+ * @param context State reused between files (NULL to use temporary state)
+ * @return true if successful, false otherwise
+ */
+bool waver_generate_waveform_with_context(
+    const char *input_path,
+    const char *output_path,
+    const waver_args_t *args,
+    waver_context_t *context
+);
+
+/**
+ * @brief Create the state one thread reuses from one file to the next
+ *
+ * A context must not be used by two threads at the same time.
+ *
+ * @param stats Where to record the timing of each file (may be NULL)
+ * @return New context or NULL on allocation failure
+ */
+waver_context_t *waver_context_new(waver_stats_t *stats);
+
+/**
+ * @brief Free a context made by waver_context_new()
+ *
+ * @param context Context to free (may be NULL)
+ */
+void waver_context_free(waver_context_t *context);
+
+/**
+ * @brief Hand the PNGs of a context's files to a writer stage
+ *
+ * Each PNG is then encoded into memory and queued instead of written by
+ * the thread that made it (see writer.h).
+ *
+ * @param context Context of one thread
+ * @param writer Writer stage (NULL to write directly again)
+ */
+void waver_context_set_writer(waver_context_t *context, waver_writer_t *writer);
+
+/**
+ * @brief Reuse the images of a context's files that have the same audio as one already drawn
+ *
+ * @param context Context of one thread
+ * @param dedup Table of the audio drawn in the run (NULL to draw every file)
+ */
+void waver_context_set_dedup(waver_context_t *context, waver_dedup_t *dedup);
+
+/**
+ * @brief Generate a waveform from one audio file using several threads
+ *
+ * Long files are split at frame boundaries into segments that are decoded
+ * in parallel, each into its own range of image columns.
+ *
+ * @param input_path Path to the input audio file
+ * @param output_path Path to save the output PNG
+ * @param args Command-line arguments
+ * @param num_threads Number of threads to decode the file with
+ * @param context State reused between files (NULL to use temporary state)
+ * @return true if successful, false otherwise
+ */
+bool waver_generate_waveform_parallel(
+    const char *input_path,
+    const char *output_path,
+    const waver_args_t *args,
+    size_t num_threads,
+    waver_context_t *context
+);
+
 /**
  * @brief Process audio files or directories
  *
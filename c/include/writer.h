@@ -0,0 +1,78 @@
+/**
+ * @file writer.h
+ * @brief Writer stage: threads that put finished PNGs on disk (--write-threads)
+ *
+ * A worker that writes its own output waits for storage after every file:
+ * a create, a few writes and a close, each of which can take a round trip
+ * on a network filesystem.  With a writer stage the worker encodes the PNG
+ * into memory and queues it instead, and a few writer threads take the
+ * queue in batches and write the files.  The queue holds at most a fixed
+ * number of PNGs; a worker that finds it full waits for room, so slow
+ * storage holds the workers back instead of filling memory.
+ *
+ * Messages about an output ("Created ...", and the verbose PNG line that
+ * goes with it) are printed by the writer thread once the file is written,
+ * so they keep their order.
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "waver.h"
+
+/**
+ * @brief A PNG being encoded into memory
+ */
+typedef struct {
+    uint8_t *data;    /**< Start of the buffer (NULL until the first write) */
+    size_t capacity;  /**< Size of the buffer */
+    size_t size;      /**< Bytes of PNG so far */
+} waver_writer_buffer_t;
+
+/**
+ * @brief Start a writer stage
+ *
+ * @param threads Number of writer threads (at least 1)
+ * @param depth Number of PNGs that may wait to be written (at least 1)
+ * @return New stage or NULL on error
+ */
+waver_writer_t *waver_writer_new(size_t threads, size_t depth);
+
+/**
+ * @brief Append bytes to a PNG in memory (a waver_write_fn)
+ *
+ * @param context waver_writer_buffer_t to grow
+ * @param data Bytes to append
+ * @param size Number of bytes
+ * @return true if successful, false on allocation failure
+ */
+bool waver_writer_buffer_write(void *context, const void *data, size_t size);
+
+/**
+ * @brief Queue a PNG to be written, waiting while the queue is full
+ *
+ * Safe to call from any thread.  The stage takes over the buffer whether
+ * or not the PNG could be queued.
+ *
+ * @param writer Writer stage
+ * @param path Path of the output file
+ * @param buffer Encoded PNG (emptied)
+ * @param args Command-line arguments, for the messages (must outlive the stage)
+ * @param note Verbose line to print after "Created" (NULL for none)
+ * @return true if queued, false on allocation failure
+ */
+bool waver_writer_submit(waver_writer_t *writer, const char *path, waver_writer_buffer_t *buffer,
+                         const waver_args_t *args, const char *note);
+
+/**
+ * @brief Write everything still queued, stop the threads and free the stage
+ *
+ * @param writer Writer stage (may be NULL)
+ * @return true if every PNG was written, false otherwise
+ */
+bool waver_writer_finish(waver_writer_t *writer);
+
+#endif /* WRITER_H */
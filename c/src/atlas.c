@@ -0,0 +1,449 @@
+/**
+ * @file atlas.c
+ * @brief Outputs made once per directory instead of once per track (--atlas)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "atlas.h"
+#include "format.h"
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define MAX_PATH_LENGTH 1024
+
+// Initial number of track slots (grown as needed)
+#define INITIAL_TRACKS 32
+
+/**
+ * @brief Slot of one track
+ */
+struct waver_atlas_track_t {
+    waver_atlas_t *atlas;        /**< Atlas the track belongs to */
+    char *name;                  /**< File name in the directory */
+    unsigned int channels;       /**< Channels decoded (0 until decoded or if that failed) */
+    uint16_t *buffer;            /**< Allocation holding the column peaks */
+    waver_column_peaks_t image;  /**< Peaks per column of its band (WAVER_ATLAS_PNG) */
+    waver_column_peaks_t peaks;  /**< Peaks written to the index (WAVER_ATLAS_PEAKS) */
+};
+
+/**
+ * @brief Atlas of one directory
+ */
+struct waver_atlas_t {
+    char *path;                    /**< Path of the directory */
+    const waver_args_t *args;      /**< Command-line arguments */
+    atomic_size_t references;      /**< Scan plus tracks not rendered yet */
+    waver_atlas_track_t **tracks;  /**< Slots in the order added */
+    size_t count;                  /**< Number of slots */
+    size_t capacity;               /**< Allocated entries in tracks */
+};
+
+/**
+ * @brief Parse the list of atlas outputs given on the command line
+ *
+ * @param list Comma-separated kinds ("png" and/or "peaks")
+ * @param kinds Receives the waver_atlas_kind_t flags
+ * @return true if successful, false on an unknown or missing kind
+ */
+bool waver_atlas_parse(const char *list, unsigned int *kinds) {
+    *kinds = 0;
+    const char *kind = list;
+    for (;;) {
+        size_t length = strcspn(kind, ",");
+        if (length == 3 && strncmp(kind, "png", 3) == 0) {
+            *kinds |= WAVER_ATLAS_PNG;
+        } else if (length == 5 && strncmp(kind, "peaks", 5) == 0) {
+            *kinds |= WAVER_ATLAS_PEAKS;
+        } else {
+            return false;
+        }
+        if (kind[length] == '\0') {
+            return true;
+        }
+        kind += length + 1;
+    }
+}
+
+/**
+ * @brief Build the path of a file inside the atlas directory
+ *
+ * @param dir_path Path of the directory
+ * @param name File name
+ * @param buffer Receives the path
+ * @param size Size of buffer
+ * @return true if successful, false if the path does not fit
+ */
+static bool atlas_path(const char *dir_path, const char *name, char *buffer, size_t size) {
+    int result = snprintf(buffer, size, "%s/%s", dir_path, name);
+    return result >= 0 && (size_t)result < size;
+}
+
+/**
+ * @brief Whether a directory already has an atlas index
+ *
+ * @param dir_path Path of the directory
+ * @return true if its index exists
+ */
+bool waver_atlas_exists(const char *dir_path) {
+    char path[MAX_PATH_LENGTH];
+    struct stat st;
+    return atlas_path(dir_path, WAVER_ATLAS_INDEX, path, sizeof(path)) && stat(path, &st) == 0;
+}
+
+/**
+ * @brief Start the atlas of one directory
+ *
+ * @param dir_path Path of the directory
+ * @param args Command-line arguments (kinds, size, colors, PNG settings)
+ * @return New atlas or NULL on allocation failure
+ */
+waver_atlas_t *waver_atlas_new(const char *dir_path, const waver_args_t *args) {
+    waver_atlas_t *atlas = calloc(1, sizeof(waver_atlas_t));
+    if (!atlas) {
+        return NULL;
+    }
+    atlas->path = strdup(dir_path);
+    if (!atlas->path) {
+        free(atlas);
+        return NULL;
+    }
+    atlas->args = args;
+    atomic_init(&atlas->references, 1);
+    return atlas;
+}
+
+/**
+ * @brief Add a track to an atlas
+ *
+ * @param atlas Atlas of the directory
+ * @param name File name of the track in the directory
+ * @return Slot of the track or NULL on allocation failure
+ */
+waver_atlas_track_t *waver_atlas_add(waver_atlas_t *atlas, const char *name) {
+    if (atlas->count == atlas->capacity) {
+        size_t capacity = atlas->capacity ? atlas->capacity * 2 : INITIAL_TRACKS;
+        waver_atlas_track_t **tracks = realloc(atlas->tracks, capacity * sizeof(waver_atlas_track_t *));
+        if (!tracks) {
+            return NULL;
+        }
+        atlas->tracks = tracks;
+        atlas->capacity = capacity;
+    }
+
+    waver_atlas_track_t *track = calloc(1, sizeof(waver_atlas_track_t));
+    if (!track) {
+        return NULL;
+    }
+    track->name = strdup(name);
+    if (!track->name) {
+        free(track);
+        return NULL;
+    }
+    track->atlas = atlas;
+    atlas->tracks[atlas->count++] = track;
+    atomic_fetch_add(&atlas->references, 1);
+    return track;
+}
+
+/**
+ * @brief Decode a track into its slot and drop its reference
+ *
+ * Both widths come from one decode, and the sidecar is the one a
+ * per-track image would use, so a library already drawn with --peaks is
+ * not decoded again.
+ *
+ * @param track Slot from waver_atlas_add()
+ * @param input_path Path to the audio file of the track
+ * @param context State reused between files (NULL to use temporary state)
+ * @return true if successful, false if the track or (as the last reference) the outputs failed
+ */
+bool waver_atlas_render(waver_atlas_track_t *track, const char *input_path, waver_context_t *context) {
+    waver_atlas_t *atlas = track->atlas;
+    const waver_args_t *args = atlas->args;
+
+    // The band of the image and the index peaks share a layout when they are as wide
+    waver_column_peaks_t layouts[2];
+    size_t layout_count = 0;
+    if (args->atlas & WAVER_ATLAS_PNG) {
+        layouts[layout_count++].width = args->width;
+    }
+    if ((args->atlas & WAVER_ATLAS_PEAKS) && (layout_count == 0 || args->atlas_columns != args->width)) {
+        layouts[layout_count++].width = args->atlas_columns;
+    }
+    track->buffer = waver_column_peaks_alloc(layouts, layout_count, layouts);
+
+    char output_path[MAX_PATH_LENGTH];
+    int result = snprintf(output_path, sizeof(output_path), "%s.png", input_path);
+    bool success = track->buffer && result >= 0 && (size_t)result < sizeof(output_path);
+    unsigned int channels = 0;
+    success = success && waver_file_column_peaks(input_path, output_path, args, layouts, layout_count,
+                                                 &channels, context);
+    if (success) {
+        track->image = layouts[0];
+        track->peaks = layouts[layout_count - 1];
+        track->channels = channels;
+        waver_print_verbose(args, "Atlas track: %s", input_path);
+    } else if (!track->buffer) {
+        waver_print_stderr(args, "Failed to allocate memory for %s", input_path);
+    }
+    return waver_atlas_release(atlas) && success;
+}
+
+/**
+ * @brief Order two track slots by file name, those that failed to decode last
+ *
+ * @param a First slot pointer
+ * @param b Second slot pointer
+ * @return Negative, zero or positive as for strcmp()
+ */
+static int compare_tracks(const void *a, const void *b) {
+    const waver_atlas_track_t *x = *(const waver_atlas_track_t *const *)a;
+    const waver_atlas_track_t *y = *(const waver_atlas_track_t *const *)b;
+    if ((x->channels == 0) != (y->channels == 0)) {
+        return x->channels == 0 ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+/**
+ * @brief Write the atlas image, one band per decoded track
+ *
+ * Each band is drawn as a span image of its own and copied row by row
+ * into one bitmap, which is then encoded like any other waveform.
+ *
+ * @param atlas Atlas of the directory
+ * @param tracks Decoded tracks in output order
+ * @param count Number of tracks
+ * @param path Path of the image
+ * @return true if successful, false otherwise
+ */
+static bool write_image(const waver_atlas_t *atlas, waver_atlas_track_t *const *tracks, size_t count,
+                        const char *path) {
+    const waver_args_t *args = atlas->args;
+    if (count > UINT_MAX / args->height) {
+        waver_print_stderr(args, "Too many tracks for one atlas: %s", atlas->path);
+        return false;
+    }
+
+    char temp_path[MAX_PATH_LENGTH];
+    int result = snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    if (result < 0 || (size_t)result >= sizeof(temp_path)) {
+        waver_print_stderr(args, "Output path too long or formatting error");
+        return false;
+    }
+
+    waver_image_t *image = waver_image_new(args->width, (unsigned int)count * args->height);
+    waver_image_t *band = waver_image_new_spans(args->width, args->height);
+    if (!image || !band) {
+        waver_print_stderr(args, "Failed to create image buffer");
+        waver_image_free(image);
+        waver_image_free(band);
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        waver_image_reset_spans(band, args->width, args->height);
+        waver_image_draw_peaks(band, tracks[i]->image.left, tracks[i]->image.right, tracks[i]->channels,
+                               0, args->width);
+        for (unsigned int y = 0; y < args->height; y++) {
+            waver_image_row(band, y, image->pixels + (i * args->height + y) * image->line_width);
+        }
+    }
+
+    bool success = waver_image_save_png(image, &args->bg_color, &args->left_color, &args->right_color,
+                                        temp_path, &args->png, NULL, NULL) &&
+                   rename(temp_path, path) == 0;
+    if (!success) {
+        remove(temp_path);
+        waver_print_stderr(args, "Failed to save PNG file: %s", path);
+    }
+    waver_image_free(band);
+    waver_image_free(image);
+    return success;
+}
+
+/**
+ * @brief Write a string as a JSON string literal
+ *
+ * @param file Output file
+ * @param text NUL-terminated text (bytes above 0x7f are copied as they are)
+ */
+static void write_json_string(FILE *file, const char *text) {
+    fputc('"', file);
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', file);
+            fputc(*c, file);
+        } else if (*c < 0x20) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+/**
+ * @brief Write the peaks of one track as base64, one byte per column
+ *
+ * @param file Output file
+ * @param peaks Column peaks of the track
+ * @param channels Number of channels (1 or 2)
+ */
+static void write_peaks(FILE *file, const waver_column_peaks_t *peaks, unsigned int channels) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t count = (size_t)peaks->width * channels;
+    uint32_t bits = 0;
+    unsigned int held = 0;
+    fputc('"', file);
+    for (size_t i = 0; i < count; i++) {
+        unsigned int peak = i < peaks->width ? peaks->left[i] : peaks->right[i - peaks->width];
+        peak = peak > 32767 ? 32767 : peak;
+        bits = (bits << 8) | ((peak * 255 + 16383) / 32767);
+        held += 8;
+        while (held >= 6) {
+            held -= 6;
+            fputc(digits[(bits >> held) & 63], file);
+        }
+    }
+    if (held > 0) {
+        fputc(digits[(bits << (6 - held)) & 63], file);
+        fputs(held == 2 ? "==" : "=", file);
+    }
+    fputc('"', file);
+}
+
+/**
+ * @brief Write the index of the atlas
+ *
+ * @param atlas Atlas of the directory
+ * @param tracks Decoded tracks in output order
+ * @param count Number of tracks
+ * @param path Path of the index
+ * @return true if successful, false otherwise
+ */
+static bool write_index(const waver_atlas_t *atlas, waver_atlas_track_t *const *tracks, size_t count,
+                        const char *path) {
+    const waver_args_t *args = atlas->args;
+    char temp_path[MAX_PATH_LENGTH];
+    int result = snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE *file = result >= 0 && (size_t)result < sizeof(temp_path) ? fopen(temp_path, "w") : NULL;
+    if (!file) {
+        waver_print_stderr(args, "Failed to write atlas index: %s", path);
+        return false;
+    }
+
+    bool image = (args->atlas & WAVER_ATLAS_PNG) != 0;
+    bool peaks = (args->atlas & WAVER_ATLAS_PEAKS) != 0;
+    fprintf(file, "{\"version\":%d", WAVER_ATLAS_VERSION);
+    if (image) {
+        fprintf(file, ",\"image\":\"%s\",\"width\":%u,\"height\":%u", WAVER_ATLAS_IMAGE, args->width, args->height);
+    }
+    if (peaks) {
+        fprintf(file, ",\"columns\":%u", args->atlas_columns);
+    }
+    fputs(",\"tracks\":[", file);
+    for (size_t i = 0; i < count; i++) {
+        fputs(i == 0 ? "\n{\"file\":" : ",\n{\"file\":", file);
+        write_json_string(file, tracks[i]->name);
+        if (image) {
+            fprintf(file, ",\"y\":%zu", i * args->height);
+        }
+        fprintf(file, ",\"channels\":%u", tracks[i]->channels);
+        if (peaks) {
+            fputs(",\"peaks\":", file);
+            write_peaks(file, &tracks[i]->peaks, tracks[i]->channels);
+        }
+        fputc('}', file);
+    }
+    fputs("]}\n", file);
+
+    bool success = !ferror(file);
+    success = fclose(file) == 0 && success;
+    success = success && rename(temp_path, path) == 0;
+    if (!success) {
+        remove(temp_path);
+        waver_print_stderr(args, "Failed to write atlas index: %s", path);
+    }
+    return success;
+}
+
+/**
+ * @brief Write the outputs of an atlas whose tracks have all been rendered
+ *
+ * The image goes first, so a reader that finds the new index also finds
+ * the bands it points to.
+ *
+ * @param atlas Atlas of the directory
+ * @return true if successful, false otherwise
+ */
+static bool write_atlas(waver_atlas_t *atlas) {
+    const waver_args_t *args = atlas->args;
+
+    // Tracks that failed to decode sort last and are left out
+    if (atlas->count == 0) {
+        return true;
+    }
+    qsort(atlas->tracks, atlas->count, sizeof(waver_atlas_track_t *), compare_tracks);
+    size_t count = 0;
+    while (count < atlas->count && atlas->tracks[count]->channels > 0) {
+        count++;
+    }
+    if (count == 0) {
+        return true;
+    }
+
+    char image_path[MAX_PATH_LENGTH];
+    char index_path[MAX_PATH_LENGTH];
+    if (!atlas_path(atlas->path, WAVER_ATLAS_IMAGE, image_path, sizeof(image_path)) ||
+        !atlas_path(atlas->path, WAVER_ATLAS_INDEX, index_path, sizeof(index_path))) {
+        waver_print_stderr(args, "Output path too long or formatting error");
+        return false;
+    }
+    if (args->dry_run) {
+        if (args->atlas & WAVER_ATLAS_PNG) {
+            waver_print_verbose(args, "DryRun %s", image_path);
+        }
+        waver_print_verbose(args, "DryRun %s (%zu tracks)", index_path, count);
+        return true;
+    }
+
+    if (args->atlas & WAVER_ATLAS_PNG) {
+        if (!write_image(atlas, atlas->tracks, count, image_path)) {
+            return false;
+        }
+        waver_print_stdout(args, "Created %s", image_path);
+    }
+    if (!write_index(atlas, atlas->tracks, count, index_path)) {
+        return false;
+    }
+    waver_print_stdout(args, "Created %s (%zu tracks)", index_path, count);
+    return true;
+}
+
+/**
+ * @brief Drop a reference to an atlas, writing and freeing it if it was the last
+ *
+ * @param atlas Atlas of the directory
+ * @return true if successful, false if the outputs could not be written
+ */
+bool waver_atlas_release(waver_atlas_t *atlas) {
+    if (atomic_fetch_sub(&atlas->references, 1) != 1) {
+        return true;
+    }
+
+    bool success = write_atlas(atlas);
+    for (size_t i = 0; i < atlas->count; i++) {
+        free(atlas->tracks[i]->buffer);
+        free(atlas->tracks[i]->name);
+        free(atlas->tracks[i]);
+    }
+    free(atlas->tracks);
+    free(atlas->path);
+    free(atlas);
+    return success;
+}
@@ -3,138 +3,1580 @@
  * @brief Audio processing functionality for waveform generation
  */
 
-// MINIMP3_IMPLEMENTATION and MINIMP3_NO_SIMD are defined in the Makefile
+// The minimp3 implementation is compiled in the mp3_*.c backend units
 
 #include "waver.h"
-#include "minimp3.h"
-#include "minimp3_ex.h"
+#include "libwaver.h"
+#include "mp3_backend.h"
+#include "sidecar.h"
+#include "input.h"
+#include "stats.h"
+#include "format.h"
+#include "writer.h"
+#include "dedup.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/stat.h>
 
-// Define INT16_MIN if not defined
-#ifndef INT16_MIN
-#define INT16_MIN (-32768)
-#endif
+// Extra bins per column when the length is only an estimate
+#define ESTIMATED_LENGTH_SPLIT 8
+
+// Shortest stretch of audio (samples per channel) worth its own thread
+#define MIN_SEGMENT_SAMPLES (512 * 1152)
+
+// Bytes of a mapped input a decoder moves past before they are released
+#define RELEASE_BYTES (1024 * 1024)
+
+// Frames decoded per column of the widest image in preview quality
+#define PREVIEW_FRAMES_PER_COLUMN 2
+
+// Frames a file needs per decoded frame for a preview to be worth skipping
+#define PREVIEW_MIN_SKIP 4
+
+// Samples per channel in one layer III granule
+#define GRANULE_SAMPLES 576
+
+// Peak of a granule per unit of spectral RMS (peak = gain * sqrt(energy)).
+// Granule peaks of the bench corpus follow the RMS with an exponent of 1.0;
+// the gain is set so that column peaks, the largest of several granules,
+// match exact decodes on average
+#define ENVELOPE_GAIN 88000.0f
+
+// Granules between the spectrum of a granule and where it shows up in the
+// decoded samples (the IMDCT overlap and the synthesis filter delay)
+#define ENVELOPE_LAG 1
+
+/**
+ * @brief Samples per channel in one frame with the given header
+ *
+ * @param hdr The 4-byte MPEG audio frame header
+ * @return Samples per channel in the frame
+ */
+static unsigned int frame_samples(const uint8_t *hdr) {
+    unsigned int layer = 4 - ((hdr[1] >> 1) & 3);
+    if (layer == 1) {
+        return 384;
+    }
+    if (layer == 3 && !(hdr[1] & 0x08)) {
+        return 576; // MPEG-2 and MPEG-2.5 layer III
+    }
+    return 1152;
+}
+
+/**
+ * @brief Read the frame count from a Fraunhofer VBRI header
+ *
+ * The VBRI header always sits 32 bytes after the frame header of the first
+ * frame.  Unlike a Xing/Info tag minimp3 does not know about it, and it
+ * decodes the (silent) VBRI frame itself as audio, so it is counted too.
+ *
+ * @param frame The first frame of the stream
+ * @param size Bytes available from the start of the frame
+ * @param frames Output number of frames including the VBRI frame
+ * @return true if a VBRI header was found, false otherwise
+ */
+static bool read_vbri_frames(const uint8_t *frame, size_t size, uint64_t *frames) {
+    const size_t vbri_offset = 4 + 32;
+    if (size < vbri_offset + 18 || memcmp(frame + vbri_offset, "VBRI", 4) != 0) {
+        return false;
+    }
+
+    const uint8_t *count = frame + vbri_offset + 14;
+    *frames = ((uint64_t)count[0] << 24 | (uint64_t)count[1] << 16 | (uint64_t)count[2] << 8 | count[3]) + 1;
+    return *frames > 1;
+}
+
+/**
+ * @brief Work out the number of samples per channel without a full scan
+ *
+ * Uses, in order, the Xing/Info/LAME tag minimp3 already parsed, a VBRI
+ * header, or the stream size divided by the bit rate of the first frame.
+ *
+ * @param mp3d Decoder opened with MP3D_DO_NOT_SCAN
+ * @param exact Set to true if the count comes from a header
+ * @return Samples per channel, or 0 if no estimate is possible
+ */
+static uint64_t header_total_samples(const mp3dec_ex_t *mp3d, bool *exact) {
+    *exact = false;
+
+    if (mp3d->vbr_tag_found) {
+        *exact = true;
+        return mp3d->samples / mp3d->info.channels;
+    }
+
+    if (mp3d->end_offset <= mp3d->start_offset || mp3d->end_offset > mp3d->file.size) {
+        return 0;
+    }
+
+    const uint8_t *frame = mp3d->file.buffer + mp3d->start_offset;
+    uint64_t stream_bytes = mp3d->end_offset - mp3d->start_offset;
+    uint64_t samples_per_frame = frame_samples(frame);
+
+    uint64_t frames;
+    if (read_vbri_frames(frame, stream_bytes, &frames)) {
+        return frames * samples_per_frame;
+    }
+
+    // Constant bit rate estimate (free format streams have no bit rate)
+    if (mp3d->info.bitrate_kbps <= 0 || mp3d->info.hz <= 0) {
+        return 0;
+    }
+    uint64_t bits_per_second = (uint64_t)mp3d->info.bitrate_kbps * 1000;
+    uint64_t hz = (uint64_t)mp3d->info.hz;
+    frames = (stream_bytes * 8 * hz + bits_per_second * samples_per_frame / 2) /
+             (bits_per_second * samples_per_frame);
+    return frames * samples_per_frame;
+}
+
+/**
+ * @brief Open an MP3 file and determine its length
+ *
+ * In single-pass mode the length comes from the stream headers and the
+ * file is only scanned when it has none; otherwise minimp3 builds its
+ * frame index, which reads the whole file before decoding starts.
+ *
+ * @param mp3d Decoder to open
+ * @param input_path Path to the input audio file
+ * @param input Mapping of the file, or NULL to let minimp3 open it
+ * @param backend The minimp3 build to decode with
+ * @param single_pass Avoid the index scan when the headers allow it
+ * @param exact Set to true if the returned count is exact
+ * @return Samples per channel, or 0 on error (decoder is closed)
+ */
+static uint64_t open_audio_file(mp3dec_ex_t *mp3d, const char *input_path, const waver_input_t *input,
+                                const waver_mp3_backend_t *backend, bool single_pass, bool *exact) {
+    if (single_pass) {
+        int flags = MP3D_SEEK_TO_SAMPLE | MP3D_DO_NOT_SCAN;
+        if (input ? backend->ex_open_buf(mp3d, input->data, input->size, flags)
+                  : backend->ex_open(mp3d, input_path, flags)) {
+            return 0;
+        }
+        if (mp3d->info.channels > 0) {
+            uint64_t total_samples = header_total_samples(mp3d, exact);
+            if (total_samples > 0) {
+                return total_samples;
+            }
+        }
+        // No usable header, fall back to the scan
+        backend->ex_close(mp3d);
+    }
+
+    if (input ? backend->ex_open_buf(mp3d, input->data, input->size, MP3D_SEEK_TO_SAMPLE)
+              : backend->ex_open(mp3d, input_path, MP3D_SEEK_TO_SAMPLE)) {
+        return 0;
+    }
+    *exact = true;
+    uint64_t total_samples = mp3d->info.channels > 0 ? mp3d->samples / mp3d->info.channels : 0;
+    if (total_samples == 0) {
+        backend->ex_close(mp3d);
+    }
+    return total_samples;
+}
+
+/**
+ * @brief Decode samples from an opened decoder into peak accumulators
+ *
+ * @param mp3d Opened (and possibly seeked) decoder
+ * @param backend The minimp3 build the decoder was opened with
+ * @param peaks Accumulators to fill, one per image width
+ * @param peaks_count Number of accumulators
+ * @param sidecar Sidecar bins to fill as well, or NULL
+ * @param max_frames Maximum sample frames to decode (UINT64_MAX for all)
+ * @param input Mapping the decoder reads from, to release what it has read, or NULL
+ * @param timing Receives the decode and peak reduction time, or NULL
+ * @return true if successful, false otherwise
+ */
+static bool decode_into_peaks(mp3dec_ex_t *mp3d, const waver_mp3_backend_t *backend,
+                              waver_peaks_t **peaks, size_t peaks_count,
+                              waver_sidecar_builder_t *sidecar, uint64_t max_frames,
+                              const waver_input_t *input, waver_file_stats_t *timing) {
+    // Use a reasonably sized buffer for streaming
+    const size_t BUFFER_SIZE = 4096;
+    mp3d_sample_t pcm[BUFFER_SIZE];
+
+    unsigned int channels = mp3d->info.channels;
+    size_t buffer_frames = BUFFER_SIZE / channels;
+    size_t released = (size_t)mp3d->offset;
+    double mark = timing ? waver_stats_now() : 0.0;
+
+    // Process audio stream packet by packet
+    while (max_frames > 0) {
+        size_t frames = buffer_frames < max_frames ? buffer_frames : (size_t)max_frames;
+        size_t samples_read = backend->ex_read(mp3d, pcm, frames * channels);
+        if (timing) {
+            double now = waver_stats_now();
+            timing->seconds[WAVER_PHASE_DECODE] += now - mark;
+            mark = now;
+        }
+        if (samples_read == 0) {
+            break;
+        }
+        frames = samples_read / channels;
+        for (size_t i = 0; i < peaks_count; i++) {
+            if (!waver_peaks_add(peaks[i], pcm, frames, channels)) {
+                return false;
+            }
+        }
+        if (sidecar && !waver_sidecar_builder_add(sidecar, pcm, frames, channels)) {
+            return false;
+        }
+        max_frames -= frames;
+        if (timing) {
+            double now = waver_stats_now();
+            timing->seconds[WAVER_PHASE_PEAKS] += now - mark;
+            mark = now;
+        }
+
+        // The bit reservoir is copied into the decoder, so frames behind it are done with
+        if (input && mp3d->offset >= released + RELEASE_BYTES) {
+            waver_input_release(input, released, (size_t)mp3d->offset);
+            released = (size_t)mp3d->offset;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Allocate zeroed column peak arrays shaped like another set
+ *
+ * @param layouts Layouts to copy the widths from
+ * @param count Number of layouts
+ * @param copy Layouts to fill (count entries)
+ * @return Single allocation holding all arrays (free it to release them), or NULL
+ */
+uint16_t *waver_column_peaks_alloc(const waver_column_peaks_t *layouts, size_t count, waver_column_peaks_t *copy) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += 2 * (size_t)layouts[i].width;
+    }
+
+    uint16_t *buffer = calloc(total, sizeof(uint16_t));
+    if (!buffer) {
+        return NULL;
+    }
+
+    uint16_t *next = buffer;
+    for (size_t i = 0; i < count; i++) {
+        copy[i].width = layouts[i].width;
+        copy[i].left = next;
+        copy[i].right = next + layouts[i].width;
+        next += 2 * (size_t)layouts[i].width;
+    }
+    return buffer;
+}
+
+/**
+ * @brief One sample range of a file decoded by its own thread
+ */
+typedef struct {
+    const mp3dec_ex_t *source;          /**< Decoder holding the file mapping and frame index */
+    const waver_input_t *input;         /**< The mapping if waver made it, or NULL */
+    const waver_mp3_backend_t *backend; /**< The minimp3 build to decode with */
+    size_t layout_count;                /**< Number of image widths */
+    waver_column_peaks_t *peaks;              /**< Column peaks of this segment, one per width */
+    uint64_t total_samples;             /**< Samples per channel in the whole file */
+    uint64_t first_sample;              /**< First sample of the segment */
+    uint64_t end_sample;                /**< One past the last sample (UINT64_MAX for the rest) */
+    bool build_sidecar;                 /**< Collect sidecar bins for the segment */
+    waver_sidecar_builder_t *sidecar;   /**< Sidecar bins of the segment */
+    bool timed;                         /**< Measure the phases of the segment */
+    waver_file_stats_t timing;          /**< Phase times of the segment */
+    bool success;                       /**< Result of the segment */
+} segment_task_t;
+
+/**
+ * @brief Decode one segment of a file into its own column peaks
+ *
+ * The segment gets its own decoder over the shared memory mapping and
+ * reuses the frame index of the source decoder.  Seeking with
+ * MP3D_SEEK_TO_SAMPLE starts a few frames early and refills the bit
+ * reservoir, so the samples match a sequential decode exactly.  Columns
+ * that straddle two segments get part of their peak from each.
+ *
+ * @param task Segment to decode
+ * @return true if successful, false otherwise
+ */
+static bool decode_segment(segment_task_t *task) {
+    const mp3dec_ex_t *source = task->source;
+    const waver_mp3_backend_t *backend = task->backend;
+
+    mp3dec_ex_t mp3d;
+    if (backend->ex_open_buf(&mp3d, source->file.buffer, source->file.size,
+                             MP3D_SEEK_TO_SAMPLE | MP3D_DO_NOT_SCAN)) {
+        return false;
+    }
+
+    // Borrow the index; it is detached again before closing
+    mp3d.index = source->index;
+    mp3d.indexes_built = 1;
+
+    bool success = mp3d.info.channels == source->info.channels;
+    waver_peaks_t **peaks = calloc(task->layout_count, sizeof(waver_peaks_t *));
+    success = success && peaks;
+    for (size_t i = 0; success && i < task->layout_count; i++) {
+        peaks[i] = waver_peaks_new(task->peaks[i].width, task->total_samples, 1, task->first_sample);
+        success = peaks[i] != NULL;
+    }
+    if (success && task->build_sidecar) {
+        task->sidecar = waver_sidecar_builder_new(mp3d.info.channels, mp3d.info.hz, task->first_sample);
+        success = task->sidecar != NULL;
+    }
+
+    if (success && backend->ex_seek(&mp3d, task->first_sample * mp3d.info.channels) == 0) {
+        // The last segment also decodes the samples past the last column
+        uint64_t max_frames = task->end_sample == UINT64_MAX ? UINT64_MAX : task->end_sample - task->first_sample;
+        waver_file_stats_t *timing = task->timed ? &task->timing : NULL;
+        success = decode_into_peaks(&mp3d, backend, peaks, task->layout_count, task->sidecar, max_frames,
+                                    task->input, timing);
+        double start = timing ? waver_stats_now() : 0.0;
+        for (size_t i = 0; success && i < task->layout_count; i++) {
+            waver_peaks_finish(peaks[i], task->peaks[i].left, task->peaks[i].right);
+        }
+        if (timing) {
+            timing->seconds[WAVER_PHASE_PEAKS] += waver_stats_now() - start;
+        }
+    } else {
+        success = false;
+    }
+
+    for (size_t i = 0; peaks && i < task->layout_count; i++) {
+        waver_peaks_free(peaks[i]);
+    }
+    free(peaks);
+    mp3d.index.frames = NULL;
+    backend->ex_close(&mp3d);
+    return success;
+}
+
+/**
+ * @brief Thread entry point for a segment
+ *
+ * @param arg Segment task
+ * @return NULL
+ */
+static void *segment_thread(void *arg) {
+    segment_task_t *task = (segment_task_t *)arg;
+    task->success = decode_segment(task);
+    return NULL;
+}
+
+/**
+ * @brief Decode a file in several segments on separate threads
+ *
+ * @param mp3d Decoder opened with a frame index (seek table)
+ * @param input Mapping the decoder reads from, or NULL
+ * @param backend The minimp3 build the decoder was opened with
+ * @param layouts Column peaks to fill, one per image width
+ * @param layout_count Number of layouts
+ * @param total_samples Samples per channel in the whole file
+ * @param segment_count Number of segments (and threads)
+ * @param sidecar Receives the sidecar bins of the whole file, or NULL
+ * @param timing Receives the phase times summed over the segments, or NULL
+ * @return true if successful, false otherwise
+ */
+static bool decode_segments(const mp3dec_ex_t *mp3d, const waver_input_t *input,
+                            const waver_mp3_backend_t *backend,
+                            waver_column_peaks_t *layouts, size_t layout_count,
+                            uint64_t total_samples, unsigned int segment_count,
+                            waver_sidecar_builder_t **sidecar, waver_file_stats_t *timing) {
+    segment_task_t *tasks = calloc(segment_count, sizeof(segment_task_t));
+    pthread_t *threads = calloc(segment_count, sizeof(pthread_t));
+    bool *started = calloc(segment_count, sizeof(bool));
+    waver_column_peaks_t *peaks = calloc((size_t)segment_count * layout_count, sizeof(waver_column_peaks_t));
+    uint16_t **buffers = calloc(segment_count, sizeof(uint16_t *));
+    bool success = tasks && threads && started && peaks && buffers;
+
+    for (unsigned int i = 0; success && i < segment_count; i++) {
+        tasks[i].source = mp3d;
+        tasks[i].input = input;
+        tasks[i].backend = backend;
+        tasks[i].layout_count = layout_count;
+        tasks[i].peaks = peaks + (size_t)i * layout_count;
+        tasks[i].total_samples = total_samples;
+        tasks[i].first_sample = total_samples * i / segment_count;
+        tasks[i].end_sample = UINT64_MAX;
+        tasks[i].build_sidecar = sidecar != NULL;
+        tasks[i].timed = timing != NULL;
+        if (i > 0) {
+            tasks[i - 1].end_sample = tasks[i].first_sample;
+        }
+        buffers[i] = waver_column_peaks_alloc(layouts, layout_count, tasks[i].peaks);
+        success = buffers[i] != NULL;
+    }
+
+    if (success) {
+        for (unsigned int i = 1; i < segment_count; i++) {
+            started[i] = pthread_create(&threads[i], NULL, segment_thread, &tasks[i]) == 0;
+        }
+
+        // This thread takes the first segment and any that failed to start
+        for (unsigned int i = 0; i < segment_count; i++) {
+            if (!started[i]) {
+                segment_thread(&tasks[i]);
+            }
+        }
+        for (unsigned int i = 0; i < segment_count; i++) {
+            if (started[i]) {
+                pthread_join(threads[i], NULL);
+            }
+            if (!tasks[i].success) {
+                success = false;
+            }
+            for (size_t phase = 0; timing && phase < WAVER_PHASE_COUNT; phase++) {
+                timing->seconds[phase] += tasks[i].timing.seconds[phase];
+            }
+        }
+    }
+
+    // Merge the segments; a column split between segments takes the larger peak
+    double start = timing ? waver_stats_now() : 0.0;
+    for (size_t l = 0; success && l < layout_count; l++) {
+        for (unsigned int x = 0; x < layouts[l].width; x++) {
+            uint16_t left = 0;
+            uint16_t right = 0;
+            for (unsigned int i = 0; i < segment_count; i++) {
+                const waver_column_peaks_t *segment = &tasks[i].peaks[l];
+                left = segment->left[x] > left ? segment->left[x] : left;
+                right = segment->right[x] > right ? segment->right[x] : right;
+            }
+            layouts[l].left[x] = left;
+            layouts[l].right[x] = right;
+        }
+    }
+    if (timing) {
+        timing->seconds[WAVER_PHASE_PEAKS] += waver_stats_now() - start;
+    }
+
+    // Stitch the sidecar bins of the segments together in order
+    for (unsigned int i = 1; tasks && i < segment_count; i++) {
+        if (success && sidecar && !waver_sidecar_builder_append(tasks[0].sidecar, tasks[i].sidecar)) {
+            success = false;
+        }
+        waver_sidecar_builder_free(tasks[i].sidecar);
+    }
+    if (tasks) {
+        if (success && sidecar) {
+            *sidecar = tasks[0].sidecar;
+        } else {
+            waver_sidecar_builder_free(tasks[0].sidecar);
+        }
+    }
+
+    for (unsigned int i = 0; buffers && i < segment_count; i++) {
+        free(buffers[i]);
+    }
+    free(buffers);
+    free(peaks);
+    free(tasks);
+    free(threads);
+    free(started);
+    return success;
+}
+
+/**
+ * @brief Number of segments to split a file into
+ *
+ * @param decode_threads Threads available for this file
+ * @param total_samples Samples per channel in the file
+ * @return Number of segments (1 to decode sequentially)
+ */
+static unsigned int segment_count_for(unsigned int decode_threads, uint64_t total_samples) {
+    uint64_t count = decode_threads;
+    if (count > total_samples / MIN_SEGMENT_SAMPLES) {
+        count = total_samples / MIN_SEGMENT_SAMPLES;
+    }
+    return count > 1 ? (unsigned int)count : 1;
+}
+
+/**
+ * @brief Bytes from the start of a layer III frame to its main data
+ *
+ * @param hdr The 4-byte MPEG audio frame header
+ * @return Size of the header, CRC and side information
+ */
+static size_t main_data_start(const uint8_t *hdr) {
+    bool mono = (hdr[3] & 0xc0) == 0xc0;
+    size_t side_info = (hdr[1] & 0x08) ? (mono ? 17 : 32) : (mono ? 9 : 17);
+    return 4 + ((hdr[1] & 1) ? 0 : 2) + side_info;
+}
+
+/**
+ * @brief Set up a frame decoder to start at one frame of an indexed file
+ *
+ * A layer III frame may take its main data from up to 511 bytes of the
+ * frames before it (the bit reservoir).  Seeking with minimp3_ex decodes
+ * those frames to fill the reservoir; here it is copied straight out of
+ * the mapping instead, so nothing but the frame itself is synthesized.
+ * The filter bank starts from silence, which only softens the first few
+ * hundred samples of the frame.
+ *
+ * @param dec Frame decoder to set up
+ * @param mp3d Decoder holding the file and its frame index
+ * @param frame Index of the frame that is decoded next
+ */
+static void prime_frame_decoder(mp3dec_t *dec, const mp3dec_ex_t *mp3d, size_t frame) {
+    const mp3dec_frame_t *frames = mp3d->index.frames;
+    const uint8_t *buffer = mp3d->file.buffer;
+    const size_t capacity = sizeof(dec->reserv_buf);
+
+    memset(dec, 0, sizeof(*dec));
+    memcpy(dec->header, buffer + frames[frame].offset, 4);
+    dec->free_format_bytes = mp3d->free_format_bytes;
+    if (mp3d->info.layer != 3) {
+        return;
+    }
+
+    // Gather the reservoir back to front from the main data of earlier frames
+    size_t have = 0;
+    for (size_t i = frame; i > 0 && have < capacity; i--) {
+        size_t start = (size_t)frames[i - 1].offset + main_data_start(buffer + frames[i - 1].offset);
+        size_t end = (size_t)frames[i].offset;
+        if (start >= end) {
+            continue;
+        }
+        size_t take = end - start < capacity - have ? end - start : capacity - have;
+        memcpy(dec->reserv_buf + capacity - have - take, buffer + end - take, take);
+        have += take;
+    }
+    memmove(dec->reserv_buf, dec->reserv_buf + capacity - have, have);
+    dec->reserv = (int)have;
+}
+
+/**
+ * @brief Index of the frame holding a sample
+ *
+ * @param index Frame index of the file
+ * @param sample Interleaved sample position, as stored in the index
+ * @return Index of the last frame starting at or before the sample
+ */
+static size_t frame_at(const mp3dec_index_t *index, uint64_t sample) {
+    size_t low = 0;
+    size_t high = index->num_frames;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (index->frames[middle].sample <= sample) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Whether a file is long enough for a preview to skip most of it
+ *
+ * @param index Frame index of the file
+ * @param layouts Layouts to fill
+ * @param layout_count Number of layouts
+ * @return true if the file has several frames for every frame a preview decodes
+ */
+static bool preview_worthwhile(const mp3dec_index_t *index, const waver_column_peaks_t *layouts,
+                               size_t layout_count) {
+    uint64_t widest = 0;
+    for (size_t i = 0; i < layout_count; i++) {
+        widest = layouts[i].width > widest ? layouts[i].width : widest;
+    }
+    return index->num_frames >= widest * PREVIEW_FRAMES_PER_COLUMN * PREVIEW_MIN_SKIP;
+}
+
+/**
+ * @brief Approximate column peaks from a few frames per column
+ *
+ * The widest image gets PREVIEW_FRAMES_PER_COLUMN frames per column,
+ * spread evenly over the file, and narrower images see the same frames.
+ * Every other frame is skipped without being decoded.  The peaks are the
+ * peaks of the frames decoded, so a short transient between them can be
+ * missed; the overall envelope is the same.
+ *
+ * @param mp3d Decoder holding the file mapping and frame index
+ * @param backend The minimp3 build to decode with
+ * @param layouts Column peaks to fill, one per image width
+ * @param layout_count Number of layouts
+ * @param total_samples Samples per channel in the whole file
+ * @param timing Receives the decode and peak reduction time, or NULL
+ * @return true if successful, false otherwise
+ */
+static bool decode_preview(const mp3dec_ex_t *mp3d, const waver_mp3_backend_t *backend,
+                           waver_column_peaks_t *layouts, size_t layout_count,
+                           uint64_t total_samples, waver_file_stats_t *timing) {
+    const mp3dec_index_t *index = &mp3d->index;
+    unsigned int channels = mp3d->info.channels;
+    unsigned int widest = 0;
+    for (size_t i = 0; i < layout_count; i++) {
+        widest = layouts[i].width > widest ? layouts[i].width : widest;
+    }
+
+    waver_peaks_t **peaks = calloc(layout_count, sizeof(waver_peaks_t *));
+    bool success = peaks != NULL;
+    for (size_t i = 0; success && i < layout_count; i++) {
+        peaks[i] = waver_peaks_new(layouts[i].width, total_samples, 1, 0);
+        success = peaks[i] != NULL;
+    }
+
+    mp3dec_t dec;
+    mp3d_sample_t pcm[MINIMP3_MAX_SAMPLES_PER_FRAME];
+    uint64_t picks = (uint64_t)widest * PREVIEW_FRAMES_PER_COLUMN;
+    uint64_t delay = (uint64_t)mp3d->start_delay / channels;
+    uint64_t position = 0;
+    size_t last = SIZE_MAX;
+    double mark = timing ? waver_stats_now() : 0.0;
+    for (uint64_t pick = 0; success && pick < picks; pick++) {
+        // The middle sample of each share of the file picks the frame
+        uint64_t target = (total_samples * (2 * pick + 1) / (2 * picks) + delay) * channels;
+        size_t frame = frame_at(index, target);
+        if (last != SIZE_MAX && frame <= last) {
+            continue;
+        }
+
+        // A frame right after the last one carries on with its reservoir
+        if (last == SIZE_MAX || frame != last + 1) {
+            prime_frame_decoder(&dec, mp3d, frame);
+        }
+        last = frame;
+        size_t offset = (size_t)index->frames[frame].offset;
+        size_t end = frame + 1 < index->num_frames ? mp3d->file.size : (size_t)mp3d->end_offset;
+        if (end <= offset) {
+            continue;
+        }
+        mp3dec_frame_info_t info;
+        int samples = backend->decode_frame(&dec, mp3d->file.buffer + offset, (int)(end - offset), pcm, &info);
+        if (timing) {
+            double now = waver_stats_now();
+            timing->seconds[WAVER_PHASE_DECODE] += now - mark;
+            mark = now;
+        }
+        if (samples <= 0 || (unsigned int)info.channels != channels) {
+            continue;
+        }
+
+        // Place the frame where a full decode would have put it
+        uint64_t first = index->frames[frame].sample / channels;
+        const mp3d_sample_t *data = pcm;
+        size_t count = (size_t)samples;
+        first = first > delay ? first - delay : 0;
+        if (first < position) {
+            size_t overlap = position - first < count ? (size_t)(position - first) : count;
+            data += overlap * channels;
+            count -= overlap;
+            first = position;
+        }
+        for (size_t i = 0; success && i < layout_count; i++) {
+            success = waver_peaks_skip(peaks[i], first - position) &&
+                      waver_peaks_add(peaks[i], data, count, channels);
+        }
+        position = first + count;
+        if (timing) {
+            double now = waver_stats_now();
+            timing->seconds[WAVER_PHASE_PEAKS] += now - mark;
+            mark = now;
+        }
+    }
+
+    for (size_t i = 0; success && i < layout_count; i++) {
+        waver_peaks_finish(peaks[i], layouts[i].left, layouts[i].right);
+    }
+    if (timing) {
+        timing->seconds[WAVER_PHASE_PEAKS] += waver_stats_now() - mark;
+    }
+    for (size_t i = 0; peaks && i < layout_count; i++) {
+        waver_peaks_free(peaks[i]);
+    }
+    free(peaks);
+    return success;
+}
+
+/**
+ * @brief Peak estimate of a granule from its spectral energy
+ *
+ * @param energy Sum of the squared MDCT coefficients of the granule
+ * @return Estimated peak on the 16-bit sample scale
+ */
+static uint16_t envelope_peak(float energy) {
+    float peak = ENVELOPE_GAIN * sqrtf(energy);
+    return peak < 32767.0f ? (uint16_t)peak : 32767;
+}
+
+/**
+ * @brief Spread the granule peaks of a file over the columns of one width
+ *
+ * @param layout Column peaks to fill
+ * @param left Peak per granule for left/mono
+ * @param right Peak per granule for right
+ * @param granules Number of granules
+ * @param shift Sample (per channel) of the track where the first granule shows up;
+ *              negative when the encoder delay trims the start of the stream
+ * @param total_samples Samples per channel in the track
+ */
+static void envelope_columns(waver_column_peaks_t *layout, const uint16_t *left, const uint16_t *right,
+                             size_t granules, int64_t shift, uint64_t total_samples) {
+    unsigned int width = layout->width;
+    memset(layout->left, 0, width * sizeof(uint16_t));
+    memset(layout->right, 0, width * sizeof(uint16_t));
+
+    unsigned int column = 0;
+    for (size_t g = 0; g < granules; g++) {
+        int64_t first = (int64_t)g * GRANULE_SAMPLES + shift;
+        int64_t last = first + GRANULE_SAMPLES;
+        if (last <= 0) {
+            continue;
+        }
+        uint64_t start = first > 0 ? (uint64_t)first : 0;
+        uint64_t end = (uint64_t)last;
+        if (start >= total_samples) {
+            break;
+        }
+
+        while (column + 1 < width && waver_column_start(total_samples, width, column + 1) <= start) {
+            column++;
+        }
+        for (unsigned int x = column; x < width && waver_column_start(total_samples, width, x) < end; x++) {
+            layout->left[x] = left[g] > layout->left[x] ? left[g] : layout->left[x];
+            layout->right[x] = right[g] > layout->right[x] ? right[g] : layout->right[x];
+        }
+    }
+}
+
+/**
+ * @brief Estimate column peaks from the MP3 spectrum without synthesis
+ *
+ * Every frame goes through Huffman decoding and dequantization, which
+ * gives the MDCT coefficients of its granules.  The energy of those is the
+ * energy of the granule's samples, and ENVELOPE_GAIN turns its square root
+ * into a peak.  Reordering, the IMDCT and the polyphase synthesis, most of
+ * the cost of a decode, are skipped.  Within a granule the peak is spread
+ * evenly, so a column is never narrower than a granule (576 samples).
+ *
+ * @param mp3d Opened decoder (the frame index is not needed)
+ * @param backend The minimp3 build to decode with
+ * @param layouts Column peaks to fill, one per image width
+ * @param layout_count Number of layouts
+ * @param total_samples Samples per channel in the track
+ * @param exact Whether total_samples is exact rather than an estimate
+ * @param input Mapping the decoder reads from, to release what it has read, or NULL
+ * @param timing Receives the decode and peak reduction time, or NULL
+ * @return true if successful, false otherwise
+ */
+static bool decode_envelope(const mp3dec_ex_t *mp3d, const waver_mp3_backend_t *backend,
+                            waver_column_peaks_t *layouts, size_t layout_count,
+                            uint64_t total_samples, bool exact,
+                            const waver_input_t *input, waver_file_stats_t *timing) {
+    unsigned int channels = mp3d->info.channels;
+    size_t capacity = (size_t)(total_samples / GRANULE_SAMPLES) + 16;
+    uint16_t *left = malloc(capacity * sizeof(uint16_t));
+    uint16_t *right = malloc(capacity * sizeof(uint16_t));
+    bool success = left && right;
+
+    mp3dec_t dec;
+    memset(&dec, 0, sizeof(dec));
+    size_t granules = 0;
+    size_t offset = (size_t)mp3d->start_offset;
+    size_t end = (size_t)mp3d->end_offset;
+    size_t released = offset;
+    double mark = timing ? waver_stats_now() : 0.0;
+    while (success && offset < end) {
+        float energy[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        mp3dec_frame_info_t info;
+        int samples = backend->envelope_frame(&dec, mp3d->file.buffer + offset, (int)(end - offset), energy, &info);
+        if (info.frame_bytes == 0) {
+            break;
+        }
+        offset += (size_t)info.frame_bytes;
+        if (samples <= 0 || (unsigned int)info.channels != channels) {
+            continue;
+        }
+
+        size_t count = (size_t)samples / GRANULE_SAMPLES;
+        if (granules + count > capacity) {
+            capacity *= 2;
+            uint16_t *grown_left = realloc(left, capacity * sizeof(uint16_t));
+            left = grown_left ? grown_left : left;
+            uint16_t *grown_right = grown_left ? realloc(right, capacity * sizeof(uint16_t)) : NULL;
+            right = grown_right ? grown_right : right;
+            success = grown_left && grown_right;
+        }
+        for (size_t g = 0; success && g < count; g++, granules++) {
+            left[granules] = envelope_peak(energy[g * 2]);
+            right[granules] = channels > 1 ? envelope_peak(energy[g * 2 + 1]) : 0;
+        }
+
+        if (input && offset >= released + RELEASE_BYTES) {
+            waver_input_release(input, released, offset);
+            released = offset;
+        }
+    }
+    if (timing) {
+        double now = waver_stats_now();
+        timing->seconds[WAVER_PHASE_DECODE] += now - mark;
+        mark = now;
+    }
+
+    // The encoder delay of a Xing/LAME tag is trimmed like the decoder does
+    uint64_t delay = (uint64_t)mp3d->start_delay / channels;
+    uint64_t decoded = (uint64_t)granules * GRANULE_SAMPLES;
+    if (!exact) {
+        total_samples = decoded > delay ? decoded - delay : 0;
+    }
+    int64_t shift = (int64_t)ENVELOPE_LAG * GRANULE_SAMPLES - (int64_t)delay;
+    success = success && total_samples > 0;
+    for (size_t i = 0; success && i < layout_count; i++) {
+        envelope_columns(&layouts[i], left, right, granules, shift, total_samples);
+    }
+    if (timing) {
+        timing->seconds[WAVER_PHASE_PEAKS] += waver_stats_now() - mark;
+        if (success && mp3d->info.hz) {
+            timing->audio_seconds = (double)total_samples / mp3d->info.hz;
+        }
+    }
+
+    free(left);
+    free(right);
+    return success;
+}
+
+/**
+ * @brief Decode an MP3 file into column peaks for one or more image widths
+ *
+ * This function decodes the audio file frame by frame and immediately reduces
+ * each frame to per-column peaks, without storing all audio data in memory.
+ * Every width gets its own accumulator, all fed from the same decode.
+ *
+ * Long files can be split into segments that are decoded on separate
+ * threads.  That needs the exact length and the frame index, so it is not
+ * done in single-pass mode.
+ *
+ * In preview quality only a few frames per column are decoded, unless the
+ * file is too short for that to skip much.  Previews build no sidecar.
+ *
+ * @param input_path Path to the input audio file
+ * @param input Mapping of the file, or NULL to let minimp3 open it
+ * @param layouts Column peaks to fill, one per image width
+ * @param layout_count Number of layouts
+ * @param options Decoder build, single-pass mode and decode threads
+ * @param sidecar Receives the sidecar bins of the file, or NULL to skip them
+ * @param channel_count Receives the number of channels drawn (1 or 2)
+ * @param timing Receives the phase times, input size and audio length, or NULL
+ * @return true if successful, false otherwise
+ */
+static bool decode_mp3(const char *input_path, const waver_input_t *input,
+                       waver_column_peaks_t *layouts, size_t layout_count,
+                       const waver_decode_options_t *options, waver_sidecar_builder_t **sidecar,
+                       unsigned int *channel_count, waver_file_stats_t *timing) {
+    const waver_mp3_backend_t *backend = waver_mp3_backend_select(options->decoder);
+    bool single_pass = options->single_pass;
+    mp3dec_ex_t mp3d;
+    bool exact = false;
+    double start = timing ? waver_stats_now() : 0.0;
+    uint64_t total_samples = open_audio_file(&mp3d, input_path, input, backend, single_pass, &exact);
+    if (timing) {
+        timing->seconds[WAVER_PHASE_OPEN] += waver_stats_now() - start;
+    }
+    if (total_samples == 0) {
+        return false;
+    }
+    if (timing) {
+        timing->input_bytes = mp3d.file.size;
+        timing->audio_seconds = mp3d.info.hz ? (double)total_samples / mp3d.info.hz : 0.0;
+    }
+
+    // Get channel information
+    *channel_count = mp3d.info.channels;
+    if (*channel_count > 2) {
+        *channel_count = 2; // Limit to stereo
+    }
+
+    // The envelope of a layer III stream reads every frame once, in order
+    if (options->quality == WAVER_QUALITY_ENVELOPE && mp3d.info.layer == 3) {
+        bool success = decode_envelope(&mp3d, backend, layouts, layout_count, total_samples, exact,
+                                       input, timing);
+        backend->ex_close(&mp3d);
+        return success;
+    }
+
+    // A preview needs the frame index, which seeking builds if opening did not
+    if (options->quality == WAVER_QUALITY_PREVIEW) {
+        start = timing ? waver_stats_now() : 0.0;
+        bool indexed = mp3d.indexes_built || backend->ex_seek(&mp3d, mp3d.info.channels) == 0;
+        if (timing) {
+            timing->seconds[WAVER_PHASE_OPEN] += waver_stats_now() - start;
+        }
+        if (indexed && preview_worthwhile(&mp3d.index, layouts, layout_count)) {
+            bool success = decode_preview(&mp3d, backend, layouts, layout_count, total_samples, timing);
+            backend->ex_close(&mp3d);
+            return success;
+        }
+        backend->ex_seek(&mp3d, 0);
+    }
+
+    unsigned int segment_count = single_pass ? 1 : segment_count_for(options->decode_threads, total_samples);
+    if (segment_count > 1) {
+        // With a Xing/Info tag minimp3 skipped the index; seeking builds it
+        start = timing ? waver_stats_now() : 0.0;
+        bool indexed = mp3d.indexes_built || backend->ex_seek(&mp3d, mp3d.info.channels) == 0;
+        if (timing) {
+            timing->seconds[WAVER_PHASE_OPEN] += waver_stats_now() - start;
+        }
+        if (indexed) {
+            bool success = decode_segments(&mp3d, input, backend, layouts, layout_count,
+                                           total_samples, segment_count, sidecar, timing);
+            backend->ex_close(&mp3d);
+            return success;
+        }
+        backend->ex_seek(&mp3d, 0);
+    }
+
+    // An estimated length gets finer bins so re-binning stays accurate
+    waver_peaks_t **peaks = calloc(layout_count, sizeof(waver_peaks_t *));
+    bool success = peaks != NULL;
+    for (size_t i = 0; success && i < layout_count; i++) {
+        peaks[i] = waver_peaks_new(layouts[i].width, total_samples, exact ? 1 : ESTIMATED_LENGTH_SPLIT, 0);
+        success = peaks[i] != NULL;
+    }
+    waver_sidecar_builder_t *bins = NULL;
+    if (success && sidecar) {
+        bins = waver_sidecar_builder_new(mp3d.info.channels, mp3d.info.hz, 0);
+        success = bins != NULL;
+    }
+
+    if (success) {
+        success = decode_into_peaks(&mp3d, backend, peaks, layout_count, bins, UINT64_MAX, input, timing);
+    }
+    start = timing ? waver_stats_now() : 0.0;
+    for (size_t i = 0; success && i < layout_count; i++) {
+        if (peaks[i]->samples == peaks[i]->expected_samples) {
+            waver_peaks_finish(peaks[i], layouts[i].left, layouts[i].right);
+        } else {
+            waver_peaks_rebin(peaks[i], layouts[i].left, layouts[i].right);
+        }
+    }
+    if (timing) {
+        timing->seconds[WAVER_PHASE_PEAKS] += waver_stats_now() - start;
+        if (success && mp3d.info.hz) {
+            // The estimate of single-pass mode gives way to what was decoded
+            timing->audio_seconds = (double)peaks[0]->samples / mp3d.info.hz;
+        }
+    }
+
+    if (success && sidecar) {
+        *sidecar = bins;
+    } else {
+        waver_sidecar_builder_free(bins);
+    }
+    for (size_t i = 0; peaks && i < layout_count; i++) {
+        waver_peaks_free(peaks[i]);
+    }
+    free(peaks);
+    backend->ex_close(&mp3d);
+    return success;
+}
+
+/**
+ * @brief Accept any file as MP3
+ *
+ * minimp3 scans past whatever precedes the first frame header, so there is
+ * nothing to check up front; files that are not MP3 fail to decode.
+ *
+ * @param data First bytes of the file
+ * @param size Number of bytes in data
+ * @return true
+ */
+static bool probe_mp3(const uint8_t *data, size_t size) {
+    (void)data;
+    (void)size;
+    return true;
+}
+
+const waver_format_t waver_format_mp3 = {"mp3", probe_mp3, decode_mp3};
 
 /**
- * @brief Absolute value of a PCM sample
+ * @brief Pick the format of a file from its first bytes
  *
- * This function converts a PCM sample into its positive only value
- * It handles the special case of sample being INT16_MIN value.
- *
- * @param sample The signed PCM sample
- * @return The absolue value of the signed PCM sample
+ * @param data First bytes of the file (at least WAVER_FORMAT_PROBE_BYTES if it is that long)
+ * @param size Number of bytes in data
+ * @return The format (never NULL)
  */
-static unsigned int abs_pcm(int16_t sample) {
-    if (sample == INT16_MIN) {
-        return 32767;
+const waver_format_t *waver_format_detect(const uint8_t *data, size_t size) {
+    // MP3 goes last, since it takes anything
+    static const waver_format_t *const formats[] = {&waver_format_wav, &waver_format_mp3};
+    for (size_t i = 0; i + 1 < sizeof(formats) / sizeof(formats[0]); i++) {
+        if (formats[i]->probe(data, size)) {
+            return formats[i];
+        }
     }
-    return (sample < 0) ? -sample : sample;
+    return &waver_format_mp3;
 }
 
 /**
- * @brief Process an audio file and generate a waveform visualization
+ * @brief Decode an audio file, mapping it first unless told not to
  *
- * This function decodes the audio file frame by frame and immediately processes
- * each frame to generate the waveform image, without storing all audio data in memory.
+ * The format is told from the first bytes of the file.  Files that cannot
+ * be mapped are opened by the format itself.
  *
  * @param input_path Path to the input audio file
- * @param image The waveform image to draw into
- * @param width Width of the output image in pixels
+ * @param mapping Mapping of the file the caller already has, or NULL
+ * @param args Command-line arguments (decoder, input and single-pass options)
+ * @param layouts Column peaks to fill, one per image width
+ * @param layout_count Number of layouts
+ * @param decode_threads Number of threads to decode this one file with
+ * @param sidecar Receives the sidecar bins of the file, or NULL to skip them
+ * @param channel_count Receives the number of channels drawn (1 or 2)
+ * @param timing Receives the phase times, input size and audio length, or NULL
  * @return true if successful, false otherwise
  */
-static bool process_audio_file(const char *input_path, waver_image_t *image, unsigned int width) {
-    mp3dec_ex_t mp3d;
-    if (mp3dec_ex_open(&mp3d, input_path, MP3D_SEEK_TO_SAMPLE)) {
+static bool process_audio_file(const char *input_path, const waver_input_t *mapping, const waver_args_t *args,
+                               waver_column_peaks_t *layouts, size_t layout_count,
+                               unsigned int decode_threads, waver_sidecar_builder_t **sidecar,
+                               unsigned int *channel_count, waver_file_stats_t *timing) {
+    waver_input_t input;
+    double start = timing ? waver_stats_now() : 0.0;
+    bool opened = !mapping && args->input == WAVER_INPUT_MMAP && waver_input_open(input_path, &input);
+    if (mapping) {
+        input = *mapping;
+    }
+    bool mapped = mapping || opened;
+    if (timing) {
+        timing->seconds[WAVER_PHASE_OPEN] += waver_stats_now() - start;
+    }
+    uint8_t head[WAVER_FORMAT_PROBE_BYTES];
+    size_t head_size = 0;
+    if (!mapped) {
+        FILE *file = fopen(input_path, "rb");
+        if (file) {
+            head_size = fread(head, 1, sizeof(head), file);
+            fclose(file);
+        }
+    }
+    const waver_format_t *format = mapped ? waver_format_detect(input.data, input.size)
+                                          : waver_format_detect(head, head_size);
+    waver_decode_options_t options = {args->decoder, args->single_pass, decode_threads, args->quality};
+    bool success = format->decode(input_path, mapped ? &input : NULL, layouts, layout_count, &options,
+                                  sidecar, channel_count, timing);
+    if (opened) {
+        start = timing ? waver_stats_now() : 0.0;
+        waver_input_close(&input);
+        if (timing) {
+            timing->seconds[WAVER_PHASE_OPEN] += waver_stats_now() - start;
+        }
+    }
+    return success;
+}
+
+/**
+ * @brief Fill column peaks from a .peaks sidecar
+ *
+ * @param sidecar_path Path of the sidecar
+ * @param layouts Column peaks to fill, one per image width
+ * @param layout_count Number of layouts
+ * @param source_size Size of the audio file the sidecar must match
+ * @param source_mtime Modification time of the audio file the sidecar must match
+ * @param channel_count Receives the number of channels drawn (1 or 2)
+ * @param timing Receives the audio length, or NULL
+ * @return true if filled, false if the sidecar is missing, stale or invalid
+ */
+static bool peaks_from_sidecar(const char *sidecar_path, waver_column_peaks_t *layouts, size_t layout_count,
+                               uint64_t source_size, int64_t source_mtime, unsigned int *channel_count,
+                               waver_file_stats_t *timing) {
+    waver_sidecar_t *sidecar = waver_sidecar_open(sidecar_path);
+    if (!sidecar) {
         return false;
     }
 
-    // Get channel information
-    unsigned int channel_count = mp3d.info.channels;
-    if (channel_count > 2) {
-        channel_count = 2; // Limit to stereo
+    bool success = waver_sidecar_matches(sidecar, source_size, source_mtime);
+    if (success) {
+        for (size_t i = 0; i < layout_count; i++) {
+            waver_sidecar_column_peaks(sidecar, layouts[i].width, layouts[i].left, layouts[i].right);
+        }
+        *channel_count = sidecar->header->channels;
+        if (timing && sidecar->header->sample_rate) {
+            timing->audio_seconds = (double)sidecar->header->total_samples / sidecar->header->sample_rate;
+        }
     }
 
-    // Get total number of frames for scaling calculation
-    uint64_t total_samples = mp3d.samples / mp3d.info.channels;
-    if (total_samples == 0) {
-        mp3dec_ex_close(&mp3d);
+    waver_sidecar_close(sidecar);
+    return success;
+}
+
+/**
+ * @brief Fill column peaks from the sidecar of an output or by decoding
+ *
+ * With --peaks an up-to-date sidecar next to output_path is used instead
+ * of decoding, and a missing or stale one is written after the decode.
+ *
+ * @param input_path Path to the input audio file
+ * @param mapping Mapping of the file the caller already has, or NULL
+ * @param output_path Path of the output the sidecar belongs to
+ * @param args Command-line arguments
+ * @param layouts Column peaks to fill, one per image width
+ * @param layout_count Number of layouts
+ * @param decode_threads Number of threads to decode this one file with
+ * @param channel_count Receives the number of channels drawn (1 or 2)
+ * @param timing Receives the phase times, input size and audio length, or NULL
+ * @return true if successful, false otherwise
+ */
+static bool file_column_peaks(const char *input_path, const waver_input_t *mapping, const char *output_path,
+                              const waver_args_t *args, waver_column_peaks_t *layouts, size_t layout_count,
+                              unsigned int decode_threads, unsigned int *channel_count,
+                              waver_file_stats_t *timing) {
+    // Draw from an up-to-date sidecar next to the output if there is one
+    char sidecar_path[1024];
+    bool use_sidecar = args->peaks && waver_sidecar_path(output_path, sidecar_path, sizeof(sidecar_path));
+    struct stat source;
+    if (use_sidecar && stat(input_path, &source) != 0) {
+        use_sidecar = false;
+    }
+
+    if (use_sidecar) {
+        double start = timing ? waver_stats_now() : 0.0;
+        bool success = peaks_from_sidecar(sidecar_path, layouts, layout_count,
+                                          (uint64_t)source.st_size, (int64_t)source.st_mtime, channel_count,
+                                          timing);
+        if (timing) {
+            timing->seconds[WAVER_PHASE_PEAKS] += waver_stats_now() - start;
+        }
+        if (success) {
+            waver_print_verbose(args, "Using peaks from %s", sidecar_path);
+            return true;
+        }
+    }
+
+    // Process audio file
+    waver_sidecar_builder_t *sidecar = NULL;
+    if (!process_audio_file(input_path, mapping, args, layouts, layout_count, decode_threads,
+                            use_sidecar ? &sidecar : NULL, channel_count, timing)) {
+        waver_print_stderr(args, "Failed to process audio file: %s", input_path);
+        waver_sidecar_builder_free(sidecar);
         return false;
     }
 
-    // Calculate samples per pixel ratio for even distribution
-    uint64_t samples_per_pixel = total_samples / width;
-    uint64_t remainder = total_samples % width;
+    if (sidecar && !args->dry_run) {
+        if (waver_sidecar_write(sidecar_path, sidecar, (uint64_t)source.st_size, (int64_t)source.st_mtime)) {
+            waver_print_verbose(args, "Created %s", sidecar_path);
+        } else {
+            waver_print_stderr(args, "Failed to save peaks file: %s", sidecar_path);
+        }
+    }
+    waver_sidecar_builder_free(sidecar);
+    return true;
+}
 
-    // Use a reasonably sized buffer for streaming
-    const size_t BUFFER_SIZE = 4096;
-    mp3d_sample_t pcm[BUFFER_SIZE];
+/**
+ * @brief One image to produce from a decode
+ */
+typedef struct {
+    waver_output_spec_t spec; /**< Size and palette */
+    char path[1024];          /**< Output PNG path */
+    size_t layout;            /**< Index of the column peaks for the width */
+    bool skip;                /**< Output exists and --overwrite was not given */
+} output_target_t;
+
+/**
+ * @brief Work out the images to produce for an input file
+ *
+ * Without output specs there is a single target at output_path using the
+ * size and palette options; otherwise every spec names its output by
+ * appending its suffix to the input path.
+ *
+ * @param input_path Path to the input audio file
+ * @param output_path Path of the default output
+ * @param args Command-line arguments
+ * @param count Receives the number of targets
+ * @return Array of targets (free() it) or NULL on error
+ */
+static output_target_t *output_targets(const char *input_path, const char *output_path,
+                                       const waver_args_t *args, size_t *count) {
+    *count = args->output_spec_count > 0 ? args->output_spec_count : 1;
+    output_target_t *targets = calloc(*count, sizeof(output_target_t));
+    if (!targets) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < *count; i++) {
+        int result;
+        if (args->output_spec_count == 0) {
+            targets[i].spec.width = args->width;
+            targets[i].spec.height = args->height;
+            targets[i].spec.left_color = args->left_color;
+            targets[i].spec.right_color = args->right_color;
+            targets[i].spec.bg_color = args->bg_color;
+            result = snprintf(targets[i].path, sizeof(targets[i].path), "%s", output_path);
+        } else {
+            targets[i].spec = args->output_specs[i];
+            result = snprintf(targets[i].path, sizeof(targets[i].path), "%s%s", input_path, targets[i].spec.suffix);
+        }
+        if (result < 0 || (size_t)result >= sizeof(targets[i].path)) {
+            waver_print_stderr(args, "Output path too long or formatting error");
+            free(targets);
+            return NULL;
+        }
+    }
+    return targets;
+}
 
-    // Initialize tracking variables
-    uint64_t sample_count = samples_per_pixel;
-    uint64_t sample_remainder = 0;
+/**
+ * @brief State one thread reuses from one file to the next
+ */
+struct waver_context_t {
+    waver_image_t *image;          /**< Span image, reset for every output */
+    waver_png_encoder_t *encoder;  /**< Deflate streams and scanline buffers */
+    waver_stats_t *stats;          /**< Where the timing of each file goes, or NULL */
+    waver_writer_t *writer;        /**< Writer stage the PNGs are queued for, or NULL to write them here */
+    waver_dedup_t *dedup;          /**< Table of the audio drawn in the run, or NULL to draw every file */
+};
 
-    unsigned int current_pixel = 0;  // The pixel we're currently collecting samples for
-    unsigned int left = 0;
-    unsigned int right = 0;
+/**
+ * @brief Create the state one thread reuses from one file to the next
+ *
+ * @param stats Where to record the timing of each file (may be NULL)
+ * @return New context or NULL on allocation failure
+ */
+waver_context_t *waver_context_new(waver_stats_t *stats) {
+    waver_context_t *context = calloc(1, sizeof(waver_context_t));
+    if (!context) {
+        return NULL;
+    }
+    context->stats = stats;
+    context->encoder = waver_png_encoder_new();
+    if (!context->encoder) {
+        free(context);
+        return NULL;
+    }
+    return context;
+}
 
+/**
+ * @brief Free a context made by waver_context_new()
+ *
+ * @param context Context to free (may be NULL)
+ */
+void waver_context_free(waver_context_t *context) {
+    if (!context) {
+        return;
+    }
+    waver_image_free(context->image);
+    waver_png_encoder_free(context->encoder);
+    free(context);
+}
 
-    // Process audio stream packet by packet
-    size_t samples_read;
-    while ((samples_read = mp3dec_ex_read(&mp3d, pcm, BUFFER_SIZE)) > 0) {
-        // Process each frame in the current packet
-        for (size_t i = 0; i < samples_read; i += channel_count) {
-            // Process each channel's sample
-            unsigned int sample = abs_pcm(pcm[i]);
-            if (sample > left) {
-                left = sample;
-            }
+/**
+ * @brief Hand the PNGs of a context's files to a writer stage
+ *
+ * @param context Context of one thread
+ * @param writer Writer stage (NULL to write directly again)
+ */
+void waver_context_set_writer(waver_context_t *context, waver_writer_t *writer) {
+    context->writer = writer;
+}
 
-            if (channel_count > 1) {
-                sample = abs_pcm(pcm[i + 1]);
-                if (sample > right) {
-                    right = sample;
-                }
-            }
+/**
+ * @brief Reuse the images of a context's files that have the same audio as one already drawn
+ *
+ * @param context Context of one thread
+ * @param dedup Table of the audio drawn in the run (NULL to draw every file)
+ */
+void waver_context_set_dedup(waver_context_t *context, waver_dedup_t *dedup) {
+    context->dedup = dedup;
+}
+
+/**
+ * @brief Get a cleared span image for one output
+ *
+ * @param context Context holding the image to reuse, or NULL for a new image
+ * @param width Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @return Image (owned by context if there is one) or NULL on error
+ */
+static waver_image_t *output_image(waver_context_t *context, unsigned int width, unsigned int height) {
+    if (!context) {
+        return waver_image_new_spans(width, height);
+    }
+    if (context->image && waver_image_reset_spans(context->image, width, height)) {
+        return context->image;
+    }
+    waver_image_free(context->image);
+    context->image = waver_image_new_spans(width, height);
+    return context->image;
+}
+
+/**
+ * @brief Give the images of a file the ones already drawn for the same audio
+ *
+ * @param input_path Path to the input audio file
+ * @param args Command-line arguments
+ * @param dedup Table of the audio drawn in the run
+ * @param entry Entry of the file's audio
+ * @param targets Images of the file
+ * @param target_count Number of targets
+ * @return true if successful, false otherwise
+ */
+static bool reuse_targets(const char *input_path, const waver_args_t *args, waver_dedup_t *dedup,
+                          const waver_dedup_entry_t *entry, const output_target_t *targets, size_t target_count) {
+    bool success = true;
+    for (size_t i = 0; i < target_count; i++) {
+        if (targets[i].skip) {
+            continue;
+        }
+        char source[sizeof(targets[i].path)];
+        if (waver_dedup_reuse(dedup, entry, i, targets[i].path, source, sizeof(source))) {
+            waver_print_stdout(args, "Created %s", targets[i].path);
+            waver_print_verbose(args, "%s: same audio as %s, %s", input_path, source,
+                                args->dedup == WAVER_DEDUP_LINK ? "linked" : "copied");
+        } else {
+            waver_print_stderr(args, "Failed to save PNG file: %s", targets[i].path);
+            success = false;
+        }
+    }
+    return success;
+}
+
+/**
+ * @brief Decode an audio file and write the images it still lacks
+ *
+ * @param input_path Path to the input audio file
+ * @param mapping Mapping of the file the caller already has, or NULL
+ * @param args Command-line arguments
+ * @param decode_threads Number of threads to decode this one file with
+ * @param context State reused between files (NULL to use temporary state)
+ * @param targets Images of the file
+ * @param target_count Number of targets
+ * @return true if successful, false otherwise
+ */
+static bool render_targets(const char *input_path, const waver_input_t *mapping, const waver_args_t *args,
+                           unsigned int decode_threads, waver_context_t *context,
+                           output_target_t *targets, size_t target_count) {
+    // One set of column peaks per distinct width
+    waver_column_peaks_t *layouts = calloc(target_count, sizeof(waver_column_peaks_t));
+    size_t layout_count = 0;
+    for (size_t i = 0; layouts && i < target_count; i++) {
+        if (targets[i].skip) {
+            continue;
+        }
+        size_t l = 0;
+        while (l < layout_count && layouts[l].width != targets[i].spec.width) {
+            l++;
+        }
+        if (l == layout_count) {
+            layouts[layout_count++].width = targets[i].spec.width;
+        }
+        targets[i].layout = l;
+    }
+    uint16_t *column_buffer = layouts ? waver_column_peaks_alloc(layouts, layout_count, layouts) : NULL;
+    if (!column_buffer) {
+        waver_print_stderr(args, "Failed to create image buffer");
+        free(layouts);
+        return false;
+    }
+
+    // Phase times are only taken when they are going to be reported
+    waver_file_stats_t file_stats;
+    memset(&file_stats, 0, sizeof(file_stats));
+    waver_file_stats_t *timing = context && context->stats && (args->stats || args->stats_json) ? &file_stats : NULL;
+    waver_png_options_t png = args->png;
+    png.timing = timing != NULL;
+
+    unsigned int channel_count = 0;
+    bool success = file_column_peaks(input_path, mapping, targets[0].path, args, layouts, layout_count,
+                                     decode_threads, &channel_count, timing);
+    if (!success) {
+        free(column_buffer);
+        free(layouts);
+        return false;
+    }
+
+    for (size_t i = 0; i < target_count; i++) {
+        if (targets[i].skip) {
+            continue;
+        }
+
+        // Generate the image buffer
+        const waver_output_spec_t *spec = &targets[i].spec;
+        const waver_column_peaks_t *columns = &layouts[targets[i].layout];
+        waver_image_t *image = output_image(context, spec->width, spec->height);
+        if (!image) {
+            waver_print_stderr(args, "Failed to create image buffer");
+            success = false;
+            continue;
+        }
+        double start = timing ? waver_stats_now() : 0.0;
+        waver_image_draw_peaks(image, columns->left, columns->right, channel_count, 0, spec->width);
+        if (timing) {
+            timing->seconds[WAVER_PHASE_DRAW] += waver_stats_now() - start;
+        }
 
-            sample_count--;
-            if (sample_count == 0) {
-                // Draw the current pixel with its max values
-                if (channel_count > 1) {
-                    waver_image_draw_point(image, current_pixel, left, right);
+        // Save or log the result; with a writer stage the PNG is queued and
+        // the writer reports it once it is on disk.  An image hard-linked by
+        // --dedup is unlinked first, so the other names keep their image
+        if (!args->dry_run) {
+            if (args->overwrite) {
+                waver_dedup_unshare(targets[i].path);
+            }
+            waver_png_stats_t png_stats;
+            waver_writer_t *writer = context ? context->writer : NULL;
+            waver_writer_buffer_t encoded = {NULL, 0, 0};
+            bool saved = writer ? waver_image_encode_png(image, &spec->bg_color, &spec->left_color, &spec->right_color,
+                                                         waver_writer_buffer_write, &encoded, &png,
+                                                         context->encoder, &png_stats)
+                                : waver_image_save_png(image, &spec->bg_color, &spec->left_color, &spec->right_color,
+                                                       targets[i].path, &png, context ? context->encoder : NULL,
+                                                       &png_stats);
+            if (saved) {
+                if (timing) {
+                    // Everything but filtering and deflate is file output and chunk CRCs
+                    double write = png_stats.seconds - png_stats.filter_seconds - png_stats.compress_seconds;
+                    timing->seconds[WAVER_PHASE_FILTER] += png_stats.filter_seconds;
+                    timing->seconds[WAVER_PHASE_COMPRESS] += png_stats.compress_seconds;
+                    timing->seconds[WAVER_PHASE_WRITE] += write > 0.0 ? write : 0.0;
+                }
+                char note[sizeof(targets[i].path) + 128];
+                if (args->verbose) {
+                    snprintf(note, sizeof(note), "PNG %s: %zu bytes in %.2f ms (%s profile, kept %s, %u pass%s)",
+                             targets[i].path, png_stats.bytes, png_stats.seconds * 1000.0,
+                             waver_png_profile_name(args->png.profile), png_stats.encoding,
+                             png_stats.passes, png_stats.passes == 1 ? "" : "es");
+                }
+                if (writer) {
+                    if (!waver_writer_submit(writer, targets[i].path, &encoded, args, args->verbose ? note : NULL)) {
+                        waver_print_stderr(args, "Failed to save PNG file: %s", targets[i].path);
+                        success = false;
+                    }
                 } else {
-                    waver_image_draw_point_mono(image, current_pixel, left);
+                    waver_print_stdout(args, "Created %s", targets[i].path);
+                    waver_print_verbose(args, "%s", note);
                 }
+            } else {
+                free(encoded.data);
+                waver_print_stderr(args, "Failed to save PNG file: %s", targets[i].path);
+                success = false;
+            }
+        } else if (args->verbose) {
+            waver_print_verbose(args, "DryRun %s", targets[i].path);
+        }
+
+        if (!context) {
+            waver_image_free(image);
+        }
+    }
+
+    if (timing && !waver_stats_add(context->stats, timing)) {
+        waver_print_stderr(args, "Failed to record timing of %s", input_path);
+    }
+
+    free(column_buffer);
+    free(layouts);
+    return success;
+}
+
+/**
+ * @brief Generate a waveform from an audio file
+ *
+ * @param input_path Path to the input audio file
+ * @param output_path Path to save the output PNG
+ * @param args Command-line arguments
+ * @param decode_threads Number of threads to decode this one file with
+ * @param context State reused between files (NULL to use temporary state)
+ * @return true if successful, false otherwise
+ */
+static bool generate_waveform(
+    const char *input_path,
+    const char *output_path,
+    const waver_args_t *args,
+    unsigned int decode_threads,
+    waver_context_t *context
+) {
+    if (!input_path || !output_path || !args) {
+        return false;
+    }
+
+    size_t target_count = 0;
+    output_target_t *targets = output_targets(input_path, output_path, args, &target_count);
+    if (!targets) {
+        return false;
+    }
 
-                // Reset max values for the new pixel
-                left = 0;
-                right = 0;
-
-                // Update current pixel
-                current_pixel++;
-                sample_count = samples_per_pixel;
-                sample_remainder += remainder;
-                if (sample_remainder >= width) {
-                    sample_remainder -= width;
-                    sample_count++;
+    // Skip outputs that exist if overwrite isn't allowed
+    size_t pending = 0;
+    for (size_t i = 0; i < target_count; i++) {
+        if (!args->overwrite) {
+            FILE *test_file = fopen(targets[i].path, "rb");
+            if (test_file) {
+                fclose(test_file);
+                if (args->verbose) {
+                    waver_print_stderr(args, "Output file '%s' already exists - use --overwrite", targets[i].path);
                 }
+                targets[i].skip = true;
+                continue;
             }
         }
+        pending++;
+    }
+    if (pending == 0) {
+        free(targets);
+        return true; // Not an error, but skipped
     }
 
-    // Draw the final pixel if we've collected any samples for it
-    if (sample_count > 0) {
-        if (channel_count > 1) {
-            waver_image_draw_point(image, current_pixel, left, right);
-        } else {
-            waver_image_draw_point_mono(image, current_pixel, left);
+    // With --dedup the file is fingerprinted from the mapping it is then
+    // decoded from, and a copy of audio already drawn reuses those images
+    waver_dedup_t *dedup = context && !args->dry_run ? context->dedup : NULL;
+    waver_input_t mapping;
+    bool mapped = dedup && waver_input_open(input_path, &mapping);
+    waver_dedup_entry_t *entry = NULL;
+    bool render = true;
+    if (mapped) {
+        entry = waver_dedup_claim(dedup, mapping.data, mapping.size, &render);
+    }
+
+    bool success;
+    if (render) {
+        double start = waver_stats_now();
+        success = render_targets(input_path, mapped && args->input == WAVER_INPUT_MMAP ? &mapping : NULL, args,
+                                 decode_threads, context, targets, target_count);
+        if (entry) {
+            const char **paths = calloc(target_count, sizeof(const char *));
+            for (size_t i = 0; paths && i < target_count; i++) {
+                paths[i] = targets[i].path;
+            }
+            waver_dedup_finish(dedup, entry, paths, target_count, success && paths, waver_stats_now() - start);
+            free(paths);
         }
+    } else {
+        success = reuse_targets(input_path, args, dedup, entry, targets, target_count);
     }
+    if (mapped) {
+        waver_input_close(&mapping);
+    }
+    free(targets);
+    return success;
+}
 
-    mp3dec_ex_close(&mp3d);
-    return true;
+/**
+ * @brief Reduce an audio file to column peaks the way its outputs would be drawn
+ *
+ * @param input_path Path to the input audio file
+ * @param output_path Path of the output whose sidecar may be used or written (--peaks)
+ * @param args Command-line arguments
+ * @param layouts Column peaks to fill, one per width
+ * @param layout_count Number of layouts
+ * @param channel_count Receives the number of channels (1 or 2)
+ * @param context State reused between files, whose accumulator gets the timing (NULL for none)
+ * @return true if successful, false otherwise
+ */
+bool waver_file_column_peaks(const char *input_path, const char *output_path, const waver_args_t *args,
+                             waver_column_peaks_t *layouts, size_t layout_count, unsigned int *channel_count,
+                             waver_context_t *context) {
+    waver_file_stats_t file_stats;
+    memset(&file_stats, 0, sizeof(file_stats));
+    waver_file_stats_t *timing = context && context->stats && (args->stats || args->stats_json) ? &file_stats : NULL;
+    bool success = file_column_peaks(input_path, NULL, output_path, args, layouts, layout_count, 1, channel_count,
+                                     timing);
+    if (success && timing && !waver_stats_add(context->stats, timing)) {
+        waver_print_stderr(args, "Failed to record timing of %s", input_path);
+    }
+    return success;
 }
 
 /**
@@ -150,57 +1592,207 @@ bool waver_generate_waveform(
     const char *output_path,
     const waver_args_t *args
 ) {
-    if (!input_path || !output_path || !args) {
+    return generate_waveform(input_path, output_path, args, 1, NULL);
+}
+
+/**
+ * @brief Generate a waveform from an audio file, reusing per-thread state
+ *
+ * @param input_path Path to the input audio file
+ * @param output_path Path to save the output PNG
+ * @param args Command-line arguments
+ * @param context State reused between files (NULL to use temporary state)
+ * @return true if successful, false otherwise
+ */
+bool waver_generate_waveform_with_context(
+    const char *input_path,
+    const char *output_path,
+    const waver_args_t *args,
+    waver_context_t *context
+) {
+    return generate_waveform(input_path, output_path, args, 1, context);
+}
+
+/**
+ * @brief Generate a waveform from one audio file using several threads
+ *
+ * @param input_path Path to the input audio file
+ * @param output_path Path to save the output PNG
+ * @param args Command-line arguments
+ * @param num_threads Number of threads to decode the file with
+ * @param context State reused between files (NULL to use temporary state)
+ * @return true if successful, false otherwise
+ */
+bool waver_generate_waveform_parallel(
+    const char *input_path,
+    const char *output_path,
+    const waver_args_t *args,
+    size_t num_threads,
+    waver_context_t *context
+) {
+    return generate_waveform(input_path, output_path, args, num_threads > UINT_MAX ? UINT_MAX : (unsigned int)num_threads,
+                             context);
+}
+
+/**
+ * @brief Fill in the same defaults the command line uses
+ *
+ * @param options Options to initialize
+ */
+void waver_render_options_init(waver_render_options_t *options) {
+    memset(options, 0, sizeof(*options));
+    options->width = 2048;
+    options->height = 128;
+    options->left_color = (waver_color_t){0x00, 0xff, 0x99, 0xff};
+    options->right_color = (waver_color_t){0x99, 0xff, 0x00, 0xff};
+    options->bg_color = (waver_color_t){0xff, 0xff, 0xff, 0x00};
+    options->decoder = WAVER_DECODER_SIMD;
+    options->decode_threads = 1;
+    options->png.profile = WAVER_PNG_PROFILE_BALANCED;
+    options->png.deflate = WAVER_PNG_DEFLATE_ZLIB;
+}
+
+/**
+ * @brief Decode MP3 or WAV data in memory into column peaks for one width
+ *
+ * @param data MP3 or PCM WAV data
+ * @param size Size of data in bytes
+ * @param options Width, decoder and decode threads to use
+ * @param columns Column peaks to fill (options->width entries each)
+ * @param channel_count Receives 1 for mono or 2 for stereo
+ * @return true if successful, false otherwise
+ */
+static bool decode_buffer(const void *data, size_t size, const waver_render_options_t *options,
+                          waver_column_peaks_t *columns, unsigned int *channel_count) {
+    if (!data || size == 0 || !options || options->width == 0) {
         return false;
     }
 
-    // Skip if output exists and overwrite isn't allowed
-    if (!args->overwrite) {
-        FILE *test_file = fopen(output_path, "rb");
-        if (test_file) {
-            fclose(test_file);
-            if (args->verbose) {
-                waver_print_stderr(args, "Output file '%s' already exists - use --overwrite", output_path);
-            }
-            return true; // Not an error, but skipped
-        }
+    // The caller's memory is read as if it were a mapping, but never released
+    waver_input_t input = {data, size, -1};
+    waver_decode_options_t decode = {options->decoder, options->single_pass,
+                                     options->decode_threads > 1 ? options->decode_threads : 1,
+                                     options->quality};
+    const waver_format_t *format = waver_format_detect(input.data, input.size);
+    if (!format->decode(NULL, &input, columns, 1, &decode, NULL, channel_count, NULL)) {
+        return false;
+    }
+    if (*channel_count < 2) {
+        memset(columns->right, 0, columns->width * sizeof(uint16_t));
     }
+    return true;
+}
 
-    // Generate the image buffer
-    waver_image_t *image = waver_image_new(args->width, args->height);
-    if (!image) {
-        waver_print_stderr(args, "Failed to create image buffer");
+/**
+ * @brief Decode MP3 or WAV data into one peak per image column
+ *
+ * @param data MP3 or PCM WAV data (not modified, and only read during the call)
+ * @param size Size of data in bytes
+ * @param options Width, decoder and decode threads to use
+ * @param left Receives the peak per column for left or mono (options->width entries)
+ * @param right Receives the peak per column for right (options->width entries, zero for mono)
+ * @param channel_count Receives 1 for mono or 2 for stereo
+ * @return true if successful, false if the data cannot be decoded
+ */
+bool waver_render_peaks(const void *data, size_t size, const waver_render_options_t *options,
+                        uint16_t *left, uint16_t *right, unsigned int *channel_count) {
+    if (!options || !left || !right || !channel_count) {
         return false;
     }
+    waver_column_peaks_t columns = {options->width, left, right};
+    memset(left, 0, options->width * sizeof(uint16_t));
+    memset(right, 0, options->width * sizeof(uint16_t));
+    return decode_buffer(data, size, options, &columns, channel_count);
+}
 
-    // Process audio file and generate waveform
-    bool success = process_audio_file(input_path, image, args->width);
-    if (!success) {
-        waver_print_stderr(args, "Failed to process audio file: %s", input_path);
-        waver_image_free(image);
+/**
+ * @brief Render MP3 or WAV data as a PNG passed to a callback in pieces
+ *
+ * @param data MP3 or PCM WAV data (not modified, and only read during the call)
+ * @param size Size of data in bytes
+ * @param options Size, colors, decoder and PNG settings
+ * @param context Image and encoder reused between calls on one thread (NULL for temporary state)
+ * @param write Receives the PNG in pieces, in order
+ * @param write_context Passed to write
+ * @return true if successful, false otherwise (including when write fails)
+ */
+bool waver_render_png(const void *data, size_t size, const waver_render_options_t *options,
+                      waver_context_t *context, waver_write_fn write, void *write_context) {
+    if (!options || !write || options->width == 0) {
         return false;
     }
 
-    // Save or log the result
-    if (!args->dry_run) {
-        success = waver_image_save_optimized_png(
-            image,
-            &args->bg_color,
-            &args->left_color,
-            &args->right_color,
-            output_path
-        );
+    waver_column_peaks_t layout = {options->width, NULL, NULL};
+    waver_column_peaks_t columns;
+    uint16_t *column_buffer = waver_column_peaks_alloc(&layout, 1, &columns);
+    if (!column_buffer) {
+        return false;
+    }
+    unsigned int channel_count = 0;
+    bool success = decode_buffer(data, size, options, &columns, &channel_count);
 
-        if (success) {
-            waver_print_stdout(args, "Created %s", output_path);
-        } else {
-            waver_print_stderr(args, "Failed to save PNG file: %s", output_path);
+    waver_image_t *image = success ? output_image(context, options->width, options->height) : NULL;
+    if (image) {
+        waver_image_draw_peaks(image, columns.left, columns.right, channel_count, 0, options->width);
+        success = waver_image_encode_png(image, &options->bg_color, &options->left_color, &options->right_color,
+                                         write, write_context, &options->png, context ? context->encoder : NULL,
+                                         NULL);
+        if (!context) {
+            waver_image_free(image);
         }
-    } else if (args->verbose) {
-        waver_print_verbose(args, "DryRun %s", output_path);
-        success = true;
+    } else {
+        success = false;
     }
 
-    waver_image_free(image);
+    free(column_buffer);
     return success;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief A caller's buffer being filled with a PNG
+ */
+typedef struct {
+    uint8_t *data;    /**< Start of the buffer */
+    size_t capacity;  /**< Size of the buffer */
+    size_t size;      /**< Bytes of PNG so far, including any that did not fit */
+} fixed_buffer_t;
+
+/**
+ * @brief Copy a piece of PNG into a fixed_buffer_t, counting what does not fit
+ *
+ * @param context fixed_buffer_t
+ * @param data Bytes to write
+ * @param size Number of bytes
+ * @return true (a full buffer only stops the copying, not the size count)
+ */
+static bool write_fixed_buffer(void *context, const void *data, size_t size) {
+    fixed_buffer_t *buffer = context;
+    if (buffer->size <= buffer->capacity && size <= buffer->capacity - buffer->size) {
+        memcpy(buffer->data + buffer->size, data, size);
+    }
+    buffer->size += size;
+    return true;
+}
+
+/**
+ * @brief Render MP3 or WAV data as a PNG into a caller-provided buffer
+ *
+ * @param data MP3 or PCM WAV data (not modified, and only read during the call)
+ * @param size Size of data in bytes
+ * @param options Size, colors, decoder and PNG settings
+ * @param context Image and encoder reused between calls on one thread (NULL for temporary state)
+ * @param buffer Receives the PNG
+ * @param capacity Size of buffer in bytes
+ * @param png_size Receives the size of the PNG (larger than capacity if it did not fit, 0 on other errors)
+ * @return true if the PNG is in buffer, false otherwise
+ */
+bool waver_render_png_buffer(const void *data, size_t size, const waver_render_options_t *options,
+                             waver_context_t *context, void *buffer, size_t capacity, size_t *png_size) {
+    if (!png_size || (!buffer && capacity > 0)) {
+        return false;
+    }
+    fixed_buffer_t fixed = {buffer, capacity, 0};
+    bool success = waver_render_png(data, size, options, context, write_fixed_buffer, &fixed);
+    *png_size = success ? fixed.size : 0;
+    return success && fixed.size <= capacity;
+}
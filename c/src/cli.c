@@ -13,7 +13,12 @@
 #include <sys/stat.h>
 #include <libgen.h>
 #include <stdlib.h> // For strdup
-#include "thread_safe_console.h" // For console mutex
+#include "mp3_backend.h"
+#include "threadpool.h"
+#include "stats.h"
+#include "server.h"
+#include "atlas.h"
+#include "console.h"
 
 // Special return value for help display
 #define WAVER_ARGS_HELP ((waver_args_t*)1)
@@ -25,6 +30,8 @@
 #define DEFAULT_RIGHT_COLOR "99ff00"
 #define DEFAULT_BG_COLOR "ffffff00"
 #define DEFAULT_FILE_EXTENSION "mp3"
+#define DEFAULT_CACHE_MB 64
+#define DEFAULT_ATLAS_COLUMNS 256
 
 // For file processing
 #define MAX_PATH_LENGTH 1024
@@ -43,14 +50,79 @@ static const char *HELP_TEXT =
     "  --background-color <color> Background color (default: ffffff00)\n"
     "  -o, --output-filename <file> Output PNG file name (only in single-file mode)\n"
     "  --file-extensions <ext>   Comma-separated list of audio file extensions (default: mp3)\n"
-    "  --threads <number>        Number of worker threads (default: auto)\n"
+    "  --threads <number>        Number of worker threads (default: auto, the CPUs\n"
+    "                            the affinity mask and cgroup quota allow, growing\n"
+    "                            while files wait on I/O)\n"
+    "  --pin-threads             Pin each worker thread to one of those CPUs\n"
+    "  --schedule <order>        Order of files in a batch: fifo (as found) or\n"
+    "                            largest-first (by file size) (default: fifo)\n"
+    "  --io-threads <number>     Threads that read input files into the page cache\n"
+    "                            ahead of the workers (default: 0, workers read\n"
+    "                            their own)\n"
+    "  --prefetch-depth <number> Files read ahead that may wait for a worker\n"
+    "                            (default: 2 per worker thread)\n"
+    "  --write-threads <number>  Threads that write the PNGs the workers finish\n"
+    "                            (default: 0, workers write their own)\n"
+    "  --write-depth <number>    Finished PNGs that may wait to be written before\n"
+    "                            the workers do (default: 4 per worker thread)\n"
+    "  --decoder <mode>          MP3 decoder build: simd or scalar (default: simd)\n"
+    "  --input <mode>            Input reading: mmap (mapped with read-ahead hints,\n"
+    "                            released as decoded) or file (default: mmap)\n"
+    "  --single-pass             Take the track length from the MP3 headers instead\n"
+    "                            of scanning the whole file before decoding\n"
+    "  --quality <level>         exact (every frame decoded), preview (a few MP3\n"
+    "                            frames per column decoded, the rest skipped) or\n"
+    "                            envelope (peaks estimated from the MP3 spectrum\n"
+    "                            without synthesis, experimental) (default: exact)\n"
+    "  --output-spec <spec>      Add an output WxH:left:right:bg:suffix, named by\n"
+    "                            appending suffix to the input path; empty fields\n"
+    "                            use the options above (repeatable, one decode)\n"
+    "  --peaks                   Write a .peaks sidecar next to each output and draw\n"
+    "                            from it instead of decoding while it is up to date\n"
+    "  --atlas <kinds>           Instead of an image per track, write per directory\n"
+    "                            waveforms.png (png: a band per track) and/or\n"
+    "                            waveforms.json (peaks: a short peaks array per\n"
+    "                            track), comma-separated; the JSON indexes both\n"
+    "  --atlas-columns <number>  Peaks per channel of each track in waveforms.json\n"
+    "                            (default: 256)\n"
+    "  --tree <file>             Also write the library index Music.js loads, as\n"
+    "                            Music.py makes it, from the same scan of the\n"
+    "                            directory (- for stdout)\n"
+    "  --png-profile <name>      PNG compression: fast, balanced or smallest\n"
+    "                            (default: balanced)\n"
+    "  --png-deflate <name>      Deflate implementation: zlib or libdeflate\n"
+    "                            (libdeflate only if built with LIBDEFLATE=1)\n"
+    "  --watch                   After the first pass, keep watching the directories\n"
+    "                            and render audio files as they are added or changed\n"
+    "                            (inotify on Linux, polled elsewhere); Ctrl-C stops\n"
+    "  --incremental             Keep a .waver-manifest in each directory and only\n"
+    "                            render files that are new or changed since it was\n"
+    "                            written, or all of them if the options changed\n"
+    "  --trust-dir-mtimes        With --incremental, do not read a directory whose\n"
+    "                            modification time is unchanged (misses files\n"
+    "                            rewritten in place)\n"
+    "  --dedup <mode>            Draw each distinct audio stream once: files whose\n"
+    "                            audio (tags aside) matches one already drawn get\n"
+    "                            its images as hard links (link) or copies (copy)\n"
+    "  --serve <[host:]port>     Answer HTTP GET /<track><suffix> for the directory,\n"
+    "                            rendering each image on first request and keeping\n"
+    "                            it next to the track and in memory (host default:\n"
+    "                            127.0.0.1); Ctrl-C stops\n"
+    "  --cache-mb <number>       Memory for images rendered by --serve (default: 64)\n"
+    "  --stats                   Print the time spent opening, decoding, reducing,\n"
+    "                            drawing, filtering, compressing and writing, with\n"
+    "                            percentiles per file and throughput, at the end\n"
+    "  --stats-json <file>       Write the same figures as JSON (- for stdout)\n"
+    "  --scheduler-benchmark     Measure thread pool throughput from 1 to --threads\n"
+    "                            (default: 128) threads and exit; no files needed\n"
     "  --dry-run                 Perform actions without generating files\n"
     "  --overwrite               Overwrite existing output files\n"
     "  --quiet                   Suppress most output\n"
     "  --verbose                 Print additional information\n"
     "  -h, --help                Display this help message\n"
     "\n"
-    "Colors can be specified in RGB, RRGGBB, or RRGGBBAA hex format.\n";
+    "Colors can be specified in RGB, RRGGBB, or RRGGBBAA hex format.\n"
+    "Options that take a value also accept the --option=value form.\n";
 
 /**
  * @brief Print the help message
@@ -149,17 +221,11 @@ void waver_print_stderr(const waver_args_t *args, const char *format, ...) {
         return;
     }
     
-    // Lock mutex for thread safety
-    pthread_mutex_lock(&console_mutex);
-    
+    // Formatted here, written by the console thread (see console.h)
     va_list ap;
     va_start(ap, format);
-    vfprintf(stderr, format, ap);
-    fprintf(stderr, "\n");
+    waver_console_vprint(WAVER_CONSOLE_STDERR, format, ap);
     va_end(ap);
-    
-    // Unlock mutex
-    pthread_mutex_unlock(&console_mutex);
 }
 
 /**
@@ -174,17 +240,10 @@ void waver_print_stdout(const waver_args_t *args, const char *format, ...) {
         return;
     }
     
-    // Lock mutex for thread safety
-    pthread_mutex_lock(&console_mutex);
-    
     va_list ap;
     va_start(ap, format);
-    vprintf(format, ap);
-    printf("\n");
+    waver_console_vprint(WAVER_CONSOLE_STDOUT, format, ap);
     va_end(ap);
-    
-    // Unlock mutex
-    pthread_mutex_unlock(&console_mutex);
 }
 
 /**
@@ -199,27 +258,91 @@ void waver_print_verbose(const waver_args_t *args, const char *format, ...) {
         return;
     }
     
-    // Lock mutex for thread safety
-    pthread_mutex_lock(&console_mutex);
-    
     va_list ap;
     va_start(ap, format);
-    vprintf(format, ap);
-    printf("\n");
+    waver_console_vprint(WAVER_CONSOLE_STDOUT, format, ap);
     va_end(ap);
-    
-    // Unlock mutex
-    pthread_mutex_unlock(&console_mutex);
 }
 
 /**
- * @brief Parse command-line arguments
+ * @brief Resolve an --output-spec given as WxH:left:right:bg:suffix
+ *
+ * The raw text is kept in spec->suffix while the options are parsed and is
+ * replaced by the suffix here.  Empty fields take the values of --width,
+ * --height and the color options.
+ *
+ * @param spec Spec holding the raw text, filled in place
+ * @param args Parsed arguments providing the defaults
+ * @return true if successful, false otherwise
+ */
+static bool parse_output_spec(waver_output_spec_t *spec, const waver_args_t *args) {
+    char *text = spec->suffix;
+    char *fields[5] = { NULL };
+
+    // The suffix is everything after the fourth colon
+    int colons = 0;
+    for (const char *p = text; *p && colons < 4; p++) {
+        colons += *p == ':';
+    }
+    if (colons < 4) {
+        fprintf(stderr, "Output spec must be WxH:left:right:bg:suffix: %s\n", text);
+        return false;
+    }
+
+    char *cursor = text;
+    for (int f = 0; f < 4; f++) {
+        char *colon = strchr(cursor, ':');
+        *colon = '\0';
+        fields[f] = cursor;
+        cursor = colon + 1;
+    }
+    fields[4] = cursor;
+
+    spec->width = args->width;
+    spec->height = args->height;
+    if (*fields[0]) {
+        char extra;
+        if (sscanf(fields[0], "%ux%u%c", &spec->width, &spec->height, &extra) != 2 ||
+            spec->width < 16 || spec->height < 6 || spec->height % 2 != 0) {
+            fprintf(stderr, "Output spec size must be WxH with width >= 16 and an even height >= 6: %s\n",
+                    fields[0]);
+            return false;
+        }
+    }
+
+    spec->left_color = args->left_color;
+    spec->right_color = args->right_color;
+    spec->bg_color = args->bg_color;
+    if ((*fields[1] && !waver_color_parse(fields[1], &spec->left_color)) ||
+        (*fields[2] && !waver_color_parse(fields[2], &spec->right_color)) ||
+        (*fields[3] && !waver_color_parse(fields[3], &spec->bg_color))) {
+        fprintf(stderr, "Invalid color format in --output-spec\n");
+        return false;
+    }
+
+    if (!*fields[4]) {
+        fprintf(stderr, "Output spec needs a file name suffix\n");
+        return false;
+    }
+
+    char *suffix = strdup(fields[4]);
+    if (!suffix) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    free(text);
+    spec->suffix = suffix;
+    return true;
+}
+
+/**
+ * @brief Parse command-line arguments that are already split into words
  * 
  * @param argc Argument count
  * @param argv Argument vectors
  * @return Parsed arguments or NULL on error
  */
-waver_args_t *waver_args_parse(int argc, char *argv[]) {
+static waver_args_t *parse_split_args(int argc, char *argv[]) {
     if (argc < 2) {
         print_help();
         return (waver_args_t*)1; // Special value for help
@@ -235,6 +358,8 @@ waver_args_t *waver_args_parse(int argc, char *argv[]) {
     args->width = DEFAULT_WIDTH;
     args->height = DEFAULT_HEIGHT;
     args->threads = 0;  // Auto-detect number of threads by default
+    args->cache_mb = DEFAULT_CACHE_MB;
+    args->atlas_columns = DEFAULT_ATLAS_COLUMNS;
     
     if (!waver_color_parse(DEFAULT_LEFT_COLOR, &args->left_color) ||
         !waver_color_parse(DEFAULT_RIGHT_COLOR, &args->right_color) ||
@@ -426,6 +551,30 @@ waver_args_t *waver_args_parse(int argc, char *argv[]) {
                     return NULL;
                 }
             }
+            // Output spec (resolved once all options are known)
+            else if (strcmp(arg, "--output-spec") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --output-spec\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                waver_output_spec_t *specs = realloc(args->output_specs,
+                                                     (args->output_spec_count + 1) * sizeof(waver_output_spec_t));
+                if (!specs) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                args->output_specs = specs;
+                memset(&specs[args->output_spec_count], 0, sizeof(waver_output_spec_t));
+                specs[args->output_spec_count].suffix = strdup(argv[++i]);
+                if (!specs[args->output_spec_count].suffix) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                args->output_spec_count++;
+            }
             // Dry run
             else if (strcmp(arg, "--dry-run") == 0) {
                 args->dry_run = true;
@@ -434,6 +583,133 @@ waver_args_t *waver_args_parse(int argc, char *argv[]) {
             else if (strcmp(arg, "--overwrite") == 0) {
                 args->overwrite = true;
             }
+            // Single pass
+            else if (strcmp(arg, "--single-pass") == 0) {
+                args->single_pass = true;
+            }
+            // Phase timing
+            else if (strcmp(arg, "--stats") == 0) {
+                args->stats = true;
+            }
+            else if (strcmp(arg, "--stats-json") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --stats-json\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                free(args->stats_json);
+                args->stats_json = strdup(argv[++i]);
+                if (!args->stats_json) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            // Thread pool benchmark
+            else if (strcmp(arg, "--scheduler-benchmark") == 0) {
+                args->scheduler_benchmark = true;
+            }
+            // Peaks sidecar
+            else if (strcmp(arg, "--peaks") == 0) {
+                args->peaks = true;
+            }
+            // Outputs per directory
+            else if (strcmp(arg, "--atlas") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --atlas\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                if (!waver_atlas_parse(argv[++i], &args->atlas)) {
+                    fprintf(stderr, "Atlas must be png, peaks or png,peaks\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            else if (strcmp(arg, "--atlas-columns") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --atlas-columns\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                if (sscanf(argv[++i], "%u", &args->atlas_columns) != 1 ||
+                    args->atlas_columns < 16 || args->atlas_columns > 65536) {
+                    fprintf(stderr, "Atlas columns must be a number from 16 to 65536\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            // Library index for the web player
+            else if (strcmp(arg, "--tree") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --tree\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                free(args->tree);
+                args->tree = strdup(argv[++i]);
+                if (!args->tree) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            // Watch mode
+            else if (strcmp(arg, "--watch") == 0) {
+                args->watch = true;
+            }
+            // Incremental mode
+            else if (strcmp(arg, "--incremental") == 0) {
+                args->incremental = true;
+            }
+            else if (strcmp(arg, "--trust-dir-mtimes") == 0) {
+                args->trust_dir_mtimes = true;
+            }
+            // Duplicate audio
+            else if (strcmp(arg, "--dedup") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --dedup\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                const char *mode = argv[++i];
+                if (strcmp(mode, "link") == 0) {
+                    args->dedup = WAVER_DEDUP_LINK;
+                } else if (strcmp(mode, "copy") == 0) {
+                    args->dedup = WAVER_DEDUP_COPY;
+                } else {
+                    fprintf(stderr, "Dedup must be link or copy\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            // HTTP server
+            else if (strcmp(arg, "--serve") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --serve\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                free(args->serve);
+                args->serve = strdup(argv[++i]);
+                if (!args->serve) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            else if (strcmp(arg, "--cache-mb") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --cache-mb\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                if (sscanf(argv[++i], "%u", &args->cache_mb) != 1) {
+                    fprintf(stderr, "Cache size must be a number\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
             // Quiet
             else if (strcmp(arg, "--quiet") == 0) {
                 args->quiet = true;
@@ -455,6 +731,156 @@ waver_args_t *waver_args_parse(int argc, char *argv[]) {
                     return NULL;
                 }
             }
+            else if (strcmp(arg, "--pin-threads") == 0) {
+                args->pin_threads = true;
+            }
+            // Pipeline stages
+            else if (strcmp(arg, "--io-threads") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --io-threads\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                if (sscanf(argv[++i], "%u", &args->io_threads) != 1) {
+                    fprintf(stderr, "I/O threads must be a number\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            else if (strcmp(arg, "--prefetch-depth") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --prefetch-depth\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                if (sscanf(argv[++i], "%u", &args->prefetch_depth) != 1) {
+                    fprintf(stderr, "Prefetch depth must be a number\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            else if (strcmp(arg, "--write-threads") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --write-threads\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                if (sscanf(argv[++i], "%u", &args->write_threads) != 1) {
+                    fprintf(stderr, "Write threads must be a number\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            else if (strcmp(arg, "--write-depth") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --write-depth\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                if (sscanf(argv[++i], "%u", &args->write_depth) != 1) {
+                    fprintf(stderr, "Write depth must be a number\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            // Decoder
+            else if (strcmp(arg, "--decoder") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --decoder\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                if (!waver_mp3_backend_parse(argv[++i], &args->decoder)) {
+                    fprintf(stderr, "Decoder must be simd or scalar\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            // Task order
+            else if (strcmp(arg, "--schedule") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --schedule\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                const char *order = argv[++i];
+                if (strcmp(order, "fifo") == 0) {
+                    args->schedule = WAVER_SCHEDULE_FIFO;
+                } else if (strcmp(order, "largest-first") == 0) {
+                    args->schedule = WAVER_SCHEDULE_LARGEST_FIRST;
+                } else {
+                    fprintf(stderr, "Schedule must be fifo or largest-first\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            // Input reading
+            else if (strcmp(arg, "--input") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --input\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                const char *mode = argv[++i];
+                if (strcmp(mode, "mmap") == 0) {
+                    args->input = WAVER_INPUT_MMAP;
+                } else if (strcmp(mode, "file") == 0) {
+                    args->input = WAVER_INPUT_FILE;
+                } else {
+                    fprintf(stderr, "Input must be mmap or file\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            // Peak accuracy
+            else if (strcmp(arg, "--quality") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --quality\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                const char *level = argv[++i];
+                if (strcmp(level, "exact") == 0) {
+                    args->quality = WAVER_QUALITY_EXACT;
+                } else if (strcmp(level, "preview") == 0) {
+                    args->quality = WAVER_QUALITY_PREVIEW;
+                } else if (strcmp(level, "envelope") == 0) {
+                    args->quality = WAVER_QUALITY_ENVELOPE;
+                } else {
+                    fprintf(stderr, "Quality must be exact, preview or envelope\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            // PNG compression
+            else if (strcmp(arg, "--png-profile") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --png-profile\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                if (!waver_png_profile_parse(argv[++i], &args->png.profile)) {
+                    fprintf(stderr, "PNG profile must be fast, balanced or smallest\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
+            else if (strcmp(arg, "--png-deflate") == 0) {
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "Missing value for --png-deflate\n");
+                    waver_args_free(args);
+                    return NULL;
+                }
+                if (!waver_png_deflate_parse(argv[++i], &args->png.deflate)) {
+#ifdef WAVER_HAVE_LIBDEFLATE
+                    fprintf(stderr, "PNG deflate must be zlib or libdeflate\n");
+#else
+                    fprintf(stderr, "PNG deflate must be zlib (built without libdeflate)\n");
+#endif
+                    waver_args_free(args);
+                    return NULL;
+                }
+            }
             // Unknown option
             else {
                 fprintf(stderr, "Unknown option: %s\n", arg);
@@ -485,20 +911,88 @@ waver_args_t *waver_args_parse(int argc, char *argv[]) {
     }
 
     // Validate arguments
-    if (args->path_count == 0) {
+    if (args->path_count == 0 && !args->scheduler_benchmark) {
         fprintf(stderr, "No audio files specified\n");
         waver_args_free(args);
         return NULL;
     }
 
+    // Resolve output specs against the final size and color options
+    for (unsigned int i = 0; i < args->output_spec_count; i++) {
+        if (!parse_output_spec(&args->output_specs[i], args)) {
+            waver_args_free(args);
+            return NULL;
+        }
+    }
+
     // Check output filename constraints
+    if (args->output_filename && args->output_spec_count > 0) {
+        fprintf(stderr, "Cannot specify --output-filename with --output-spec\n");
+        waver_args_free(args);
+        return NULL;
+    }
     if (args->output_filename && args->path_count > 1) {
         fprintf(stderr, "Cannot specify --output-filename with multiple audio files\n");
         waver_args_free(args);
         return NULL;
     }
 
+    if (args->output_filename && args->watch) {
+        fprintf(stderr, "Cannot specify --output-filename with --watch\n");
+        waver_args_free(args);
+        return NULL;
+    }
+
+    if (args->trust_dir_mtimes && !args->incremental) {
+        fprintf(stderr, "--trust-dir-mtimes needs --incremental\n");
+        waver_args_free(args);
+        return NULL;
+    }
+
+    if (args->serve && (args->output_filename || args->watch || args->incremental)) {
+        fprintf(stderr, "Cannot specify --serve with --output-filename, --watch or --incremental\n");
+        waver_args_free(args);
+        return NULL;
+    }
+
+    if (args->atlas && (args->output_filename || args->output_spec_count > 0 || args->watch ||
+                        args->incremental || args->serve)) {
+        fprintf(stderr, "Cannot specify --atlas with --output-filename, --output-spec, --watch, --incremental "
+                        "or --serve\n");
+        waver_args_free(args);
+        return NULL;
+    }
+
+    // Manifests would record files before a writer thread has written them,
+    // and atlases and served images are not written by file tasks
+    if (args->write_threads && (args->incremental || args->atlas || args->serve)) {
+        fprintf(stderr, "Cannot specify --write-threads with --incremental, --atlas or --serve\n");
+        waver_args_free(args);
+        return NULL;
+    }
+
+    // A copy needs its first image on disk, and atlases and served images
+    // are not written by file tasks
+    if (args->dedup && (args->write_threads || args->atlas || args->serve)) {
+        fprintf(stderr, "Cannot specify --dedup with --write-threads, --atlas or --serve\n");
+        waver_args_free(args);
+        return NULL;
+    }
+
+    if (args->io_threads && args->serve) {
+        fprintf(stderr, "Cannot specify --io-threads with --serve\n");
+        waver_args_free(args);
+        return NULL;
+    }
+
+    if (args->tree && (args->watch || args->serve || args->trust_dir_mtimes)) {
+        fprintf(stderr, "Cannot specify --tree with --watch, --serve or --trust-dir-mtimes\n");
+        waver_args_free(args);
+        return NULL;
+    }
+
     // Check that paths exist
+    bool have_directory = false;
     for (unsigned int i = 0; i < args->path_count; i++) {
         if (!file_exists(args->audio_paths[i])) {
             fprintf(stderr, "File not found: %s\n", args->audio_paths[i]);
@@ -507,13 +1001,90 @@ waver_args_t *waver_args_parse(int argc, char *argv[]) {
         }
         
         // Check directory constraints
-        if (args->output_filename && is_directory(args->audio_paths[i])) {
+        bool directory = is_directory(args->audio_paths[i]);
+        if (args->output_filename && directory) {
             fprintf(stderr, "Cannot specify --output-filename with a directory\n");
             waver_args_free(args);
             return NULL;
         }
+        have_directory = have_directory || directory;
+        if (args->atlas && !directory) {
+            fprintf(stderr, "--atlas needs directories: %s\n", args->audio_paths[i]);
+            waver_args_free(args);
+            return NULL;
+        }
+    }
+    if (args->watch && !have_directory && !args->scheduler_benchmark) {
+        fprintf(stderr, "--watch needs at least one directory\n");
+        waver_args_free(args);
+        return NULL;
+    }
+    if (args->serve && (args->path_count != 1 || !have_directory)) {
+        fprintf(stderr, "--serve needs exactly one directory\n");
+        waver_args_free(args);
+        return NULL;
+    }
+    if (args->tree && (args->path_count != 1 || !have_directory)) {
+        fprintf(stderr, "--tree needs exactly one directory\n");
+        waver_args_free(args);
+        return NULL;
+    }
+
+    return args;
+}
+
+/**
+ * @brief Parse command-line arguments
+ *
+ * Long options given as --option=value are split into two words before
+ * parsing so that every option accepts either form.
+ * 
+ * @param argc Argument count
+ * @param argv Argument vectors
+ * @return Parsed arguments or NULL on error
+ */
+waver_args_t *waver_args_parse(int argc, char *argv[]) {
+    // Worst case every argument is split in two
+    char **split_argv = calloc((size_t)argc * 2 + 1, sizeof(char*));
+    char **owned = calloc((size_t)argc + 1, sizeof(char*));
+    if (!split_argv || !owned) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(split_argv);
+        free(owned);
+        return NULL;
+    }
+
+    int split_argc = 0;
+    int owned_count = 0;
+    for (int i = 0; i < argc; i++) {
+        const char *equals = (i > 0 && strncmp(argv[i], "--", 2) == 0) ? strchr(argv[i], '=') : NULL;
+        if (!equals) {
+            split_argv[split_argc++] = argv[i];
+            continue;
+        }
+
+        char *name = strndup(argv[i], (size_t)(equals - argv[i]));
+        if (!name) {
+            fprintf(stderr, "Memory allocation failed\n");
+            for (int j = 0; j < owned_count; j++) {
+                free(owned[j]);
+            }
+            free(owned);
+            free(split_argv);
+            return NULL;
+        }
+        owned[owned_count++] = name;
+        split_argv[split_argc++] = name;
+        split_argv[split_argc++] = (char *)equals + 1;
     }
 
+    waver_args_t *args = parse_split_args(split_argc, split_argv);
+
+    for (int j = 0; j < owned_count; j++) {
+        free(owned[j]);
+    }
+    free(owned);
+    free(split_argv);
     return args;
 }
 
@@ -528,6 +1099,9 @@ void waver_args_free(waver_args_t *args) {
     }
 
     free(args->output_filename);
+    free(args->stats_json);
+    free(args->serve);
+    free(args->tree);
     
     if (args->file_extensions) {
         for (unsigned int i = 0; i < args->extension_count; i++) {
@@ -542,6 +1116,13 @@ void waver_args_free(waver_args_t *args) {
         }
         free(args->audio_paths);
     }
+
+    if (args->output_specs) {
+        for (unsigned int i = 0; i < args->output_spec_count; i++) {
+            free(args->output_specs[i].suffix);
+        }
+        free(args->output_specs);
+    }
     
     free(args);
 }
@@ -582,8 +1163,21 @@ static bool process_file(const char *file_path, const waver_args_t *args) {
     
     waver_print_verbose(args, "Input file: %s, Output file: %s", file_path, output_file);
     
-    // Generate waveform
-    return waver_generate_waveform(file_path, output_file, args);
+    // Generate waveform, splitting the file over all worker threads
+    size_t num_threads = args->threads ? (size_t)args->threads : threadpool_default_threads();
+    if (!args->stats && !args->stats_json) {
+        return waver_generate_waveform_parallel(file_path, output_file, args, num_threads, NULL);
+    }
+
+    // The timing of the one file goes through a context of its own
+    waver_stats_t stats = {0};
+    waver_context_t *context = waver_context_new(&stats);
+    double start = waver_stats_now();
+    bool success = waver_generate_waveform_parallel(file_path, output_file, args, num_threads, context);
+    bool reported = waver_stats_report(args, &stats, waver_stats_now() - start, num_threads);
+    waver_context_free(context);
+    waver_stats_free(&stats);
+    return success && reported;
 }
 
 /**
@@ -596,9 +1190,23 @@ bool waver_process_files(const waver_args_t *args) {
     if (!args) {
         return false;
     }
+
+    if (args->scheduler_benchmark) {
+        return threadpool_benchmark(args->threads ? (size_t)args->threads : 128);
+    }
+
+    waver_print_verbose(args, "MP3 decoder: %s", waver_mp3_backend_select(args->decoder)->name);
+    static const char *const quality_names[] = {"exact", "preview", "envelope"};
+    waver_print_verbose(args, "Quality: %s", quality_names[args->quality]);
+    waver_print_verbose(args, "PNG profile: %s (%s)", waver_png_profile_name(args->png.profile),
+                        args->png.deflate == WAVER_PNG_DEFLATE_LIBDEFLATE ? "libdeflate" : "zlib");
     
+    if (args->serve) {
+        return waver_serve(args);
+    }
+
     // Use parallel processing if there are multiple files or directories
-    if (args->path_count > 1 || is_directory(args->audio_paths[0])) {
+    if (args->watch || args->path_count > 1 || is_directory(args->audio_paths[0])) {
         return waver_process_files_parallel(args, args->threads);
     }
     
@@ -0,0 +1,380 @@
+/**
+ * @file console.c
+ * @brief Console output that does not make the workers wait for the terminal
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "console.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes queued per thread (a power of two); a full ring makes its thread wait
+#define RING_SIZE (32 * 1024)
+
+// Longer messages are cut, keeping their line break
+#define MAX_MESSAGE (RING_SIZE / 4)
+
+// Bytes the writer collects before handing them to stdio
+#define BATCH_SIZE (64 * 1024)
+
+// Messages up to this size are formatted without an allocation
+#define LINE_SIZE 1024
+
+// Each record is a header followed by the text; the high bit selects stderr
+#define RECORD_HEADER sizeof(uint32_t)
+#define RECORD_STDERR 0x80000000u
+
+/**
+ * @brief Messages queued by one thread
+ *
+ * Only the owning thread advances head and only the writer advances tail,
+ * so neither needs a lock.  Rings are never freed: a thread that exits
+ * gives its ring back and the next new thread takes it over.
+ */
+typedef struct console_ring {
+    _Atomic size_t head;        /**< Bytes appended so far (owner only) */
+    _Atomic size_t tail;        /**< Bytes drained so far (writer only) */
+    atomic_bool claimed;        /**< Whether a live thread owns the ring */
+    struct console_ring *next;  /**< Next ring in the list of all rings */
+    unsigned char data[RING_SIZE]; /**< Records, wrapping around */
+} console_ring_t;
+
+static _Atomic(console_ring_t *) rings = NULL;
+static _Thread_local console_ring_t *own_ring = NULL;
+static pthread_key_t ring_key;
+
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static pthread_t writer;
+static atomic_bool writer_running = false;
+
+// The mutex only guards sleeping and waking; messages never take it
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static atomic_bool writer_idle = false;
+static unsigned long flush_requested = 0;
+static unsigned long flush_done = 0;
+static bool stopping = false;
+
+/**
+ * @brief Write one line directly, for when it cannot be queued
+ *
+ * @param stream Stream the line is bound for
+ * @param text Line including its line break
+ * @param length Length of the line
+ */
+static void write_direct(waver_console_stream_t stream, const char *text, size_t length) {
+    FILE *file = stream == WAVER_CONSOLE_STDERR ? stderr : stdout;
+    fwrite(text, 1, length, file);
+    if (stream == WAVER_CONSOLE_STDERR) {
+        fflush(file);
+    }
+}
+
+/**
+ * @brief Whether every ring has been drained
+ *
+ * @return true if nothing is queued
+ */
+static bool rings_empty(void) {
+    for (console_ring_t *ring = atomic_load(&rings); ring; ring = ring->next) {
+        if (atomic_load(&ring->head) != atomic_load(&ring->tail)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Hand the collected bytes of one stream to stdio
+ *
+ * @param batch Collected bytes
+ * @param length Number of bytes (reset to 0)
+ * @param stream Stream they are bound for
+ */
+static void emit_batch(const unsigned char *batch, size_t *length, waver_console_stream_t stream) {
+    if (*length > 0) {
+        fwrite(batch, 1, *length, stream == WAVER_CONSOLE_STDERR ? stderr : stdout);
+        *length = 0;
+    }
+}
+
+/**
+ * @brief Copy bytes out of a ring, wrapping around its end
+ *
+ * @param ring Ring to read
+ * @param position Byte offset since the ring was created
+ * @param out Receives the bytes
+ * @param length Number of bytes
+ */
+static void ring_read(const console_ring_t *ring, size_t position, void *out, size_t length) {
+    size_t offset = position & (RING_SIZE - 1);
+    size_t first = length < RING_SIZE - offset ? length : RING_SIZE - offset;
+    memcpy(out, ring->data + offset, first);
+    memcpy((unsigned char *)out + first, ring->data, length - first);
+}
+
+/**
+ * @brief Copy bytes into a ring, wrapping around its end
+ *
+ * @param ring Ring to write
+ * @param position Byte offset since the ring was created
+ * @param in Bytes to copy
+ * @param length Number of bytes
+ */
+static void ring_write(console_ring_t *ring, size_t position, const void *in, size_t length) {
+    size_t offset = position & (RING_SIZE - 1);
+    size_t first = length < RING_SIZE - offset ? length : RING_SIZE - offset;
+    memcpy(ring->data + offset, in, first);
+    memcpy(ring->data, (const unsigned char *)in + first, length - first);
+}
+
+/**
+ * @brief Write out everything queued in every ring
+ *
+ * Consecutive messages for the same stream are written with one call.
+ *
+ * @return true if anything was written
+ */
+static bool drain_rings(void) {
+    static unsigned char batch[BATCH_SIZE];
+    size_t length = 0;
+    waver_console_stream_t stream = WAVER_CONSOLE_STDOUT;
+    bool wrote = false;
+
+    for (console_ring_t *ring = atomic_load(&rings); ring; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            uint32_t header;
+            ring_read(ring, tail, &header, RECORD_HEADER);
+            size_t size = header & ~RECORD_STDERR;
+            waver_console_stream_t next = header & RECORD_STDERR ? WAVER_CONSOLE_STDERR : WAVER_CONSOLE_STDOUT;
+            if (next != stream || length + size > sizeof(batch)) {
+                emit_batch(batch, &length, stream);
+                stream = next;
+            }
+            ring_read(ring, tail + RECORD_HEADER, batch + length, size);
+            length += size;
+            tail += RECORD_HEADER + size;
+        }
+        if (tail != atomic_load_explicit(&ring->tail, memory_order_relaxed)) {
+            // Gives the space back before the next ring is read
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+            wrote = true;
+        }
+    }
+    emit_batch(batch, &length, stream);
+    if (wrote) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return wrote;
+}
+
+/**
+ * @brief Body of the writer thread
+ *
+ * @param arg Unused
+ * @return NULL
+ */
+static void *writer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&mutex);
+    for (;;) {
+        unsigned long requested = flush_requested;
+        bool stop = stopping;
+        pthread_mutex_unlock(&mutex);
+
+        bool wrote = drain_rings();
+
+        pthread_mutex_lock(&mutex);
+        // Every pass wakes the flushes and full rings that were waiting for it
+        flush_done = requested;
+        pthread_cond_broadcast(&drained);
+        if (stop) {
+            break;
+        }
+        if (!wrote && flush_requested == requested && !stopping) {
+            // A message appended after the check below sees writer_idle and signals
+            atomic_store(&writer_idle, true);
+            if (rings_empty()) {
+                pthread_cond_wait(&wake, &mutex);
+            }
+            atomic_store(&writer_idle, false);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+}
+
+/**
+ * @brief Write everything still queued and stop the writer when the program exits
+ */
+static void stop_writer(void) {
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(writer, NULL);
+    atomic_store(&writer_running, false);
+}
+
+/**
+ * @brief Give the ring of an exiting thread back
+ *
+ * @param ring Ring of the thread
+ */
+static void release_ring(void *ring) {
+    atomic_store(&((console_ring_t *)ring)->claimed, false);
+}
+
+/**
+ * @brief Start the writer thread
+ */
+static void start_writer(void) {
+    if (pthread_key_create(&ring_key, release_ring) != 0) {
+        return;
+    }
+    // Signals are left to the threads that wait for them
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    bool started = pthread_create(&writer, NULL, writer_main, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (started) {
+        atomic_store(&writer_running, true);
+        atexit(stop_writer);
+    }
+}
+
+/**
+ * @brief Find the ring of the calling thread, taking one over or making one
+ *
+ * @return Ring of the thread or NULL on allocation failure
+ */
+static console_ring_t *thread_ring(void) {
+    if (own_ring) {
+        return own_ring;
+    }
+    console_ring_t *ring;
+    for (ring = atomic_load(&rings); ring; ring = ring->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&ring->claimed, &expected, true)) {
+            break;
+        }
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if (!ring) {
+            return NULL;
+        }
+        atomic_init(&ring->claimed, true);
+        ring->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+        }
+    }
+    pthread_setspecific(ring_key, ring);
+    own_ring = ring;
+    return ring;
+}
+
+/**
+ * @brief Append one record to the ring of the calling thread
+ *
+ * @param ring Ring of the thread
+ * @param stream Stream the line is bound for
+ * @param text Line including its line break
+ * @param length Length of the line (at most MAX_MESSAGE)
+ */
+static void ring_append(console_ring_t *ring, waver_console_stream_t stream, const char *text, size_t length) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t end = head + RECORD_HEADER + length;
+    if (end - atomic_load_explicit(&ring->tail, memory_order_acquire) > RING_SIZE) {
+        // Full: wait for the writer to make room
+        pthread_mutex_lock(&mutex);
+        while (end - atomic_load_explicit(&ring->tail, memory_order_acquire) > RING_SIZE) {
+            pthread_cond_signal(&wake);
+            pthread_cond_wait(&drained, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    uint32_t header = (uint32_t)length | (stream == WAVER_CONSOLE_STDERR ? RECORD_STDERR : 0);
+    ring_write(ring, head, &header, RECORD_HEADER);
+    ring_write(ring, head + RECORD_HEADER, text, length);
+    atomic_store(&ring->head, end);
+
+    if (atomic_load(&writer_idle)) {
+        pthread_mutex_lock(&mutex);
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+/**
+ * @brief Queue one line for the writer thread
+ *
+ * @param stream Stream the line is bound for
+ * @param format Format string
+ * @param ap Additional arguments
+ */
+void waver_console_vprint(waver_console_stream_t stream, const char *format, va_list ap) {
+    char line[LINE_SIZE];
+    char *text = line;
+    va_list again;
+    va_copy(again, ap);
+    int result = vsnprintf(line, sizeof(line) - 1, format, ap);
+    if (result < 0) {
+        va_end(again);
+        return;
+    }
+    size_t length = (size_t)result;
+    if (length >= sizeof(line) - 1) {
+        if (length > MAX_MESSAGE - 1) {
+            length = MAX_MESSAGE - 1;
+        }
+        text = malloc(length + 2);
+        if (!text) {
+            va_end(again);
+            return;
+        }
+        vsnprintf(text, length + 1, format, again);
+    }
+    va_end(again);
+    text[length++] = '\n';
+
+    pthread_once(&start_once, start_writer);
+    console_ring_t *ring = atomic_load(&writer_running) ? thread_ring() : NULL;
+    if (ring) {
+        ring_append(ring, stream, text, length);
+    } else {
+        write_direct(stream, text, length);
+    }
+    if (text != line) {
+        free(text);
+    }
+}
+
+/**
+ * @brief Wait until every line queued so far has been written and flushed
+ */
+void waver_console_flush(void) {
+    if (atomic_load(&writer_running)) {
+        pthread_mutex_lock(&mutex);
+        unsigned long ticket = ++flush_requested;
+        pthread_cond_signal(&wake);
+        while (flush_done < ticket && !stopping) {
+            pthread_cond_wait(&drained, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    fflush(stdout);
+}
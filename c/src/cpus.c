@@ -0,0 +1,309 @@
+/**
+ * @file cpus.c
+ * @brief CPUs the process may actually use, and where its threads spend their time
+ */
+
+// sched_getaffinity(), CPU_COUNT() and pthread_setaffinity_np() are GNU extensions
+#define _GNU_SOURCE
+
+#include "cpus.h"
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CPUS_PATH_LENGTH 4096
+
+/**
+ * @brief Whether a comma-separated list holds a word
+ *
+ * @param list List such as "rw,cpu,cpuacct"
+ * @param word Word to look for
+ * @return true if the word is one of the items
+ */
+static bool list_has(const char *list, const char *word) {
+    size_t length = strlen(word);
+    for (const char *item = list; item; item = strchr(item, ',') ? strchr(item, ',') + 1 : NULL) {
+        if (strncmp(item, word, length) == 0 && (item[length] == ',' || item[length] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Open a file of a cgroup directory for reading
+ *
+ * @param dir Directory of the cgroup
+ * @param name Name of the file
+ * @return Open file, or NULL if it does not exist or the path is too long
+ */
+static FILE *open_in(const char *dir, const char *name) {
+    char path[CPUS_PATH_LENGTH];
+    int result = snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (result < 0 || (size_t)result >= sizeof(path)) {
+        return NULL;
+    }
+    return fopen(path, "r");
+}
+
+/**
+ * @brief CPUs allowed by the quota files of one cgroup directory
+ *
+ * @param dir Directory of the cgroup
+ * @param v2 Whether it is a cgroup v2 hierarchy
+ * @return Quota in CPUs, or 0 if there is none
+ */
+static double quota_of(const char *dir, bool v2) {
+    long long quota = -1;
+    long long period = 0;
+    if (v2) {
+        // "max 100000" or "<quota> <period>"
+        FILE *file = open_in(dir, "cpu.max");
+        if (!file) {
+            return 0.0;
+        }
+        char first[32];
+        if (fscanf(file, "%31s %lld", first, &period) == 2 && strcmp(first, "max") != 0) {
+            quota = strtoll(first, NULL, 10);
+        }
+        fclose(file);
+    } else {
+        FILE *file = open_in(dir, "cpu.cfs_quota_us");
+        if (!file) {
+            return 0.0;
+        }
+        if (fscanf(file, "%lld", &quota) != 1) {
+            quota = -1;
+        }
+        fclose(file);
+        file = open_in(dir, "cpu.cfs_period_us");
+        if (!file) {
+            return 0.0;
+        }
+        if (fscanf(file, "%lld", &period) != 1) {
+            period = 0;
+        }
+        fclose(file);
+    }
+    return quota > 0 && period > 0 ? (double)quota / (double)period : 0.0;
+}
+
+/**
+ * @brief Tightest quota of a cgroup and its ancestors within one mount
+ *
+ * A quota set on a parent limits its children too, so every level up to
+ * the mount point counts.
+ *
+ * @param mount Mount point of the hierarchy
+ * @param relative Path of the cgroup below the mount point
+ * @param v2 Whether it is a cgroup v2 hierarchy
+ * @return Quota in CPUs, or 0 if there is none
+ */
+static double quota_below(const char *mount, const char *relative, bool v2) {
+    char dir[CPUS_PATH_LENGTH];
+    int result = snprintf(dir, sizeof(dir), "%s%s", mount, strcmp(relative, "/") == 0 ? "" : relative);
+    if (result < 0 || (size_t)result >= sizeof(dir)) {
+        return 0.0;
+    }
+    size_t mount_length = strlen(mount);
+    double limit = 0.0;
+    for (;;) {
+        double quota = quota_of(dir, v2);
+        if (quota > 0.0 && (limit == 0.0 || quota < limit)) {
+            limit = quota;
+        }
+        char *slash = strrchr(dir, '/');
+        if (strlen(dir) <= mount_length || !slash || (size_t)(slash - dir) < mount_length) {
+            break;
+        }
+        *slash = '\0';
+    }
+    return limit;
+}
+
+/**
+ * @brief Path of the calling process's cgroup in the hierarchy that has the CPU controller
+ *
+ * @param v2 Whether to look for the v2 entry ("0::/path") or the v1 one with "cpu"
+ * @param path Receives the path
+ * @param size Size of path
+ * @return true if found
+ */
+static bool own_cgroup(bool v2, char *path, size_t size) {
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    if (!file) {
+        return false;
+    }
+    char line[CPUS_PATH_LENGTH];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *controllers = strchr(line, ':');
+        char *own = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (!own) {
+            continue;
+        }
+        *own++ = '\0';
+        controllers++;
+        bool match = v2 ? strcmp(line, "0") == 0 && *controllers == '\0' : list_has(controllers, "cpu");
+        if (match && strlen(own) < size) {
+            strcpy(path, own);
+            found = true;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+/**
+ * @brief CPU quota of the cgroups the process is in
+ *
+ * Every cgroup mount with the CPU controller is looked up in mountinfo, and
+ * the process's own cgroup in it (relative to the part of the hierarchy
+ * the mount shows) is checked up to the mount point.
+ *
+ * @return Quota in CPUs, or 0 if there is none
+ */
+static double cgroup_quota(void) {
+    FILE *file = fopen("/proc/self/mountinfo", "r");
+    if (!file) {
+        return 0.0;
+    }
+    char line[CPUS_PATH_LENGTH];
+    double limit = 0.0;
+    while (fgets(line, sizeof(line), file)) {
+        // id parent major:minor root mount-point options [optional...] - type source super-options
+        char root[CPUS_PATH_LENGTH];
+        char mount[CPUS_PATH_LENGTH];
+        char *separator = strstr(line, " - ");
+        if (!separator || sscanf(line, "%*s %*s %*s %4095s %4095s", root, mount) != 2) {
+            continue;
+        }
+        char type[32];
+        char options[CPUS_PATH_LENGTH];
+        if (sscanf(separator + 3, "%31s %*s %4095s", type, options) != 2) {
+            continue;
+        }
+        bool v2 = strcmp(type, "cgroup2") == 0;
+        if (!v2 && !(strcmp(type, "cgroup") == 0 && list_has(options, "cpu"))) {
+            continue;
+        }
+
+        char own[CPUS_PATH_LENGTH];
+        if (!own_cgroup(v2, own, sizeof(own))) {
+            continue;
+        }
+        // The mount may show only part of the hierarchy (as in a container)
+        size_t root_length = strcmp(root, "/") == 0 ? 0 : strlen(root);
+        const char *relative = "/";
+        if (strncmp(own, root, root_length) == 0 && (own[root_length] == '/' || own[root_length] == '\0')) {
+            relative = own[root_length] ? own + root_length : "/";
+        }
+        double quota = quota_below(mount, relative, v2);
+        if (quota > 0.0 && (limit == 0.0 || quota < limit)) {
+            limit = quota;
+        }
+    }
+    fclose(file);
+    return limit;
+}
+
+/**
+ * @brief Number of CPUs the process can use
+ *
+ * @return Smallest of the online processors, the CPUs in the affinity mask
+ *         and the cgroup CPU quota rounded up (2 if nothing is known)
+ */
+size_t waver_cpus_available(void) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t cpus = online > 0 ? (size_t)online : 2;
+
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        int allowed = CPU_COUNT(&set);
+        if (allowed > 0 && (size_t)allowed < cpus) {
+            cpus = (size_t)allowed;
+        }
+    }
+
+    double quota = cgroup_quota();
+    if (quota > 0.0) {
+        size_t limit = (size_t)ceil(quota);
+        if (limit < cpus) {
+            cpus = limit > 0 ? limit : 1;
+        }
+    }
+    return cpus;
+}
+
+/**
+ * @brief Pin the calling thread to one of the CPUs the process may run on
+ *
+ * @param index Index of the thread; threads are dealt over the allowed CPUs in turn
+ * @return true if successful, false if the affinity could not be read or set
+ */
+bool waver_cpus_pin(size_t index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return false;
+    }
+    size_t target = index % (size_t)CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        if (target-- == 0) {
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            return pthread_setaffinity_np(pthread_self(), sizeof(one), &one) == 0;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Open the schedstat file of the calling thread
+ *
+ * The file stays bound to the thread that opened it, so a thread that
+ * reads its times around every task opens it once and keeps it.
+ *
+ * @return File descriptor, or -1 if the kernel does not provide the file
+ */
+int waver_thread_schedstat_open(void) {
+    return open("/proc/thread-self/schedstat", O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * @brief Read the times of the calling thread
+ *
+ * @param times Receives the times
+ * @param schedstat Descriptor from waver_thread_schedstat_open() for the
+ *                  calling thread, or -1 to leave the waiting time at 0
+ */
+void waver_thread_times(waver_thread_times_t *times, int schedstat) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    times->wall_ns = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    times->cpu_ns = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+
+    // "<on cpu ns> <waiting on a runqueue ns> <timeslices>", generated
+    // afresh on every read from the start
+    times->waiting_ns = 0;
+    char line[96];
+    ssize_t length = schedstat >= 0 ? pread(schedstat, line, sizeof(line) - 1, 0) : -1;
+    if (length > 0) {
+        line[length] = '\0';
+        char *waiting = strchr(line, ' ');
+        if (waiting) {
+            times->waiting_ns = strtoull(waiting + 1, NULL, 10);
+        }
+    }
+}
@@ -0,0 +1,594 @@
+/**
+ * @file dedup.c
+ * @brief Drawing each distinct audio stream once per run (--dedup)
+ */
+
+// For struct stat's st_mtim and link()
+#define _POSIX_C_SOURCE 200809L
+
+#include "dedup.h"
+#include "stats.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Hash chains of the table (a power of two)
+#define DEDUP_BUCKETS 4096
+
+// Bytes copied at a time when an image cannot be linked
+#define COPY_CHUNK 65536
+
+// xxHash64 primes
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+/**
+ * @brief Whether the images of a stream can be reused
+ */
+typedef enum {
+    ENTRY_RENDERING, /**< Claimed by a file that is being drawn */
+    ENTRY_DONE,      /**< Every image was written */
+    ENTRY_FAILED     /**< The file failed; the next copy is drawn instead */
+} entry_state_t;
+
+/**
+ * @brief One image drawn for a stream, and what it looked like when written
+ */
+typedef struct {
+    char *path;      /**< Path of the image */
+    dev_t device;    /**< Device and inode, to notice an image written again */
+    ino_t inode;
+    off_t size;      /**< Size in bytes */
+    time_t mtime;    /**< Modification time */
+    long mtime_ns;
+} dedup_image_t;
+
+struct waver_dedup_entry_t {
+    uint64_t hash;              /**< Fingerprint of the payload */
+    uint64_t length;            /**< Bytes of payload hashed */
+    entry_state_t state;        /**< Whether the images can be reused */
+    dedup_image_t *images;      /**< Image per output of the file (DONE only) */
+    size_t image_count;         /**< Number of images */
+    double seconds;             /**< Time the file took to decode and draw */
+    waver_dedup_entry_t *next;  /**< Next entry in the hash chain */
+};
+
+struct waver_dedup_t {
+    waver_dedup_mode_t mode;    /**< Hard links or copies */
+    uint64_t params;            /**< Hash of the render parameters, the seed of every fingerprint */
+    waver_dedup_entry_t *buckets[DEDUP_BUCKETS]; /**< Hash chains of entries */
+    pthread_mutex_t mutex;      /**< Guards the table, the entries' states and the counts */
+    pthread_cond_t finished;    /**< Signalled when a claimed stream is done */
+    size_t files;               /**< Files fingerprinted */
+    size_t streams;             /**< Distinct streams among them */
+    size_t reused;              /**< Files that reused the images of another */
+    double saved_seconds;       /**< Decode and draw time of the files not drawn */
+    double fingerprint_seconds; /**< Time spent fingerprinting */
+};
+
+/**
+ * @brief Read a little-endian 32-bit value
+ *
+ * @param data Bytes
+ * @return Value
+ */
+static uint32_t read_le32(const uint8_t *data) {
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+/**
+ * @brief Read a little-endian 64-bit value
+ *
+ * @param data Bytes
+ * @return Value
+ */
+static uint64_t read_le64(const uint8_t *data) {
+    return (uint64_t)read_le32(data) | (uint64_t)read_le32(data + 4) << 32;
+}
+
+/**
+ * @brief Rotate left
+ *
+ * @param value Value
+ * @param bits Bits to rotate by (1 to 63)
+ * @return Rotated value
+ */
+static uint64_t rotate_left(uint64_t value, unsigned int bits) {
+    return value << bits | value >> (64 - bits);
+}
+
+/**
+ * @brief Mix 8 bytes into one lane of xxHash64
+ *
+ * @param lane Lane so far
+ * @param input Next 8 bytes
+ * @return Updated lane
+ */
+static uint64_t xxh64_round(uint64_t lane, uint64_t input) {
+    lane += input * PRIME64_2;
+    return rotate_left(lane, 31) * PRIME64_1;
+}
+
+/**
+ * @brief Fold a lane into the hash of xxHash64
+ *
+ * @param hash Hash so far
+ * @param lane Lane to fold in
+ * @return Updated hash
+ */
+static uint64_t xxh64_merge(uint64_t hash, uint64_t lane) {
+    hash ^= xxh64_round(0, lane);
+    return hash * PRIME64_1 + PRIME64_4;
+}
+
+/**
+ * @brief xxHash64 of a buffer
+ *
+ * About as fast as memory can be read, so fingerprinting costs little
+ * next to a decode.
+ *
+ * @param data Bytes to hash
+ * @param size Number of bytes
+ * @param seed Seed
+ * @return Hash
+ */
+static uint64_t xxh64(const uint8_t *data, size_t size, uint64_t seed) {
+    const uint8_t *end = data + size;
+    uint64_t hash;
+    if (size >= 32) {
+        uint64_t lanes[4] = {seed + PRIME64_1 + PRIME64_2, seed + PRIME64_2, seed, seed - PRIME64_1};
+        for (; end - data >= 32; data += 32) {
+            for (int i = 0; i < 4; i++) {
+                lanes[i] = xxh64_round(lanes[i], read_le64(data + 8 * i));
+            }
+        }
+        hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) +
+               rotate_left(lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = xxh64_merge(hash, lanes[i]);
+        }
+    } else {
+        hash = seed + PRIME64_5;
+    }
+    hash += (uint64_t)size;
+
+    for (; end - data >= 8; data += 8) {
+        hash ^= xxh64_round(0, read_le64(data));
+        hash = rotate_left(hash, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (end - data >= 4) {
+        hash ^= (uint64_t)read_le32(data) * PRIME64_1;
+        hash = rotate_left(hash, 23) * PRIME64_2 + PRIME64_3;
+        data += 4;
+    }
+    for (; data < end; data++) {
+        hash ^= *data * PRIME64_5;
+        hash = rotate_left(hash, 11) * PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+ * @brief Find the bytes of an MP3 between its leading and trailing tags
+ *
+ * @param data Contents of the file
+ * @param size Size of the file
+ * @param start Receives the offset of the first byte after the ID3v2 tags
+ * @param stop Receives the offset just past the last byte before the trailing tags
+ */
+static void mp3_payload(const uint8_t *data, size_t size, size_t *start, size_t *stop) {
+    // ID3v2 tags (sometimes more than one in a row); the size is syncsafe
+    size_t begin = 0;
+    while (size - begin >= 10 && memcmp(data + begin, "ID3", 3) == 0 && !(data[begin + 5] & 15) &&
+           !((data[begin + 6] | data[begin + 7] | data[begin + 8] | data[begin + 9]) & 0x80)) {
+        const uint8_t *header = data + begin;
+        size_t tag = ((size_t)header[6] << 21 | (size_t)header[7] << 14 | (size_t)header[8] << 7 | header[9]) + 10;
+        if (header[5] & 16) {
+            tag += 10; // footer
+        }
+        begin = tag < size - begin ? begin + tag : size;
+    }
+
+    // Trailing tags in any order: ID3v1 (with its extended block), APEv2, Lyrics3v2
+    size_t end = size;
+    for (bool stripped = true; stripped;) {
+        size_t length = end - begin;
+        stripped = false;
+        if (length >= 128 && memcmp(data + end - 128, "TAG", 3) == 0) {
+            end -= 128;
+            if (end - begin >= 227 && memcmp(data + end - 227, "TAG+", 4) == 0) {
+                end -= 227;
+            }
+            stripped = true;
+        } else if (length >= 32 && memcmp(data + end - 32, "APETAGEX", 8) == 0) {
+            // The size counts the items and the footer; a header may come first
+            uint32_t tag = read_le32(data + end - 32 + 12);
+            uint32_t flags = read_le32(data + end - 32 + 20);
+            uint64_t total = (uint64_t)tag + (flags & 0x80000000u ? 32 : 0);
+            if (tag >= 32 && total <= length) {
+                end -= (size_t)total;
+                stripped = true;
+            }
+        } else if (length >= 15 && memcmp(data + end - 9, "LYRICS200", 9) == 0) {
+            // Six decimal digits give the size of the tag before them
+            uint64_t tag = 0;
+            bool digits = true;
+            for (size_t i = end - 15; i < end - 9; i++) {
+                digits = digits && data[i] >= '0' && data[i] <= '9';
+                tag = tag * 10 + (uint64_t)(data[i] - '0');
+            }
+            if (digits && tag + 15 <= length) {
+                end -= (size_t)tag + 15;
+                stripped = true;
+            }
+        }
+    }
+    *start = begin;
+    *stop = end;
+}
+
+/**
+ * @brief Hash of the format and data chunks of a RIFF, RF64 or BW64 WAVE file
+ *
+ * @param data Contents of the file
+ * @param size Size of the file
+ * @param seed Seed of the hash
+ * @param length Receives the number of bytes hashed
+ * @param hash Receives the hash
+ * @return true if the data chunk was found, false otherwise
+ */
+static bool wav_fingerprint(const uint8_t *data, size_t size, uint64_t seed, uint64_t *length, uint64_t *hash) {
+    if (size < 12 || memcmp(data + 8, "WAVE", 4) != 0 ||
+        !(memcmp(data, "RIFF", 4) == 0 || memcmp(data, "RF64", 4) == 0 || memcmp(data, "BW64", 4) == 0)) {
+        return false;
+    }
+    *hash = seed;
+    *length = 0;
+    size_t offset = 12;
+    while (size - offset >= 8) {
+        const uint8_t *chunk = data + offset;
+        uint64_t chunk_size = read_le32(chunk + 4);
+        size_t body = offset + 8;
+        bool is_data = memcmp(chunk, "data", 4) == 0;
+        // A 64-bit data size lives in the ds64 chunk; the data runs to the end
+        if (chunk_size > size - body || (is_data && chunk_size == 0xFFFFFFFFu)) {
+            chunk_size = size - body;
+        }
+        if (is_data || memcmp(chunk, "fmt ", 4) == 0) {
+            *hash = xxh64(data + body, (size_t)chunk_size, *hash);
+            *length += chunk_size;
+        }
+        if (is_data) {
+            return true;
+        }
+        offset = body + (size_t)chunk_size + (chunk_size & 1);
+        if (offset > size) {
+            break;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Hash of the audio payload of a file, leaving out its tags
+ *
+ * @param data Contents of the file
+ * @param size Size of the file
+ * @param seed Seed of the hash (such as a hash of the render parameters)
+ * @param length Receives the number of bytes hashed
+ * @return Hash of the payload
+ */
+uint64_t waver_dedup_fingerprint(const uint8_t *data, size_t size, uint64_t seed, uint64_t *length) {
+    uint64_t hash;
+    if (wav_fingerprint(data, size, seed, length, &hash)) {
+        return hash;
+    }
+    size_t start;
+    size_t stop;
+    mp3_payload(data, size, &start, &stop);
+    *length = stop - start;
+    return xxh64(data + start, stop - start, seed);
+}
+
+/**
+ * @brief Create an empty table of audio streams
+ *
+ * @param mode Whether images are reused as hard links or as copies
+ * @param params Hash of the render parameters of the run
+ * @return New table or NULL on allocation failure
+ */
+waver_dedup_t *waver_dedup_new(waver_dedup_mode_t mode, uint64_t params) {
+    waver_dedup_t *dedup = calloc(1, sizeof(waver_dedup_t));
+    if (!dedup) {
+        return NULL;
+    }
+    dedup->mode = mode;
+    dedup->params = params;
+    pthread_mutex_init(&dedup->mutex, NULL);
+    pthread_cond_init(&dedup->finished, NULL);
+    return dedup;
+}
+
+/**
+ * @brief Free the images recorded for a stream
+ *
+ * @param images Images (may be NULL)
+ * @param count Number of images
+ */
+static void images_free(dedup_image_t *images, size_t count) {
+    for (size_t i = 0; images && i < count; i++) {
+        free(images[i].path);
+    }
+    free(images);
+}
+
+/**
+ * @brief Free a table and everything it recorded
+ *
+ * @param dedup Table (may be NULL)
+ */
+void waver_dedup_free(waver_dedup_t *dedup) {
+    if (!dedup) {
+        return;
+    }
+    for (size_t i = 0; i < DEDUP_BUCKETS; i++) {
+        waver_dedup_entry_t *entry = dedup->buckets[i];
+        while (entry) {
+            waver_dedup_entry_t *next = entry->next;
+            images_free(entry->images, entry->image_count);
+            free(entry);
+            entry = next;
+        }
+    }
+    pthread_cond_destroy(&dedup->finished);
+    pthread_mutex_destroy(&dedup->mutex);
+    free(dedup);
+}
+
+/**
+ * @brief Whether a file is still the image recorded for a stream
+ *
+ * @param image Recorded image
+ * @param st Current status of its path
+ * @return true if it is the same inode, unchanged
+ */
+static bool image_matches(const dedup_image_t *image, const struct stat *st) {
+    return st->st_dev == image->device && st->st_ino == image->inode && st->st_size == image->size &&
+           st->st_mtim.tv_sec == image->mtime && st->st_mtim.tv_nsec == image->mtime_ns;
+}
+
+/**
+ * @brief Whether every image of a stream is still as it was written
+ *
+ * Under --watch an image may have been written again for a file whose
+ * audio has changed since.
+ *
+ * @param entry Entry of the stream
+ * @return true if all of them are unchanged
+ */
+static bool images_current(const waver_dedup_entry_t *entry) {
+    for (size_t i = 0; i < entry->image_count; i++) {
+        struct stat st;
+        if (stat(entry->images[i].path, &st) != 0 || !image_matches(&entry->images[i], &st)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Look up the audio stream of a file, claiming it if it is new
+ *
+ * @param dedup Table
+ * @param data Contents of the file
+ * @param size Size of the file
+ * @param render Receives true if the caller must draw the file and then
+ *               call waver_dedup_finish(), false if its images can be reused
+ * @return Entry of the stream, or NULL on allocation failure (draw the file without the table)
+ */
+waver_dedup_entry_t *waver_dedup_claim(waver_dedup_t *dedup, const uint8_t *data, size_t size, bool *render) {
+    double start = waver_stats_now();
+    uint64_t length;
+    uint64_t hash = waver_dedup_fingerprint(data, size, dedup->params, &length);
+    double seconds = waver_stats_now() - start;
+
+    pthread_mutex_lock(&dedup->mutex);
+    dedup->files++;
+    dedup->fingerprint_seconds += seconds;
+    waver_dedup_entry_t **bucket = &dedup->buckets[hash & (DEDUP_BUCKETS - 1)];
+    waver_dedup_entry_t *entry = *bucket;
+    while (entry && !(entry->hash == hash && entry->length == length)) {
+        entry = entry->next;
+    }
+    if (!entry) {
+        entry = calloc(1, sizeof(waver_dedup_entry_t));
+        if (entry) {
+            entry->hash = hash;
+            entry->length = length;
+            entry->state = ENTRY_RENDERING;
+            entry->next = *bucket;
+            *bucket = entry;
+            dedup->streams++;
+        }
+        pthread_mutex_unlock(&dedup->mutex);
+        *render = true;
+        return entry;
+    }
+
+    // Another worker is drawing the same audio: wait for its images
+    while (entry->state == ENTRY_RENDERING) {
+        pthread_cond_wait(&dedup->finished, &dedup->mutex);
+    }
+    if (entry->state == ENTRY_DONE && images_current(entry)) {
+        dedup->reused++;
+        dedup->saved_seconds += entry->seconds;
+        *render = false;
+    } else {
+        entry->state = ENTRY_RENDERING;
+        *render = true;
+    }
+    pthread_mutex_unlock(&dedup->mutex);
+    return entry;
+}
+
+/**
+ * @brief Record the images of a stream the caller has claimed and drawn
+ *
+ * @param dedup Table
+ * @param entry Entry returned by waver_dedup_claim() with render set
+ * @param paths Paths of the images, one per output of the file
+ * @param count Number of paths
+ * @param success Whether every image was written (if not, the next copy is drawn instead)
+ * @param seconds Time the file took to decode and draw
+ */
+void waver_dedup_finish(waver_dedup_t *dedup, waver_dedup_entry_t *entry, const char *const *paths, size_t count,
+                        bool success, double seconds) {
+    // The entry is only the claimer's until it is marked done
+    dedup_image_t *images = success ? calloc(count, sizeof(dedup_image_t)) : NULL;
+    success = images != NULL;
+    for (size_t i = 0; success && i < count; i++) {
+        struct stat st;
+        images[i].path = strdup(paths[i]);
+        if (!images[i].path || stat(paths[i], &st) != 0) {
+            success = false;
+            break;
+        }
+        images[i].device = st.st_dev;
+        images[i].inode = st.st_ino;
+        images[i].size = st.st_size;
+        images[i].mtime = st.st_mtim.tv_sec;
+        images[i].mtime_ns = st.st_mtim.tv_nsec;
+    }
+    if (!success) {
+        images_free(images, count);
+        images = NULL;
+    }
+
+    pthread_mutex_lock(&dedup->mutex);
+    images_free(entry->images, entry->image_count);
+    entry->images = images;
+    entry->image_count = images ? count : 0;
+    entry->seconds = seconds;
+    entry->state = images ? ENTRY_DONE : ENTRY_FAILED;
+    pthread_cond_broadcast(&dedup->finished);
+    pthread_mutex_unlock(&dedup->mutex);
+}
+
+/**
+ * @brief Copy a file
+ *
+ * @param from Path of the file to copy
+ * @param to Path of the copy
+ * @return true if successful, false otherwise
+ */
+static bool copy_file(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    if (!in) {
+        return false;
+    }
+    FILE *out = fopen(to, "wb");
+    if (!out) {
+        fclose(in);
+        return false;
+    }
+    char buffer[COPY_CHUNK];
+    bool success = true;
+    size_t read;
+    while (success && (read = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        success = fwrite(buffer, 1, read, out) == read;
+    }
+    success = success && !ferror(in);
+    fclose(in);
+    if (fclose(out) != 0) {
+        success = false;
+    }
+    return success;
+}
+
+/**
+ * @brief Give an output of a file the image already drawn for the same output of its stream
+ *
+ * The image is copied out under the lock, since under --watch another
+ * file may claim the entry again and replace its images meanwhile.
+ *
+ * @param dedup Table
+ * @param entry Entry returned by waver_dedup_claim() without render set
+ * @param index Index of the output
+ * @param path Path of the output (replaced if it exists)
+ * @param source Receives the path of the image reused
+ * @param source_size Size of the source buffer
+ * @return true if successful, false otherwise
+ */
+bool waver_dedup_reuse(waver_dedup_t *dedup, const waver_dedup_entry_t *entry, size_t index, const char *path,
+                       char *source, size_t source_size) {
+    pthread_mutex_lock(&dedup->mutex);
+    dedup_image_t image = {0};
+    if (index < entry->image_count) {
+        image = entry->images[index];
+        image.path = strdup(image.path);
+    }
+    pthread_mutex_unlock(&dedup->mutex);
+    if (!image.path) {
+        return false;
+    }
+    snprintf(source, source_size, "%s", image.path);
+
+    // The same file reached through another path (a symlinked directory) is already done
+    struct stat st;
+    bool success = false;
+    if (stat(path, &st) == 0) {
+        success = image_matches(&image, &st);
+        if (!success) {
+            unlink(path);
+        }
+    }
+    if (!success && dedup->mode == WAVER_DEDUP_LINK) {
+        success = link(image.path, path) == 0;
+    }
+    // Other filesystems, and those without hard links, get a copy
+    if (!success) {
+        success = copy_file(image.path, path);
+    }
+    free(image.path);
+    return success;
+}
+
+/**
+ * @brief Remove an output about to be written again if it is linked elsewhere
+ *
+ * @param path Path of the output
+ */
+void waver_dedup_unshare(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1) {
+        unlink(path);
+    }
+}
+
+/**
+ * @brief Print how many files were drawn from another copy and the time it saved
+ *
+ * @param dedup Table (may be NULL)
+ * @param args Command-line arguments
+ */
+void waver_dedup_report(const waver_dedup_t *dedup, const waver_args_t *args) {
+    if (!dedup) {
+        return;
+    }
+    waver_print_stdout(args, "Dedup: %zu of %zu files had the same audio as another, saving %.3f s of "
+                       "decoding and drawing (fingerprints took %.3f s)",
+                       dedup->reused, dedup->files, dedup->saved_seconds, dedup->fingerprint_seconds);
+    waver_print_verbose(args, "Dedup: %zu distinct audio streams", dedup->streams);
+}
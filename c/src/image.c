@@ -9,6 +9,10 @@
 #include <math.h>
 #include <stdlib.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /**
  * @brief Convert a color index to the bit location based on the x coordinate
  *
@@ -21,13 +25,13 @@ static inline uint8_t draw_bits(uint8_t color, unsigned int x) {
 }
 
 /**
- * @brief Create a new waveform image
+ * @brief Allocate an image without any pixel storage
  *
  * @param width Width of the image in pixels
  * @param height Height of the image in pixels
  * @return New image or NULL on error
  */
-waver_image_t *waver_image_new(unsigned int width, unsigned int height) {
+static waver_image_t *image_alloc(unsigned int width, unsigned int height) {
     if (width < 16 || height < 6 || height % 2 != 0) {
         return NULL;
     }
@@ -44,9 +48,24 @@ waver_image_t *waver_image_new(unsigned int width, unsigned int height) {
     image->height = height;
     image->center = height / 2;
     image->line_width = line_width;
+    return image;
+}
+
+/**
+ * @brief Create a new waveform image
+ *
+ * @param width Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @return New image or NULL on error
+ */
+waver_image_t *waver_image_new(unsigned int width, unsigned int height) {
+    waver_image_t *image = image_alloc(width, height);
+    if (!image) {
+        return NULL;
+    }
 
     // Allocate memory for pixels
-    image->pixels = calloc(line_width * height, sizeof(uint8_t));
+    image->pixels = calloc((size_t)image->line_width * height, sizeof(uint8_t));
     if (!image->pixels) {
         free(image);
         return NULL;
@@ -55,6 +74,70 @@ waver_image_t *waver_image_new(unsigned int width, unsigned int height) {
     return image;
 }
 
+/**
+ * @brief Create a new waveform image that stores per-column spans
+ *
+ * @param width Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @return New image or NULL on error
+ */
+waver_image_t *waver_image_new_spans(unsigned int width, unsigned int height) {
+    waver_image_t *image = image_alloc(width, height);
+    if (!image) {
+        return NULL;
+    }
+
+    // One allocation holds all three arrays; every span starts out empty
+    image->span_top = calloc(3 * (size_t)width, sizeof(uint32_t));
+    if (!image->span_top) {
+        free(image);
+        return NULL;
+    }
+    image->span_capacity = width;
+    image->span_split = image->span_top + width;
+    image->span_bottom = image->span_split + width;
+    image->span_first_row = height;
+    image->span_end_row = 0;
+
+    return image;
+}
+
+/**
+ * @brief Clear a span image for reuse, possibly at a different size
+ *
+ * The span arrays are only reallocated when the new width does not fit.
+ *
+ * @param image Span image made by waver_image_new_spans()
+ * @param width Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @return true if successful, false on invalid dimensions or allocation failure
+ */
+bool waver_image_reset_spans(waver_image_t *image, unsigned int width, unsigned int height) {
+    if (!image || image->pixels || width < 16 || height < 6 || height % 2 != 0) {
+        return false;
+    }
+
+    if (width > image->span_capacity) {
+        uint32_t *spans = realloc(image->span_top, 3 * (size_t)width * sizeof(uint32_t));
+        if (!spans) {
+            return false;
+        }
+        image->span_top = spans;
+        image->span_capacity = width;
+    }
+    memset(image->span_top, 0, 3 * (size_t)width * sizeof(uint32_t));
+
+    image->width = width;
+    image->height = height;
+    image->center = height / 2;
+    image->line_width = (width + 3) >> 2;
+    image->span_split = image->span_top + width;
+    image->span_bottom = image->span_split + width;
+    image->span_first_row = height;
+    image->span_end_row = 0;
+    return true;
+}
+
 /**
  * @brief Free memory allocated for an image
  *
@@ -66,9 +149,36 @@ void waver_image_free(waver_image_t *image) {
     }
 
     free(image->pixels);
+    free(image->span_top);
     free(image);
 }
 
+/**
+ * @brief Store the extents of one column of a span image
+ *
+ * @param image Span image
+ * @param x Column
+ * @param top First row drawn
+ * @param split First row in the right color
+ * @param bottom One past the last row drawn
+ */
+static void set_span(waver_image_t *image, unsigned int x, unsigned int top, unsigned int split,
+                     unsigned int bottom) {
+    image->span_top[x] = top;
+    image->span_split[x] = split;
+    image->span_bottom[x] = bottom;
+
+    // Keep a (possibly loose) bound on the rows that have anything in them
+    if (top < bottom) {
+        if (top < image->span_first_row) {
+            image->span_first_row = top;
+        }
+        if (bottom > image->span_end_row) {
+            image->span_end_row = bottom;
+        }
+    }
+}
+
 /**
  * @brief Draw a single point (left and right channels) of the waveform
  *
@@ -85,10 +195,20 @@ void waver_image_draw_point(waver_image_t *image, unsigned int x, const unsigned
     // The byte offset where the 2-bit pixel will be
     unsigned int offset = x >> 2;
 
-    // Draw left channel (above center, going up)
-    uint8_t draw_left = draw_bits(WAVER_CHANNEL_LEFT, x);
     // Scale the 16-bit value (0-32767) to image height
     unsigned int left_height = (left * image->center + 16384) >> 15;
+    unsigned int right_height = (right * image->center + 16384) >> 15;
+
+    if (!image->pixels) {
+        set_span(image, x,
+                 (left_height > image->center) ? 0 : image->center - left_height,
+                 image->center,
+                 (image->center + right_height < image->height) ? image->center + right_height : image->height);
+        return;
+    }
+
+    // Draw left channel (above center, going up)
+    uint8_t draw_left = draw_bits(WAVER_CHANNEL_LEFT, x);
 
     for (unsigned int y = (left_height > image->center) ? 0 : image->center - left_height;
          y < image->center;
@@ -99,8 +219,6 @@ void waver_image_draw_point(waver_image_t *image, unsigned int x, const unsigned
 
     // Draw right channel (below center, going down)
     uint8_t draw_right = draw_bits(WAVER_CHANNEL_RIGHT, x);
-    // Scale the 16-bit value (0-32767) to image height
-    unsigned int right_height = (right * image->center + 16384) >> 15;
     unsigned int max_y = (image->center + right_height < image->height) ?
                           image->center + right_height :
                           image->height;
@@ -123,12 +241,6 @@ void waver_image_draw_point_mono(waver_image_t *image, unsigned int x, const uns
         return;
     }
 
-    // The byte offset where the 2-bit pixel will be
-    unsigned int offset = x >> 2;
-
-    // Bit position for the pixel
-    uint8_t draw = draw_bits(WAVER_CHANNEL_LEFT, x);
-
     // Calculate wave height - scale 16-bit value (0-32767) to image height
     unsigned int wave_height = (mono * image->center + 16384) >> 15;
     unsigned int y_start = (wave_height > image->center) ? 0 : image->center - wave_height;
@@ -136,8 +248,164 @@ void waver_image_draw_point_mono(waver_image_t *image, unsigned int x, const uns
                           image->center + wave_height :
                           image->height;
 
+    if (!image->pixels) {
+        set_span(image, x, y_start, y_end, y_end);
+        return;
+    }
+
+    // The byte offset where the 2-bit pixel will be
+    unsigned int offset = x >> 2;
+
+    // Bit position for the pixel
+    uint8_t draw = draw_bits(WAVER_CHANNEL_LEFT, x);
+
     for (unsigned int y = y_start; y < y_end; y++) {
         unsigned int idx = offset + y * image->line_width;
         image->pixels[idx] |= draw;
     }
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Draw a range of columns of the waveform from per-column peaks
+ *
+ * Columns are packed four to a byte, so callers drawing disjoint ranges
+ * from several threads must start each range on a multiple of 4.
+ *
+ * @param image Image to draw to
+ * @param left Max amplitude per column for left (or mono)
+ * @param right Max amplitude per column for right (ignored for mono)
+ * @param channel_count Number of channels (1 for mono)
+ * @param first_column First column to draw
+ * @param end_column One past the last column to draw
+ */
+void waver_image_draw_peaks(waver_image_t *image, const uint16_t *left, const uint16_t *right,
+                            unsigned int channel_count, unsigned int first_column, unsigned int end_column) {
+    if (!image || !left || !right) {
+        return;
+    }
+
+    if (end_column > image->width) {
+        end_column = image->width;
+    }
+    for (unsigned int x = first_column; x < end_column; x++) {
+        if (channel_count > 1) {
+            waver_image_draw_point(image, x, left[x], right[x]);
+        } else {
+            waver_image_draw_point_mono(image, x, left[x]);
+        }
+    }
+}
+/**
+ * @brief Color index of one pixel of a span image
+ *
+ * The unsigned subtractions wrap for rows above a span, so each range
+ * test is a single comparison and the two results can simply be combined.
+ *
+ * @param image Span image
+ * @param x Column
+ * @param y Row
+ * @return Color index (0 background, 1 left, 2 right)
+ */
+static inline uint8_t span_color(const waver_image_t *image, unsigned int x, uint32_t y) {
+    uint32_t top = image->span_top[x];
+    uint32_t split = image->span_split[x];
+    uint32_t bottom = image->span_bottom[x];
+    return (uint8_t)((y - top < split - top) | ((y - split < bottom - split) << 1));
+}
+
+// Columns colored per pass of the portable waver_image_row() loop (a multiple of 4)
+#define ROW_BLOCK 256
+
+#if defined(__SSE2__)
+/**
+ * @brief Pack 16 columns of a span image row into 4 bytes with SSE2
+ *
+ * Unsigned "less than" is a signed comparison after flipping the top bit.
+ * Each lane gets its color bits already shifted into place, and the four
+ * lanes of each output byte are then folded together.
+ *
+ * @param image Span image
+ * @param x First column (16 columns must exist)
+ * @param y Row
+ * @return Four packed bytes, first column group in the lowest byte
+ */
+static inline uint32_t span_pack16(const waver_image_t *image, unsigned int x, uint32_t y) {
+    const __m128i bias = _mm_set1_epi32((int)0x80000000u);
+    const __m128i left_bits = _mm_setr_epi32(1, 4, 16, 64);
+    const __m128i right_bits = _mm_setr_epi32(2, 8, 32, 128);
+    const __m128i row = _mm_set1_epi32((int)y);
+    __m128i groups[4];
+
+    for (int k = 0; k < 4; k++) {
+        __m128i top = _mm_loadu_si128((const __m128i *)(image->span_top + x + 4 * k));
+        __m128i split = _mm_loadu_si128((const __m128i *)(image->span_split + x + 4 * k));
+        __m128i bottom = _mm_loadu_si128((const __m128i *)(image->span_bottom + x + 4 * k));
+        __m128i in_left = _mm_cmpgt_epi32(_mm_xor_si128(_mm_sub_epi32(split, top), bias),
+                                          _mm_xor_si128(_mm_sub_epi32(row, top), bias));
+        __m128i in_right = _mm_cmpgt_epi32(_mm_xor_si128(_mm_sub_epi32(bottom, split), bias),
+                                           _mm_xor_si128(_mm_sub_epi32(row, split), bias));
+        groups[k] = _mm_or_si128(_mm_and_si128(in_left, left_bits), _mm_and_si128(in_right, right_bits));
+    }
+
+    // Bytes 4k..4k+3 now hold the pixels of output byte k; fold them
+    __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(groups[0], groups[1]),
+                                     _mm_packs_epi32(groups[2], groups[3]));
+    bytes = _mm_or_si128(bytes, _mm_srli_epi32(bytes, 8));
+    bytes = _mm_or_si128(bytes, _mm_srli_epi32(bytes, 16));
+    bytes = _mm_and_si128(bytes, _mm_set1_epi32(0xff));
+    bytes = _mm_packus_epi16(_mm_packs_epi32(bytes, bytes), bytes);
+    return (uint32_t)_mm_cvtsi128_si32(bytes);
+}
+#endif
+
+/**
+ * @brief Get one packed 2-bit scanline of an image
+ *
+ * For span images the row is built from the column extents with
+ * branch-free comparisons, writing four columns (one whole byte) at a
+ * time: 16 columns per step with SSE2, otherwise a block of columns is
+ * colored first and then packed, which compilers vectorize.  The bit
+ * layout matches draw_bits().
+ *
+ * @param image Image to read
+ * @param y Row to get
+ * @param row Output buffer of line_width bytes
+ */
+void waver_image_row(const waver_image_t *image, unsigned int y, uint8_t *row) {
+    if (image->pixels) {
+        memcpy(row, image->pixels + (size_t)y * image->line_width, image->line_width);
+        return;
+    }
+    if (y < image->span_first_row || y >= image->span_end_row) {
+        memset(row, 0, image->line_width);
+        return;
+    }
+
+    unsigned int x = 0;
+#if defined(__SSE2__)
+    for (; x + 16 <= image->width; x += 16) {
+        uint32_t packed = span_pack16(image, x, y);
+        memcpy(row + (x >> 2), &packed, 4);
+    }
+#endif
+
+    uint8_t colors[ROW_BLOCK];
+    for (; x < image->width; x += ROW_BLOCK) {
+        unsigned int count = image->width - x < ROW_BLOCK ? image->width - x : ROW_BLOCK;
+        for (unsigned int i = 0; i < count; i++) {
+            colors[i] = span_color(image, x + i, y);
+        }
+
+        // Pad the last byte of the row with background pixels
+        unsigned int padded = (count + 3) & ~3u;
+        for (unsigned int i = count; i < padded; i++) {
+            colors[i] = 0;
+        }
+
+        uint8_t *out = row + (x >> 2);
+        for (unsigned int i = 0; i < padded / 4; i++) {
+            out[i] = (uint8_t)(colors[4 * i] | (colors[4 * i + 1] << 2) |
+                               (colors[4 * i + 2] << 4) | (colors[4 * i + 3] << 6));
+        }
+    }
+}
@@ -0,0 +1,121 @@
+/**
+ * @file input.c
+ * @brief Memory-mapped audio input with read-ahead hints
+ */
+
+// madvise() and MADV_DONTNEED are not part of POSIX; posix_madvise()'s
+// POSIX_MADV_DONTNEED is a no-op on Linux
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include "input.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Map a file for sequential reading
+ *
+ * @param path Path of the file
+ * @param input Receives the mapping
+ * @return true if successful, false if the file cannot be opened or mapped
+ */
+bool waver_input_open(const char *path, waver_input_t *input) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    // Empty files, pipes and the like are left to the stdio path
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    // The hints only affect performance, so their results are ignored
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    madvise(data, size, MADV_SEQUENTIAL);
+    madvise(data, size, MADV_WILLNEED);
+
+    input->data = data;
+    input->size = size;
+    input->fd = fd;
+    return true;
+}
+
+/**
+ * @brief Drop a range of the file that will not be read again
+ *
+ * @param input Mapped file
+ * @param offset First byte of the range
+ * @param end One past the last byte of the range
+ */
+void waver_input_release(const waver_input_t *input, size_t offset, size_t end) {
+    if (input->fd < 0) {
+        return;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t first = (offset + page - 1) / page * page;
+    size_t last = (end < input->size ? end : input->size) / page * page;
+    if (first >= last) {
+        return;
+    }
+
+    madvise((void *)(input->data + first), last - first, MADV_DONTNEED);
+    posix_fadvise(input->fd, (off_t)first, (off_t)(last - first), POSIX_FADV_DONTNEED);
+}
+
+/**
+ * @brief Read the start of a file into the page cache ahead of its decoder
+ *
+ * @param path Path of the file
+ * @param buffer Scratch space for the reads
+ * @param buffer_size Size of buffer
+ * @param limit Read at most this many bytes; the kernel reads the rest ahead while decoding
+ * @return true if the file could be read, false otherwise
+ */
+bool waver_input_prefetch(const char *path, void *buffer, size_t buffer_size, uint64_t limit) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t done = 0;
+    ssize_t got = 0;
+    while (done < limit) {
+        size_t want = limit - done < buffer_size ? (size_t)(limit - done) : buffer_size;
+        got = read(fd, buffer, want);
+        if (got <= 0) {
+            break;
+        }
+        done += (uint64_t)got;
+    }
+    close(fd);
+    return got >= 0;
+}
+
+/**
+ * @brief Unmap a file and drop it from the page cache
+ *
+ * @param input Mapped file
+ */
+void waver_input_close(waver_input_t *input) {
+    munmap((void *)input->data, input->size);
+    posix_fadvise(input->fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(input->fd);
+    input->data = NULL;
+    input->size = 0;
+    input->fd = -1;
+}
@@ -0,0 +1,928 @@
+/**
+ * @file manifest.c
+ * @brief Record of what an incremental run has rendered (--incremental)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "manifest.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Marks an unused hash slot and a directory that is not in the loaded manifest
+#define NO_INDEX UINT32_MAX
+
+// 64-bit FNV-1a
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/**
+ * @brief Record of one directory in this run
+ */
+struct waver_manifest_dir_t {
+    waver_manifest_t *manifest; /**< Manifest the directory belongs to */
+    char *path;                 /**< Path relative to the root */
+    int64_t mtime_ns;           /**< Modification time before it was read */
+    uint32_t old;               /**< Index in the loaded manifest, or NO_INDEX */
+    size_t index;               /**< Index in the directories of this run */
+    bool failed;                /**< Some file did not get current outputs */
+};
+
+/**
+ * @brief One file recorded in this run
+ */
+typedef struct {
+    waver_manifest_stamp_t stamp; /**< Identity when its outputs were made */
+    size_t dir;                   /**< Index of its directory in this run */
+    size_t name;                  /**< Offset of its name in the names of this run */
+} run_file_t;
+
+/**
+ * @brief Loaded manifest of a root and the records of this run
+ */
+struct waver_manifest_t {
+    char *root;                   /**< Root directory as given */
+    char *path;                   /**< Path of the manifest file */
+    uint64_t params;              /**< Hash of the render parameters of this run */
+
+    // The loaded manifest, mapped and only read during the run
+    const uint8_t *data;          /**< Mapping (NULL if there was none) */
+    size_t size;                  /**< Size of the mapping */
+    const waver_manifest_directory_t *directories; /**< Loaded directories */
+    const waver_manifest_file_t *files;            /**< Loaded files */
+    const char *names;            /**< Loaded names */
+    size_t directory_count;       /**< Loaded directories */
+    bool params_match;            /**< The loaded manifest has the parameters of this run */
+    uint32_t *directory_slots;    /**< Hash of loaded directories by path */
+    uint32_t *file_slots;         /**< Hash of loaded files by directory and name */
+    size_t directory_mask;        /**< Slots in directory_slots minus one */
+    size_t file_mask;             /**< Slots in file_slots minus one */
+    uint32_t *child_start;        /**< Start of each loaded directory's children (count + 1 entries) */
+    uint32_t *children;           /**< Loaded subdirectories grouped by parent */
+
+    // This run
+    pthread_mutex_t mutex;        /**< Guards everything below */
+    waver_manifest_dir_t **dirs;  /**< Directories in the order scanned */
+    size_t dir_count;             /**< Entries in dirs */
+    size_t dir_capacity;          /**< Allocated entries in dirs */
+    run_file_t *run_files;        /**< Files with current outputs */
+    size_t file_count;            /**< Entries in run_files */
+    size_t file_capacity;         /**< Allocated entries in run_files */
+    char *run_names;              /**< Names of the directories and files of this run */
+    size_t names_used;            /**< Bytes used in run_names */
+    size_t names_capacity;        /**< Bytes allocated in run_names */
+    size_t unchanged;             /**< Files skipped as unchanged */
+    size_t changed;               /**< Files with stale outputs */
+    size_t added;                 /**< Files not in the loaded manifest */
+    size_t carried_dirs;          /**< Directories carried over without reading them */
+    double check_seconds;         /**< Time spent deciding what to skip */
+};
+
+/**
+ * @brief Add bytes to an FNV-1a hash
+ *
+ * @param hash Hash so far
+ * @param data Bytes to add
+ * @param size Number of bytes
+ * @return Updated hash
+ */
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * @brief Add a string, including its terminator, to an FNV-1a hash
+ *
+ * @param hash Hash so far
+ * @param text String to add (NULL adds nothing but the terminator)
+ * @return Updated hash
+ */
+static uint64_t hash_string(uint64_t hash, const char *text) {
+    return text ? hash_bytes(hash, text, strlen(text) + 1) : hash_bytes(hash, "", 1);
+}
+
+/**
+ * @brief Add a color to an FNV-1a hash
+ *
+ * @param hash Hash so far
+ * @param color Color to add
+ * @return Updated hash
+ */
+static uint64_t hash_color(uint64_t hash, const waver_color_t *color) {
+    uint8_t bytes[4] = {color->red, color->green, color->blue, color->alpha};
+    return hash_bytes(hash, bytes, sizeof(bytes));
+}
+
+/**
+ * @brief Hash of everything that decides the outputs of a file
+ *
+ * @param args Command-line arguments
+ * @return Hash of the render parameters
+ */
+uint64_t waver_manifest_params(const waver_args_t *args) {
+    uint64_t hash = FNV_OFFSET;
+    uint32_t values[5] = {args->width, args->height, args->output_spec_count, args->peaks, args->quality};
+    hash = hash_bytes(hash, values, sizeof(values));
+    hash = hash_color(hash, &args->left_color);
+    hash = hash_color(hash, &args->right_color);
+    hash = hash_color(hash, &args->bg_color);
+    for (unsigned int i = 0; i < args->output_spec_count; i++) {
+        const waver_output_spec_t *spec = &args->output_specs[i];
+        uint32_t size[2] = {spec->width, spec->height};
+        hash = hash_bytes(hash, size, sizeof(size));
+        hash = hash_color(hash, &spec->left_color);
+        hash = hash_color(hash, &spec->right_color);
+        hash = hash_color(hash, &spec->bg_color);
+        hash = hash_string(hash, spec->suffix);
+    }
+    return hash;
+}
+
+/**
+ * @brief Modification time of a stat() result in nanoseconds
+ *
+ * @param st Result of stat()
+ * @return Nanoseconds since the epoch
+ */
+int64_t waver_manifest_mtime_ns(const struct stat *st) {
+#ifdef __APPLE__
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Identity of a file from its stat() result
+ *
+ * @param st Result of stat()
+ * @param stamp Receives the size, modification time and inode
+ */
+void waver_manifest_stamp(const struct stat *st, waver_manifest_stamp_t *stamp) {
+    stamp->size = st->st_size > 0 ? (uint64_t)st->st_size : 0;
+    stamp->mtime_ns = waver_manifest_mtime_ns(st);
+    stamp->inode = (uint64_t)st->st_ino;
+}
+
+/**
+ * @brief Hash slot of a loaded file
+ *
+ * @param directory Index of its loaded directory
+ * @param name Name of the file
+ * @return Hash of the key
+ */
+static uint64_t file_hash(uint32_t directory, const char *name) {
+    return hash_string(hash_bytes(FNV_OFFSET, &directory, sizeof(directory)), name);
+}
+
+/**
+ * @brief Smallest power of two number of slots for a hash of count entries
+ *
+ * @param count Number of entries
+ * @return Slots, at least twice the count
+ */
+static size_t slot_count(size_t count) {
+    size_t slots = 16;
+    while (slots < count * 2) {
+        slots *= 2;
+    }
+    return slots;
+}
+
+/**
+ * @brief Check the header and tables of a mapped manifest
+ *
+ * @param data Start of the mapping
+ * @param size Size of the mapping
+ * @return true if the file is a complete manifest this build can read
+ */
+static bool validate(const uint8_t *data, size_t size) {
+    if (size < sizeof(waver_manifest_header_t)) {
+        return false;
+    }
+    const waver_manifest_header_t *header = (const waver_manifest_header_t *)data;
+    if (memcmp(header->magic, WAVER_MANIFEST_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != WAVER_MANIFEST_VERSION ||
+        header->byte_order != WAVER_MANIFEST_BYTE_ORDER ||
+        header->header_size != sizeof(waver_manifest_header_t) ||
+        header->directory_count >= NO_INDEX || header->file_count >= NO_INDEX) {
+        return false;
+    }
+
+    uint64_t tables = header->directory_count * sizeof(waver_manifest_directory_t) +
+                      header->file_count * sizeof(waver_manifest_file_t);
+    if (size - sizeof(waver_manifest_header_t) < tables ||
+        size - sizeof(waver_manifest_header_t) - tables != header->names_size) {
+        return false;
+    }
+
+    // Every offset below names_size is then a terminated string
+    const char *names = (const char *)data + sizeof(waver_manifest_header_t) + tables;
+    if (header->names_size == 0 || names[header->names_size - 1] != '\0') {
+        return false;
+    }
+
+    const waver_manifest_directory_t *directories =
+        (const waver_manifest_directory_t *)(data + sizeof(waver_manifest_header_t));
+    for (uint64_t i = 0; i < header->directory_count; i++) {
+        const waver_manifest_directory_t *directory = &directories[i];
+        if (directory->name >= header->names_size ||
+            (directory->parent != WAVER_MANIFEST_NO_PARENT && directory->parent >= header->directory_count) ||
+            directory->first_file > header->file_count ||
+            directory->file_count > header->file_count - directory->first_file) {
+            return false;
+        }
+    }
+    const waver_manifest_file_t *files = (const waver_manifest_file_t *)(directories + header->directory_count);
+    for (uint64_t i = 0; i < header->file_count; i++) {
+        if (files[i].name >= header->names_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Build the lookup tables of a loaded manifest
+ *
+ * @param manifest Manifest with a validated mapping
+ * @return true if successful, false on allocation failure
+ */
+static bool index_loaded(waver_manifest_t *manifest) {
+    const waver_manifest_header_t *header = (const waver_manifest_header_t *)manifest->data;
+    size_t directory_count = (size_t)header->directory_count;
+    size_t file_count = (size_t)header->file_count;
+    size_t directory_slots = slot_count(directory_count);
+    size_t file_slots = slot_count(file_count);
+
+    manifest->directory_slots = malloc(directory_slots * sizeof(uint32_t));
+    manifest->file_slots = malloc(file_slots * sizeof(uint32_t));
+    manifest->child_start = calloc(directory_count + 1, sizeof(uint32_t));
+    manifest->children = malloc((directory_count ? directory_count : 1) * sizeof(uint32_t));
+    if (!manifest->directory_slots || !manifest->file_slots || !manifest->child_start || !manifest->children) {
+        return false;
+    }
+    memset(manifest->directory_slots, 0xff, directory_slots * sizeof(uint32_t));
+    memset(manifest->file_slots, 0xff, file_slots * sizeof(uint32_t));
+    manifest->directory_mask = directory_slots - 1;
+    manifest->file_mask = file_slots - 1;
+
+    for (size_t i = 0; i < directory_count; i++) {
+        const waver_manifest_directory_t *directory = &manifest->directories[i];
+        size_t slot = hash_string(FNV_OFFSET, manifest->names + directory->name) & manifest->directory_mask;
+        while (manifest->directory_slots[slot] != NO_INDEX) {
+            slot = (slot + 1) & manifest->directory_mask;
+        }
+        manifest->directory_slots[slot] = (uint32_t)i;
+
+        for (uint32_t f = directory->first_file; f < directory->first_file + directory->file_count; f++) {
+            slot = file_hash((uint32_t)i, manifest->names + manifest->files[f].name) & manifest->file_mask;
+            while (manifest->file_slots[slot] != NO_INDEX) {
+                slot = (slot + 1) & manifest->file_mask;
+            }
+            manifest->file_slots[slot] = f;
+        }
+        if (directory->parent != WAVER_MANIFEST_NO_PARENT) {
+            manifest->child_start[directory->parent + 1]++;
+        }
+    }
+
+    // Children grouped by parent: counts, then running starts, then fill
+    for (size_t i = 0; i < directory_count; i++) {
+        manifest->child_start[i + 1] += manifest->child_start[i];
+    }
+    uint32_t *fill = calloc(directory_count + 1, sizeof(uint32_t));
+    if (!fill) {
+        return false;
+    }
+    for (size_t i = 0; i < directory_count; i++) {
+        uint32_t parent = manifest->directories[i].parent;
+        if (parent != WAVER_MANIFEST_NO_PARENT) {
+            manifest->children[manifest->child_start[parent] + fill[parent]++] = (uint32_t)i;
+        }
+    }
+    free(fill);
+    return true;
+}
+
+/**
+ * @brief Map the manifest file of a root if there is a valid one
+ *
+ * @param manifest Manifest whose path is set
+ * @return true if the file was loaded
+ */
+static bool load(waver_manifest_t *manifest) {
+    int fd = open(manifest->path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    if (!validate(data, size)) {
+        munmap(data, size);
+        return false;
+    }
+
+    const waver_manifest_header_t *header = data;
+    manifest->data = data;
+    manifest->size = size;
+    manifest->directories = (const waver_manifest_directory_t *)(manifest->data + sizeof(waver_manifest_header_t));
+    manifest->files = (const waver_manifest_file_t *)(manifest->directories + header->directory_count);
+    manifest->names = (const char *)(manifest->files + header->file_count);
+    manifest->directory_count = (size_t)header->directory_count;
+    manifest->params_match = header->params == manifest->params;
+    return true;
+}
+
+/**
+ * @brief Load the manifest of a root directory, or start an empty one
+ *
+ * @param root Directory given on the command line
+ * @param params Hash of the render parameters of this run
+ * @return Manifest or NULL on allocation failure
+ */
+waver_manifest_t *waver_manifest_open(const char *root, uint64_t params) {
+    waver_manifest_t *manifest = calloc(1, sizeof(waver_manifest_t));
+    if (!manifest) {
+        return NULL;
+    }
+    size_t length = strlen(root) + 1 + strlen(WAVER_MANIFEST_NAME) + 1;
+    manifest->root = strdup(root);
+    manifest->path = malloc(length);
+    if (!manifest->root || !manifest->path || pthread_mutex_init(&manifest->mutex, NULL) != 0) {
+        free(manifest->root);
+        free(manifest->path);
+        free(manifest);
+        return NULL;
+    }
+    snprintf(manifest->path, length, "%s/%s", root, WAVER_MANIFEST_NAME);
+    manifest->params = params;
+
+    if (load(manifest) && !index_loaded(manifest)) {
+        waver_manifest_free(manifest);
+        return NULL;
+    }
+    return manifest;
+}
+
+/**
+ * @brief Path of a directory relative to the root
+ *
+ * @param manifest Manifest of the root
+ * @param path Path built from the root path
+ * @return Relative path ("" for the root itself)
+ */
+static const char *relative_path(const waver_manifest_t *manifest, const char *path) {
+    size_t length = strlen(manifest->root);
+    if (strncmp(path, manifest->root, length) != 0) {
+        return path;
+    }
+    path += length;
+    while (*path == '/') {
+        path++;
+    }
+    return path;
+}
+
+/**
+ * @brief Find a directory of the loaded manifest
+ *
+ * @param manifest Manifest
+ * @param path Path relative to the root
+ * @return Index of the directory, or NO_INDEX
+ */
+static uint32_t find_directory(const waver_manifest_t *manifest, const char *path) {
+    if (!manifest->data) {
+        return NO_INDEX;
+    }
+    size_t slot = hash_string(FNV_OFFSET, path) & manifest->directory_mask;
+    for (uint32_t index; (index = manifest->directory_slots[slot]) != NO_INDEX;
+         slot = (slot + 1) & manifest->directory_mask) {
+        if (strcmp(manifest->names + manifest->directories[index].name, path) == 0) {
+            return index;
+        }
+    }
+    return NO_INDEX;
+}
+
+/**
+ * @brief Find a file of the loaded manifest
+ *
+ * @param manifest Manifest
+ * @param directory Index of its loaded directory
+ * @param name Name of the file
+ * @return The file, or NULL if it is not in the manifest
+ */
+static const waver_manifest_file_t *find_file(const waver_manifest_t *manifest, uint32_t directory,
+                                              const char *name) {
+    if (directory == NO_INDEX) {
+        return NULL;
+    }
+    const waver_manifest_directory_t *entry = &manifest->directories[directory];
+    size_t slot = file_hash(directory, name) & manifest->file_mask;
+    for (uint32_t index; (index = manifest->file_slots[slot]) != NO_INDEX; slot = (slot + 1) & manifest->file_mask) {
+        if (index >= entry->first_file && index < entry->first_file + entry->file_count &&
+            strcmp(manifest->names + manifest->files[index].name, name) == 0) {
+            return &manifest->files[index];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Copy a name into the names of this run
+ *
+ * @param manifest Manifest (locked)
+ * @param name Name to copy
+ * @param offset Receives the offset of the copy
+ * @return true if successful, false on allocation failure
+ */
+static bool add_name(waver_manifest_t *manifest, const char *name, size_t *offset) {
+    size_t length = strlen(name) + 1;
+    if (manifest->names_used + length > manifest->names_capacity) {
+        size_t capacity = manifest->names_capacity ? manifest->names_capacity * 2 : 4096;
+        while (capacity < manifest->names_used + length) {
+            capacity *= 2;
+        }
+        char *names = realloc(manifest->run_names, capacity);
+        if (!names) {
+            return false;
+        }
+        manifest->run_names = names;
+        manifest->names_capacity = capacity;
+    }
+    memcpy(manifest->run_names + manifest->names_used, name, length);
+    *offset = manifest->names_used;
+    manifest->names_used += length;
+    return true;
+}
+
+/**
+ * @brief Append a file to this run
+ *
+ * @param dir Record of its directory
+ * @param name Name of the file
+ * @param stamp Identity of the file
+ * @return true if successful, false on allocation failure
+ */
+static bool add_file(waver_manifest_dir_t *dir, const char *name, const waver_manifest_stamp_t *stamp) {
+    waver_manifest_t *manifest = dir->manifest;
+    if (manifest->file_count == manifest->file_capacity) {
+        size_t capacity = manifest->file_capacity ? manifest->file_capacity * 2 : 256;
+        run_file_t *files = realloc(manifest->run_files, capacity * sizeof(run_file_t));
+        if (!files) {
+            return false;
+        }
+        manifest->run_files = files;
+        manifest->file_capacity = capacity;
+    }
+    run_file_t *file = &manifest->run_files[manifest->file_count];
+    if (!add_name(manifest, name, &file->name)) {
+        return false;
+    }
+    file->stamp = *stamp;
+    file->dir = dir->index;
+    manifest->file_count++;
+    return true;
+}
+
+/**
+ * @brief Start the record of one directory
+ *
+ * @param manifest Manifest of the root the directory is under
+ * @param path Path of the directory (the root path or a path built from it)
+ * @param mtime_ns Modification time of the directory, taken before reading it
+ * @return Record to add the directory's files to, or NULL on allocation failure
+ */
+waver_manifest_dir_t *waver_manifest_begin_dir(waver_manifest_t *manifest, const char *path, int64_t mtime_ns) {
+    const char *relative = relative_path(manifest, path);
+    waver_manifest_dir_t *dir = calloc(1, sizeof(waver_manifest_dir_t));
+    if (!dir) {
+        return NULL;
+    }
+    dir->path = strdup(relative);
+    if (!dir->path) {
+        free(dir);
+        return NULL;
+    }
+    dir->manifest = manifest;
+    dir->mtime_ns = mtime_ns;
+    dir->old = find_directory(manifest, relative);
+
+    pthread_mutex_lock(&manifest->mutex);
+    if (manifest->dir_count == manifest->dir_capacity) {
+        size_t capacity = manifest->dir_capacity ? manifest->dir_capacity * 2 : 64;
+        waver_manifest_dir_t **dirs = realloc(manifest->dirs, capacity * sizeof(waver_manifest_dir_t *));
+        if (!dirs) {
+            pthread_mutex_unlock(&manifest->mutex);
+            free(dir->path);
+            free(dir);
+            return NULL;
+        }
+        manifest->dirs = dirs;
+        manifest->dir_capacity = capacity;
+    }
+    dir->index = manifest->dir_count;
+    manifest->dirs[manifest->dir_count++] = dir;
+    pthread_mutex_unlock(&manifest->mutex);
+    return dir;
+}
+
+/**
+ * @brief Carry a directory over unread if nothing in it can have changed
+ *
+ * @param dir Record of the directory
+ * @param fn Receives every subdirectory
+ * @param context Passed to fn
+ * @param files Receives the number of files carried over
+ * @return true if the directory was carried over, false if it has to be read
+ */
+bool waver_manifest_carry_dir(waver_manifest_dir_t *dir, waver_manifest_dir_fn fn, void *context, size_t *files) {
+    waver_manifest_t *manifest = dir->manifest;
+    *files = 0;
+    if (!manifest->params_match || dir->old == NO_INDEX) {
+        return false;
+    }
+    const waver_manifest_directory_t *old = &manifest->directories[dir->old];
+    if (old->mtime_ns != dir->mtime_ns || !(old->flags & WAVER_MANIFEST_COMPLETE)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&manifest->mutex);
+    bool ok = true;
+    for (uint32_t f = old->first_file; ok && f < old->first_file + old->file_count; f++) {
+        ok = add_file(dir, manifest->names + manifest->files[f].name, &manifest->files[f].stamp);
+    }
+    if (ok) {
+        manifest->unchanged += old->file_count;
+        manifest->carried_dirs++;
+    }
+    pthread_mutex_unlock(&manifest->mutex);
+    if (!ok) {
+        // Whatever was copied stays; reading the directory adds the rest
+        return false;
+    }
+    *files = old->file_count;
+
+    char path[4096];
+    for (uint32_t c = manifest->child_start[dir->old]; c < manifest->child_start[dir->old + 1]; c++) {
+        const char *child = manifest->names + manifest->directories[manifest->children[c]].name;
+        int length = snprintf(path, sizeof(path), "%s/%s", manifest->root, child);
+        if (length > 0 && (size_t)length < sizeof(path)) {
+            fn(context, path);
+        } else {
+            waver_manifest_fail(dir);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Check one file of a directory against the loaded manifest
+ *
+ * @param dir Record of the directory
+ * @param name Name of the file in the directory
+ * @param stamp Current identity of the file
+ * @param outputs_exist Whether every output of the file is there
+ * @return Whether the outputs of the file are current
+ */
+waver_manifest_state_t waver_manifest_check(waver_manifest_dir_t *dir, const char *name,
+                                            const waver_manifest_stamp_t *stamp, bool outputs_exist) {
+    waver_manifest_t *manifest = dir->manifest;
+    const waver_manifest_file_t *file = manifest->params_match ? find_file(manifest, dir->old, name) : NULL;
+
+    waver_manifest_state_t state;
+    if (!manifest->data || (manifest->params_match && !file)) {
+        state = WAVER_MANIFEST_NEW;
+    } else if (file && outputs_exist && file->stamp.size == stamp->size && file->stamp.mtime_ns == stamp->mtime_ns &&
+               file->stamp.inode == stamp->inode) {
+        state = WAVER_MANIFEST_UNCHANGED;
+    } else {
+        state = WAVER_MANIFEST_CHANGED;
+    }
+
+    pthread_mutex_lock(&manifest->mutex);
+    if (state == WAVER_MANIFEST_UNCHANGED && !add_file(dir, name, stamp)) {
+        state = WAVER_MANIFEST_CHANGED; // Rendering it again records it again
+    }
+    if (state == WAVER_MANIFEST_UNCHANGED) {
+        manifest->unchanged++;
+    } else if (state == WAVER_MANIFEST_CHANGED) {
+        manifest->changed++;
+    } else {
+        manifest->added++;
+    }
+    pthread_mutex_unlock(&manifest->mutex);
+    return state;
+}
+
+/**
+ * @brief Record a file whose outputs have been made
+ *
+ * @param dir Record of the directory
+ * @param name Name of the file in the directory
+ * @param stamp Identity of the file before its outputs were made
+ * @return true if successful, false on allocation failure (the directory is marked incomplete)
+ */
+bool waver_manifest_record(waver_manifest_dir_t *dir, const char *name, const waver_manifest_stamp_t *stamp) {
+    pthread_mutex_lock(&dir->manifest->mutex);
+    bool ok = add_file(dir, name, stamp);
+    if (!ok) {
+        dir->failed = true;
+    }
+    pthread_mutex_unlock(&dir->manifest->mutex);
+    return ok;
+}
+
+/**
+ * @brief Mark a directory as not complete, so it is read again next time
+ *
+ * @param dir Record of the directory
+ */
+void waver_manifest_fail(waver_manifest_dir_t *dir) {
+    pthread_mutex_lock(&dir->manifest->mutex);
+    dir->failed = true;
+    pthread_mutex_unlock(&dir->manifest->mutex);
+}
+
+/**
+ * @brief Add time spent deciding which files to skip
+ *
+ * @param manifest Manifest
+ * @param seconds Time spent in stat() and lookups
+ */
+void waver_manifest_add_check_time(waver_manifest_t *manifest, double seconds) {
+    pthread_mutex_lock(&manifest->mutex);
+    manifest->check_seconds += seconds;
+    pthread_mutex_unlock(&manifest->mutex);
+}
+
+/**
+ * @brief Print how many files were skipped and how long the checks took
+ *
+ * @param manifest Manifest after the run
+ * @param args Command-line arguments (for quiet)
+ */
+void waver_manifest_report(const waver_manifest_t *manifest, const waver_args_t *args) {
+    waver_print_stdout(args, "Incremental %s: %zu unchanged, %zu changed, %zu new; %zu of %zu directories "
+                       "not read; skip checks took %.3f ms",
+                       manifest->root, manifest->unchanged, manifest->changed, manifest->added,
+                       manifest->carried_dirs, manifest->dir_count, manifest->check_seconds * 1000.0);
+}
+
+/**
+ * @brief A directory of this run being sorted by path
+ */
+typedef struct {
+    const waver_manifest_dir_t *dir; /**< Directory */
+} sorted_dir_t;
+
+/**
+ * @brief A file of this run being sorted by directory and name
+ */
+typedef struct {
+    uint32_t dir;            /**< Index of its directory in the written manifest */
+    const char *name;        /**< Name of the file */
+    const run_file_t *file;  /**< File */
+} sorted_file_t;
+
+/**
+ * @brief Compare two directories by path for qsort
+ *
+ * @param a First directory
+ * @param b Second directory
+ * @return Negative, zero or positive as a sorts before, with or after b
+ */
+static int compare_dirs(const void *a, const void *b) {
+    return strcmp(((const sorted_dir_t *)a)->dir->path, ((const sorted_dir_t *)b)->dir->path);
+}
+
+/**
+ * @brief Compare two files by directory and name for qsort
+ *
+ * @param a First file
+ * @param b Second file
+ * @return Negative, zero or positive as a sorts before, with or after b
+ */
+static int compare_files(const void *a, const void *b) {
+    const sorted_file_t *x = a;
+    const sorted_file_t *y = b;
+    if (x->dir != y->dir) {
+        return x->dir < y->dir ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+/**
+ * @brief Find a directory among the sorted directories
+ *
+ * @param dirs Directories sorted by path, without duplicates
+ * @param count Number of directories
+ * @param path Path relative to the root
+ * @return Index of the directory, or WAVER_MANIFEST_NO_PARENT
+ */
+static uint32_t find_sorted(const sorted_dir_t *dirs, size_t count, const char *path) {
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int order = strcmp(dirs[middle].dir->path, path);
+        if (order == 0) {
+            return (uint32_t)middle;
+        }
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return WAVER_MANIFEST_NO_PARENT;
+}
+
+/**
+ * @brief Replace the manifest file with the directories and files of this run
+ *
+ * A directory that was scanned twice (by a watch, say) is written once,
+ * and so is a file that was recorded twice.
+ *
+ * @param manifest Manifest after every task has finished
+ * @return true if successful, false otherwise
+ */
+bool waver_manifest_write(waver_manifest_t *manifest) {
+    size_t dir_count = manifest->dir_count;
+    size_t file_count = manifest->file_count;
+    sorted_dir_t *dirs = malloc((dir_count ? dir_count : 1) * sizeof(sorted_dir_t));
+    uint32_t *final_index = malloc((dir_count ? dir_count : 1) * sizeof(uint32_t));
+    sorted_file_t *files = malloc((file_count ? file_count : 1) * sizeof(sorted_file_t));
+    waver_manifest_directory_t *directory_table = calloc(dir_count ? dir_count : 1,
+                                                         sizeof(waver_manifest_directory_t));
+    waver_manifest_file_t *file_table = calloc(file_count ? file_count : 1, sizeof(waver_manifest_file_t));
+    size_t names_capacity = manifest->names_used + 1;
+    for (size_t i = 0; i < dir_count; i++) {
+        names_capacity += strlen(manifest->dirs[i]->path) + 1;
+    }
+    char *names = malloc(names_capacity);
+    bool success = false;
+    FILE *fp = NULL;
+    if (!dirs || !final_index || !files || !directory_table || !file_table || !names) {
+        goto cleanup;
+    }
+
+    // Directories by path; duplicates are merged into the first
+    for (size_t i = 0; i < dir_count; i++) {
+        dirs[i].dir = manifest->dirs[i];
+    }
+    qsort(dirs, dir_count, sizeof(sorted_dir_t), compare_dirs);
+    size_t unique = 0;
+    bool *failed = calloc(dir_count ? dir_count : 1, sizeof(bool));
+    if (!failed) {
+        goto cleanup;
+    }
+    for (size_t i = 0; i < dir_count; i++) {
+        if (unique == 0 || strcmp(dirs[unique - 1].dir->path, dirs[i].dir->path) != 0) {
+            dirs[unique++] = dirs[i];
+        }
+        final_index[dirs[i].dir->index] = (uint32_t)(unique - 1);
+        failed[unique - 1] = failed[unique - 1] || dirs[i].dir->failed;
+    }
+
+    // Names: directory paths first, then file names
+    size_t names_size = 0;
+    for (size_t i = 0; i < unique; i++) {
+        const waver_manifest_dir_t *dir = dirs[i].dir;
+        size_t length = strlen(dir->path) + 1;
+        memcpy(names + names_size, dir->path, length);
+        waver_manifest_directory_t *entry = &directory_table[i];
+        entry->mtime_ns = dir->mtime_ns;
+        entry->name = names_size;
+        entry->flags = failed[i] ? 0 : WAVER_MANIFEST_COMPLETE;
+        names_size += length;
+
+        const char *slash = strrchr(dir->path, '/');
+        if (dir->path[0] == '\0') {
+            entry->parent = WAVER_MANIFEST_NO_PARENT;
+        } else if (!slash) {
+            entry->parent = find_sorted(dirs, unique, "");
+        } else {
+            char parent[4096];
+            snprintf(parent, sizeof(parent), "%.*s", (int)(slash - dir->path), dir->path);
+            entry->parent = find_sorted(dirs, unique, parent);
+        }
+    }
+    free(failed);
+
+    // Files by directory and name; a repeated file keeps its last record
+    for (size_t i = 0; i < file_count; i++) {
+        files[i].dir = final_index[manifest->run_files[i].dir];
+        files[i].name = manifest->run_names + manifest->run_files[i].name;
+        files[i].file = &manifest->run_files[i];
+    }
+    qsort(files, file_count, sizeof(sorted_file_t), compare_files);
+    size_t written = 0;
+    for (size_t i = 0; i < file_count; i++) {
+        if (i + 1 < file_count && compare_files(&files[i], &files[i + 1]) == 0) {
+            continue;
+        }
+        waver_manifest_directory_t *entry = &directory_table[files[i].dir];
+        if (entry->file_count == 0) {
+            entry->first_file = (uint32_t)written;
+        }
+        entry->file_count++;
+        file_table[written].stamp = files[i].file->stamp;
+        file_table[written].name = names_size;
+        size_t length = strlen(files[i].name) + 1;
+        memcpy(names + names_size, files[i].name, length);
+        names_size += length;
+        written++;
+    }
+    if (names_size == 0) {
+        names[names_size++] = '\0';
+    }
+
+    waver_manifest_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WAVER_MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = WAVER_MANIFEST_VERSION;
+    header.byte_order = WAVER_MANIFEST_BYTE_ORDER;
+    header.header_size = sizeof(header);
+    header.params = manifest->params;
+    header.directory_count = unique;
+    header.file_count = written;
+    header.names_size = names_size;
+
+    // Rewritten in place: renaming a new file over it would move the
+    // modification time of the root, which then always has to be read.  A
+    // write cut short leaves a size that does not match the header, and a
+    // manifest that fails to validate only means every file is checked.
+    if (manifest->data) {
+        munmap((void *)manifest->data, manifest->size);
+        manifest->data = NULL;
+    }
+    fp = fopen(manifest->path, "wb");
+    if (!fp) {
+        goto cleanup;
+    }
+    success = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(directory_table, sizeof(waver_manifest_directory_t), unique, fp) == unique &&
+              fwrite(file_table, sizeof(waver_manifest_file_t), written, fp) == written &&
+              fwrite(names, 1, names_size, fp) == names_size;
+    if (fclose(fp) != 0) {
+        success = false;
+    }
+
+cleanup:
+    free(names);
+    free(file_table);
+    free(directory_table);
+    free(files);
+    free(final_index);
+    free(dirs);
+    return success;
+}
+
+/**
+ * @brief Free a manifest
+ *
+ * @param manifest Manifest (may be NULL)
+ */
+void waver_manifest_free(waver_manifest_t *manifest) {
+    if (!manifest) {
+        return;
+    }
+    if (manifest->data) {
+        munmap((void *)manifest->data, manifest->size);
+    }
+    free(manifest->directory_slots);
+    free(manifest->file_slots);
+    free(manifest->child_start);
+    free(manifest->children);
+    for (size_t i = 0; i < manifest->dir_count; i++) {
+        free(manifest->dirs[i]->path);
+        free(manifest->dirs[i]);
+    }
+    free(manifest->dirs);
+    free(manifest->run_files);
+    free(manifest->run_names);
+    pthread_mutex_destroy(&manifest->mutex);
+    free(manifest->root);
+    free(manifest->path);
+    free(manifest);
+}
@@ -0,0 +1,12 @@
+/**
+ * @file mp3_avx2.c
+ * @brief AVX2 build of the minimp3 decoder (x86-64 only)
+ *
+ * The Makefile compiles this file with -mavx2 so the SSE intrinsics in
+ * minimp3 are VEX encoded and its plain loops can be auto-vectorized to
+ * 256-bit registers.  It is only selected when the CPU reports AVX2.
+ */
+
+#define MP3_BACKEND_VARIANT avx2
+#define MP3_BACKEND_NAME "avx2"
+#include "mp3_backend_impl.h"
@@ -0,0 +1,50 @@
+/**
+ * @file mp3_backend.c
+ * @brief Runtime selection of the minimp3 decoder build
+ */
+
+#include "mp3_backend.h"
+#include <string.h>
+
+/**
+ * @brief Select the decoder build to use for the requested mode
+ *
+ * @param decoder Requested decoder mode
+ * @return The selected backend (never NULL)
+ */
+const waver_mp3_backend_t *waver_mp3_backend_select(waver_decoder_t decoder) {
+    if (decoder == WAVER_DECODER_SCALAR) {
+        return &waver_mp3_backend_scalar;
+    }
+
+#ifdef WAVER_HAVE_AVX2
+    // WAVER_HAVE_AVX2 is only defined by the Makefile for x86-64 GCC/Clang builds
+    if (__builtin_cpu_supports("avx2")) {
+        return &waver_mp3_backend_avx2;
+    }
+#endif
+
+    return &waver_mp3_backend_simd;
+}
+
+/**
+ * @brief Parse a decoder mode name as given on the command line
+ *
+ * @param name Mode name ("scalar" or "simd")
+ * @param decoder Output decoder mode
+ * @return true if successful, false otherwise
+ */
+bool waver_mp3_backend_parse(const char *name, waver_decoder_t *decoder) {
+    if (!name || !decoder) {
+        return false;
+    }
+
+    if (strcmp(name, "scalar") == 0) {
+        *decoder = WAVER_DECODER_SCALAR;
+    } else if (strcmp(name, "simd") == 0) {
+        *decoder = WAVER_DECODER_SIMD;
+    } else {
+        return false;
+    }
+    return true;
+}
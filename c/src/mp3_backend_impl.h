@@ -0,0 +1,159 @@
+/**
+ * @file mp3_backend_impl.h
+ * @brief Template for one renamed build of minimp3
+ *
+ * Each mp3_*.c translation unit defines MP3_BACKEND_VARIANT (and the
+ * minimp3 configuration it wants, such as MINIMP3_NO_SIMD) and then
+ * includes this file.  All public minimp3 symbols are renamed with the
+ * variant as a prefix so that several builds can be linked side by side,
+ * and a waver_mp3_backend_<variant> function table is defined for them.
+ */
+
+#ifndef MP3_BACKEND_VARIANT
+#error MP3_BACKEND_VARIANT must be defined before including mp3_backend_impl.h
+#endif
+
+#define MP3_BACKEND_CONCAT_(a, b) a##b
+#define MP3_BACKEND_CONCAT(a, b) MP3_BACKEND_CONCAT_(a, b)
+#define MP3_BACKEND_SYMBOL(name) MP3_BACKEND_CONCAT(MP3_BACKEND_CONCAT(waver_, MP3_BACKEND_VARIANT), _##name)
+
+// The renames must be in place before minimp3 declares anything
+#define mp3dec_init MP3_BACKEND_SYMBOL(mp3dec_init)
+#define mp3dec_decode_frame MP3_BACKEND_SYMBOL(mp3dec_decode_frame)
+#define mp3dec_f32_to_s16 MP3_BACKEND_SYMBOL(mp3dec_f32_to_s16)
+#define mp3dec_detect_buf MP3_BACKEND_SYMBOL(mp3dec_detect_buf)
+#define mp3dec_detect_cb MP3_BACKEND_SYMBOL(mp3dec_detect_cb)
+#define mp3dec_load_buf MP3_BACKEND_SYMBOL(mp3dec_load_buf)
+#define mp3dec_load_cb MP3_BACKEND_SYMBOL(mp3dec_load_cb)
+#define mp3dec_iterate_buf MP3_BACKEND_SYMBOL(mp3dec_iterate_buf)
+#define mp3dec_iterate_cb MP3_BACKEND_SYMBOL(mp3dec_iterate_cb)
+#define mp3dec_ex_open_buf MP3_BACKEND_SYMBOL(mp3dec_ex_open_buf)
+#define mp3dec_ex_open_cb MP3_BACKEND_SYMBOL(mp3dec_ex_open_cb)
+#define mp3dec_ex_close MP3_BACKEND_SYMBOL(mp3dec_ex_close)
+#define mp3dec_ex_seek MP3_BACKEND_SYMBOL(mp3dec_ex_seek)
+#define mp3dec_ex_read_frame MP3_BACKEND_SYMBOL(mp3dec_ex_read_frame)
+#define mp3dec_ex_read MP3_BACKEND_SYMBOL(mp3dec_ex_read)
+#define mp3dec_detect MP3_BACKEND_SYMBOL(mp3dec_detect)
+#define mp3dec_load MP3_BACKEND_SYMBOL(mp3dec_load)
+#define mp3dec_iterate MP3_BACKEND_SYMBOL(mp3dec_iterate)
+#define mp3dec_ex_open MP3_BACKEND_SYMBOL(mp3dec_ex_open)
+
+#define MINIMP3_IMPLEMENTATION
+#include "minimp3.h"
+#include "minimp3_ex.h"
+#include "mp3_backend.h"
+
+#if HAVE_SIMD
+#if HAVE_SSE
+#define MP3_BACKEND_ISA_NAME "sse2"
+#else
+#define MP3_BACKEND_ISA_NAME "neon"
+#endif
+#else
+#define MP3_BACKEND_ISA_NAME "scalar"
+#endif
+
+/**
+ * @brief Spectral energy of each granule of a layer III frame, without synthesis
+ *
+ * Follows mp3dec_decode_frame() through the side information, the bit
+ * reservoir, the scalefactors, Huffman decoding with dequantization and
+ * the stereo processing, which leaves the MDCT coefficients of each
+ * granule, and stops there: no reordering, alias reduction, IMDCT or
+ * polyphase synthesis.  The sum of the squared coefficients is the energy
+ * of the granule (up to a constant), since the MDCT preserves energy.
+ *
+ * @param dec Decoder state (frame header and bit reservoir)
+ * @param mp3 Input data, starting at or before the frame
+ * @param mp3_bytes Bytes of input available
+ * @param energy Receives the energy per granule and channel, granule-major (up to 2x2)
+ * @param info Receives the frame information, including the bytes consumed
+ * @return Samples per channel of the frame, or 0 if it is not layer III or cannot be decoded
+ */
+static int waver_envelope_frame(mp3dec_t *dec, const uint8_t *mp3, int mp3_bytes, float *energy,
+                                mp3dec_frame_info_t *info) {
+    int i = 0, frame_size = 0, success = 1;
+    bs_t bs_frame[1];
+    mp3dec_scratch_t scratch;
+
+    if (mp3_bytes > 4 && dec->header[0] == 0xff && hdr_compare(dec->header, mp3)) {
+        frame_size = hdr_frame_bytes(mp3, dec->free_format_bytes) + hdr_padding(mp3);
+        if (frame_size != mp3_bytes && (frame_size + HDR_SIZE > mp3_bytes || !hdr_compare(mp3, mp3 + frame_size))) {
+            frame_size = 0;
+        }
+    }
+    if (!frame_size) {
+        memset(dec, 0, sizeof(mp3dec_t));
+        i = mp3d_find_frame(mp3, mp3_bytes, &dec->free_format_bytes, &frame_size);
+        if (!frame_size || i + frame_size > mp3_bytes) {
+            info->frame_bytes = i;
+            return 0;
+        }
+    }
+
+    const uint8_t *hdr = mp3 + i;
+    memcpy(dec->header, hdr, HDR_SIZE);
+    info->frame_bytes = i + frame_size;
+    info->frame_offset = i;
+    info->channels = HDR_IS_MONO(hdr) ? 1 : 2;
+    info->hz = hdr_sample_rate_hz(hdr);
+    info->layer = 4 - HDR_GET_LAYER(hdr);
+    info->bitrate_kbps = hdr_bitrate_kbps(hdr);
+    if (info->layer != 3) {
+        return 0;
+    }
+
+    bs_init(bs_frame, hdr + HDR_SIZE, frame_size - HDR_SIZE);
+    if (HDR_IS_CRC(hdr)) {
+        get_bits(bs_frame, 16);
+    }
+    int main_data_begin = L3_read_side_info(bs_frame, scratch.gr_info, hdr);
+    if (main_data_begin < 0 || bs_frame->pos > bs_frame->limit) {
+        mp3dec_init(dec);
+        return 0;
+    }
+
+    int channels = info->channels;
+    success = L3_restore_reservoir(dec, bs_frame, &scratch, main_data_begin);
+    for (int igr = 0; success && igr < (HDR_TEST_MPEG1(hdr) ? 2 : 1); igr++) {
+        L3_gr_info_t *gr_info = scratch.gr_info + igr * channels;
+        memset(scratch.grbuf[0], 0, 576 * 2 * sizeof(float));
+        for (int ch = 0; ch < channels; ch++) {
+            int layer3gr_limit = scratch.bs.pos + gr_info[ch].part_23_length;
+            L3_decode_scalefactors(dec->header, scratch.ist_pos[ch], &scratch.bs, gr_info + ch, scratch.scf, ch);
+            L3_huffman(scratch.grbuf[ch], &scratch.bs, gr_info + ch, scratch.scf, layer3gr_limit);
+        }
+        if (HDR_TEST_I_STEREO(dec->header)) {
+            L3_intensity_stereo(scratch.grbuf[0], scratch.ist_pos[1], gr_info, dec->header);
+        } else if (HDR_IS_MS_STEREO(dec->header)) {
+            L3_midside_stereo(scratch.grbuf[0], 576);
+        }
+        for (int ch = 0; ch < channels; ch++) {
+            // Independent partial sums, so the loop is not one long chain of dependent adds
+            float sum[8] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+            for (int k = 0; k < 576; k += 8) {
+                for (int lane = 0; lane < 8; lane++) {
+                    sum[lane] += scratch.grbuf[ch][k + lane] * scratch.grbuf[ch][k + lane];
+                }
+            }
+            energy[igr * 2 + ch] = ((sum[0] + sum[4]) + (sum[1] + sum[5])) + ((sum[2] + sum[6]) + (sum[3] + sum[7]));
+        }
+    }
+    L3_save_reservoir(dec, &scratch);
+    return success * hdr_frame_samples(dec->header);
+}
+
+const waver_mp3_backend_t MP3_BACKEND_CONCAT(waver_mp3_backend_, MP3_BACKEND_VARIANT) = {
+#ifdef MP3_BACKEND_NAME
+    .name = MP3_BACKEND_NAME,
+#else
+    .name = MP3_BACKEND_ISA_NAME,
+#endif
+    .ex_open = mp3dec_ex_open,
+    .ex_open_buf = mp3dec_ex_open_buf,
+    .ex_seek = mp3dec_ex_seek,
+    .ex_read = mp3dec_ex_read,
+    .ex_close = mp3dec_ex_close,
+    .decode_frame = mp3dec_decode_frame,
+    .envelope_frame = waver_envelope_frame,
+};
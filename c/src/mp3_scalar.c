@@ -0,0 +1,8 @@
+/**
+ * @file mp3_scalar.c
+ * @brief Portable scalar build of the minimp3 decoder
+ */
+
+#define MINIMP3_NO_SIMD
+#define MP3_BACKEND_VARIANT scalar
+#include "mp3_backend_impl.h"
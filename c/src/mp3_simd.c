@@ -0,0 +1,11 @@
+/**
+ * @file mp3_simd.c
+ * @brief SSE2 (x86) or NEON (ARM) build of the minimp3 decoder
+ *
+ * On targets where the compiler does not enable either instruction set
+ * by default, minimp3 falls back to its scalar code and this backend
+ * reports itself as "scalar".
+ */
+
+#define MP3_BACKEND_VARIANT simd
+#include "mp3_backend_impl.h"
@@ -3,12 +3,18 @@
  * @brief Optimized PNG encoding using 2-bit depth indexed color
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "waver.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <zlib.h>
+#ifdef WAVER_HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
 // Indexed PNG format constants
 #define PNG_SIGNATURE "\x89PNG\r\n\x1a\n"
@@ -30,87 +36,250 @@
 #define PNG_FILTER_AVG  3
 #define PNG_FILTER_PAETH 4
 
-// CRC table for PNG chunks
-static uint32_t crc_table[256];
-static int crc_table_computed = 0;
+// Compressed bytes per IDAT chunk; bounds the output buffer of the encoder
+#define IDAT_CHUNK_SIZE 65536
 
-// Generate CRC table for PNG chunks
-static void make_crc_table() {
-    uint32_t c;
-    int n, k;
-    
-    for (n = 0; n < 256; n++) {
-        c = (uint32_t)n;
-        for (k = 0; k < 8; k++) {
-            if (c & 1)
-                c = 0xedb88320L ^ (c >> 1);
-            else
-                c = c >> 1;
-        }
-        crc_table[n] = c;
-    }
-    crc_table_computed = 1;
-}
+// Deflate states an encoder keeps; enough for every candidate of any profile
+#define ENCODER_STREAMS 4
+
+/**
+ * @brief One way of encoding the image data
+ */
+typedef struct {
+    const char *name;   /**< Reported in verbose output */
+    bool up_filter;     /**< UP filter on every row but the first, NONE otherwise */
+    int level;          /**< Compression level (zlib 1-9, libdeflate 1-12) */
+    int strategy;       /**< zlib strategy (ignored by libdeflate) */
+} png_candidate_t;
+
+/**
+ * @brief Candidates tried by a profile
+ */
+typedef struct {
+    const png_candidate_t *candidates; /**< Candidates in the order tried */
+    size_t count;                      /**< Number of candidates */
+} png_profile_t;
+
+// Waveform rows repeat their neighbours, so UP turns most of them into runs
+// of zero bytes that Z_RLE codes as well as a full match search, at a
+// fraction of the cost.  Mono images with few distinct rows sometimes do
+// better unfiltered with ordinary matching, so the slower profiles try that.
+static const png_candidate_t FAST_ZLIB[] = {
+    {"up+rle", true, 1, Z_RLE},
+};
+static const png_candidate_t BALANCED_ZLIB[] = {
+    {"up+rle", true, 6, Z_RLE},
+    {"none+default", false, 6, Z_DEFAULT_STRATEGY},
+};
+static const png_candidate_t SMALLEST_ZLIB[] = {
+    {"up+rle", true, 9, Z_RLE},
+    {"up+filtered", true, 9, Z_FILTERED},
+    {"none+filtered", false, 9, Z_FILTERED},
+    {"none+default", false, 9, Z_DEFAULT_STRATEGY},
+};
+
+static const png_profile_t ZLIB_PROFILES[] = {
+    [WAVER_PNG_PROFILE_BALANCED] = {BALANCED_ZLIB, sizeof(BALANCED_ZLIB) / sizeof(BALANCED_ZLIB[0])},
+    [WAVER_PNG_PROFILE_FAST] = {FAST_ZLIB, sizeof(FAST_ZLIB) / sizeof(FAST_ZLIB[0])},
+    [WAVER_PNG_PROFILE_SMALLEST] = {SMALLEST_ZLIB, sizeof(SMALLEST_ZLIB) / sizeof(SMALLEST_ZLIB[0])},
+};
+
+#ifdef WAVER_HAVE_LIBDEFLATE
+// libdeflate has no strategies; it only gets the filter and level choices
+static const png_candidate_t FAST_LIBDEFLATE[] = {
+    {"up+libdeflate", true, 1, 0},
+};
+static const png_candidate_t BALANCED_LIBDEFLATE[] = {
+    {"up+libdeflate", true, 6, 0},
+    {"none+libdeflate", false, 6, 0},
+};
+static const png_candidate_t SMALLEST_LIBDEFLATE[] = {
+    {"up+libdeflate", true, 12, 0},
+    {"none+libdeflate", false, 12, 0},
+};
+
+static const png_profile_t LIBDEFLATE_PROFILES[] = {
+    [WAVER_PNG_PROFILE_BALANCED] = {BALANCED_LIBDEFLATE,
+                                    sizeof(BALANCED_LIBDEFLATE) / sizeof(BALANCED_LIBDEFLATE[0])},
+    [WAVER_PNG_PROFILE_FAST] = {FAST_LIBDEFLATE, sizeof(FAST_LIBDEFLATE) / sizeof(FAST_LIBDEFLATE[0])},
+    [WAVER_PNG_PROFILE_SMALLEST] = {SMALLEST_LIBDEFLATE,
+                                    sizeof(SMALLEST_LIBDEFLATE) / sizeof(SMALLEST_LIBDEFLATE[0])},
+};
+#endif
+
+/**
+ * @brief A zlib stream set up for one level and strategy
+ */
+typedef struct {
+    z_stream stream;    /**< Stream, reset rather than ended between passes */
+    int level;          /**< Level it was set up with */
+    int strategy;       /**< Strategy it was set up with */
+    bool ready;         /**< Whether deflateInit2() has been called */
+} encoder_stream_t;
+
+/**
+ * @brief A growable byte buffer
+ */
+typedef struct {
+    unsigned char *data; /**< Buffer */
+    size_t capacity;     /**< Allocated size of data */
+} encoder_buffer_t;
+
+/**
+ * @brief Reusable PNG encoder state
+ *
+ * Setting up a deflate stream allocates its window and hash tables, which
+ * costs about as much as compressing a small waveform.  An encoder sets up
+ * one stream per level and strategy the first time it is asked for and
+ * resets it for every later pass.  The scanline buffers only ever grow.
+ */
+struct waver_png_encoder_t {
+    encoder_stream_t streams[ENCODER_STREAMS]; /**< zlib streams by level and strategy */
+    unsigned char *previous;   /**< Unfiltered previous scanline */
+    unsigned char *current;    /**< Unfiltered current scanline */
+    unsigned char *filtered;   /**< Filter byte plus filtered scanline */
+    size_t row_capacity;       /**< Bytes allocated per scanline buffer */
+    unsigned char buffer[IDAT_CHUNK_SIZE]; /**< Compressed output of one IDAT chunk */
+#ifdef WAVER_HAVE_LIBDEFLATE
+    struct libdeflate_compressor *compressors[ENCODER_STREAMS]; /**< libdeflate compressors by level */
+    int compressor_levels[ENCODER_STREAMS]; /**< Level of each compressor */
+    encoder_buffer_t raw;      /**< Whole filtered image */
+    encoder_buffer_t output;   /**< Compressed image of the current candidate */
+    encoder_buffer_t best;     /**< Compressed image of the best candidate so far */
+#endif
+};
+
+// CRC-32 table for PNG chunks (polynomial 0xedb88320).  It is a constant
+// rather than filled in on first use, so encoders on several threads never
+// race on it.
+static const uint32_t crc_table[256] = {
+    0x00000000u, 0x77073096u, 0xee0e612cu, 0x990951bau, 0x076dc419u, 0x706af48fu,
+    0xe963a535u, 0x9e6495a3u, 0x0edb8832u, 0x79dcb8a4u, 0xe0d5e91eu, 0x97d2d988u,
+    0x09b64c2bu, 0x7eb17cbdu, 0xe7b82d07u, 0x90bf1d91u, 0x1db71064u, 0x6ab020f2u,
+    0xf3b97148u, 0x84be41deu, 0x1adad47du, 0x6ddde4ebu, 0xf4d4b551u, 0x83d385c7u,
+    0x136c9856u, 0x646ba8c0u, 0xfd62f97au, 0x8a65c9ecu, 0x14015c4fu, 0x63066cd9u,
+    0xfa0f3d63u, 0x8d080df5u, 0x3b6e20c8u, 0x4c69105eu, 0xd56041e4u, 0xa2677172u,
+    0x3c03e4d1u, 0x4b04d447u, 0xd20d85fdu, 0xa50ab56bu, 0x35b5a8fau, 0x42b2986cu,
+    0xdbbbc9d6u, 0xacbcf940u, 0x32d86ce3u, 0x45df5c75u, 0xdcd60dcfu, 0xabd13d59u,
+    0x26d930acu, 0x51de003au, 0xc8d75180u, 0xbfd06116u, 0x21b4f4b5u, 0x56b3c423u,
+    0xcfba9599u, 0xb8bda50fu, 0x2802b89eu, 0x5f058808u, 0xc60cd9b2u, 0xb10be924u,
+    0x2f6f7c87u, 0x58684c11u, 0xc1611dabu, 0xb6662d3du, 0x76dc4190u, 0x01db7106u,
+    0x98d220bcu, 0xefd5102au, 0x71b18589u, 0x06b6b51fu, 0x9fbfe4a5u, 0xe8b8d433u,
+    0x7807c9a2u, 0x0f00f934u, 0x9609a88eu, 0xe10e9818u, 0x7f6a0dbbu, 0x086d3d2du,
+    0x91646c97u, 0xe6635c01u, 0x6b6b51f4u, 0x1c6c6162u, 0x856530d8u, 0xf262004eu,
+    0x6c0695edu, 0x1b01a57bu, 0x8208f4c1u, 0xf50fc457u, 0x65b0d9c6u, 0x12b7e950u,
+    0x8bbeb8eau, 0xfcb9887cu, 0x62dd1ddfu, 0x15da2d49u, 0x8cd37cf3u, 0xfbd44c65u,
+    0x4db26158u, 0x3ab551ceu, 0xa3bc0074u, 0xd4bb30e2u, 0x4adfa541u, 0x3dd895d7u,
+    0xa4d1c46du, 0xd3d6f4fbu, 0x4369e96au, 0x346ed9fcu, 0xad678846u, 0xda60b8d0u,
+    0x44042d73u, 0x33031de5u, 0xaa0a4c5fu, 0xdd0d7cc9u, 0x5005713cu, 0x270241aau,
+    0xbe0b1010u, 0xc90c2086u, 0x5768b525u, 0x206f85b3u, 0xb966d409u, 0xce61e49fu,
+    0x5edef90eu, 0x29d9c998u, 0xb0d09822u, 0xc7d7a8b4u, 0x59b33d17u, 0x2eb40d81u,
+    0xb7bd5c3bu, 0xc0ba6cadu, 0xedb88320u, 0x9abfb3b6u, 0x03b6e20cu, 0x74b1d29au,
+    0xead54739u, 0x9dd277afu, 0x04db2615u, 0x73dc1683u, 0xe3630b12u, 0x94643b84u,
+    0x0d6d6a3eu, 0x7a6a5aa8u, 0xe40ecf0bu, 0x9309ff9du, 0x0a00ae27u, 0x7d079eb1u,
+    0xf00f9344u, 0x8708a3d2u, 0x1e01f268u, 0x6906c2feu, 0xf762575du, 0x806567cbu,
+    0x196c3671u, 0x6e6b06e7u, 0xfed41b76u, 0x89d32be0u, 0x10da7a5au, 0x67dd4accu,
+    0xf9b9df6fu, 0x8ebeeff9u, 0x17b7be43u, 0x60b08ed5u, 0xd6d6a3e8u, 0xa1d1937eu,
+    0x38d8c2c4u, 0x4fdff252u, 0xd1bb67f1u, 0xa6bc5767u, 0x3fb506ddu, 0x48b2364bu,
+    0xd80d2bdau, 0xaf0a1b4cu, 0x36034af6u, 0x41047a60u, 0xdf60efc3u, 0xa867df55u,
+    0x316e8eefu, 0x4669be79u, 0xcb61b38cu, 0xbc66831au, 0x256fd2a0u, 0x5268e236u,
+    0xcc0c7795u, 0xbb0b4703u, 0x220216b9u, 0x5505262fu, 0xc5ba3bbeu, 0xb2bd0b28u,
+    0x2bb45a92u, 0x5cb36a04u, 0xc2d7ffa7u, 0xb5d0cf31u, 0x2cd99e8bu, 0x5bdeae1du,
+    0x9b64c2b0u, 0xec63f226u, 0x756aa39cu, 0x026d930au, 0x9c0906a9u, 0xeb0e363fu,
+    0x72076785u, 0x05005713u, 0x95bf4a82u, 0xe2b87a14u, 0x7bb12baeu, 0x0cb61b38u,
+    0x92d28e9bu, 0xe5d5be0du, 0x7cdcefb7u, 0x0bdbdf21u, 0x86d3d2d4u, 0xf1d4e242u,
+    0x68ddb3f8u, 0x1fda836eu, 0x81be16cdu, 0xf6b9265bu, 0x6fb077e1u, 0x18b74777u,
+    0x88085ae6u, 0xff0f6a70u, 0x66063bcau, 0x11010b5cu, 0x8f659effu, 0xf862ae69u,
+    0x616bffd3u, 0x166ccf45u, 0xa00ae278u, 0xd70dd2eeu, 0x4e048354u, 0x3903b3c2u,
+    0xa7672661u, 0xd06016f7u, 0x4969474du, 0x3e6e77dbu, 0xaed16a4au, 0xd9d65adcu,
+    0x40df0b66u, 0x37d83bf0u, 0xa9bcae53u, 0xdebb9ec5u, 0x47b2cf7fu, 0x30b5ffe9u,
+    0xbdbdf21cu, 0xcabac28au, 0x53b39330u, 0x24b4a3a6u, 0xbad03605u, 0xcdd70693u,
+    0x54de5729u, 0x23d967bfu, 0xb3667a2eu, 0xc4614ab8u, 0x5d681b02u, 0x2a6f2b94u,
+    0xb40bbe37u, 0xc30c8ea1u, 0x5a05df1bu, 0x2d02ef8du
+};
 
 // Update CRC calculation
 static uint32_t update_crc(uint32_t crc, const unsigned char *buf, size_t len) {
     uint32_t c = crc;
-    
-    if (!crc_table_computed)
-        make_crc_table();
-    
     for (size_t n = 0; n < len; n++) {
         c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
     }
     return c;
 }
 
-// Calculate CRC for a chunk
-static uint32_t crc(const unsigned char *buf, size_t len) {
-    return update_crc(0xffffffffL, buf, len) ^ 0xffffffffL;
+/**
+ * @brief Where the bytes of a PNG go
+ */
+typedef struct {
+    waver_write_fn write; /**< Receives every piece of the PNG in order */
+    void *context;        /**< Passed to write */
+    size_t bytes;         /**< Bytes written so far */
+} png_sink_t;
+
+/**
+ * @brief Pass bytes to a sink
+ *
+ * @param sink Sink
+ * @param data Bytes to write
+ * @param size Number of bytes
+ * @return true if successful, false if the sink failed
+ */
+static bool sink_write(png_sink_t *sink, const void *data, size_t size) {
+    if (!sink->write(sink->context, data, size)) {
+        return false;
+    }
+    sink->bytes += size;
+    return true;
+}
+
+/**
+ * @brief Sink callback that writes to a stdio stream
+ *
+ * @param context FILE to write to
+ * @param data Bytes to write
+ * @param size Number of bytes
+ * @return true if every byte was written, false otherwise
+ */
+static bool write_file(void *context, const void *data, size_t size) {
+    return fwrite(data, 1, size, (FILE *)context) == size;
 }
 
 // Write a 4-byte unsigned integer in big-endian format
-static bool write_uint32(FILE *fp, uint32_t value) {
+static bool write_uint32(png_sink_t *sink, uint32_t value) {
     unsigned char bytes[4];
     bytes[0] = (value >> 24) & 0xFF;
     bytes[1] = (value >> 16) & 0xFF;
     bytes[2] = (value >> 8) & 0xFF;
     bytes[3] = value & 0xFF;
-    return (fwrite(bytes, 1, 4, fp) == 4);
+    return sink_write(sink, bytes, 4);
 }
 
 // Write a chunk to the PNG file
-static int write_chunk(FILE *fp, const char *type, const unsigned char *data, size_t length) {
+static int write_chunk(png_sink_t *sink, const char *type, const unsigned char *data, size_t length) {
     // Write length
-    if (!write_uint32(fp, length)) {
+    if (!write_uint32(sink, length)) {
         return 0;
     }
     
     // Write type and data
-    if (fwrite(type, 1, 4, fp) != 4) {
+    if (!sink_write(sink, type, 4)) {
         return 0;
     }
     
     if (length > 0 && data != NULL) {
-        if (fwrite(data, 1, length, fp) != length) {
+        if (!sink_write(sink, data, length)) {
             return 0;
         }
     }
     
-    // Calculate and write CRC
-    unsigned char *crc_buf = malloc(4 + length);
-    if (!crc_buf) return 0;
-    
-    memcpy(crc_buf, type, 4);
+    // Calculate and write CRC over the type and data as they are
+    uint32_t crc_value = update_crc(0xffffffffL, (const unsigned char *)type, 4);
     if (length > 0 && data != NULL) {
-        memcpy(crc_buf + 4, data, length);
+        crc_value = update_crc(crc_value, data, length);
     }
+    crc_value ^= 0xffffffffL;
     
-    uint32_t crc_value = crc(crc_buf, 4 + length);
-    free(crc_buf);
-    
-    if (!write_uint32(fp, crc_value)) {
+    if (!write_uint32(sink, crc_value)) {
         return 0;
     }
     
@@ -118,39 +287,423 @@ static int write_chunk(FILE *fp, const char *type, const unsigned char *data, si
 }
 
 /**
- * @brief Save the waveform image as an optimized PNG file
- * 
- * This function creates a 2-bit indexed color PNG file with optimal compression
- * settings, directly using the internal 2-bit representation for maximum efficiency.
- * 
+ * @brief Deflate output and write it as IDAT chunks
+ *
+ * @param sink Where to write, or NULL to only count the compressed bytes
+ * @param stream Deflate stream with input set up
+ * @param buffer Output buffer of IDAT_CHUNK_SIZE bytes
+ * @param flush Z_NO_FLUSH while rows remain, Z_FINISH for the end
+ * @param compressed Incremented by the number of compressed bytes produced
+ * @param deflate_seconds Incremented by the time spent in deflate(), or NULL
+ * @return true if successful, false otherwise
+ */
+static bool deflate_to_chunks(png_sink_t *sink, z_stream *stream, unsigned char *buffer, int flush,
+                              size_t *compressed, double *deflate_seconds) {
+    for (;;) {
+        double start = deflate_seconds ? waver_stats_now() : 0.0;
+        int z_result = deflate(stream, flush);
+        if (deflate_seconds) {
+            *deflate_seconds += waver_stats_now() - start;
+        }
+        if (z_result == Z_STREAM_ERROR) {
+            return false;
+        }
+
+        // Emit a chunk whenever the buffer is full, and whatever is left at the end
+        size_t pending = IDAT_CHUNK_SIZE - stream->avail_out;
+        if (stream->avail_out == 0 || (z_result == Z_STREAM_END && pending > 0)) {
+            if (sink && !write_chunk(sink, CHUNK_TYPE_IDAT, buffer, pending)) {
+                return false;
+            }
+            *compressed += pending;
+            stream->next_out = buffer;
+            stream->avail_out = IDAT_CHUNK_SIZE;
+        }
+
+        if (z_result == Z_STREAM_END) {
+            return true;
+        }
+        if (flush == Z_NO_FLUSH && stream->avail_in == 0 && stream->avail_out > 0) {
+            return true;
+        }
+    }
+}
+
+/**
+ * @brief Create reusable PNG encoder state
+ *
+ * @return New encoder or NULL on allocation failure
+ */
+waver_png_encoder_t *waver_png_encoder_new(void) {
+    return calloc(1, sizeof(waver_png_encoder_t));
+}
+
+/**
+ * @brief Free PNG encoder state
+ *
+ * @param encoder Encoder to free (may be NULL)
+ */
+void waver_png_encoder_free(waver_png_encoder_t *encoder) {
+    if (!encoder) {
+        return;
+    }
+
+    for (size_t i = 0; i < ENCODER_STREAMS; i++) {
+        if (encoder->streams[i].ready) {
+            deflateEnd(&encoder->streams[i].stream);
+        }
+    }
+#ifdef WAVER_HAVE_LIBDEFLATE
+    for (size_t i = 0; i < ENCODER_STREAMS; i++) {
+        if (encoder->compressors[i]) {
+            libdeflate_free_compressor(encoder->compressors[i]);
+        }
+    }
+    free(encoder->raw.data);
+    free(encoder->output.data);
+    free(encoder->best.data);
+#endif
+    free(encoder->previous);
+    free(encoder->current);
+    free(encoder->filtered);
+    free(encoder);
+}
+
+/**
+ * @brief Make sure a buffer holds at least size bytes
+ *
+ * @param buffer Buffer to grow
+ * @param size Bytes needed
+ * @return true if successful, false on allocation failure
+ */
+static bool grow_buffer(unsigned char **buffer, size_t size) {
+    unsigned char *grown = realloc(*buffer, size);
+    if (!grown) {
+        return false;
+    }
+    *buffer = grown;
+    return true;
+}
+
+/**
+ * @brief Prepare the scanline buffers of an encoder for an image
+ *
+ * @param encoder Encoder state
+ * @param line_width Bytes per scanline of the image
+ * @return true if successful, false on allocation failure
+ */
+static bool encoder_rows(waver_png_encoder_t *encoder, unsigned int line_width) {
+    if (line_width > encoder->row_capacity) {
+        if (!grow_buffer(&encoder->previous, line_width) || !grow_buffer(&encoder->current, line_width) ||
+            !grow_buffer(&encoder->filtered, 1 + (size_t)line_width)) { // +1 for filter byte per scanline
+            return false;
+        }
+        encoder->row_capacity = line_width;
+    }
+    memset(encoder->previous, 0, line_width);
+    return true;
+}
+
+/**
+ * @brief Get a zlib stream for a candidate, ready for a new image
+ *
+ * @param encoder Encoder state
+ * @param candidate Level and strategy wanted
+ * @return Reset stream, or NULL on error
+ */
+static z_stream *encoder_stream(waver_png_encoder_t *encoder, const png_candidate_t *candidate) {
+    encoder_stream_t *free_slot = NULL;
+    for (size_t i = 0; i < ENCODER_STREAMS; i++) {
+        encoder_stream_t *slot = &encoder->streams[i];
+        if (slot->ready && slot->level == candidate->level && slot->strategy == candidate->strategy) {
+            return deflateReset(&slot->stream) == Z_OK ? &slot->stream : NULL;
+        }
+        if (!slot->ready && !free_slot) {
+            free_slot = slot;
+        }
+    }
+
+    // Every slot holds other settings: give up the first one
+    if (!free_slot) {
+        free_slot = &encoder->streams[0];
+        deflateEnd(&free_slot->stream);
+        free_slot->ready = false;
+    }
+
+    memset(&free_slot->stream, 0, sizeof(free_slot->stream));
+    if (deflateInit2(&free_slot->stream, candidate->level, Z_DEFLATED, 15, 8, candidate->strategy) != Z_OK) {
+        return NULL;
+    }
+    free_slot->level = candidate->level;
+    free_slot->strategy = candidate->strategy;
+    free_slot->ready = true;
+    return &free_slot->stream;
+}
+
+/**
+ * @brief Fetch and filter one scanline
+ *
+ * @param image Image to read from
+ * @param y Row to fetch
+ * @param up_filter Whether to use the UP filter (rows after the first only)
+ * @param previous Unfiltered previous row (updated to this row on return)
+ * @param current Scratch row of line_width bytes (swapped with previous)
+ * @param filtered Output filter byte plus line_width filtered bytes
+ */
+static void filter_row(const waver_image_t *image, unsigned int y, bool up_filter,
+                       unsigned char **previous, unsigned char **current, unsigned char *filtered) {
+    unsigned int line_width = image->line_width;
+    waver_image_row(image, y, *current);
+
+    if (up_filter && y > 0) {
+        // Apply UP filter: each byte is difference from byte in previous scanline
+        filtered[0] = PNG_FILTER_UP;
+        for (unsigned int x = 0; x < line_width; x++) {
+            filtered[1 + x] = (*current)[x] - (*previous)[x];
+        }
+    } else {
+        // The first scanline has no previous line to filter against
+        filtered[0] = PNG_FILTER_NONE;
+        memcpy(filtered + 1, *current, line_width);
+    }
+
+    unsigned char *swap = *previous;
+    *previous = *current;
+    *current = swap;
+}
+
+/**
+ * @brief Filter, compress and write the scanlines of an image with zlib
+ *
+ * Each row is fetched, filtered and fed to deflate on its own, and the
+ * compressed data goes out in IDAT chunks of at most IDAT_CHUNK_SIZE
+ * bytes, so memory use does not depend on the image size.
+ *
+ * @param encoder Encoder state
+ * @param sink Where to write, or NULL to only measure the compressed size
+ * @param image Image to save
+ * @param candidate Filter, level and strategy to use
+ * @param compressed Receives the number of compressed bytes
+ * @param timing Incremented by the filter and compress time, or NULL
+ * @return true if successful, false otherwise
+ */
+static bool write_image_data(waver_png_encoder_t *encoder, png_sink_t *sink, const waver_image_t *image,
+                             const png_candidate_t *candidate, size_t *compressed, waver_png_stats_t *timing) {
+    unsigned int line_width = image->line_width;
+    z_stream *stream = encoder_rows(encoder, line_width) ? encoder_stream(encoder, candidate) : NULL;
+    if (!stream) {
+        return false;
+    }
+    stream->next_out = encoder->buffer;
+    stream->avail_out = IDAT_CHUNK_SIZE;
+    *compressed = 0;
+
+    double *deflate_seconds = timing ? &timing->compress_seconds : NULL;
+    bool success = true;
+    for (unsigned int y = 0; success && y < image->height; y++) {
+        double start = timing ? waver_stats_now() : 0.0;
+        filter_row(image, y, candidate->up_filter, &encoder->previous, &encoder->current, encoder->filtered);
+        if (timing) {
+            timing->filter_seconds += waver_stats_now() - start;
+        }
+        stream->next_in = encoder->filtered;
+        stream->avail_in = 1 + line_width;
+        success = deflate_to_chunks(sink, stream, encoder->buffer, Z_NO_FLUSH, compressed, deflate_seconds);
+    }
+
+    if (success) {
+        stream->next_in = NULL;
+        stream->avail_in = 0;
+        success = deflate_to_chunks(sink, stream, encoder->buffer, Z_FINISH, compressed, deflate_seconds);
+    }
+    return success;
+}
+
+/**
+ * @brief Pick the candidate with the smallest zlib output
+ *
+ * With a single candidate nothing is compressed.
+ *
+ * @param encoder Encoder state
+ * @param image Image to save
+ * @param profile Candidates to try
+ * @param stats Incremented by the number of trial compressions (and their time with timing)
+ * @param timing Whether to measure the filter and compress time
+ * @return The smallest candidate, or NULL on error
+ */
+static const png_candidate_t *pick_zlib_candidate(waver_png_encoder_t *encoder, const waver_image_t *image,
+                                                  const png_profile_t *profile, waver_png_stats_t *stats,
+                                                  bool timing) {
+    if (profile->count == 1) {
+        return &profile->candidates[0];
+    }
+
+    const png_candidate_t *best = NULL;
+    size_t best_size = 0;
+    for (size_t i = 0; i < profile->count; i++) {
+        size_t size;
+        if (!write_image_data(encoder, NULL, image, &profile->candidates[i], &size, timing ? stats : NULL)) {
+            return NULL;
+        }
+        stats->passes++;
+        if (!best || size < best_size) {
+            best = &profile->candidates[i];
+            best_size = size;
+        }
+    }
+    return best;
+}
+
+#ifdef WAVER_HAVE_LIBDEFLATE
+/**
+ * @brief Get a libdeflate compressor for a level
+ *
+ * @param encoder Encoder state
+ * @param level Compression level
+ * @return Compressor, or NULL on allocation failure
+ */
+static struct libdeflate_compressor *encoder_compressor(waver_png_encoder_t *encoder, int level) {
+    size_t free_slot = ENCODER_STREAMS;
+    for (size_t i = 0; i < ENCODER_STREAMS; i++) {
+        if (encoder->compressors[i] && encoder->compressor_levels[i] == level) {
+            return encoder->compressors[i];
+        }
+        if (!encoder->compressors[i] && free_slot == ENCODER_STREAMS) {
+            free_slot = i;
+        }
+    }
+
+    // Every slot holds another level: give up the first one
+    if (free_slot == ENCODER_STREAMS) {
+        free_slot = 0;
+        libdeflate_free_compressor(encoder->compressors[0]);
+    }
+    encoder->compressors[free_slot] = libdeflate_alloc_compressor(level);
+    encoder->compressor_levels[free_slot] = level;
+    return encoder->compressors[free_slot];
+}
+
+/**
+ * @brief Make sure an encoder buffer holds at least size bytes
+ *
+ * @param buffer Buffer to grow
+ * @param size Bytes needed
+ * @return true if successful, false on allocation failure
+ */
+static bool grow_encoder_buffer(encoder_buffer_t *buffer, size_t size) {
+    if (size <= buffer->capacity) {
+        return true;
+    }
+    if (!grow_buffer(&buffer->data, size)) {
+        return false;
+    }
+    buffer->capacity = size;
+    return true;
+}
+
+/**
+ * @brief Compress the image data with libdeflate and write it as IDAT chunks
+ *
+ * libdeflate only compresses whole buffers, so unlike the zlib path this
+ * holds the filtered image and its compressed form in memory at once.
+ * Every candidate of the profile is compressed and the smallest is written.
+ *
+ * @param encoder Encoder state
+ * @param sink Where to write
+ * @param image Image to save
+ * @param profile Candidates to try
+ * @param stats Receives the passes and the kept candidate (and the time spent with timing)
+ * @param timing Whether to measure the filter and compress time
+ * @return true if successful, false otherwise
+ */
+static bool write_image_data_libdeflate(waver_png_encoder_t *encoder, png_sink_t *sink, const waver_image_t *image,
+                                        const png_profile_t *profile, waver_png_stats_t *stats, bool timing) {
+    unsigned int line_width = image->line_width;
+    size_t raw_size = (1 + (size_t)line_width) * image->height;
+    size_t best_size = 0;
+    bool success = encoder_rows(encoder, line_width) && grow_encoder_buffer(&encoder->raw, raw_size);
+
+    for (size_t i = 0; success && i < profile->count; i++) {
+        const png_candidate_t *candidate = &profile->candidates[i];
+        struct libdeflate_compressor *compressor = encoder_compressor(encoder, candidate->level);
+        if (!compressor) {
+            success = false;
+            break;
+        }
+
+        double start = timing ? waver_stats_now() : 0.0;
+        memset(encoder->previous, 0, line_width);
+        for (unsigned int y = 0; y < image->height; y++) {
+            filter_row(image, y, candidate->up_filter, &encoder->previous, &encoder->current,
+                       encoder->raw.data + (size_t)y * (1 + line_width));
+        }
+        if (timing) {
+            double now = waver_stats_now();
+            stats->filter_seconds += now - start;
+            start = now;
+        }
+
+        size_t bound = libdeflate_zlib_compress_bound(compressor, raw_size);
+        size_t size = 0;
+        if (grow_encoder_buffer(&encoder->output, bound)) {
+            size = libdeflate_zlib_compress(compressor, encoder->raw.data, raw_size, encoder->output.data, bound);
+        }
+        if (timing) {
+            stats->compress_seconds += waver_stats_now() - start;
+        }
+        if (size == 0) {
+            success = false;
+            break;
+        }
+
+        stats->passes++;
+        if (best_size == 0 || size < best_size) {
+            // Keep this result and compress the next candidate into the old buffer
+            encoder_buffer_t swap = encoder->best;
+            encoder->best = encoder->output;
+            encoder->output = swap;
+            best_size = size;
+            stats->encoding = candidate->name;
+        }
+    }
+
+    for (size_t offset = 0; success && offset < best_size; offset += IDAT_CHUNK_SIZE) {
+        size_t length = best_size - offset < IDAT_CHUNK_SIZE ? best_size - offset : IDAT_CHUNK_SIZE;
+        success = write_chunk(sink, CHUNK_TYPE_IDAT, encoder->best.data + offset, length);
+    }
+    return success;
+}
+#endif
+
+/**
+ * @brief Encode a PNG with the given encoder state
+ *
+ * This function creates a 2-bit indexed color PNG, directly using the
+ * internal 2-bit representation, and compresses it with every candidate
+ * encoding of the chosen profile, keeping the smallest.
+ *
+ * @param encoder Encoder state
  * @param image Image to save
  * @param bg_color Background color
  * @param left_color Left channel color
  * @param right_color Right channel color
- * @param output_path Path to save the PNG to
- * @param use_up_filter Whether to use the UP filter (usually better compression)
+ * @param sink Where the PNG goes
+ * @param options Encoder settings
+ * @param stats Receives what the encoder did
  * @return true if successful, false otherwise
  */
-static bool waver_image_save_optimized_png_with_filter(
+static bool encode_png(
+    waver_png_encoder_t *encoder,
     const waver_image_t *image,
     const waver_color_t *bg_color,
     const waver_color_t *left_color,
     const waver_color_t *right_color,
-    const char *output_path,
-    bool use_up_filter
+    png_sink_t *sink,
+    const waver_png_options_t *options,
+    waver_png_stats_t *stats
 ) {
-    if (!image || !bg_color || !left_color || !right_color || !output_path) {
-        return false;
-    }
-
-    FILE *fp = fopen(output_path, "wb");
-    if (!fp) {
-        return false;
-    }
-    
     // Write PNG signature
-    if (fwrite(PNG_SIGNATURE, 1, 8, fp) != 8) {
-        fclose(fp);
+    if (!sink_write(sink, PNG_SIGNATURE, 8)) {
         return false;
     }
     
@@ -176,8 +729,7 @@ static bool waver_image_save_optimized_png_with_filter(
     ihdr_data[12] = PNG_INTERLACE_NONE;
     
     // Write IHDR chunk
-    if (!write_chunk(fp, CHUNK_TYPE_IHDR, ihdr_data, 13)) {
-        fclose(fp);
+    if (!write_chunk(sink, CHUNK_TYPE_IHDR, ihdr_data, 13)) {
         return false;
     }
     
@@ -205,8 +757,7 @@ static bool waver_image_save_optimized_png_with_filter(
     plte_data[11] = bg_color->blue;
     
     // Write PLTE chunk
-    if (!write_chunk(fp, CHUNK_TYPE_PLTE, plte_data, 12)) {
-        fclose(fp);
+    if (!write_chunk(sink, CHUNK_TYPE_PLTE, plte_data, 12)) {
         return false;
     }
     
@@ -218,84 +769,168 @@ static bool waver_image_save_optimized_png_with_filter(
         trns_data[2] = right_color->alpha;
         trns_data[3] = bg_color->alpha;  // Unused entry alpha
         
-        if (!write_chunk(fp, "tRNS", trns_data, 4)) {
-            fclose(fp);
+        if (!write_chunk(sink, "tRNS", trns_data, 4)) {
             return false;
         }
     }
     
-    // Compress the image data with zlib
-    uLongf compress_buf_size = image->height * (1 + image->line_width);  // +1 for filter byte per scanline
-    unsigned char *scanlines = malloc(compress_buf_size);
-    if (!scanlines) {
-        fclose(fp);
+    // Compress the image data
+    bool success;
+#ifdef WAVER_HAVE_LIBDEFLATE
+    if (options->deflate == WAVER_PNG_DEFLATE_LIBDEFLATE) {
+        success = write_image_data_libdeflate(encoder, sink, image, &LIBDEFLATE_PROFILES[options->profile], stats,
+                                              options->timing);
+    } else
+#endif
+    {
+        // Trial runs only count bytes; the kept candidate is streamed to the file
+        const png_candidate_t *candidate =
+            pick_zlib_candidate(encoder, image, &ZLIB_PROFILES[options->profile], stats, options->timing);
+        size_t compressed;
+        success = candidate &&
+                  write_image_data(encoder, sink, image, candidate, &compressed, options->timing ? stats : NULL);
+        if (candidate) {
+            stats->encoding = candidate->name;
+            stats->passes++;
+        }
+    }
+    if (!success) {
         return false;
     }
     
-    if (use_up_filter) {
-        // Process scanlines with UP filter (filter type 2) for better compression
-        // First scanline uses None filter (0) since there's no previous line
-        scanlines[0] = PNG_FILTER_NONE;
-        memcpy(scanlines + 1, image->pixels, image->line_width);
-        
-        // All other scanlines use UP filter
-        for (unsigned int y = 1; y < image->height; y++) {
-            scanlines[y * (1 + image->line_width)] = PNG_FILTER_UP;  // Up filter
-            
-            // Apply UP filter: each byte is difference from byte in previous scanline
-            for (unsigned int x = 0; x < image->line_width; x++) {
-                unsigned int current_idx = y * image->line_width + x;
-                unsigned int prev_idx = (y - 1) * image->line_width + x;
-                
-                scanlines[y * (1 + image->line_width) + 1 + x] = 
-                    image->pixels[current_idx] - image->pixels[prev_idx];
-            }
-        }
-    } else {
-        // Copy scanlines with filter byte (NONE) before each
-        for (unsigned int y = 0; y < image->height; y++) {
-            scanlines[y * (1 + image->line_width)] = PNG_FILTER_NONE;  // None filter
-            memcpy(scanlines + y * (1 + image->line_width) + 1, 
-                image->pixels + y * image->line_width, 
-                image->line_width);
+    // Write IEND chunk
+    if (!write_chunk(sink, CHUNK_TYPE_IEND, NULL, 0)) {
+        return false;
+    }
+    stats->bytes = sink->bytes;
+    return true;
+}
+
+/**
+ * @brief Set up the defaults, the stats and a temporary encoder, then encode
+ *
+ * @param image Image to encode
+ * @param bg_color Background color
+ * @param left_color Left channel color
+ * @param right_color Right channel color
+ * @param sink Where the PNG goes
+ * @param options Encoder settings (NULL for the defaults)
+ * @param encoder Reusable encoder state (NULL to set up and free temporary state)
+ * @param stats Receives what the encoder did (may be NULL)
+ * @return true if successful, false otherwise
+ */
+static bool encode_with_defaults(
+    const waver_image_t *image,
+    const waver_color_t *bg_color,
+    const waver_color_t *left_color,
+    const waver_color_t *right_color,
+    png_sink_t *sink,
+    const waver_png_options_t *options,
+    waver_png_encoder_t *encoder,
+    waver_png_stats_t *stats
+) {
+    waver_png_options_t defaults = {WAVER_PNG_PROFILE_BALANCED, WAVER_PNG_DEFLATE_ZLIB, false};
+    if (!options) {
+        options = &defaults;
+    }
+    waver_png_stats_t local_stats;
+    if (!stats) {
+        stats = &local_stats;
+    }
+    memset(stats, 0, sizeof(*stats));
+
+    waver_png_encoder_t *temporary = NULL;
+    if (!encoder) {
+        encoder = temporary = waver_png_encoder_new();
+        if (!encoder) {
+            return false;
         }
     }
-    
-    // Compress the data
-    uLongf compress_len = compress_buf_size * 1.1 + 12;  // Add some margin as required by zlib
-    unsigned char *compressed = malloc(compress_len);
-    if (!compressed) {
-        free(scanlines);
-        fclose(fp);
+
+    bool success = encode_png(encoder, image, bg_color, left_color, right_color, sink, options, stats);
+    waver_png_encoder_free(temporary);
+    return success;
+}
+
+/**
+ * @brief Save the waveform image as a PNG file using the given encoder settings
+ *
+ * @param image Image to save
+ * @param bg_color Background color
+ * @param left_color Left channel color
+ * @param right_color Right channel color
+ * @param output_path Path to save the PNG to
+ * @param options Encoder settings (NULL for the defaults)
+ * @param encoder Reusable encoder state (NULL to set up and free temporary state)
+ * @param stats Receives what the encoder did (may be NULL)
+ * @return true if successful, false otherwise
+ */
+bool waver_image_save_png(
+    const waver_image_t *image,
+    const waver_color_t *bg_color,
+    const waver_color_t *left_color,
+    const waver_color_t *right_color,
+    const char *output_path,
+    const waver_png_options_t *options,
+    waver_png_encoder_t *encoder,
+    waver_png_stats_t *stats
+) {
+    if (!image || !bg_color || !left_color || !right_color || !output_path) {
         return false;
     }
-    
-    int z_result = compress2(compressed, &compress_len, scanlines, compress_buf_size, 9);  // Max compression
-    free(scanlines);
-    
-    if (z_result != Z_OK) {
-        free(compressed);
-        fclose(fp);
+
+    double start = waver_stats_now();
+    FILE *fp = fopen(output_path, "wb");
+    if (!fp) {
         return false;
     }
-    
-    // Write IDAT chunk
-    if (!write_chunk(fp, CHUNK_TYPE_IDAT, compressed, compress_len)) {
-        free(compressed);
-        fclose(fp);
-        return false;
+    png_sink_t sink = {write_file, fp, 0};
+    bool success = encode_with_defaults(image, bg_color, left_color, right_color, &sink, options, encoder, stats);
+    if (fclose(fp) != 0) {
+        success = false;
     }
-    
-    free(compressed);
-    
-    // Write IEND chunk
-    if (!write_chunk(fp, CHUNK_TYPE_IEND, NULL, 0)) {
-        fclose(fp);
+    if (success && stats) {
+        stats->seconds = waver_stats_now() - start;
+    }
+    return success;
+}
+
+/**
+ * @brief Encode the waveform image as a PNG and pass it to a callback
+ *
+ * @param image Image to encode
+ * @param bg_color Background color
+ * @param left_color Left channel color
+ * @param right_color Right channel color
+ * @param write Receives the PNG in pieces, in order
+ * @param write_context Passed to write
+ * @param options Encoder settings (NULL for the defaults)
+ * @param encoder Reusable encoder state (NULL to set up and free temporary state)
+ * @param stats Receives what the encoder did (may be NULL)
+ * @return true if successful, false otherwise (including when write fails)
+ */
+bool waver_image_encode_png(
+    const waver_image_t *image,
+    const waver_color_t *bg_color,
+    const waver_color_t *left_color,
+    const waver_color_t *right_color,
+    waver_write_fn write,
+    void *write_context,
+    const waver_png_options_t *options,
+    waver_png_encoder_t *encoder,
+    waver_png_stats_t *stats
+) {
+    if (!image || !bg_color || !left_color || !right_color || !write) {
         return false;
     }
-    
-    fclose(fp);
-    return true;
+
+    double start = waver_stats_now();
+    png_sink_t sink = {write, write_context, 0};
+    bool success = encode_with_defaults(image, bg_color, left_color, right_color, &sink, options, encoder, stats);
+    if (success && stats) {
+        stats->seconds = waver_stats_now() - start;
+    }
+    return success;
 }
 
 /**
@@ -318,7 +953,63 @@ bool waver_image_save_optimized_png(
     const waver_color_t *right_color,
     const char *output_path
 ) {
-    // Use the UP filter by default for better compression in most cases
-    return waver_image_save_optimized_png_with_filter(
-        image, bg_color, left_color, right_color, output_path, true);
+    return waver_image_save_png(image, bg_color, left_color, right_color, output_path, NULL, NULL, NULL);
+}
+
+/**
+ * @brief Parse a PNG profile name as given on the command line
+ *
+ * @param name Profile name ("fast", "balanced" or "smallest")
+ * @param profile Output profile
+ * @return true if successful, false otherwise
+ */
+bool waver_png_profile_parse(const char *name, waver_png_profile_t *profile) {
+    if (strcmp(name, "balanced") == 0) {
+        *profile = WAVER_PNG_PROFILE_BALANCED;
+    } else if (strcmp(name, "fast") == 0) {
+        *profile = WAVER_PNG_PROFILE_FAST;
+    } else if (strcmp(name, "smallest") == 0) {
+        *profile = WAVER_PNG_PROFILE_SMALLEST;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Parse a deflate implementation name as given on the command line
+ *
+ * @param name Implementation name ("zlib" or "libdeflate")
+ * @param deflate Output implementation
+ * @return true if successful, false if unknown or not built in
+ */
+bool waver_png_deflate_parse(const char *name, waver_png_deflate_t *deflate) {
+    if (strcmp(name, "zlib") == 0) {
+        *deflate = WAVER_PNG_DEFLATE_ZLIB;
+        return true;
+    }
+#ifdef WAVER_HAVE_LIBDEFLATE
+    if (strcmp(name, "libdeflate") == 0) {
+        *deflate = WAVER_PNG_DEFLATE_LIBDEFLATE;
+        return true;
+    }
+#endif
+    return false;
+}
+
+/**
+ * @brief Name of a PNG profile
+ *
+ * @param profile Profile
+ * @return Name as accepted by waver_png_profile_parse()
+ */
+const char *waver_png_profile_name(waver_png_profile_t profile) {
+    switch (profile) {
+        case WAVER_PNG_PROFILE_FAST:
+            return "fast";
+        case WAVER_PNG_PROFILE_SMALLEST:
+            return "smallest";
+        default:
+            return "balanced";
+    }
 }
\ No newline at end of file
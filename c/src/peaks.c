@@ -0,0 +1,525 @@
+/**
+ * @file peaks.c
+ * @brief Per-column peak accumulation for waveform generation
+ *
+ * Decoded samples are reduced to the maximum absolute value per pixel
+ * column before anything is drawn.  The columns are laid out from the
+ * expected number of samples; when that number is only an estimate each
+ * column is split into several bins so that, if the decoded length turns
+ * out to differ, the bins can be re-binned onto the real column layout
+ * without decoding the file again.
+ *
+ * Samples are reduced one run at a time, a run being the part of a block
+ * that falls into the current bin.  The runs are reduced with SSE2 (x86-64)
+ * or NEON (AArch64) kernels specialized for mono and stereo; the plain
+ * per-sample loop is kept as waver_peaks_add_scalar() for reference.
+ */
+
+#include "waver.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PEAKS_HAVE_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PEAKS_HAVE_NEON
+#endif
+
+// Define INT16_MIN if not defined
+#ifndef INT16_MIN
+#define INT16_MIN (-32768)
+#endif
+
+/**
+ * @brief Absolute value of a PCM sample
+ *
+ * This function converts a PCM sample into its positive only value
+ * It handles the special case of sample being INT16_MIN value.
+ *
+ * @param sample The signed PCM sample
+ * @return The absolue value of the signed PCM sample
+ */
+static unsigned int abs_pcm(int16_t sample) {
+    if (sample == INT16_MIN) {
+        return 32767;
+    }
+    return (sample < 0) ? -sample : sample;
+}
+
+/**
+ * @brief First sample (per channel) of a pixel column
+ *
+ * Column 0 holds total/width samples and every later column gets one
+ * extra sample each time the running remainder wraps past the width.
+ * Columns at or beyond the width continue the same spacing, which is
+ * where any samples that do not fit the layout end up.
+ *
+ * @param total_samples Samples per channel in the whole file
+ * @param width Number of columns
+ * @param column Column index
+ * @return Index of the first sample of the column
+ */
+uint64_t waver_column_start(uint64_t total_samples, unsigned int width, uint64_t column) {
+    if (column == 0) {
+        return 0;
+    }
+    uint64_t samples_per_pixel = total_samples / width;
+    uint64_t remainder = total_samples % width;
+    return column * samples_per_pixel + ((column - 1) * remainder) / width;
+}
+
+/**
+ * @brief Number of samples in one bin of the accumulator layout
+ *
+ * @param peaks Peak accumulator
+ * @param bin Bin index
+ * @return Number of samples that belong to the bin (may be 0)
+ */
+static uint64_t bin_length(const waver_peaks_t *peaks, size_t bin) {
+    uint64_t column = peaks->first_column + bin / peaks->split;
+    unsigned int part = bin % peaks->split;
+    uint64_t length = waver_column_start(peaks->expected_samples, peaks->width, column + 1) -
+                      waver_column_start(peaks->expected_samples, peaks->width, column);
+
+    return length / peaks->split + (part < length % peaks->split ? 1 : 0);
+}
+
+/**
+ * @brief Make room for at least one more bin
+ *
+ * @param peaks Peak accumulator
+ * @return true if successful, false on allocation failure
+ */
+static bool grow_bins(waver_peaks_t *peaks) {
+    size_t capacity = peaks->capacity * 2;
+    uint16_t *left = realloc(peaks->left, capacity * sizeof(uint16_t));
+    if (!left) {
+        return false;
+    }
+    peaks->left = left;
+
+    uint16_t *right = realloc(peaks->right, capacity * sizeof(uint16_t));
+    if (!right) {
+        return false;
+    }
+    peaks->right = right;
+
+    memset(peaks->left + peaks->capacity, 0, (capacity - peaks->capacity) * sizeof(uint16_t));
+    memset(peaks->right + peaks->capacity, 0, (capacity - peaks->capacity) * sizeof(uint16_t));
+    peaks->capacity = capacity;
+    return true;
+}
+
+/**
+ * @brief Move to the next bin that holds at least one sample
+ *
+ * @param peaks Peak accumulator
+ * @return true if successful, false on allocation failure
+ */
+static bool next_bin(waver_peaks_t *peaks) {
+    do {
+        peaks->bin++;
+        if (peaks->bin >= peaks->capacity && !grow_bins(peaks)) {
+            return false;
+        }
+        peaks->bin_remaining = bin_length(peaks, peaks->bin);
+    } while (peaks->bin_remaining == 0);
+    return true;
+}
+
+/**
+ * @brief Create a new peak accumulator
+ *
+ * The accumulator expects samples starting at first_sample, which lets
+ * several accumulators cover consecutive sample ranges of the same layout.
+ * When first_sample is not the first sample of a column, the first column
+ * only sees part of its samples and has to be merged with the accumulator
+ * of the previous range.
+ *
+ * @param width Number of image columns
+ * @param expected_samples Expected number of samples per channel
+ * @param split Bins per column (1 when expected_samples is exact)
+ * @param first_sample First sample (per channel) that will be accumulated
+ * @return New accumulator or NULL on error
+ */
+waver_peaks_t *waver_peaks_new(unsigned int width, uint64_t expected_samples, unsigned int split,
+                               uint64_t first_sample) {
+    if (width == 0 || expected_samples == 0 || split == 0 ||
+        first_sample >= waver_column_start(expected_samples, width, width)) {
+        return NULL;
+    }
+
+    // Find the column holding the first sample, starting from an estimate
+    uint64_t column = (uint64_t)((double)first_sample / expected_samples * width);
+    if (column >= width) {
+        column = width - 1;
+    }
+    while (column > 0 && waver_column_start(expected_samples, width, column) > first_sample) {
+        column--;
+    }
+    while (waver_column_start(expected_samples, width, column + 1) <= first_sample) {
+        column++;
+    }
+
+    waver_peaks_t *peaks = calloc(1, sizeof(waver_peaks_t));
+    if (!peaks) {
+        return NULL;
+    }
+
+    peaks->width = width;
+    peaks->split = split;
+    peaks->first_column = (unsigned int)column;
+    peaks->expected_samples = expected_samples;
+
+    // One spare column absorbs the samples past the last column
+    peaks->capacity = (size_t)(width - peaks->first_column + 1) * split;
+    peaks->left = calloc(peaks->capacity, sizeof(uint16_t));
+    peaks->right = calloc(peaks->capacity, sizeof(uint16_t));
+    if (!peaks->left || !peaks->right) {
+        waver_peaks_free(peaks);
+        return NULL;
+    }
+
+    // Start on the bin holding the first sample
+    uint64_t offset = first_sample - waver_column_start(expected_samples, width, column);
+    uint64_t length = bin_length(peaks, 0);
+    while (offset >= length) {
+        offset -= length;
+        peaks->bin++;
+        length = bin_length(peaks, peaks->bin);
+    }
+    peaks->bin_remaining = length - offset;
+
+    return peaks;
+}
+
+/**
+ * @brief Free memory allocated for a peak accumulator
+ *
+ * @param peaks Accumulator to free
+ */
+void waver_peaks_free(waver_peaks_t *peaks) {
+    if (!peaks) {
+        return;
+    }
+
+    free(peaks->left);
+    free(peaks->right);
+    free(peaks);
+}
+
+/**
+ * @brief Accumulate a block of interleaved PCM samples one sample at a time
+ *
+ * Reference implementation of waver_peaks_add(); both produce the same bins.
+ *
+ * @param peaks Peak accumulator
+ * @param pcm Interleaved PCM samples
+ * @param frames Number of sample frames (samples per channel) in pcm
+ * @param channels Channels in pcm; only the first two are used
+ * @return true if successful, false on allocation failure
+ */
+bool waver_peaks_add_scalar(waver_peaks_t *peaks, const int16_t *pcm, size_t frames, unsigned int channels) {
+    unsigned int left = peaks->left[peaks->bin];
+    unsigned int right = peaks->right[peaks->bin];
+
+    for (size_t i = 0; i < frames; i++, pcm += channels) {
+        // Process each channel's sample
+        unsigned int sample = abs_pcm(pcm[0]);
+        if (sample > left) {
+            left = sample;
+        }
+
+        if (channels > 1) {
+            sample = abs_pcm(pcm[1]);
+            if (sample > right) {
+                right = sample;
+            }
+        }
+
+        peaks->bin_remaining--;
+        if (peaks->bin_remaining == 0) {
+            peaks->left[peaks->bin] = (uint16_t)left;
+            peaks->right[peaks->bin] = (uint16_t)right;
+            if (!next_bin(peaks)) {
+                return false;
+            }
+            left = 0;
+            right = 0;
+        }
+    }
+
+    peaks->left[peaks->bin] = (uint16_t)left;
+    peaks->right[peaks->bin] = (uint16_t)right;
+    peaks->samples += frames;
+    return true;
+}
+
+/**
+ * @brief Peak of a run of mono samples
+ *
+ * The SIMD paths compute abs() with saturation, which maps INT16_MIN to
+ * 32767 exactly like abs_pcm().
+ *
+ * @param pcm Mono PCM samples
+ * @param frames Number of samples
+ * @param peak Peak so far
+ * @return Updated peak
+ */
+static unsigned int peak_mono(const int16_t *pcm, size_t frames, unsigned int peak) {
+    size_t i = 0;
+
+#if defined(PEAKS_HAVE_SSE2)
+    if (frames >= 16) {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc0 = zero;
+        __m128i acc1 = zero;
+        for (; i + 16 <= frames; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(pcm + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(pcm + i + 8));
+            acc0 = _mm_max_epi16(acc0, _mm_max_epi16(a, _mm_subs_epi16(zero, a)));
+            acc1 = _mm_max_epi16(acc1, _mm_max_epi16(b, _mm_subs_epi16(zero, b)));
+        }
+        __m128i acc = _mm_max_epi16(acc0, acc1);
+        acc = _mm_max_epi16(acc, _mm_srli_si128(acc, 8));
+        acc = _mm_max_epi16(acc, _mm_srli_si128(acc, 4));
+        acc = _mm_max_epi16(acc, _mm_srli_si128(acc, 2));
+        unsigned int value = (uint16_t)_mm_cvtsi128_si32(acc);
+        if (value > peak) {
+            peak = value;
+        }
+    }
+#elif defined(PEAKS_HAVE_NEON)
+    if (frames >= 16) {
+        int16x8_t acc0 = vdupq_n_s16(0);
+        int16x8_t acc1 = vdupq_n_s16(0);
+        for (; i + 16 <= frames; i += 16) {
+            acc0 = vmaxq_s16(acc0, vqabsq_s16(vld1q_s16(pcm + i)));
+            acc1 = vmaxq_s16(acc1, vqabsq_s16(vld1q_s16(pcm + i + 8)));
+        }
+        unsigned int value = (unsigned int)vmaxvq_s16(vmaxq_s16(acc0, acc1));
+        if (value > peak) {
+            peak = value;
+        }
+    }
+#endif
+
+    for (; i < frames; i++) {
+        unsigned int sample = abs_pcm(pcm[i]);
+        if (sample > peak) {
+            peak = sample;
+        }
+    }
+    return peak;
+}
+
+/**
+ * @brief Peaks of a run of interleaved stereo samples
+ *
+ * @param pcm Interleaved left/right PCM samples
+ * @param frames Number of sample frames
+ * @param left Left peak so far, updated in place
+ * @param right Right peak so far, updated in place
+ */
+static void peak_stereo(const int16_t *pcm, size_t frames, uint16_t *left, uint16_t *right) {
+    unsigned int left_peak = *left;
+    unsigned int right_peak = *right;
+    size_t i = 0;
+
+#if defined(PEAKS_HAVE_SSE2)
+    if (frames >= 8) {
+        // Even lanes hold left samples and odd lanes right samples
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc0 = zero;
+        __m128i acc1 = zero;
+        for (; i + 8 <= frames; i += 8) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(pcm + 2 * i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(pcm + 2 * i + 8));
+            acc0 = _mm_max_epi16(acc0, _mm_max_epi16(a, _mm_subs_epi16(zero, a)));
+            acc1 = _mm_max_epi16(acc1, _mm_max_epi16(b, _mm_subs_epi16(zero, b)));
+        }
+        __m128i acc = _mm_max_epi16(acc0, acc1);
+        acc = _mm_max_epi16(acc, _mm_srli_si128(acc, 8));
+        acc = _mm_max_epi16(acc, _mm_srli_si128(acc, 4));
+        unsigned int pair = (unsigned int)_mm_cvtsi128_si32(acc);
+        if ((pair & 0xffff) > left_peak) {
+            left_peak = pair & 0xffff;
+        }
+        if ((pair >> 16) > right_peak) {
+            right_peak = pair >> 16;
+        }
+    }
+#elif defined(PEAKS_HAVE_NEON)
+    if (frames >= 8) {
+        int16x8_t left_acc = vdupq_n_s16(0);
+        int16x8_t right_acc = vdupq_n_s16(0);
+        for (; i + 8 <= frames; i += 8) {
+            int16x8x2_t v = vld2q_s16(pcm + 2 * i);
+            left_acc = vmaxq_s16(left_acc, vqabsq_s16(v.val[0]));
+            right_acc = vmaxq_s16(right_acc, vqabsq_s16(v.val[1]));
+        }
+        unsigned int value = (unsigned int)vmaxvq_s16(left_acc);
+        if (value > left_peak) {
+            left_peak = value;
+        }
+        value = (unsigned int)vmaxvq_s16(right_acc);
+        if (value > right_peak) {
+            right_peak = value;
+        }
+    }
+#endif
+
+    for (; i < frames; i++) {
+        unsigned int sample = abs_pcm(pcm[2 * i]);
+        if (sample > left_peak) {
+            left_peak = sample;
+        }
+        sample = abs_pcm(pcm[2 * i + 1]);
+        if (sample > right_peak) {
+            right_peak = sample;
+        }
+    }
+
+    *left = (uint16_t)left_peak;
+    *right = (uint16_t)right_peak;
+}
+
+/**
+ * @brief Accumulate a block of interleaved PCM samples
+ *
+ * The block is cut at bin boundaries and each run is reduced by the mono or
+ * stereo kernel.  Other channel counts use waver_peaks_add_scalar().
+ *
+ * @param peaks Peak accumulator
+ * @param pcm Interleaved PCM samples
+ * @param frames Number of sample frames (samples per channel) in pcm
+ * @param channels Channels in pcm; only the first two are used
+ * @return true if successful, false on allocation failure
+ */
+bool waver_peaks_add(waver_peaks_t *peaks, const int16_t *pcm, size_t frames, unsigned int channels) {
+    if (channels != 1 && channels != 2) {
+        return waver_peaks_add_scalar(peaks, pcm, frames, channels);
+    }
+
+    peaks->samples += frames;
+    while (frames > 0) {
+        size_t run = frames < peaks->bin_remaining ? frames : (size_t)peaks->bin_remaining;
+        if (channels == 1) {
+            peaks->left[peaks->bin] = (uint16_t)peak_mono(pcm, run, peaks->left[peaks->bin]);
+        } else {
+            peak_stereo(pcm, run, &peaks->left[peaks->bin], &peaks->right[peaks->bin]);
+        }
+
+        pcm += run * channels;
+        frames -= run;
+        peaks->bin_remaining -= run;
+        if (peaks->bin_remaining == 0 && !next_bin(peaks)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Move past samples without accumulating them
+ *
+ * The bins skipped over keep the peaks they already have (zero unless
+ * samples were added to them), so a sparse sample of a file can be fed
+ * in order with gaps in between.
+ *
+ * @param peaks Peak accumulator
+ * @param frames Number of sample frames (samples per channel) to skip
+ * @return true if successful, false on allocation failure
+ */
+bool waver_peaks_skip(waver_peaks_t *peaks, uint64_t frames) {
+    peaks->samples += frames;
+    while (frames >= peaks->bin_remaining) {
+        frames -= peaks->bin_remaining;
+        if (!next_bin(peaks)) {
+            return false;
+        }
+    }
+    peaks->bin_remaining -= frames;
+    return true;
+}
+
+/**
+ * @brief Reduce the accumulated bins to one peak per image column
+ *
+ * The bins are collapsed exactly as they were laid out, so this is only
+ * correct when the expected sample count was right (or the accumulator
+ * was deliberately fed a sub-range of the file).  Columns before
+ * first_column are left untouched, and the first column only holds the
+ * peak of the samples this accumulator saw.
+ *
+ * @param peaks Peak accumulator
+ * @param left Output column peaks for left/mono (width entries)
+ * @param right Output column peaks for right (width entries)
+ */
+void waver_peaks_finish(const waver_peaks_t *peaks, uint16_t *left, uint16_t *right) {
+    for (unsigned int x = peaks->first_column; x < peaks->width; x++) {
+        left[x] = 0;
+        right[x] = 0;
+        for (unsigned int part = 0; part < peaks->split; part++) {
+            size_t bin = (size_t)(x - peaks->first_column) * peaks->split + part;
+            if (bin > peaks->bin) {
+                break;
+            }
+            if (peaks->left[bin] > left[x]) {
+                left[x] = peaks->left[bin];
+            }
+            if (peaks->right[bin] > right[x]) {
+                right[x] = peaks->right[bin];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Re-bin the accumulated bins onto the layout for the real length
+ *
+ * Used when the number of accumulated samples differs from the expected
+ * count.  Every bin is spread over all columns of the real layout that its
+ * sample range overlaps, which keeps every peak visible at the cost of up
+ * to one bin of smearing.  Only valid for accumulators starting at column 0.
+ *
+ * @param peaks Peak accumulator
+ * @param left Output column peaks for left/mono (width entries)
+ * @param right Output column peaks for right (width entries)
+ */
+void waver_peaks_rebin(const waver_peaks_t *peaks, uint16_t *left, uint16_t *right) {
+    unsigned int width = peaks->width;
+    memset(left, 0, width * sizeof(uint16_t));
+    memset(right, 0, width * sizeof(uint16_t));
+
+    uint64_t total = peaks->samples;
+    uint64_t bin_start = 0;
+    unsigned int column = 0;
+    for (size_t bin = 0; bin <= peaks->bin && bin_start < total; bin++) {
+        uint64_t bin_end = bin_start + bin_length(peaks, bin);
+        if (bin_end > total) {
+            bin_end = total;
+        }
+        if (bin_end == bin_start) {
+            continue;
+        }
+
+        // Find the column holding the first sample of this bin
+        while (column < width && waver_column_start(total, width, column + 1) <= bin_start) {
+            column++;
+        }
+
+        for (unsigned int x = column; x < width && waver_column_start(total, width, x) < bin_end; x++) {
+            if (peaks->left[bin] > left[x]) {
+                left[x] = peaks->left[bin];
+            }
+            if (peaks->right[bin] > right[x]) {
+                right[x] = peaks->right[bin];
+            }
+        }
+
+        bin_start = bin_end;
+    }
+}
@@ -0,0 +1,1254 @@
+/**
+ * @file server.c
+ * @brief On-demand waveform rendering over HTTP (--serve)
+ */
+
+// For getaddrinfo, realpath, mkstemp, strncasecmp and gmtime_r
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include "server.h"
+#include "libwaver.h"
+#include "threadpool.h"
+#include "input.h"
+#include "manifest.h"
+#include "console.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+// Host the server listens on when --serve only gives a port
+#define DEFAULT_HOST "127.0.0.1"
+
+// Longest request line plus headers
+#define REQUEST_MAX 8192
+
+// Longest wait for a client to send its request or take the response
+#define IO_TIMEOUT_SECONDS 10
+
+// Longest wait for a connection before checking for a stop request
+#define ACCEPT_POLL_MS 1000
+
+// Connections waiting for a worker before new ones are turned away with 503
+#define MAX_QUEUED_CONNECTIONS 256
+
+// Initial buckets of the cache index (doubled as entries are added)
+#define INITIAL_BUCKETS 1024
+
+/**
+ * @brief One kind of image the server renders, named by its suffix
+ */
+typedef struct {
+    const char *suffix;              // Appended to the track path, in the URL and on disk
+    waver_render_options_t options;  // Size, colors, decoder and PNG settings
+} serve_target_t;
+
+/**
+ * @brief A rendered image (or failed render) in the memory cache
+ *
+ * An entry is either being rendered, and then only the requests waiting
+ * for it know about it, or on the LRU list and free to be evicted.
+ */
+typedef struct cache_entry_t cache_entry_t;
+struct cache_entry_t {
+    cache_entry_t *next;             // Next entry in the same bucket
+    cache_entry_t *newer;            // Neighbours on the LRU list
+    cache_entry_t *older;
+    uint64_t hash;                   // Hash of key
+    char *key;                       // Request path relative to the root
+    waver_manifest_stamp_t source;   // Track the image was rendered from
+    uint8_t *png;                    // Image (NULL while rendering or after a failure)
+    size_t png_size;                 // Bytes of png
+    size_t bytes;                    // Memory charged to the cache
+    bool rendering;                  // A worker is producing the image
+    bool failed;                     // The track could not be rendered
+};
+
+/**
+ * @brief Memory cache of rendered images, bounded in bytes
+ */
+typedef struct {
+    pthread_mutex_t mutex;           // Guards everything below
+    pthread_cond_t rendered;         // Signalled whenever a render finishes
+    cache_entry_t **buckets;         // Hash index of all entries
+    size_t bucket_count;             // Power of two
+    size_t entry_count;              // Entries in the index
+    cache_entry_t *newest;           // LRU list of entries not being rendered
+    cache_entry_t *oldest;
+    size_t bytes;                    // Memory charged by all entries
+    size_t budget;                   // Most memory to keep (--cache-mb)
+} serve_cache_t;
+
+/**
+ * @brief State shared by every connection
+ */
+typedef struct {
+    const waver_args_t *args;        // Command-line arguments
+    char *root;                      // Resolved directory being served
+    size_t root_length;              // Length of root
+    serve_target_t *targets;         // Images a track can be requested as
+    size_t target_count;             // Entries in targets
+    uint64_t params;                 // Hash of the render parameters (part of every ETag)
+    serve_cache_t cache;             // Images rendered so far
+    atomic_size_t requests;          // Requests answered
+    atomic_size_t renders;           // Tracks rendered
+    atomic_size_t disk_hits;         // Images read from an existing output file
+    atomic_size_t memory_hits;       // Images served from the memory cache
+    atomic_size_t not_modified;      // Conditional requests answered with 304
+} server_t;
+
+/**
+ * @brief One accepted connection, handed to a worker
+ */
+typedef struct {
+    server_t *server;                // Server the connection belongs to
+    int fd;                          // Connected socket
+} connection_t;
+
+/**
+ * @brief A PNG growing in memory as the encoder writes it
+ */
+typedef struct {
+    uint8_t *data;                   // Bytes so far
+    size_t size;                     // Bytes used
+    size_t capacity;                 // Bytes allocated
+} png_buffer_t;
+
+// Set by SIGINT and SIGTERM to stop the server
+static volatile sig_atomic_t serve_stopping = 0;
+
+/**
+ * @brief Ask the accept loop to stop
+ *
+ * @param signal_number Signal received
+ */
+static void stop_serving(int signal_number) {
+    (void)signal_number;
+    serve_stopping = 1;
+}
+
+/**
+ * @brief Check if a string has a specified file extension
+ *
+ * @param filename The filename to check
+ * @param extension The extension to match
+ * @return true if the filename has the extension, false otherwise
+ */
+static bool has_extension(const char *filename, const char *extension) {
+    size_t filename_len = strlen(filename);
+    size_t extension_len = strlen(extension);
+
+    if (filename_len <= extension_len) {
+        return false;
+    }
+
+    const char *file_ext = filename + filename_len - extension_len;
+
+    // Check for dot before extension
+    if (*(file_ext - 1) != '.') {
+        return false;
+    }
+
+    // Case-insensitive comparison
+    for (size_t i = 0; i < extension_len; i++) {
+        if (tolower((unsigned char)file_ext[i]) != tolower((unsigned char)extension[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Check if a file has any of the specified extensions
+ *
+ * @param filename The filename to check
+ * @param extensions Array of extensions to match
+ * @param extension_count Number of extensions in the array
+ * @return true if the file has any of the extensions, false otherwise
+ */
+static bool has_any_extension(const char *filename, char **extensions, unsigned int extension_count) {
+    for (unsigned int i = 0; i < extension_count; i++) {
+        if (has_extension(filename, extensions[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Hash a request path (FNV-1a)
+ *
+ * @param key Request path
+ * @return Hash of key
+ */
+static uint64_t hash_key(const char *key) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash = (hash ^ *p) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/**
+ * @brief Check if two stamps describe the same version of a file
+ *
+ * @param a First stamp
+ * @param b Second stamp
+ * @return true if size, modification time and inode all match
+ */
+static bool stamps_equal(const waver_manifest_stamp_t *a, const waver_manifest_stamp_t *b) {
+    return a->size == b->size && a->mtime_ns == b->mtime_ns && a->inode == b->inode;
+}
+
+/**
+ * @brief Set up an empty cache
+ *
+ * @param cache Cache to initialize
+ * @param budget Most bytes of images and bookkeeping to keep
+ * @return true if successful, false otherwise
+ */
+static bool cache_init(serve_cache_t *cache, size_t budget) {
+    memset(cache, 0, sizeof(*cache));
+    cache->buckets = calloc(INITIAL_BUCKETS, sizeof(cache_entry_t *));
+    if (!cache->buckets) {
+        return false;
+    }
+    cache->bucket_count = INITIAL_BUCKETS;
+    cache->budget = budget;
+    if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+        free(cache->buckets);
+        return false;
+    }
+    if (pthread_cond_init(&cache->rendered, NULL) != 0) {
+        pthread_mutex_destroy(&cache->mutex);
+        free(cache->buckets);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Free a cache and every entry in it
+ *
+ * @param cache Cache (no render may be running)
+ */
+static void cache_destroy(serve_cache_t *cache) {
+    for (size_t i = 0; i < cache->bucket_count; i++) {
+        cache_entry_t *entry = cache->buckets[i];
+        while (entry) {
+            cache_entry_t *next = entry->next;
+            free(entry->png);
+            free(entry->key);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    pthread_cond_destroy(&cache->rendered);
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+/**
+ * @brief Find the entry for a request path (mutex held)
+ *
+ * @param cache Cache
+ * @param key Request path
+ * @param hash Hash of key
+ * @return Entry or NULL if there is none
+ */
+static cache_entry_t *cache_find(const serve_cache_t *cache, const char *key, uint64_t hash) {
+    cache_entry_t *entry = cache->buckets[hash & (cache->bucket_count - 1)];
+    while (entry && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+/**
+ * @brief Take an entry off the LRU list (mutex held)
+ *
+ * @param cache Cache
+ * @param entry Entry on the list
+ */
+static void lru_unlink(serve_cache_t *cache, cache_entry_t *entry) {
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+/**
+ * @brief Put an entry at the front of the LRU list (mutex held)
+ *
+ * @param cache Cache
+ * @param entry Entry not on the list
+ */
+static void lru_push(serve_cache_t *cache, cache_entry_t *entry) {
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if (cache->newest) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+/**
+ * @brief Take an entry out of the index and free it (mutex held)
+ *
+ * @param cache Cache
+ * @param entry Entry that is not on the LRU list
+ */
+static void cache_remove(serve_cache_t *cache, cache_entry_t *entry) {
+    cache_entry_t **link = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    cache->entry_count--;
+    cache->bytes -= entry->bytes;
+    free(entry->png);
+    free(entry->key);
+    free(entry);
+}
+
+/**
+ * @brief Add an empty entry for a request path (mutex held)
+ *
+ * @param cache Cache
+ * @param key Request path
+ * @param hash Hash of key
+ * @return New entry or NULL on allocation failure
+ */
+static cache_entry_t *cache_insert(serve_cache_t *cache, const char *key, uint64_t hash) {
+    // Keep about one entry per bucket
+    if (cache->entry_count >= cache->bucket_count) {
+        size_t count = cache->bucket_count * 2;
+        cache_entry_t **buckets = calloc(count, sizeof(cache_entry_t *));
+        if (buckets) {
+            for (size_t i = 0; i < cache->bucket_count; i++) {
+                cache_entry_t *entry = cache->buckets[i];
+                while (entry) {
+                    cache_entry_t *next = entry->next;
+                    entry->next = buckets[entry->hash & (count - 1)];
+                    buckets[entry->hash & (count - 1)] = entry;
+                    entry = next;
+                }
+            }
+            free(cache->buckets);
+            cache->buckets = buckets;
+            cache->bucket_count = count;
+        }
+    }
+
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    if (!entry) {
+        return NULL;
+    }
+    entry->key = strdup(key);
+    if (!entry->key) {
+        free(entry);
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->bytes = sizeof(cache_entry_t) + strlen(key) + 1;
+    entry->next = cache->buckets[hash & (cache->bucket_count - 1)];
+    cache->buckets[hash & (cache->bucket_count - 1)] = entry;
+    cache->entry_count++;
+    cache->bytes += entry->bytes;
+    return entry;
+}
+
+/**
+ * @brief Evict the least recently used entries until the cache fits its budget (mutex held)
+ *
+ * @param cache Cache
+ */
+static void cache_trim(serve_cache_t *cache) {
+    while (cache->bytes > cache->budget && cache->oldest) {
+        cache_entry_t *entry = cache->oldest;
+        lru_unlink(cache, entry);
+        cache_remove(cache, entry);
+    }
+}
+
+/**
+ * @brief Append encoder output to a PNG buffer
+ *
+ * @param context png_buffer_t
+ * @param data Bytes to append
+ * @param size Number of bytes
+ * @return true if successful, false on allocation failure
+ */
+static bool buffer_write(void *context, const void *data, size_t size) {
+    png_buffer_t *buffer = (png_buffer_t *)context;
+    if (size > buffer->capacity - buffer->size) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 16384;
+        while (capacity - buffer->size < size) {
+            capacity *= 2;
+        }
+        uint8_t *data_new = realloc(buffer->data, capacity);
+        if (!data_new) {
+            return false;
+        }
+        buffer->data = data_new;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return true;
+}
+
+/**
+ * @brief Read a whole output file that is at least as new as its track
+ *
+ * @param path Path of the output file
+ * @param track Result of stat() on the track
+ * @param buffer Receives the file contents
+ * @return true if the file is current and was read, false otherwise
+ */
+static bool read_current_output(const char *path, const struct stat *track, png_buffer_t *buffer) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+        waver_manifest_mtime_ns(&st) < waver_manifest_mtime_ns(track)) {
+        return false;
+    }
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    buffer->data = malloc((size_t)st.st_size);
+    buffer->capacity = buffer->data ? (size_t)st.st_size : 0;
+    buffer->size = buffer->data ? fread(buffer->data, 1, buffer->capacity, file) : 0;
+    fclose(file);
+    if (buffer->size != (size_t)st.st_size) {
+        free(buffer->data);
+        memset(buffer, 0, sizeof(*buffer));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Write a rendered image next to its track
+ *
+ * The image goes to a temporary file first, so a batch run or another
+ * reader never sees half of it.
+ *
+ * @param args Command-line arguments (for messages)
+ * @param path Path of the output file
+ * @param buffer Image
+ * @return true if successful, false otherwise
+ */
+static bool write_output(const waver_args_t *args, const char *path, const png_buffer_t *buffer) {
+    char temp_path[PATH_MAX];
+    int result = snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+    if (result < 0 || (size_t)result >= sizeof(temp_path)) {
+        return false;
+    }
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        waver_print_stderr(args, "Cannot write %s: %s", path, strerror(errno));
+        return false;
+    }
+    bool success = fchmod(fd, 0644) == 0;
+    for (size_t done = 0; success && done < buffer->size;) {
+        ssize_t written = write(fd, buffer->data + done, buffer->size - done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        success = written > 0;
+        done += success ? (size_t)written : 0;
+    }
+    success = close(fd) == 0 && success;
+    success = success && rename(temp_path, path) == 0;
+    if (!success) {
+        waver_print_stderr(args, "Cannot write %s: %s", path, strerror(errno));
+        unlink(temp_path);
+    }
+    return success;
+}
+
+/**
+ * @brief Produce the image of a track, from its output file or by rendering it
+ *
+ * @param server Server
+ * @param target Image to produce
+ * @param track_path Path of the track
+ * @param track Result of stat() on the track
+ * @param buffer Receives the image
+ * @param source Receives where the image came from ("disk" or "rendered")
+ * @return true if successful, false if the track cannot be rendered
+ */
+static bool produce_png(server_t *server, const serve_target_t *target, const char *track_path,
+                        const struct stat *track, png_buffer_t *buffer, const char **source) {
+    const waver_args_t *args = server->args;
+    char output_path[PATH_MAX];
+    int result = snprintf(output_path, sizeof(output_path), "%s%s", track_path, target->suffix);
+    if (result < 0 || (size_t)result >= sizeof(output_path)) {
+        return false;
+    }
+
+    // An output a batch run (or an earlier request) made is used as it is
+    if (!args->overwrite && read_current_output(output_path, track, buffer)) {
+        atomic_fetch_add(&server->disk_hits, 1);
+        *source = "disk";
+        return true;
+    }
+
+    waver_input_t input;
+    if (!waver_input_open(track_path, &input)) {
+        return false;
+    }
+    bool success = waver_render_png(input.data, input.size, &target->options, threadpool_worker_context(),
+                                    buffer_write, buffer);
+    waver_input_close(&input);
+    if (!success) {
+        free(buffer->data);
+        memset(buffer, 0, sizeof(*buffer));
+        return false;
+    }
+    atomic_fetch_add(&server->renders, 1);
+    *source = "rendered";
+
+    // Failing to store the image only costs a render next time
+    if (!args->dry_run) {
+        write_output(args, output_path, buffer);
+    }
+    return true;
+}
+
+/**
+ * @brief Get the image for a request, rendering it at most once however many ask at the same time
+ *
+ * @param server Server
+ * @param target Image requested
+ * @param key Request path relative to the root
+ * @param track_path Path of the track
+ * @param track Result of stat() on the track
+ * @param size Receives the size of the image
+ * @param source Receives where the image came from ("memory", "disk" or "rendered")
+ * @return Copy of the image for the caller to free, or NULL if the track cannot be rendered
+ */
+static uint8_t *get_png(server_t *server, const serve_target_t *target, const char *key, const char *track_path,
+                        const struct stat *track, size_t *size, const char **source) {
+    serve_cache_t *cache = &server->cache;
+    waver_manifest_stamp_t stamp;
+    waver_manifest_stamp(track, &stamp);
+    uint64_t hash = hash_key(key);
+
+    pthread_mutex_lock(&cache->mutex);
+    cache_entry_t *entry = cache_find(cache, key, hash);
+    while (entry && entry->rendering) {
+        pthread_cond_wait(&cache->rendered, &cache->mutex);
+        // The entry may have been evicted (or failed and removed) meanwhile
+        entry = cache_find(cache, key, hash);
+    }
+    if (entry && stamps_equal(&entry->source, &stamp)) {
+        uint8_t *copy = NULL;
+        if (entry->png) {
+            copy = malloc(entry->png_size);
+            if (copy) {
+                memcpy(copy, entry->png, entry->png_size);
+                *size = entry->png_size;
+                *source = "memory";
+                atomic_fetch_add(&server->memory_hits, 1);
+            }
+        }
+        lru_unlink(cache, entry);
+        lru_push(cache, entry);
+        pthread_mutex_unlock(&cache->mutex);
+        return copy;
+    }
+
+    // Claim the entry, so later requests for it wait for this render
+    if (entry) {
+        lru_unlink(cache, entry);
+        cache->bytes -= entry->png_size;
+        entry->bytes -= entry->png_size;
+        free(entry->png);
+        entry->png = NULL;
+        entry->png_size = 0;
+    } else {
+        entry = cache_insert(cache, key, hash);
+    }
+    if (entry) {
+        entry->rendering = true;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    png_buffer_t buffer = {0};
+    bool success = produce_png(server, target, track_path, track, &buffer, source);
+
+    if (!entry) {
+        *size = buffer.size;
+        return success ? buffer.data : NULL;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    entry->rendering = false;
+    entry->source = stamp;
+    entry->failed = !success;
+    if (success && entry->bytes + buffer.size <= cache->budget) {
+        entry->png = malloc(buffer.size);
+        if (entry->png) {
+            memcpy(entry->png, buffer.data, buffer.size);
+            entry->png_size = buffer.size;
+            entry->bytes += buffer.size;
+            cache->bytes += buffer.size;
+        }
+    }
+    if (success && !entry->png) {
+        // Too large to keep (or no memory): served this once, rendered again next time
+        cache_remove(cache, entry);
+    } else {
+        lru_push(cache, entry);
+        cache_trim(cache);
+    }
+    pthread_cond_broadcast(&cache->rendered);
+    pthread_mutex_unlock(&cache->mutex);
+
+    *size = buffer.size;
+    return success ? buffer.data : NULL;
+}
+
+/**
+ * @brief Send all of a buffer, retrying after interrupted and partial sends
+ *
+ * @param fd Connected socket
+ * @param data Bytes to send
+ * @param size Number of bytes
+ * @return true if everything was sent, false on error or timeout
+ */
+static bool send_all(int fd, const void *data, size_t size) {
+    const char *bytes = (const char *)data;
+    while (size > 0) {
+        ssize_t sent = send(fd, bytes, size, 0);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+/**
+ * @brief Reason phrase of an HTTP status code
+ *
+ * @param status Status code
+ * @return Reason phrase
+ */
+static const char *status_reason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 431: return "Request Header Fields Too Large";
+        case 503: return "Service Unavailable";
+        default: return "Internal Server Error";
+    }
+}
+
+/**
+ * @brief Send a short plain-text response for an error
+ *
+ * @param fd Connected socket
+ * @param status Status code
+ * @param head_only Leave out the body (HEAD request)
+ */
+static void send_error(int fd, int status, bool head_only) {
+    char response[512];
+    const char *reason = status_reason(status);
+    int length = snprintf(response, sizeof(response),
+                          "HTTP/1.1 %d %s\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Content-Length: %zu\r\n"
+                          "%s"
+                          "Connection: close\r\n"
+                          "\r\n"
+                          "%s%s",
+                          status, reason, strlen(reason) + 1,
+                          status == 405 ? "Allow: GET, HEAD\r\n" : status == 503 ? "Retry-After: 1\r\n" : "",
+                          head_only ? "" : reason, head_only ? "" : "\n");
+    if (length > 0 && (size_t)length < sizeof(response)) {
+        send_all(fd, response, (size_t)length);
+    }
+}
+
+/**
+ * @brief Find a header in a request
+ *
+ * @param headers Header lines, each ending in CRLF
+ * @param name Header name (compared without regard to case)
+ * @param value Receives the value without surrounding whitespace
+ * @param capacity Size of value
+ * @return true if the header was found, false otherwise
+ */
+static bool find_header(const char *headers, const char *name, char *value, size_t capacity) {
+    size_t name_length = strlen(name);
+    for (const char *line = headers; *line && !(line[0] == '\r' && line[1] == '\n');) {
+        const char *end = strstr(line, "\r\n");
+        if (!end) {
+            break;
+        }
+        if ((size_t)(end - line) > name_length && strncasecmp(line, name, name_length) == 0 &&
+            line[name_length] == ':') {
+            const char *start = line + name_length + 1;
+            while (start < end && (*start == ' ' || *start == '\t')) {
+                start++;
+            }
+            const char *stop = end;
+            while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t')) {
+                stop--;
+            }
+            size_t length = (size_t)(stop - start);
+            if (length >= capacity) {
+                return false;
+            }
+            memcpy(value, start, length);
+            value[length] = '\0';
+            return true;
+        }
+        line = end + 2;
+    }
+    return false;
+}
+
+/**
+ * @brief Decode the path of a request target
+ *
+ * The query string is dropped.  Escapes are decoded, and a path that does
+ * not start with '/', contains a NUL or a ".." segment is rejected.
+ *
+ * @param target Request target as sent
+ * @param path Receives the decoded path without the leading '/'
+ * @param capacity Size of path
+ * @return true if the path is acceptable, false otherwise
+ */
+static bool decode_path(const char *target, char *path, size_t capacity) {
+    if (target[0] != '/') {
+        return false;
+    }
+    size_t length = 0;
+    for (const char *p = target + 1; *p && *p != '?' && *p != '#'; p++) {
+        char c = *p;
+        if (c == '%') {
+            if (!isxdigit((unsigned char)p[1]) || !isxdigit((unsigned char)p[2])) {
+                return false;
+            }
+            char hex[3] = {p[1], p[2], '\0'};
+            c = (char)strtol(hex, NULL, 16);
+            p += 2;
+            if (c == '\0') {
+                return false;
+            }
+        }
+        if (length + 1 >= capacity) {
+            return false;
+        }
+        path[length++] = c;
+    }
+    path[length] = '\0';
+
+    for (const char *segment = path; *segment;) {
+        const char *slash = strchr(segment, '/');
+        size_t segment_length = slash ? (size_t)(slash - segment) : strlen(segment);
+        if (segment_length == 2 && segment[0] == '.' && segment[1] == '.') {
+            return false;
+        }
+        if (!slash) {
+            break;
+        }
+        segment = slash + 1;
+    }
+    return length > 0;
+}
+
+/**
+ * @brief Answer one request for an image
+ *
+ * @param server Server
+ * @param fd Connected socket
+ * @param head_only Leave out the body (HEAD request)
+ * @param path Decoded path relative to the root
+ * @param headers Header lines of the request
+ * @param source Receives what answered the request (for the log)
+ * @return HTTP status sent
+ */
+static int answer_request(server_t *server, int fd, bool head_only, const char *path, const char *headers,
+                          const char **source) {
+    const waver_args_t *args = server->args;
+
+    // The path names an output: a track followed by the suffix of one target
+    size_t path_length = strlen(path);
+    const serve_target_t *target = NULL;
+    char track_relative[PATH_MAX];
+    for (size_t i = 0; i < server->target_count && !target; i++) {
+        size_t suffix_length = strlen(server->targets[i].suffix);
+        if (path_length <= suffix_length || path_length - suffix_length >= sizeof(track_relative) ||
+            strcmp(path + path_length - suffix_length, server->targets[i].suffix) != 0) {
+            continue;
+        }
+        memcpy(track_relative, path, path_length - suffix_length);
+        track_relative[path_length - suffix_length] = '\0';
+        if (has_any_extension(track_relative, args->file_extensions, args->extension_count)) {
+            target = &server->targets[i];
+        }
+    }
+    if (!target) {
+        send_error(fd, 404, head_only);
+        return 404;
+    }
+
+    // Symbolic links may not lead out of the root
+    char track_path[PATH_MAX];
+    char resolved[PATH_MAX];
+    int result = snprintf(track_path, sizeof(track_path), "%s/%s", server->root, track_relative);
+    struct stat st;
+    if (result < 0 || (size_t)result >= sizeof(track_path) || !realpath(track_path, resolved) ||
+        strncmp(resolved, server->root, server->root_length) != 0 || resolved[server->root_length] != '/' ||
+        stat(resolved, &st) != 0 || !S_ISREG(st.st_mode)) {
+        send_error(fd, 404, head_only);
+        return 404;
+    }
+
+    // Validators follow from the track and the render parameters alone
+    char etag[96];
+    snprintf(etag, sizeof(etag), "\"%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%" PRIx64 "\"",
+             (uint64_t)st.st_ino, (uint64_t)st.st_size, (uint64_t)waver_manifest_mtime_ns(&st), server->params);
+    char last_modified[64];
+    struct tm tm;
+    time_t mtime = st.st_mtime;
+    gmtime_r(&mtime, &tm);
+    strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    // If-None-Match wins over If-Modified-Since, which must echo the date sent
+    char condition[REQUEST_MAX];
+    bool not_modified;
+    if (find_header(headers, "If-None-Match", condition, sizeof(condition))) {
+        not_modified = strcmp(condition, "*") == 0 || strstr(condition, etag) != NULL;
+    } else {
+        not_modified = find_header(headers, "If-Modified-Since", condition, sizeof(condition)) &&
+                       strcmp(condition, last_modified) == 0;
+    }
+
+    char header[512];
+    if (not_modified) {
+        atomic_fetch_add(&server->not_modified, 1);
+        *source = "not modified";
+        int length = snprintf(header, sizeof(header),
+                              "HTTP/1.1 304 Not Modified\r\n"
+                              "ETag: %s\r\n"
+                              "Last-Modified: %s\r\n"
+                              "Cache-Control: no-cache\r\n"
+                              "Connection: close\r\n"
+                              "\r\n",
+                              etag, last_modified);
+        send_all(fd, header, (size_t)length);
+        return 304;
+    }
+
+    size_t png_size = 0;
+    uint8_t *png = get_png(server, target, path, resolved, &st, &png_size, source);
+    if (!png) {
+        waver_print_stderr(args, "Failed to render %s", track_path);
+        send_error(fd, 500, head_only);
+        return 500;
+    }
+    int length = snprintf(header, sizeof(header),
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: image/png\r\n"
+                          "Content-Length: %zu\r\n"
+                          "ETag: %s\r\n"
+                          "Last-Modified: %s\r\n"
+                          "Cache-Control: no-cache\r\n"
+                          "Connection: close\r\n"
+                          "\r\n",
+                          png_size, etag, last_modified);
+    if (send_all(fd, header, (size_t)length) && !head_only) {
+        send_all(fd, png, png_size);
+    }
+    free(png);
+    return 200;
+}
+
+/**
+ * @brief Read a request from a connection, answer it and close the connection
+ *
+ * @param pool Thread pool running the task
+ * @param task Task holding the connection_t
+ * @return true if the request was answered with an image or 304, false otherwise
+ */
+static bool run_connection_task(threadpool_t *pool, const task_t *task) {
+    (void)pool;
+    connection_t *connection = (connection_t *)task->context;
+    server_t *server = connection->server;
+    int fd = connection->fd;
+    free(connection);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Read until the blank line that ends the headers
+    char request[REQUEST_MAX + 1];
+    size_t length = 0;
+    char *headers_end = NULL;
+    while (!headers_end && length < REQUEST_MAX) {
+        ssize_t received = recv(fd, request + length, REQUEST_MAX - length, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            close(fd);
+            return false;
+        }
+        length += (size_t)received;
+        request[length] = '\0';
+        headers_end = strstr(request, "\r\n\r\n");
+    }
+    if (!headers_end) {
+        send_error(fd, 431, false);
+        close(fd);
+        return false;
+    }
+
+    // Request line: method, target and version
+    char *line_end = strstr(request, "\r\n");
+    *line_end = '\0';
+    const char *headers = line_end + 2;
+    const char *method = request;
+    char *target = strchr(method, ' ');
+    char *version = target ? strchr(target + 1, ' ') : NULL;
+    int status;
+    const char *source = "-";
+    const char *logged_target = "-";
+    char path[PATH_MAX];
+    bool head_only = false;
+    if (!version || strncmp(version + 1, "HTTP/1.", 7) != 0) {
+        method = "-";
+        status = 400;
+        send_error(fd, status, false);
+    } else {
+        *target++ = '\0';
+        *version = '\0';
+        logged_target = target;
+        head_only = strcmp(method, "HEAD") == 0;
+        if (!head_only && strcmp(method, "GET") != 0) {
+            status = 405;
+            send_error(fd, status, false);
+        } else if (!decode_path(target, path, sizeof(path))) {
+            status = 400;
+            send_error(fd, status, head_only);
+        } else {
+            status = answer_request(server, fd, head_only, path, headers, &source);
+        }
+    }
+    close(fd);
+    atomic_fetch_add(&server->requests, 1);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    waver_print_verbose(server->args, "%s %s %d %s %.1f ms", method, logged_target, status, source,
+                        (double)(end.tv_sec - start.tv_sec) * 1000.0 + (double)(end.tv_nsec - start.tv_nsec) / 1e6);
+    return status == 200 || status == 304;
+}
+
+/**
+ * @brief Split a --serve address into host and port
+ *
+ * Accepts "port", "host:port" and "[ipv6]:port".
+ *
+ * @param address Address from the command line
+ * @param host Receives the host
+ * @param host_capacity Size of host
+ * @param port Receives the port
+ * @param port_capacity Size of port
+ * @return true if the address has that form, false otherwise
+ */
+static bool split_address(const char *address, char *host, size_t host_capacity, char *port, size_t port_capacity) {
+    const char *port_start;
+    size_t host_length;
+    const char *host_start = address;
+    if (address[0] == '[') {
+        const char *close_bracket = strchr(address, ']');
+        if (!close_bracket || close_bracket[1] != ':') {
+            return false;
+        }
+        host_start = address + 1;
+        host_length = (size_t)(close_bracket - host_start);
+        port_start = close_bracket + 2;
+    } else if (strchr(address, ':')) {
+        host_length = (size_t)(strrchr(address, ':') - address);
+        port_start = address + host_length + 1;
+    } else {
+        host_start = DEFAULT_HOST;
+        host_length = strlen(DEFAULT_HOST);
+        port_start = address;
+    }
+    if (host_length == 0 || host_length >= host_capacity || *port_start == '\0' ||
+        strlen(port_start) >= port_capacity || strspn(port_start, "0123456789") != strlen(port_start)) {
+        return false;
+    }
+    memcpy(host, host_start, host_length);
+    host[host_length] = '\0';
+    strcpy(port, port_start);
+    return true;
+}
+
+/**
+ * @brief Open a listening socket on a --serve address
+ *
+ * @param args Command-line arguments
+ * @param bound Receives the port actually bound (differs from the address for port 0)
+ * @param bound_capacity Size of bound
+ * @return Listening socket or -1 on error
+ */
+static int open_listener(const waver_args_t *args, char *bound, size_t bound_capacity) {
+    char host[256];
+    char port[NI_MAXSERV];
+    if (!split_address(args->serve, host, sizeof(host), port, sizeof(port))) {
+        waver_print_stderr(args, "Address must be [host:]port: %s", args->serve);
+        return -1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo *addresses = NULL;
+    int error = getaddrinfo(host, port, &hints, &addresses);
+    if (error != 0) {
+        waver_print_stderr(args, "Cannot resolve %s: %s", args->serve, gai_strerror(error));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *address = addresses; address && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(fd, address->ai_addr, address->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        waver_print_stderr(args, "Cannot listen on %s: %s", args->serve, strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_storage local;
+    socklen_t local_length = sizeof(local);
+    char service[NI_MAXSERV];
+    if (getsockname(fd, (struct sockaddr *)&local, &local_length) == 0 &&
+        getnameinfo((struct sockaddr *)&local, local_length, NULL, 0, service, sizeof(service),
+                    NI_NUMERICSERV) == 0) {
+        snprintf(port, sizeof(port), "%s", service);
+    }
+    snprintf(bound, bound_capacity, strchr(host, ':') ? "[%s]:%s" : "%s:%s", host, port);
+    return fd;
+}
+
+/**
+ * @brief Build the list of images a track can be requested as
+ *
+ * @param server Server whose targets to fill in
+ * @return true if successful, false on allocation failure
+ */
+static bool build_targets(server_t *server) {
+    const waver_args_t *args = server->args;
+    size_t count = args->output_spec_count ? args->output_spec_count : 1;
+    server->targets = calloc(count, sizeof(serve_target_t));
+    if (!server->targets) {
+        return false;
+    }
+    server->target_count = count;
+    for (size_t i = 0; i < count; i++) {
+        serve_target_t *target = &server->targets[i];
+        waver_render_options_init(&target->options);
+        target->options.decoder = args->decoder;
+        target->options.single_pass = args->single_pass;
+        target->options.quality = args->quality;
+        target->options.png = args->png;
+        if (args->output_spec_count) {
+            const waver_output_spec_t *spec = &args->output_specs[i];
+            target->suffix = spec->suffix;
+            target->options.width = spec->width;
+            target->options.height = spec->height;
+            target->options.left_color = spec->left_color;
+            target->options.right_color = spec->right_color;
+            target->options.bg_color = spec->bg_color;
+        } else {
+            target->suffix = ".png";
+            target->options.width = args->width;
+            target->options.height = args->height;
+            target->options.left_color = args->left_color;
+            target->options.right_color = args->right_color;
+            target->options.bg_color = args->bg_color;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Hand each connection to the pool until SIGINT or SIGTERM
+ *
+ * @param server Server
+ * @param pool Thread pool answering the requests
+ * @param listener Listening socket
+ */
+static void accept_connections(server_t *server, threadpool_t *pool, int listener) {
+    struct timeval timeout = {IO_TIMEOUT_SECONDS, 0};
+    while (!serve_stopping) {
+        struct pollfd poll_fd = {listener, POLLIN, 0};
+        if (poll(&poll_fd, 1, ACCEPT_POLL_MS) <= 0) {
+            continue;
+        }
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // A response this short fits in the socket buffer, so the loop cannot stall on it
+        if (atomic_load(&pool->queued) >= MAX_QUEUED_CONNECTIONS) {
+            send_error(fd, 503, false);
+            close(fd);
+            continue;
+        }
+
+        connection_t *connection = malloc(sizeof(connection_t));
+        task_t task = {run_connection_task, NULL, server->args, 0, connection, false};
+        if (!connection) {
+            close(fd);
+            continue;
+        }
+        connection->server = server;
+        connection->fd = fd;
+        if (!threadpool_submit(pool, &task)) {
+            free(connection);
+            close(fd);
+        }
+    }
+}
+
+/**
+ * @brief Serve the waveforms of the directory on the command line until SIGINT or SIGTERM
+ *
+ * @param args Command-line arguments (serve address, cache size, outputs and threads)
+ * @return true if the server ran and stopped on a signal, false if it could not start
+ */
+bool waver_serve(const waver_args_t *args) {
+    server_t server;
+    memset(&server, 0, sizeof(server));
+    server.args = args;
+    server.params = waver_manifest_params(args);
+    server.root = realpath(args->audio_paths[0], NULL);
+    if (!server.root) {
+        waver_print_stderr(args, "Cannot resolve %s: %s", args->audio_paths[0], strerror(errno));
+        return false;
+    }
+    server.root_length = strlen(server.root);
+    // A root of "/" would make every resolved path start with "//"
+    if (server.root_length == 1) {
+        server.root_length = 0;
+    }
+    if (!build_targets(&server) || !cache_init(&server.cache, (size_t)args->cache_mb << 20)) {
+        waver_print_stderr(args, "Memory allocation failed");
+        free(server.targets);
+        free(server.root);
+        return false;
+    }
+
+    char bound[320];
+    int listener = open_listener(args, bound, sizeof(bound));
+    threadpool_t *pool = listener >= 0 ? threadpool_init(args->threads, WAVER_SCHEDULE_FIFO,
+                                                             args->pin_threads ? THREADPOOL_PIN : 0) : NULL;
+    if (!pool) {
+        if (listener >= 0) {
+            waver_print_stderr(args, "Failed to create thread pool");
+            close(listener);
+        }
+        cache_destroy(&server.cache);
+        free(server.targets);
+        free(server.root);
+        return false;
+    }
+
+    // A client that hangs up early must not end the process
+    struct sigaction action;
+    struct sigaction ignore;
+    struct sigaction previous_int;
+    struct sigaction previous_term;
+    struct sigaction previous_pipe;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_serving;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    serve_stopping = 0;
+    sigaction(SIGINT, &action, &previous_int);
+    sigaction(SIGTERM, &action, &previous_term);
+    sigaction(SIGPIPE, &ignore, &previous_pipe);
+
+    waver_print_stdout(args, "Serving %s on http://%s/ with %zu threads (Ctrl-C to stop)", server.root, bound,
+                       pool->num_threads);
+    // Scripts wait for this line before sending requests
+    waver_console_flush();
+    accept_connections(&server, pool, listener);
+    close(listener);
+    waver_print_stdout(args, "Stopping after the requests in progress");
+
+    // Waits for the connections already handed out
+    threadpool_destroy(pool);
+    sigaction(SIGINT, &previous_int, NULL);
+    sigaction(SIGTERM, &previous_term, NULL);
+    sigaction(SIGPIPE, &previous_pipe, NULL);
+
+    waver_print_verbose(args, "Answered %zu requests: %zu rendered, %zu from disk, %zu from memory, %zu not modified",
+                        atomic_load(&server.requests), atomic_load(&server.renders),
+                        atomic_load(&server.disk_hits), atomic_load(&server.memory_hits),
+                        atomic_load(&server.not_modified));
+    cache_destroy(&server.cache);
+    free(server.targets);
+    free(server.root);
+    return true;
+}
@@ -0,0 +1,513 @@
+/**
+ * @file sidecar.c
+ * @brief Persistent multi-resolution peak cache (.peaks sidecar files)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "sidecar.h"
+#include "waver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Highest level count a valid file can need (one bin per 64 samples of 2^64)
+#define MAX_LEVELS 64
+
+_Static_assert(sizeof(waver_sidecar_header_t) == 64, "sidecar header must stay 64 bytes");
+_Static_assert(sizeof(waver_sidecar_level_t) == 16, "sidecar level entry must stay 16 bytes");
+
+/** Bin value of a bin that has no samples yet */
+static const waver_minmax_t EMPTY_BIN = { INT16_MAX, INT16_MIN };
+
+/**
+ * @brief Combine two bins
+ *
+ * @param bin Bin to update
+ * @param other Bin to merge into it
+ */
+static void merge_bin(waver_minmax_t *bin, waver_minmax_t other) {
+    if (other.min < bin->min) {
+        bin->min = other.min;
+    }
+    if (other.max > bin->max) {
+        bin->max = other.max;
+    }
+}
+
+/**
+ * @brief Peak amplitude of a bin, the same way abs() is taken when decoding
+ *
+ * @param bin Bin
+ * @return Peak amplitude (0-32767)
+ */
+static unsigned int bin_peak(waver_minmax_t bin) {
+    unsigned int low = bin.min >= 0 ? 0 : (bin.min == INT16_MIN ? 32767 : (unsigned int)-bin.min);
+    unsigned int high = bin.max > 0 ? (unsigned int)bin.max : 0;
+    return low > high ? low : high;
+}
+
+/**
+ * @brief Number of bins in the level above one with the given bins
+ *
+ * @param bins Bins in a level
+ * @return Bins in the next level
+ */
+static uint64_t parent_bins(uint64_t bins) {
+    return (bins + 1) / 2;
+}
+
+/**
+ * @brief Size of a level in bytes, padded to 8 bytes
+ *
+ * @param bins Bins in the level
+ * @param channels Channels per bin
+ * @return Padded size in bytes
+ */
+static uint64_t level_bytes(uint64_t bins, unsigned int channels) {
+    uint64_t bytes = bins * channels * sizeof(waver_minmax_t);
+    return (bytes + 7) & ~(uint64_t)7;
+}
+
+/**
+ * @brief Sidecar path for an output image path
+ *
+ * A trailing .png is replaced by .peaks; any other name gets .peaks appended.
+ *
+ * @param output_path Path of the output PNG
+ * @param buffer Buffer for the sidecar path
+ * @param size Size of the buffer
+ * @return true if successful, false if the path does not fit
+ */
+bool waver_sidecar_path(const char *output_path, char *buffer, size_t size) {
+    size_t length = strlen(output_path);
+    if (length >= 4 && strcmp(output_path + length - 4, ".png") == 0) {
+        length -= 4;
+    }
+
+    int result = snprintf(buffer, size, "%.*s%s", (int)length, output_path, WAVER_SIDECAR_EXTENSION);
+    return result >= 0 && (size_t)result < size;
+}
+
+/**
+ * @brief Create a builder
+ *
+ * @param channels Channels to record (only the first two are used)
+ * @param sample_rate Sample rate in Hz
+ * @param first_sample First sample (per channel) that will be added
+ * @return New builder or NULL on error
+ */
+waver_sidecar_builder_t *waver_sidecar_builder_new(unsigned int channels, unsigned int sample_rate,
+                                                   uint64_t first_sample) {
+    if (channels == 0) {
+        return NULL;
+    }
+
+    waver_sidecar_builder_t *builder = calloc(1, sizeof(waver_sidecar_builder_t));
+    if (!builder) {
+        return NULL;
+    }
+
+    builder->channels = channels > 2 ? 2 : channels;
+    builder->sample_rate = sample_rate;
+    builder->first_sample = first_sample;
+    return builder;
+}
+
+/**
+ * @brief Free a builder
+ *
+ * @param builder Builder to free (may be NULL)
+ */
+void waver_sidecar_builder_free(waver_sidecar_builder_t *builder) {
+    if (!builder) {
+        return;
+    }
+
+    free(builder->bins);
+    free(builder);
+}
+
+/**
+ * @brief Make sure a builder has room for a bin
+ *
+ * @param builder Builder
+ * @param bin Bin index relative to the first bin of the builder
+ * @return true if successful, false on allocation failure
+ */
+static bool reserve_bin(waver_sidecar_builder_t *builder, size_t bin) {
+    if (bin < builder->capacity) {
+        return true;
+    }
+
+    size_t capacity = builder->capacity ? builder->capacity : 4096;
+    while (capacity <= bin) {
+        capacity *= 2;
+    }
+
+    waver_minmax_t *bins = realloc(builder->bins, capacity * builder->channels * sizeof(waver_minmax_t));
+    if (!bins) {
+        return false;
+    }
+
+    for (size_t i = builder->capacity * builder->channels; i < capacity * builder->channels; i++) {
+        bins[i] = EMPTY_BIN;
+    }
+    builder->bins = bins;
+    builder->capacity = capacity;
+    return true;
+}
+
+/**
+ * @brief Add a block of interleaved PCM samples to a builder
+ *
+ * @param builder Builder
+ * @param pcm Interleaved PCM samples
+ * @param frames Number of sample frames (samples per channel) in pcm
+ * @param channels Channels in pcm
+ * @return true if successful, false on allocation failure
+ */
+bool waver_sidecar_builder_add(waver_sidecar_builder_t *builder, const int16_t *pcm, size_t frames,
+                               unsigned int channels) {
+    uint64_t first_bin = builder->first_sample / WAVER_SIDECAR_BIN_SAMPLES;
+
+    while (frames > 0) {
+        // Cut the block at bin boundaries
+        uint64_t position = builder->first_sample + builder->samples;
+        size_t bin = (size_t)(position / WAVER_SIDECAR_BIN_SAMPLES - first_bin);
+        size_t run = WAVER_SIDECAR_BIN_SAMPLES - (size_t)(position % WAVER_SIDECAR_BIN_SAMPLES);
+        if (run > frames) {
+            run = frames;
+        }
+        if (!reserve_bin(builder, bin)) {
+            return false;
+        }
+
+        waver_minmax_t *entry = &builder->bins[bin * builder->channels];
+        waver_minmax_t left = entry[0];
+        if (builder->channels == 1) {
+            for (size_t i = 0; i < run; i++) {
+                int16_t sample = pcm[i * channels];
+                left.min = sample < left.min ? sample : left.min;
+                left.max = sample > left.max ? sample : left.max;
+            }
+        } else {
+            waver_minmax_t right = entry[1];
+            for (size_t i = 0; i < run; i++) {
+                int16_t sample = pcm[i * channels];
+                left.min = sample < left.min ? sample : left.min;
+                left.max = sample > left.max ? sample : left.max;
+                sample = pcm[i * channels + 1];
+                right.min = sample < right.min ? sample : right.min;
+                right.max = sample > right.max ? sample : right.max;
+            }
+            entry[1] = right;
+        }
+        entry[0] = left;
+
+        pcm += run * channels;
+        frames -= run;
+        builder->samples += run;
+    }
+    return true;
+}
+
+/**
+ * @brief Append a builder that continues where another one stops
+ *
+ * @param builder Builder to extend
+ * @param next Builder whose first sample follows the last sample of builder
+ * @return true if successful, false if the builders do not line up or on allocation failure
+ */
+bool waver_sidecar_builder_append(waver_sidecar_builder_t *builder, const waver_sidecar_builder_t *next) {
+    if (next->channels != builder->channels ||
+        next->first_sample != builder->first_sample + builder->samples) {
+        return false;
+    }
+    if (next->samples == 0) {
+        return true;
+    }
+
+    uint64_t first_bin = builder->first_sample / WAVER_SIDECAR_BIN_SAMPLES;
+    uint64_t next_first_bin = next->first_sample / WAVER_SIDECAR_BIN_SAMPLES;
+    uint64_t next_bins = (next->first_sample + next->samples - 1) / WAVER_SIDECAR_BIN_SAMPLES - next_first_bin + 1;
+    if (!reserve_bin(builder, (size_t)(next_first_bin + next_bins - 1 - first_bin))) {
+        return false;
+    }
+
+    // The first bin of next may be shared with the last bin of builder
+    for (uint64_t i = 0; i < next_bins; i++) {
+        waver_minmax_t *entry = &builder->bins[(next_first_bin + i - first_bin) * builder->channels];
+        for (unsigned int c = 0; c < builder->channels; c++) {
+            merge_bin(&entry[c], next->bins[i * next->channels + c]);
+        }
+    }
+
+    builder->samples += next->samples;
+    return true;
+}
+
+/**
+ * @brief Build the pyramid and write a sidecar
+ *
+ * The file is written under a temporary name and renamed into place.
+ *
+ * @param path Path of the sidecar
+ * @param builder Builder holding the whole track (first_sample 0)
+ * @param source_size Size of the source file in bytes
+ * @param source_mtime Modification time of the source file
+ * @return true if successful, false otherwise
+ */
+bool waver_sidecar_write(const char *path, const waver_sidecar_builder_t *builder,
+                         uint64_t source_size, int64_t source_mtime) {
+    if (builder->first_sample != 0 || builder->samples == 0) {
+        return false;
+    }
+
+    unsigned int channels = builder->channels;
+    uint64_t bins = (builder->samples + WAVER_SIDECAR_BIN_SAMPLES - 1) / WAVER_SIDECAR_BIN_SAMPLES;
+
+    // Lay out the levels
+    waver_sidecar_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WAVER_SIDECAR_MAGIC, sizeof(header.magic));
+    header.version = WAVER_SIDECAR_VERSION;
+    header.byte_order = WAVER_SIDECAR_BYTE_ORDER;
+    header.header_size = sizeof(header);
+    header.channels = channels;
+    header.sample_rate = builder->sample_rate;
+    header.bin_samples = WAVER_SIDECAR_BIN_SAMPLES;
+    header.total_samples = builder->samples;
+    header.source_size = source_size;
+    header.source_mtime = source_mtime;
+
+    waver_sidecar_level_t levels[MAX_LEVELS];
+    uint64_t level_size = bins;
+    do {
+        levels[header.level_count].bins = level_size;
+        header.level_count++;
+        level_size = parent_bins(level_size);
+    } while (levels[header.level_count - 1].bins > 1 && header.level_count < MAX_LEVELS);
+
+    uint64_t offset = sizeof(header) + header.level_count * sizeof(waver_sidecar_level_t);
+    uint64_t pyramid_bins = 0;
+    for (uint32_t i = 0; i < header.level_count; i++) {
+        levels[i].offset = offset;
+        offset += level_bytes(levels[i].bins, channels);
+        pyramid_bins += levels[i].bins;
+    }
+
+    // Build the levels above level 0 in one buffer
+    waver_minmax_t *pyramid = malloc((size_t)pyramid_bins * channels * sizeof(waver_minmax_t));
+    if (!pyramid) {
+        return false;
+    }
+    memcpy(pyramid, builder->bins, (size_t)bins * channels * sizeof(waver_minmax_t));
+
+    waver_minmax_t *below = pyramid;
+    for (uint32_t i = 1; i < header.level_count; i++) {
+        waver_minmax_t *level = below + levels[i - 1].bins * channels;
+        for (uint64_t b = 0; b < levels[i].bins; b++) {
+            for (unsigned int c = 0; c < channels; c++) {
+                waver_minmax_t value = below[2 * b * channels + c];
+                if (2 * b + 1 < levels[i - 1].bins) {
+                    merge_bin(&value, below[(2 * b + 1) * channels + c]);
+                }
+                level[b * channels + c] = value;
+            }
+        }
+        below = level;
+    }
+
+    // Write to a temporary file and move it into place
+    char temp_path[1024];
+    int result = snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    if (result < 0 || (size_t)result >= sizeof(temp_path)) {
+        free(pyramid);
+        return false;
+    }
+
+    FILE *file = fopen(temp_path, "wb");
+    if (!file) {
+        free(pyramid);
+        return false;
+    }
+
+    static const uint8_t padding[8] = { 0 };
+    bool success = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(levels, sizeof(waver_sidecar_level_t), header.level_count, file) == header.level_count;
+    const waver_minmax_t *level = pyramid;
+    for (uint32_t i = 0; success && i < header.level_count; i++) {
+        size_t count = (size_t)levels[i].bins * channels;
+        size_t pad = (size_t)level_bytes(levels[i].bins, channels) - count * sizeof(waver_minmax_t);
+        success = fwrite(level, sizeof(waver_minmax_t), count, file) == count &&
+                  (pad == 0 || fwrite(padding, 1, pad, file) == pad);
+        level += count;
+    }
+    free(pyramid);
+
+    if (fclose(file) != 0) {
+        success = false;
+    }
+    if (success) {
+        success = rename(temp_path, path) == 0;
+    }
+    if (!success) {
+        remove(temp_path);
+    }
+    return success;
+}
+
+/**
+ * @brief Check the header and level table of a mapped sidecar
+ *
+ * @param data Start of the mapping
+ * @param size Size of the mapping
+ * @return true if the file is a complete sidecar this build can read
+ */
+static bool validate(const uint8_t *data, size_t size) {
+    if (size < sizeof(waver_sidecar_header_t)) {
+        return false;
+    }
+
+    const waver_sidecar_header_t *header = (const waver_sidecar_header_t *)data;
+    if (memcmp(header->magic, WAVER_SIDECAR_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != WAVER_SIDECAR_VERSION ||
+        header->byte_order != WAVER_SIDECAR_BYTE_ORDER ||
+        header->header_size != sizeof(waver_sidecar_header_t) ||
+        header->channels < 1 || header->channels > 2 ||
+        header->bin_samples != WAVER_SIDECAR_BIN_SAMPLES ||
+        header->total_samples == 0 ||
+        header->level_count < 1 || header->level_count > MAX_LEVELS ||
+        size < sizeof(waver_sidecar_header_t) + header->level_count * sizeof(waver_sidecar_level_t)) {
+        return false;
+    }
+
+    const waver_sidecar_level_t *levels = (const waver_sidecar_level_t *)(data + sizeof(waver_sidecar_header_t));
+    uint64_t bins = (header->total_samples + header->bin_samples - 1) / header->bin_samples;
+    for (uint32_t i = 0; i < header->level_count; i++) {
+        if (levels[i].bins != bins || levels[i].offset % 8 != 0 || levels[i].offset > size ||
+            level_bytes(bins, header->channels) > size - levels[i].offset) {
+            return false;
+        }
+        bins = parent_bins(bins);
+    }
+    return true;
+}
+
+/**
+ * @brief Map and validate a sidecar
+ *
+ * @param path Path of the sidecar
+ * @return Mapped sidecar, or NULL if it is missing, unreadable or invalid
+ */
+waver_sidecar_t *waver_sidecar_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    waver_sidecar_t *sidecar = NULL;
+    if (validate(data, size)) {
+        sidecar = malloc(sizeof(waver_sidecar_t));
+    }
+    if (!sidecar) {
+        munmap(data, size);
+        return NULL;
+    }
+
+    sidecar->data = data;
+    sidecar->size = size;
+    sidecar->header = (const waver_sidecar_header_t *)sidecar->data;
+    sidecar->levels = (const waver_sidecar_level_t *)(sidecar->data + sizeof(waver_sidecar_header_t));
+    return sidecar;
+}
+
+/**
+ * @brief Check that a sidecar was made from the given source file
+ *
+ * @param sidecar Mapped sidecar
+ * @param source_size Size of the source file in bytes
+ * @param source_mtime Modification time of the source file
+ * @return true if the sidecar is up to date
+ */
+bool waver_sidecar_matches(const waver_sidecar_t *sidecar, uint64_t source_size, int64_t source_mtime) {
+    return sidecar->header->source_size == source_size && sidecar->header->source_mtime == source_mtime;
+}
+
+/**
+ * @brief Peak amplitude of every image column
+ *
+ * Columns follow waver_column_start() for the stored sample count.  Each
+ * column is covered by the fewest pyramid bins that span its level-0 bins,
+ * so a column may include up to bin_samples - 1 samples of its neighbours.
+ *
+ * @param sidecar Mapped sidecar
+ * @param width Number of columns
+ * @param left Output peaks for left/mono (width entries)
+ * @param right Output peaks for right (width entries, zero for mono)
+ */
+void waver_sidecar_column_peaks(const waver_sidecar_t *sidecar, unsigned int width,
+                                uint16_t *left, uint16_t *right) {
+    const waver_sidecar_header_t *header = sidecar->header;
+    unsigned int channels = header->channels;
+    uint64_t total = header->total_samples;
+
+    for (unsigned int x = 0; x < width; x++) {
+        uint64_t first = waver_column_start(total, width, x);
+        uint64_t end = waver_column_start(total, width, x + 1);
+        waver_minmax_t peaks[2] = { EMPTY_BIN, EMPTY_BIN };
+
+        // Cover the level-0 bins of the column with the largest aligned blocks
+        uint64_t bin = first / header->bin_samples;
+        uint64_t end_bin = end > first ? (end + header->bin_samples - 1) / header->bin_samples : bin;
+        while (bin < end_bin) {
+            uint32_t level = 0;
+            while (level + 1 < header->level_count && (bin & (((uint64_t)2 << level) - 1)) == 0 &&
+                   bin + ((uint64_t)2 << level) <= end_bin) {
+                level++;
+            }
+
+            const waver_minmax_t *data = (const waver_minmax_t *)(sidecar->data + sidecar->levels[level].offset);
+            for (unsigned int c = 0; c < channels; c++) {
+                merge_bin(&peaks[c], data[(bin >> level) * channels + c]);
+            }
+            bin += (uint64_t)1 << level;
+        }
+
+        left[x] = (uint16_t)bin_peak(peaks[0]);
+        right[x] = channels > 1 ? (uint16_t)bin_peak(peaks[1]) : 0;
+    }
+}
+
+/**
+ * @brief Unmap a sidecar
+ *
+ * @param sidecar Sidecar to close (may be NULL)
+ */
+void waver_sidecar_close(waver_sidecar_t *sidecar) {
+    if (!sidecar) {
+        return;
+    }
+
+    munmap((void *)sidecar->data, sidecar->size);
+    free(sidecar);
+}
@@ -0,0 +1,288 @@
+/**
+ * @file stats.c
+ * @brief Per-phase timing of waveform generation (--stats, --stats-json)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "stats.h"
+#include "console.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+// Names of the phases in the summary and the JSON keys
+static const char *PHASE_NAMES[WAVER_PHASE_COUNT] = {
+    [WAVER_PHASE_OPEN] = "open",
+    [WAVER_PHASE_DECODE] = "decode",
+    [WAVER_PHASE_PEAKS] = "peaks",
+    [WAVER_PHASE_DRAW] = "draw",
+    [WAVER_PHASE_FILTER] = "filter",
+    [WAVER_PHASE_COMPRESS] = "compress",
+    [WAVER_PHASE_WRITE] = "write",
+};
+
+/**
+ * @brief Summary of one phase (or of all phases together) over every file
+ */
+typedef struct {
+    const char *name;  /**< Phase name */
+    double total;      /**< Sum over all files in seconds */
+    double p50;        /**< Median per file in seconds */
+    double p95;        /**< 95th percentile per file in seconds */
+    double p99;        /**< 99th percentile per file in seconds */
+} phase_summary_t;
+
+/**
+ * @brief Current time of the monotonic clock
+ *
+ * @return Seconds since an arbitrary starting point
+ */
+double waver_stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Make room for more records
+ *
+ * @param stats Accumulator
+ * @param count Records needed in total
+ * @return true if successful, false on allocation failure
+ */
+static bool reserve(waver_stats_t *stats, size_t count) {
+    if (count <= stats->capacity) {
+        return true;
+    }
+    size_t capacity = stats->capacity ? stats->capacity * 2 : 64;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    waver_file_stats_t *files = realloc(stats->files, capacity * sizeof(waver_file_stats_t));
+    if (!files) {
+        return false;
+    }
+    stats->files = files;
+    stats->capacity = capacity;
+    return true;
+}
+
+/**
+ * @brief Append the record of one file
+ *
+ * @param stats Accumulator of the calling thread
+ * @param file Record to append (copied)
+ * @return true if successful, false on allocation failure
+ */
+bool waver_stats_add(waver_stats_t *stats, const waver_file_stats_t *file) {
+    if (!reserve(stats, stats->count + 1)) {
+        return false;
+    }
+    stats->files[stats->count++] = *file;
+    return true;
+}
+
+/**
+ * @brief Append all records of another accumulator
+ *
+ * @param stats Accumulator to append to
+ * @param other Accumulator to copy the records from
+ * @return true if successful, false on allocation failure
+ */
+bool waver_stats_merge(waver_stats_t *stats, const waver_stats_t *other) {
+    if (other->count == 0) {
+        return true;
+    }
+    if (!reserve(stats, stats->count + other->count)) {
+        return false;
+    }
+    memcpy(stats->files + stats->count, other->files, other->count * sizeof(waver_file_stats_t));
+    stats->count += other->count;
+    return true;
+}
+
+/**
+ * @brief Free the records of an accumulator and empty it
+ *
+ * @param stats Accumulator
+ */
+void waver_stats_free(waver_stats_t *stats) {
+    free(stats->files);
+    stats->files = NULL;
+    stats->count = 0;
+    stats->capacity = 0;
+}
+
+/**
+ * @brief Compare two doubles for qsort
+ *
+ * @param a First value
+ * @param b Second value
+ * @return Negative, zero or positive as a is less than, equal to or greater than b
+ */
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Nearest-rank percentile of sorted values
+ *
+ * @param sorted Values in ascending order
+ * @param count Number of values (at least 1)
+ * @param percent Percentile to get (0-100)
+ * @return The smallest value with at least percent of the values at or below it
+ */
+static double percentile(const double *sorted, size_t count, double percent) {
+    size_t rank = (size_t)ceil(percent / 100.0 * (double)count);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * @brief Summarize every phase, plus the total per file in the last entry
+ *
+ * @param stats Records of all files (at least one)
+ * @param summary Receives WAVER_PHASE_COUNT + 1 entries
+ * @return true if successful, false on allocation failure
+ */
+static bool summarize(const waver_stats_t *stats, phase_summary_t *summary) {
+    double *values = malloc(stats->count * sizeof(double));
+    if (!values) {
+        return false;
+    }
+
+    for (size_t phase = 0; phase <= WAVER_PHASE_COUNT; phase++) {
+        double total = 0.0;
+        for (size_t i = 0; i < stats->count; i++) {
+            const waver_file_stats_t *file = &stats->files[i];
+            double seconds = 0.0;
+            if (phase < WAVER_PHASE_COUNT) {
+                seconds = file->seconds[phase];
+            } else {
+                for (size_t p = 0; p < WAVER_PHASE_COUNT; p++) {
+                    seconds += file->seconds[p];
+                }
+            }
+            values[i] = seconds;
+            total += seconds;
+        }
+        qsort(values, stats->count, sizeof(double), compare_doubles);
+
+        summary[phase].name = phase < WAVER_PHASE_COUNT ? PHASE_NAMES[phase] : "total";
+        summary[phase].total = total;
+        summary[phase].p50 = percentile(values, stats->count, 50.0);
+        summary[phase].p95 = percentile(values, stats->count, 95.0);
+        summary[phase].p99 = percentile(values, stats->count, 99.0);
+    }
+
+    free(values);
+    return true;
+}
+
+/**
+ * @brief Write the summary as JSON
+ *
+ * @param fp File to write to
+ * @param stats Records of all files
+ * @param summary Phase summaries (WAVER_PHASE_COUNT + 1 entries)
+ * @param wall_seconds Elapsed time of the whole run
+ * @param threads Most worker threads that ran tasks at once
+ * @param input_bytes Bytes decoded over all files
+ * @param audio_seconds Audio decoded over all files
+ */
+static void write_json(FILE *fp, const waver_stats_t *stats, const phase_summary_t *summary,
+                       double wall_seconds, size_t threads, uint64_t input_bytes, double audio_seconds) {
+    double wall = wall_seconds > 0.0 ? wall_seconds : 1e-9;
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"files\": %zu,\n", stats->count);
+    fprintf(fp, "  \"threads\": %zu,\n", threads);
+    fprintf(fp, "  \"wall_seconds\": %.6f,\n", wall_seconds);
+    fprintf(fp, "  \"input_bytes\": %llu,\n", (unsigned long long)input_bytes);
+    fprintf(fp, "  \"audio_seconds\": %.3f,\n", audio_seconds);
+    fprintf(fp, "  \"files_per_second\": %.3f,\n", (double)stats->count / wall);
+    fprintf(fp, "  \"mb_per_second\": %.3f,\n", (double)input_bytes / 1e6 / wall);
+    fprintf(fp, "  \"audio_hours_per_second\": %.6f,\n", audio_seconds / 3600.0 / wall);
+    fprintf(fp, "  \"phases\": {\n");
+    for (size_t phase = 0; phase <= WAVER_PHASE_COUNT; phase++) {
+        const phase_summary_t *s = &summary[phase];
+        fprintf(fp, "    \"%s\": {\"total_seconds\": %.6f, \"p50_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f}%s\n",
+                s->name, s->total, s->p50 * 1000.0, s->p95 * 1000.0, s->p99 * 1000.0,
+                phase < WAVER_PHASE_COUNT ? "," : "");
+    }
+    fprintf(fp, "  }\n");
+    fprintf(fp, "}\n");
+}
+
+/**
+ * @brief Print the summary for --stats and write the file for --stats-json
+ *
+ * Phase totals add up the time of every thread, so with several threads
+ * they can exceed the wall time; the throughput figures use the wall time.
+ *
+ * @param args Command-line arguments (stats and stats_json)
+ * @param stats Records of all files
+ * @param wall_seconds Elapsed time of the whole run
+ * @param threads Most worker threads that ran tasks at once
+ * @return true if successful, false if the JSON file could not be written
+ */
+bool waver_stats_report(const waver_args_t *args, const waver_stats_t *stats, double wall_seconds,
+                        size_t threads) {
+    if (!args->stats && !args->stats_json) {
+        return true;
+    }
+    // Queued messages go out before the report
+    waver_console_flush();
+    if (stats->count == 0) {
+        if (args->stats) {
+            printf("Stats: no files were processed\n");
+        }
+        return true;
+    }
+
+    phase_summary_t summary[WAVER_PHASE_COUNT + 1];
+    if (!summarize(stats, summary)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+
+    uint64_t input_bytes = 0;
+    double audio_seconds = 0.0;
+    for (size_t i = 0; i < stats->count; i++) {
+        input_bytes += stats->files[i].input_bytes;
+        audio_seconds += stats->files[i].audio_seconds;
+    }
+
+    if (args->stats) {
+        double wall = wall_seconds > 0.0 ? wall_seconds : 1e-9;
+        double busy = summary[WAVER_PHASE_COUNT].total > 0.0 ? summary[WAVER_PHASE_COUNT].total : 1e-9;
+        printf("Stats: %zu file%s in %.3f s on %zu thread%s: %.1f files/s, %.2f MB/s decoded, "
+               "%.3f audio-hours/s\n",
+               stats->count, stats->count == 1 ? "" : "s", wall_seconds, threads, threads == 1 ? "" : "s",
+               (double)stats->count / wall, (double)input_bytes / 1e6 / wall, audio_seconds / 3600.0 / wall);
+        printf("  %-10s %10s %7s %10s %10s %10s\n", "phase", "total s", "share", "p50 ms", "p95 ms", "p99 ms");
+        for (size_t phase = 0; phase <= WAVER_PHASE_COUNT; phase++) {
+            const phase_summary_t *s = &summary[phase];
+            printf("  %-10s %10.3f %6.1f%% %10.3f %10.3f %10.3f\n", s->name, s->total,
+                   100.0 * s->total / busy, s->p50 * 1000.0, s->p95 * 1000.0, s->p99 * 1000.0);
+        }
+    }
+
+    if (args->stats_json) {
+        bool to_stdout = strcmp(args->stats_json, "-") == 0;
+        FILE *fp = to_stdout ? stdout : fopen(args->stats_json, "w");
+        if (!fp) {
+            fprintf(stderr, "Failed to write stats file: %s\n", args->stats_json);
+            return false;
+        }
+        write_json(fp, stats, summary, wall_seconds, threads, input_bytes, audio_seconds);
+        if (!to_stdout && fclose(fp) != 0) {
+            fprintf(stderr, "Failed to write stats file: %s\n", args->stats_json);
+            return false;
+        }
+    }
+    return true;
+}
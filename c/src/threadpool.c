@@ -3,36 +3,60 @@
  * @brief Thread pool implementation for parallel file processing
  */
 
+// For clock_gettime and openat on some systems, and d_type
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include "threadpool.h"
 #include "waver.h"
+#include "watch.h"
+#include "manifest.h"
+#include "atlas.h"
+#include "tree.h"
+#include "stats.h"
+#include "console.h"
+#include "input.h"
+#include "writer.h"
+#include "cpus.h"
+#include "dedup.h"
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <ctype.h>
 
-// For strdup on some systems
-#define _POSIX_C_SOURCE 200809L
-
-// Default queue capacity
-#define DEFAULT_QUEUE_CAPACITY 1024
+// Initial capacity of each worker's queue (queues grow as needed)
+#define INITIAL_QUEUE_CAPACITY 64
 #define MAX_PATH_LENGTH 1024
 
-/**
- * @brief Check if a path is a directory
- * 
- * @param path Path to check
- * @return true if the path is a directory, false otherwise
- */
-static bool is_directory(const char *path) {
-    struct stat st;
-    if (stat(path, &st) == 0) {
-        return S_ISDIR(st.st_mode);
-    }
-    return false;
-}
+// Bytes per block of task paths (longer paths get a block of their own)
+#define PATH_BLOCK_SIZE 16384
+
+// Reads of the prefetch stage, and how much of each file it reads ahead
+#define PREFETCH_CHUNK (1024 * 1024)
+#define PREFETCH_LIMIT (64 * 1024 * 1024)
+
+// Workers an adaptive pool creates per available CPU, how often it looks
+// at the task times, and the share of them spent waiting for a CPU that
+// makes it park a worker
+#define ADAPTIVE_THREADS_PER_CPU 4
+#define ADAPT_INTERVAL_NS 250000000u
+#define ADAPT_WAITING_SHARE 4
+
+// Longest wait for directory changes before checking for a stop request
+#define WATCH_POLL_MS 1000
+
+// Tasks per benchmark run, and the spin iterations of a short benchmark task
+#define BENCHMARK_TASKS 20000
+#define BENCHMARK_SPIN 20000
+
+// Worker running on this thread, if any
+static _Thread_local worker_t *current_worker = NULL;
 
 /**
  * @brief Check if a string has a specified file extension
@@ -84,173 +108,671 @@ static bool has_any_extension(const char *filename, char **extensions, unsigned
 }
 
 /**
- * @brief Worker thread function that processes tasks from the queue
+ * @brief Set up an empty task queue
+ *
+ * @param queue Queue to initialize
+ * @return true if successful, false otherwise
+ */
+static bool queue_init(task_queue_t *queue) {
+    queue->tasks = calloc(INITIAL_QUEUE_CAPACITY, sizeof(task_t));
+    if (!queue->tasks) {
+        return false;
+    }
+    if (pthread_mutex_init(&queue->mutex, NULL) != 0) {
+        free(queue->tasks);
+        return false;
+    }
+    queue->capacity = INITIAL_QUEUE_CAPACITY;
+    queue->head = 0;
+    atomic_init(&queue->count, 0);
+    atomic_init(&queue->top_cost, 0);
+    return true;
+}
+
+/**
+ * @brief Drop one reference to a path block, freeing it with the last one
+ *
+ * @param block Block (may be NULL)
+ */
+static void path_block_release(path_block_t *block) {
+    if (block && atomic_fetch_sub(&block->references, 1) == 1) {
+        free(block);
+    }
+}
+
+/**
+ * @brief Copy a path into an arena
+ *
+ * The arena must only be used by one thread at a time; the copy may be
+ * released from any thread.
+ *
+ * @param arena Arena to copy into
+ * @param path Path to copy
+ * @return Copy of the path, or NULL on allocation failure
+ */
+static const char *path_copy(path_arena_t *arena, const char *path) {
+    size_t length = strlen(path) + 1;
+    size_t need = sizeof(path_block_t *) + length;
+
+    path_block_t *block = arena->block;
+    if (!block || block->size - block->used < need) {
+        size_t size = need > PATH_BLOCK_SIZE ? need : PATH_BLOCK_SIZE;
+        path_block_t *next = malloc(sizeof(path_block_t) + size);
+        if (!next) {
+            return NULL;
+        }
+        atomic_init(&next->references, 1);
+        next->used = 0;
+        next->size = size;
+
+        // The full block goes once the paths still in it are done with
+        path_block_release(block);
+        arena->block = block = next;
+    }
+
+    char *copy = block->data + block->used;
+    memcpy(copy, &block, sizeof(block));
+    memcpy(copy + sizeof(block), path, length);
+    block->used += need;
+    atomic_fetch_add(&block->references, 1);
+    return copy + sizeof(block);
+}
+
+/**
+ * @brief Release a path made by path_copy()
+ *
+ * @param path Path (may be NULL)
+ */
+static void path_release(const char *path) {
+    if (path) {
+        path_block_t *block;
+        memcpy(&block, path - sizeof(block), sizeof(block));
+        path_block_release(block);
+    }
+}
+
+/**
+ * @brief Free a task queue and the paths of any tasks left in it
+ *
+ * @param queue Queue to destroy
+ */
+static void queue_destroy(task_queue_t *queue) {
+    size_t count = atomic_load(&queue->count);
+    for (size_t i = 0; i < count; i++) {
+        path_release(queue->tasks[(queue->head + i) % queue->capacity].file_path);
+    }
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue->tasks);
+}
+
+/**
+ * @brief Swap two tasks
+ *
+ * @param a First task
+ * @param b Second task
+ */
+static void swap_tasks(task_t *a, task_t *b) {
+    task_t swap = *a;
+    *a = *b;
+    *b = swap;
+}
+
+/**
+ * @brief Append a task to a queue, growing it if needed
+ *
+ * @param queue Queue to append to
+ * @param task Task to append
+ * @param by_cost Keep the queue as a max-heap on cost instead of in FIFO order
+ * @return true if successful, false on allocation failure
+ */
+static bool queue_push(task_queue_t *queue, const task_t *task, bool by_cost) {
+    pthread_mutex_lock(&queue->mutex);
+    size_t count = atomic_load(&queue->count);
+    if (count == queue->capacity) {
+        // Unwrap the ring into a buffer twice the size
+        task_t *tasks = malloc(2 * queue->capacity * sizeof(task_t));
+        if (!tasks) {
+            pthread_mutex_unlock(&queue->mutex);
+            return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+            tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+        }
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->capacity *= 2;
+        queue->head = 0;
+    }
+    queue->tasks[(queue->head + count) % queue->capacity] = *task;
+
+    // A heap has head 0; sift the new task up past cheaper parents
+    if (by_cost) {
+        size_t i = count;
+        while (i > 0 && queue->tasks[(i - 1) / 2].cost < queue->tasks[i].cost) {
+            swap_tasks(&queue->tasks[(i - 1) / 2], &queue->tasks[i]);
+            i = (i - 1) / 2;
+        }
+        atomic_store(&queue->top_cost, queue->tasks[0].cost);
+    }
+    atomic_store(&queue->count, count + 1);
+    pthread_mutex_unlock(&queue->mutex);
+    return true;
+}
+
+/**
+ * @brief Take the oldest (or, for a heap, the most costly) task from a queue
+ *
+ * @param queue Queue to take from
+ * @param task Receives the task
+ * @param by_cost The queue is a max-heap on cost
+ * @return true if a task was taken, false if the queue was empty
+ */
+static bool queue_pop(task_queue_t *queue, task_t *task, bool by_cost) {
+    if (atomic_load(&queue->count) == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    size_t count = atomic_load(&queue->count);
+    if (count == 0) {
+        pthread_mutex_unlock(&queue->mutex);
+        return false;
+    }
+    *task = queue->tasks[queue->head];
+    count--;
+
+    if (by_cost) {
+        // Move the last task to the root and sift it down past costlier children
+        queue->tasks[0] = queue->tasks[count];
+        size_t i = 0;
+        for (;;) {
+            size_t largest = i;
+            size_t left = 2 * i + 1;
+            size_t right = left + 1;
+            if (left < count && queue->tasks[left].cost > queue->tasks[largest].cost) {
+                largest = left;
+            }
+            if (right < count && queue->tasks[right].cost > queue->tasks[largest].cost) {
+                largest = right;
+            }
+            if (largest == i) {
+                break;
+            }
+            swap_tasks(&queue->tasks[i], &queue->tasks[largest]);
+            i = largest;
+        }
+        atomic_store(&queue->top_cost, count > 0 ? queue->tasks[0].cost : 0);
+    } else {
+        queue->head = (queue->head + 1) % queue->capacity;
+    }
+    atomic_store(&queue->count, count);
+    pthread_mutex_unlock(&queue->mutex);
+    return true;
+}
+
+/**
+ * @brief Wait while a worker is above the pool's active count
+ *
+ * The queue of a parked worker is still drained by the others.  A
+ * stopping pool only releases it once every task is done, so the batch
+ * that is left keeps to the active count too.
+ *
+ * @param worker Worker to park
+ */
+static void park_worker(worker_t *worker) {
+    threadpool_t *pool = worker->pool;
+    pthread_mutex_lock(&pool->idle_mutex);
+    // The wake-up that brought this worker here may have been meant for a task
+    if (atomic_load(&pool->queued) > 0 && atomic_load(&pool->sleepers) > 0) {
+        pthread_cond_signal(&pool->work_available);
+    }
+    while (worker->index >= atomic_load(&pool->active_threads) &&
+           !(atomic_load(&pool->stop) && atomic_load(&pool->pending) == 0)) {
+        pthread_cond_wait(&pool->resumed, &pool->idle_mutex);
+    }
+    pthread_mutex_unlock(&pool->idle_mutex);
+}
+
+/**
+ * @brief Wait for the next task for a worker
+ *
+ * The worker's own queue comes first; when it is empty the other queues
+ * are tried in turn.  With largest-first scheduling the queue whose top
+ * task is the most costly comes first instead.  Only when every queue is
+ * empty does the worker sleep, until a task is added or the pool stops.
+ * A worker above the active count parks first.
+ *
+ * @param worker Worker looking for work
+ * @param task Receives the task
+ * @return true if a task was taken, false if the pool is done
+ */
+static bool next_task(worker_t *worker, task_t *task) {
+    threadpool_t *pool = worker->pool;
+    bool by_cost = pool->schedule == WAVER_SCHEDULE_LARGEST_FIRST;
+
+    for (;;) {
+        if (worker->index >= atomic_load(&pool->active_threads)) {
+            park_worker(worker);
+        }
+        if (by_cost) {
+            // The top costs are read without locks, so this is only a good guess
+            size_t best = pool->num_threads;
+            uint64_t best_cost = 0;
+            for (size_t i = 0; i < pool->num_threads; i++) {
+                size_t index = (worker->index + i) % pool->num_threads;
+                uint64_t cost = atomic_load(&pool->queues[index].top_cost);
+                if (atomic_load(&pool->queues[index].count) > 0 && (best == pool->num_threads || cost > best_cost)) {
+                    best = index;
+                    best_cost = cost;
+                }
+            }
+            if (best < pool->num_threads && queue_pop(&pool->queues[best], task, true)) {
+                atomic_fetch_sub(&pool->queued, 1);
+                return true;
+            }
+        }
+        for (size_t i = 0; i < pool->num_threads; i++) {
+            if (queue_pop(&pool->queues[(worker->index + i) % pool->num_threads], task, by_cost)) {
+                atomic_fetch_sub(&pool->queued, 1);
+                return true;
+            }
+        }
+
+        // Registering as a sleeper before checking for work pairs with
+        // threadpool_submit() counting the task before checking for sleepers
+        pthread_mutex_lock(&pool->idle_mutex);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->queued) == 0 &&
+               !(atomic_load(&pool->stop) && atomic_load(&pool->pending) == 0)) {
+            pthread_cond_wait(&pool->work_available, &pool->idle_mutex);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        bool done = atomic_load(&pool->queued) == 0;
+        pthread_mutex_unlock(&pool->idle_mutex);
+
+        if (done) {
+            return false;
+        }
+    }
+}
+
+/**
+ * @brief Seconds between two monotonic clock readings
+ *
+ * @param start Earlier reading
+ * @param end Later reading
+ * @return Elapsed seconds
+ */
+static double elapsed_seconds(const struct timespec *start, const struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Remember the cost and run time of a finished file task
+ *
+ * Losing an entry to a failed allocation only makes the estimate rougher.
+ *
+ * @param worker Worker that ran the task
+ * @param cost Cost of the task
+ * @param seconds Time the task took
+ */
+static void record_cost(worker_t *worker, uint64_t cost, double seconds) {
+    if (worker->cost_count == worker->cost_capacity) {
+        size_t capacity = worker->cost_capacity ? 2 * worker->cost_capacity : INITIAL_QUEUE_CAPACITY;
+        uint64_t *costs = realloc(worker->costs, capacity * sizeof(uint64_t));
+        if (!costs) {
+            return;
+        }
+        worker->costs = costs;
+        worker->cost_capacity = capacity;
+    }
+    worker->costs[worker->cost_count++] = cost;
+    worker->busy_cost += cost;
+    worker->busy_seconds += seconds;
+}
+
+static bool run_file_task(threadpool_t *pool, const task_t *task);
+
+/**
+ * @brief Run a task, counting the tasks that run at once
+ *
+ * @param pool Thread pool the task was added to
+ * @param task Task to run
+ * @return true if the task succeeded, false otherwise
+ */
+static bool run_task(threadpool_t *pool, const task_t *task) {
+    size_t running = atomic_fetch_add(&pool->running, 1) + 1;
+    size_t peak = atomic_load(&pool->peak_running);
+    while (running > peak && !atomic_compare_exchange_weak(&pool->peak_running, &peak, running)) {
+    }
+    bool success = task->run(pool, task);
+    atomic_fetch_sub(&pool->running, 1);
+    return success;
+}
+
+/**
+ * @brief Count a task as done
+ *
+ * @param pool Thread pool the task was added to
+ * @param success Whether the task succeeded
+ */
+static void finish_task(threadpool_t *pool, bool success) {
+    atomic_fetch_add(&pool->completed_tasks, 1);
+    if (!success) {
+        atomic_fetch_add(&pool->failed_tasks, 1);
+    }
+
+    // The last task of a stopping pool lets the sleeping and parked workers exit
+    if (atomic_fetch_sub(&pool->pending, 1) == 1 && atomic_load(&pool->stop)) {
+        pthread_mutex_lock(&pool->idle_mutex);
+        pthread_cond_broadcast(&pool->work_available);
+        pthread_cond_broadcast(&pool->resumed);
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+}
+
+/**
+ * @brief Change the number of workers taking tasks
+ *
+ * @param pool Thread pool
+ * @param active New number of active workers (1 to num_threads)
+ */
+static void set_active_threads(threadpool_t *pool, size_t active) {
+    if (active > atomic_load(&pool->active_threads)) {
+        pthread_mutex_lock(&pool->idle_mutex);
+        atomic_store(&pool->active_threads, active);
+        pthread_cond_broadcast(&pool->resumed);
+        pthread_mutex_unlock(&pool->idle_mutex);
+    } else {
+        // The workers above it park once their current task is done
+        atomic_store(&pool->active_threads, active);
+    }
+    pool->fewest_active = active < pool->fewest_active ? active : pool->fewest_active;
+    pool->most_active = active > pool->most_active ? active : pool->most_active;
+}
+
+/**
+ * @brief Add the times of a finished task to the sample, and adjust the active count when it is due
+ *
+ * One worker at a time adjusts, by one worker at most.  Tasks that spent
+ * a large share of their time runnable without a CPU mean there are
+ * more workers than CPUs to run them.  Otherwise the number of workers
+ * that keeps the CPUs busy is the CPU count times the share of the time
+ * the tasks were not waiting for a CPU over the share they computed
+ * (more than one worker per CPU while tasks block on I/O).
+ *
+ * @param pool Adaptive thread pool
+ * @param schedstat Schedstat descriptor of the worker
+ * @param before Times of the worker when the task started
+ */
+static void adapt_after_task(threadpool_t *pool, int schedstat, const waver_thread_times_t *before) {
+    waver_thread_times_t after;
+    waver_thread_times(&after, schedstat);
+    atomic_fetch_add(&pool->sample_wall_ns, after.wall_ns - before->wall_ns);
+    atomic_fetch_add(&pool->sample_cpu_ns, after.cpu_ns - before->cpu_ns);
+    atomic_fetch_add(&pool->sample_waiting_ns, after.waiting_ns - before->waiting_ns);
+    if (after.wall_ns < atomic_load(&pool->adjust_at_ns) || pthread_mutex_trylock(&pool->adjust_mutex) != 0) {
+        return;
+    }
+    if (after.wall_ns >= atomic_load(&pool->adjust_at_ns)) {
+        atomic_store(&pool->adjust_at_ns, after.wall_ns + ADAPT_INTERVAL_NS);
+        uint64_t wall = atomic_exchange(&pool->sample_wall_ns, 0);
+        uint64_t cpu = atomic_exchange(&pool->sample_cpu_ns, 0);
+        uint64_t waiting = atomic_exchange(&pool->sample_waiting_ns, 0);
+
+        size_t active = atomic_load(&pool->active_threads);
+        size_t next = active;
+        if (wall > 0 && waiting > wall / ADAPT_WAITING_SHARE) {
+            next = active > 1 ? active - 1 : 1;
+        } else if (wall > 0) {
+            double running = wall > waiting ? (double)(wall - waiting) : 0.0;
+            double target = cpu > 0 ? (double)pool->cpus * running / (double)cpu : (double)pool->num_threads;
+            if (target >= (double)active + 0.5 && active < pool->num_threads) {
+                next = active + 1;
+            } else if (target < (double)active - 0.5 && active > 1) {
+                next = active - 1;
+            }
+        }
+        if (next != active) {
+            set_active_threads(pool, next);
+        }
+    }
+    pthread_mutex_unlock(&pool->adjust_mutex);
+}
+
+/**
+ * @brief Worker thread function that runs tasks until the pool is done
  * 
- * @param arg Thread pool pointer
+ * @param arg Worker pointer
  * @return NULL
  */
 static void *worker_thread(void *arg) {
-    threadpool_t *pool = (threadpool_t *)arg;
+    worker_t *worker = (worker_t *)arg;
+    threadpool_t *pool = worker->pool;
+    current_worker = worker;
+    if (pool->pin) {
+        // Only a hint; an unpinned worker runs just the same
+        waver_cpus_pin(worker->index);
+    }
+
+    // Without a context every file sets up its own image and encoder
+    worker->context = waver_context_new(&worker->stats);
+    worker->schedstat = pool->adaptive ? waver_thread_schedstat_open() : -1;
+
     task_t task;
-    bool got_task = false;
-    
-    while (1) {
-        // Lock the queue mutex
-        pthread_mutex_lock(&pool->queue_mutex);
-        
-        // Wait for a task or stop signal
-        while (pool->queue_size == 0 && !pool->stop) {
-            pthread_cond_wait(&pool->queue_not_empty, &pool->queue_mutex);
+    while (next_task(worker, &task)) {
+        // Taking a file that was read ahead makes room for the next one
+        if (task.prefetched && atomic_fetch_sub(&pool->prefetched, 1) == pool->prefetch_depth) {
+            pthread_mutex_lock(&pool->prefetch_mutex);
+            pthread_cond_signal(&pool->prefetch_wanted);
+            pthread_mutex_unlock(&pool->prefetch_mutex);
         }
-        
-        // Check if we should stop
-        if (pool->stop && pool->queue_size == 0) {
-            pthread_mutex_unlock(&pool->queue_mutex);
-            return NULL;
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        waver_thread_times_t before;
+        if (pool->adaptive) {
+            waver_thread_times(&before, worker->schedstat);
         }
-        
-        // Get a task from the queue
-        if (pool->queue_size > 0) {
-            task = pool->queue[pool->head];
-            pool->head = (pool->head + 1) % pool->queue_capacity;
-            pool->queue_size--;
-            got_task = true;
-            
-            // Signal that the queue is not full
-            pthread_cond_signal(&pool->queue_not_full);
+        bool success = run_task(pool, &task);
+        if (pool->adaptive) {
+            adapt_after_task(pool, worker->schedstat, &before);
         }
-        
-        // Unlock the queue mutex
-        pthread_mutex_unlock(&pool->queue_mutex);
-        
-        // Process the task if we got one
-        if (got_task) {
-            // Determine output filename
-            char output_file[MAX_PATH_LENGTH];
-            if (task.args->output_filename) {
-                // Initialize last character to detect truncation
-                size_t output_filename_len = strlen(task.args->output_filename);
-                if (output_filename_len >= sizeof(output_file)) {
-                    waver_print_stderr(task.args, "Output filename too long, truncation would occur");
-                    free(task.file_path);
-                    // Update failed task count and return
-                    pthread_mutex_lock(&pool->stats_mutex);
-                    pool->completed_tasks++;
-                    pool->failed_tasks++;
-                    pthread_mutex_unlock(&pool->stats_mutex);
-                    got_task = false;
-                    continue;
-                }
-                
-                // Safe to copy now
-                strcpy(output_file, task.args->output_filename);
-            } else {
-                // Use .png extension for output
-                int result = snprintf(output_file, sizeof(output_file), "%s.png", task.file_path);
-                if (result < 0 || (size_t)result >= sizeof(output_file)) {
-                    waver_print_stderr(task.args, "Output path too long or formatting error");
-                    free(task.file_path);
-                    // Update failed task count and return
-                    pthread_mutex_lock(&pool->stats_mutex);
-                    pool->completed_tasks++;
-                    pool->failed_tasks++;
-                    pthread_mutex_unlock(&pool->stats_mutex);
-                    got_task = false;
-                    continue;
-                }
-            }
-            
-            waver_print_verbose(task.args, "Input file: %s, Output file: %s", task.file_path, output_file);
-            
-            // Generate waveform
-            bool success = waver_generate_waveform(task.file_path, output_file, task.args);
-            
-            // Update stats
-            pthread_mutex_lock(&pool->stats_mutex);
-            pool->completed_tasks++;
-            if (!success) {
-                pool->failed_tasks++;
-            }
-            pthread_mutex_unlock(&pool->stats_mutex);
-            
-            // Clean up task
-            free(task.file_path);
-            got_task = false;
+        if (pool->schedule == WAVER_SCHEDULE_LARGEST_FIRST && task.run == run_file_task) {
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            record_cost(worker, task.cost, elapsed_seconds(&start, &end));
         }
+        path_release(task.file_path);
+        finish_task(pool, success);
+    }
+
+    waver_context_free(worker->context);
+    worker->context = NULL;
+    if (worker->schedstat >= 0) {
+        close(worker->schedstat);
     }
-    
     return NULL;
 }
 
+/**
+ * @brief Image and encoder state of the worker running the current task
+ *
+ * @return Context of the calling worker, or NULL outside a pool or if it has none
+ */
+waver_context_t *threadpool_worker_context(void) {
+    return current_worker ? current_worker->context : NULL;
+}
+
+/**
+ * @brief Generate the waveform of one audio file
+ *
+ * @param pool Thread pool running the task
+ * @param task Task holding the file path and arguments
+ * @return true if successful, false otherwise
+ */
+static bool run_file_task(threadpool_t *pool, const task_t *task) {
+    waver_context_t *context = threadpool_worker_context();
+
+    // The writer stage (and the dedup table) may have been started after
+    // the worker made its context
+    if (context) {
+        waver_context_set_writer(context, pool->writer);
+        waver_context_set_dedup(context, pool->dedup);
+    }
+
+    // Determine output filename
+    char output_file[MAX_PATH_LENGTH];
+    if (task->args->output_filename) {
+        // Initialize last character to detect truncation
+        size_t output_filename_len = strlen(task->args->output_filename);
+        if (output_filename_len >= sizeof(output_file)) {
+            waver_print_stderr(task->args, "Output filename too long, truncation would occur");
+            return false;
+        }
+
+        // Safe to copy now
+        strcpy(output_file, task->args->output_filename);
+    } else {
+        // Use .png extension for output
+        int result = snprintf(output_file, sizeof(output_file), "%s.png", task->file_path);
+        if (result < 0 || (size_t)result >= sizeof(output_file)) {
+            waver_print_stderr(task->args, "Output path too long or formatting error");
+            return false;
+        }
+    }
+
+    waver_print_verbose(task->args, "Input file: %s, Output file: %s", task->file_path, output_file);
+
+    // Under --incremental the file is stamped before it is read, so a change
+    // made while it is being drawn makes the next run draw it again
+    waver_manifest_dir_t *dir = (waver_manifest_dir_t *)task->context;
+    struct stat st;
+    bool have_stat = dir && stat(task->file_path, &st) == 0;
+
+    // Generate waveform
+    bool success = waver_generate_waveform_with_context(task->file_path, output_file, task->args, context);
+    if (dir) {
+        waver_manifest_stamp_t stamp;
+        const char *name = strrchr(task->file_path, '/');
+        if (success && have_stat && !task->args->dry_run) {
+            waver_manifest_stamp(&st, &stamp);
+            waver_manifest_record(dir, name ? name + 1 : task->file_path, &stamp);
+        } else {
+            waver_manifest_fail(dir);
+        }
+    }
+    return success;
+}
+
+/**
+ * @brief Number of threads to use when none was requested
+ *
+ * @return Number of CPUs the process can use (see waver_cpus_available())
+ */
+size_t threadpool_default_threads(void) {
+    return waver_cpus_available();
+}
+
 /**
  * @brief Initialize a thread pool with specified number of threads
  * 
  * @param num_threads Number of worker threads to create (0 for auto)
+ * @param schedule Order in which queued tasks run
+ * @param flags THREADPOOL_ADAPTIVE and THREADPOOL_PIN, or 0
  * @return Pointer to thread pool or NULL on error
  */
-threadpool_t *threadpool_init(size_t num_threads) {
+threadpool_t *threadpool_init(size_t num_threads, waver_schedule_t schedule, unsigned int flags) {
     // Allocate memory for thread pool
     threadpool_t *pool = (threadpool_t *)calloc(1, sizeof(threadpool_t));
     if (!pool) {
         return NULL;
     }
     
-    // Determine number of threads
+    // Determine number of threads; an adaptive pool starts one per CPU
+    pool->cpus = threadpool_default_threads();
+    pool->adaptive = num_threads == 0 && (flags & THREADPOOL_ADAPTIVE);
+    pool->pin = flags & THREADPOOL_PIN;
     if (num_threads == 0) {
-        // Auto-detect number of threads (get number of processors)
-        long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
-        if (nprocs <= 0) {
-            nprocs = 2; // Default to 2 threads
-        }
-        pool->num_threads = (size_t)nprocs;
-    } else {
-        pool->num_threads = num_threads;
+        num_threads = pool->adaptive ? ADAPTIVE_THREADS_PER_CPU * pool->cpus : pool->cpus;
     }
-    
-    // Initialize queue
-    pool->queue_capacity = DEFAULT_QUEUE_CAPACITY;
-    pool->queue = (task_t *)calloc(pool->queue_capacity, sizeof(task_t));
-    if (!pool->queue) {
+    pool->num_threads = num_threads;
+    size_t active = pool->adaptive ? pool->cpus : pool->num_threads;
+    atomic_init(&pool->active_threads, active);
+    pool->fewest_active = active;
+    pool->most_active = active;
+    atomic_init(&pool->sample_wall_ns, 0);
+    atomic_init(&pool->sample_cpu_ns, 0);
+    atomic_init(&pool->sample_waiting_ns, 0);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    atomic_init(&pool->adjust_at_ns, (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec + ADAPT_INTERVAL_NS);
+    pool->schedule = schedule;
+    atomic_init(&pool->next_queue, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->running, 0);
+    atomic_init(&pool->peak_running, 0);
+    atomic_init(&pool->stop, false);
+    atomic_init(&pool->completed_tasks, 0);
+    atomic_init(&pool->failed_tasks, 0);
+
+    // Initialize one queue per worker
+    pool->queues = (task_queue_t *)calloc(pool->num_threads, sizeof(task_queue_t));
+    pool->workers = (worker_t *)calloc(pool->num_threads, sizeof(worker_t));
+    if (!pool->queues || !pool->workers) {
+        free(pool->queues);
+        free(pool->workers);
         free(pool);
         return NULL;
     }
-    
-    // Initialize worker threads
-    pool->threads = (pthread_t *)calloc(pool->num_threads, sizeof(pthread_t));
-    if (!pool->threads) {
-        free(pool->queue);
-        free(pool);
-        return NULL;
+    size_t queue_count = 0;
+    while (queue_count < pool->num_threads && queue_init(&pool->queues[queue_count])) {
+        queue_count++;
     }
-    
+
     // Initialize mutexes and condition variables
-    if (pthread_mutex_init(&pool->queue_mutex, NULL) != 0 ||
-        pthread_mutex_init(&pool->stats_mutex, NULL) != 0 ||
-        pthread_cond_init(&pool->queue_not_empty, NULL) != 0 ||
-        pthread_cond_init(&pool->queue_not_full, NULL) != 0) {
-        
-        if (pool->threads) free(pool->threads);
-        if (pool->queue) free(pool->queue);
+    if (queue_count < pool->num_threads ||
+        pthread_mutex_init(&pool->paths_mutex, NULL) != 0 ||
+        pthread_mutex_init(&pool->idle_mutex, NULL) != 0 ||
+        pthread_cond_init(&pool->work_available, NULL) != 0 ||
+        pthread_cond_init(&pool->resumed, NULL) != 0 ||
+        pthread_mutex_init(&pool->adjust_mutex, NULL) != 0) {
+        for (size_t i = 0; i < queue_count; i++) {
+            queue_destroy(&pool->queues[i]);
+        }
+        free(pool->queues);
+        free(pool->workers);
         free(pool);
         return NULL;
     }
     
     // Create worker threads
     for (size_t i = 0; i < pool->num_threads; i++) {
-        if (pthread_create(&pool->threads[i], NULL, worker_thread, (void *)pool) != 0) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_thread, &pool->workers[i]) != 0) {
             // Clean up any threads that were created
-            pool->stop = true;
-            pthread_cond_broadcast(&pool->queue_not_empty);
+            pthread_mutex_lock(&pool->idle_mutex);
+            atomic_store(&pool->stop, true);
+            pthread_cond_broadcast(&pool->work_available);
+            pthread_cond_broadcast(&pool->resumed);
+            pthread_mutex_unlock(&pool->idle_mutex);
             for (size_t j = 0; j < i; j++) {
-                pthread_join(pool->threads[j], NULL);
+                pthread_join(pool->workers[j].thread, NULL);
             }
             
-            pthread_cond_destroy(&pool->queue_not_full);
-            pthread_cond_destroy(&pool->queue_not_empty);
-            pthread_mutex_destroy(&pool->stats_mutex);
-            pthread_mutex_destroy(&pool->queue_mutex);
-            free(pool->threads);
-            free(pool->queue);
+            pthread_mutex_destroy(&pool->adjust_mutex);
+            pthread_cond_destroy(&pool->resumed);
+            pthread_cond_destroy(&pool->work_available);
+            pthread_mutex_destroy(&pool->idle_mutex);
+            pthread_mutex_destroy(&pool->paths_mutex);
+            for (size_t j = 0; j < pool->num_threads; j++) {
+                queue_destroy(&pool->queues[j]);
+            }
+            free(pool->queues);
+            free(pool->workers);
             free(pool);
             return NULL;
         }
@@ -259,102 +781,450 @@ threadpool_t *threadpool_init(size_t num_threads) {
     return pool;
 }
 
+/**
+ * @brief Copy a task path into the arena of the calling thread
+ *
+ * Workers copy into their own arena; others share the pool's.
+ *
+ * @param pool Thread pool the task is added to
+ * @param path Path to copy
+ * @return Copy, released with path_release(), or NULL on allocation failure
+ */
+static const char *task_path_copy(threadpool_t *pool, const char *path) {
+    if (current_worker && current_worker->pool == pool) {
+        return path_copy(&current_worker->paths, path);
+    }
+    pthread_mutex_lock(&pool->paths_mutex);
+    const char *copy = path_copy(&pool->paths, path);
+    pthread_mutex_unlock(&pool->paths_mutex);
+    return copy;
+}
+
+/**
+ * @brief Put a task that is already counted as pending on a queue
+ *
+ * @param pool Thread pool
+ * @param index Queue to put it on
+ * @param task Task to add (copied)
+ * @return true if successful, false on allocation failure
+ */
+static bool dispatch_task(threadpool_t *pool, size_t index, const task_t *task) {
+    if (!queue_push(&pool->queues[index], task, pool->schedule == WAVER_SCHEDULE_LARGEST_FIRST)) {
+        return false;
+    }
+    atomic_fetch_add(&pool->queued, 1);
+
+    // Wake a sleeping worker, if there is one
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->idle_mutex);
+        pthread_cond_signal(&pool->work_available);
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+    return true;
+}
+
 /**
  * @brief Add a task to the thread pool
- * 
+ *
  * @param pool Thread pool
- * @param file_path Path to the audio file to process
- * @param args Command-line arguments (shared)
+ * @param task Task to add (copied)
  * @return true if successful, false otherwise
  */
-bool threadpool_add_task(threadpool_t *pool, const char *file_path, const waver_args_t *args) {
-    if (!pool || !file_path || !args) {
+bool threadpool_submit(threadpool_t *pool, const task_t *task) {
+    if (!pool || !task || !task->run) {
         return false;
     }
-    
-    // Lock the queue mutex
-    pthread_mutex_lock(&pool->queue_mutex);
-    
-    // Wait for the queue to have space
-    while (pool->queue_size == pool->queue_capacity && !pool->stop) {
-        pthread_cond_wait(&pool->queue_not_full, &pool->queue_mutex);
+
+    // Workers keep what they spawn, even while the pool is stopping (their
+    // running task keeps it alive); everything else is dealt out in turn
+    size_t index;
+    if (current_worker && current_worker->pool == pool) {
+        index = current_worker->index;
+    } else if (atomic_load(&pool->stop)) {
+        return false;
+    } else {
+        index = atomic_fetch_add(&pool->next_queue, 1) % atomic_load(&pool->active_threads);
     }
-    
-    // Check if we should stop
-    if (pool->stop) {
-        pthread_mutex_unlock(&pool->queue_mutex);
+
+    task_t copy = *task;
+    copy.prefetched = false;
+    if (task->file_path && !(copy.file_path = task_path_copy(pool, task->file_path))) {
         return false;
     }
-    
-    // Create a task
-    task_t task;
-    
-    // Duplicate the file path
-    size_t path_len = strlen(file_path);
-    task.file_path = malloc(path_len + 1);
-    if (!task.file_path) {
-        pthread_mutex_unlock(&pool->queue_mutex);
+
+    atomic_fetch_add(&pool->pending, 1);
+    if (!dispatch_task(pool, index, &copy)) {
+        atomic_fetch_sub(&pool->pending, 1);
+        path_release(copy.file_path);
         return false;
     }
-    memcpy(task.file_path, file_path, path_len);
-    task.file_path[path_len] = '\0';
-    
-    task.args = args;
-    
-    // Add the task to the queue
-    pool->queue[pool->tail] = task;
-    pool->tail = (pool->tail + 1) % pool->queue_capacity;
-    pool->queue_size++;
-    
-    // Signal that the queue is not empty
-    pthread_cond_signal(&pool->queue_not_empty);
-    
-    // Unlock the queue mutex
-    pthread_mutex_unlock(&pool->queue_mutex);
-    
     return true;
 }
 
 /**
- * @brief Wait for all tasks to complete and destroy the thread pool
- * 
- * @param pool Thread pool
- * @return true if all tasks completed successfully, false otherwise
+ * @brief Body of an I/O thread: read the input of file tasks ahead of the workers
+ *
+ * @param arg Thread pool
+ * @return NULL
  */
-bool threadpool_destroy(threadpool_t *pool) {
-    if (!pool) {
+static void *prefetch_thread(void *arg) {
+    threadpool_t *pool = (threadpool_t *)arg;
+    bool by_cost = pool->schedule == WAVER_SCHEDULE_LARGEST_FIRST;
+    void *buffer = malloc(PREFETCH_CHUNK);
+
+    pthread_mutex_lock(&pool->prefetch_mutex);
+    for (;;) {
+        while (!pool->prefetch_stop && (atomic_load(&pool->prefetch_queue.count) == 0 ||
+                                        atomic_load(&pool->prefetched) >= pool->prefetch_depth)) {
+            pthread_cond_wait(&pool->prefetch_wanted, &pool->prefetch_mutex);
+        }
+        // Only I/O threads take from the queue, and only under the mutex
+        task_t task;
+        if (!queue_pop(&pool->prefetch_queue, &task, by_cost)) {
+            break;
+        }
+        atomic_fetch_add(&pool->prefetched, 1);
+        pthread_mutex_unlock(&pool->prefetch_mutex);
+
+        // Reading ahead is only a hint, so a file that cannot be read is
+        // left for its task to report
+        if (buffer) {
+            waver_input_prefetch(task.file_path, buffer, PREFETCH_CHUNK, PREFETCH_LIMIT);
+        }
+        task.prefetched = true;
+        size_t index = atomic_fetch_add(&pool->next_queue, 1) % atomic_load(&pool->active_threads);
+        if (!dispatch_task(pool, index, &task)) {
+            // Rather than lose the task (and any state it holds a reference to), run it here
+            atomic_fetch_sub(&pool->prefetched, 1);
+            bool success = run_task(pool, &task);
+            path_release(task.file_path);
+            finish_task(pool, success);
+        }
+        pthread_mutex_lock(&pool->prefetch_mutex);
+    }
+    pthread_mutex_unlock(&pool->prefetch_mutex);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * @brief Read the input of file tasks ahead on threads of their own
+ *
+ * @param pool Thread pool
+ * @param threads Number of I/O threads
+ * @param depth Most files read ahead that no worker has taken yet (0 for two per worker)
+ * @return true if successful, false otherwise
+ */
+bool threadpool_start_prefetch(threadpool_t *pool, size_t threads, size_t depth) {
+    if (!pool || threads == 0 || pool->io_threads) {
         return false;
     }
-    
-    // Signal threads to stop
-    pthread_mutex_lock(&pool->queue_mutex);
-    pool->stop = true;
-    pthread_cond_broadcast(&pool->queue_not_empty);
-    pthread_mutex_unlock(&pool->queue_mutex);
-    
+    pool->io_threads = calloc(threads, sizeof(pthread_t));
+    if (!pool->io_threads) {
+        return false;
+    }
+    if (!queue_init(&pool->prefetch_queue)) {
+        free(pool->io_threads);
+        pool->io_threads = NULL;
+        return false;
+    }
+    pool->prefetch_depth = depth ? depth : 2 * pool->num_threads;
+    atomic_init(&pool->prefetched, 0);
+    pool->prefetch_stop = false;
+    pthread_mutex_init(&pool->prefetch_mutex, NULL);
+    pthread_cond_init(&pool->prefetch_wanted, NULL);
+
+    while (pool->io_thread_count < threads &&
+           pthread_create(&pool->io_threads[pool->io_thread_count], NULL, prefetch_thread, pool) == 0) {
+        pool->io_thread_count++;
+    }
+    if (pool->io_thread_count == 0) {
+        pthread_cond_destroy(&pool->prefetch_wanted);
+        pthread_mutex_destroy(&pool->prefetch_mutex);
+        queue_destroy(&pool->prefetch_queue);
+        free(pool->io_threads);
+        pool->io_threads = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Add a task that reads an input file, through the prefetch stage if there is one
+ *
+ * @param pool Thread pool
+ * @param task Task to add (copied)
+ * @return true if successful, false otherwise
+ */
+static bool submit_input_task(threadpool_t *pool, const task_t *task) {
+    if (!pool->io_threads) {
+        return threadpool_submit(pool, task);
+    }
+    if (!(current_worker && current_worker->pool == pool) && atomic_load(&pool->stop)) {
+        return false;
+    }
+
+    task_t copy = *task;
+    copy.prefetched = false;
+    if (!(copy.file_path = task_path_copy(pool, task->file_path))) {
+        return false;
+    }
+    atomic_fetch_add(&pool->pending, 1);
+    if (!queue_push(&pool->prefetch_queue, &copy, pool->schedule == WAVER_SCHEDULE_LARGEST_FIRST)) {
+        atomic_fetch_sub(&pool->pending, 1);
+        path_release(copy.file_path);
+        return false;
+    }
+    pthread_mutex_lock(&pool->prefetch_mutex);
+    pthread_cond_signal(&pool->prefetch_wanted);
+    pthread_mutex_unlock(&pool->prefetch_mutex);
+    return true;
+}
+
+/**
+ * @brief Add a file task, optionally recording its outputs in a manifest
+ *
+ * @param pool Thread pool
+ * @param file_path Path to the audio file to process
+ * @param args Command-line arguments (shared)
+ * @param size Size of the file in bytes (its cost for largest-first scheduling)
+ * @param dir Manifest record of the file's directory (NULL outside --incremental)
+ * @return true if successful, false otherwise
+ */
+static bool add_file_task(threadpool_t *pool, const char *file_path, const waver_args_t *args, uint64_t size,
+                          waver_manifest_dir_t *dir) {
+    if (!pool || !file_path || !args) {
+        return false;
+    }
+
+    // Create a task
+    task_t task;
+    task.run = run_file_task;
+    task.args = args;
+    task.cost = size;
+    task.context = dir;
+    task.file_path = file_path;
+    return submit_input_task(pool, &task);
+}
+
+/**
+ * @brief Decode one track of a directory's atlas
+ *
+ * @param pool Thread pool running the task
+ * @param task Task holding the file path and the atlas slot of the track
+ * @return true if successful, false otherwise
+ */
+static bool run_atlas_task(threadpool_t *pool, const task_t *task) {
+    (void)pool;
+    return waver_atlas_render((waver_atlas_track_t *)task->context, task->file_path, threadpool_worker_context());
+}
+
+/**
+ * @brief Add a track of a directory's atlas to the thread pool
+ *
+ * @param pool Thread pool
+ * @param file_path Path to the audio file of the track
+ * @param args Command-line arguments (shared)
+ * @param size Size of the file in bytes (its cost for largest-first scheduling)
+ * @param track Slot of the track in the atlas
+ * @return true if successful, false otherwise
+ */
+static bool add_atlas_task(threadpool_t *pool, const char *file_path, const waver_args_t *args, uint64_t size,
+                           waver_atlas_track_t *track) {
+    task_t task;
+    task.run = run_atlas_task;
+    task.args = args;
+    task.cost = size;
+    task.context = track;
+    task.file_path = file_path;
+    return submit_input_task(pool, &task);
+}
+
+/**
+ * @brief Add a file to the thread pool
+ * 
+ * @param pool Thread pool
+ * @param file_path Path to the audio file to process
+ * @param args Command-line arguments (shared)
+ * @param size Size of the file in bytes (its cost for largest-first scheduling)
+ * @return true if successful, false otherwise
+ */
+bool threadpool_add_task(threadpool_t *pool, const char *file_path, const waver_args_t *args, uint64_t size) {
+    return add_file_task(pool, file_path, args, size, NULL);
+}
+
+/**
+ * @brief Wait for all tasks to complete and stop the workers
+ *
+ * @param pool Thread pool
+ */
+void threadpool_wait(threadpool_t *pool) {
+    if (!pool || pool->joined) {
+        return;
+    }
+
+    // Signal threads to stop once the queues are drained
+    pthread_mutex_lock(&pool->idle_mutex);
+    atomic_store(&pool->stop, true);
+    pthread_cond_broadcast(&pool->work_available);
+    pthread_cond_broadcast(&pool->resumed);
+    pthread_mutex_unlock(&pool->idle_mutex);
+
     // Wait for threads to finish
     for (size_t i = 0; i < pool->num_threads; i++) {
-        pthread_join(pool->threads[i], NULL);
+        pthread_join(pool->workers[i].thread, NULL);
     }
+
+    // Every file has been handed on by now, so the I/O threads only wait
+    if (pool->io_threads) {
+        pthread_mutex_lock(&pool->prefetch_mutex);
+        pool->prefetch_stop = true;
+        pthread_cond_broadcast(&pool->prefetch_wanted);
+        pthread_mutex_unlock(&pool->prefetch_mutex);
+        for (size_t i = 0; i < pool->io_thread_count; i++) {
+            pthread_join(pool->io_threads[i], NULL);
+        }
+    }
+    pool->joined = true;
+}
+
+/**
+ * @brief Compare two costs for sorting in descending order
+ *
+ * @param a First cost
+ * @param b Second cost
+ * @return Negative if a is larger, positive if b is larger, 0 if equal
+ */
+static int compare_costs_descending(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x < y) - (x > y);
+}
+
+/**
+ * @brief Model the makespan of the file tasks a stopped pool has run
+ *
+ * @param pool Thread pool after threadpool_wait() (largest-first only)
+ * @param modelled Receives the makespan of the model in seconds
+ * @param lower_bound Receives the larger of the busy time per worker and the longest task
+ * @param workers Receives the number of workers modelled
+ * @return true if there were tasks to model, false otherwise (or if not largest-first)
+ */
+bool threadpool_makespan(const threadpool_t *pool, double *modelled, double *lower_bound, size_t *workers) {
+    if (!pool || !pool->joined || pool->schedule != WAVER_SCHEDULE_LARGEST_FIRST) {
+        return false;
+    }
+
+    size_t count = 0;
+    uint64_t total_cost = 0;
+    double total_seconds = 0.0;
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        count += pool->workers[i].cost_count;
+        total_cost += pool->workers[i].busy_cost;
+        total_seconds += pool->workers[i].busy_seconds;
+    }
+    // The run is judged by the most tasks it really had running at once
+    size_t threads = atomic_load(&pool->peak_running);
+    threads = threads < 1 ? 1 : threads > pool->num_threads ? pool->num_threads : threads;
+    uint64_t *costs = count > 0 && total_cost > 0 ? malloc(count * sizeof(uint64_t)) : NULL;
+    double *loads = costs ? calloc(threads, sizeof(double)) : NULL;
+    if (!loads) {
+        free(costs);
+        return false;
+    }
+    size_t next = 0;
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        memcpy(costs + next, pool->workers[i].costs, pool->workers[i].cost_count * sizeof(uint64_t));
+        next += pool->workers[i].cost_count;
+    }
+
+    // Largest first, each to the worker that is free first
+    double seconds_per_cost = total_seconds / (double)total_cost;
+    qsort(costs, count, sizeof(uint64_t), compare_costs_descending);
+    for (size_t i = 0; i < count; i++) {
+        size_t least = 0;
+        for (size_t w = 1; w < threads; w++) {
+            if (loads[w] < loads[least]) {
+                least = w;
+            }
+        }
+        loads[least] += (double)costs[i] * seconds_per_cost;
+    }
+
+    *modelled = 0.0;
+    for (size_t w = 0; w < threads; w++) {
+        *modelled = loads[w] > *modelled ? loads[w] : *modelled;
+    }
+    double per_worker = total_seconds / (double)threads;
+    double longest = (double)costs[0] * seconds_per_cost;
+    *lower_bound = per_worker > longest ? per_worker : longest;
+    *workers = threads;
+
+    free(costs);
+    free(loads);
+    return true;
+}
+
+/**
+ * @brief Collect the file timings the workers of a stopped pool recorded
+ *
+ * @param pool Thread pool after threadpool_wait()
+ * @param stats Accumulator to append the records of every worker to
+ * @return true if successful, false on allocation failure
+ */
+bool threadpool_collect_stats(const threadpool_t *pool, waver_stats_t *stats) {
+    if (!pool || !pool->joined) {
+        return false;
+    }
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        if (!waver_stats_merge(stats, &pool->workers[i].stats)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Wait for all tasks to complete and destroy the thread pool
+ * 
+ * @param pool Thread pool
+ * @return true if all tasks completed successfully, false otherwise
+ */
+bool threadpool_destroy(threadpool_t *pool) {
+    if (!pool) {
+        return false;
+    }
+
+    threadpool_wait(pool);
+    waver_writer_finish(pool->writer);
     
     // Get stats
-    size_t completed_tasks = pool->completed_tasks;
-    size_t failed_tasks = pool->failed_tasks;
+    size_t completed_tasks = atomic_load(&pool->completed_tasks);
+    size_t failed_tasks = atomic_load(&pool->failed_tasks);
     
     // Clean up resources
-    pthread_mutex_destroy(&pool->queue_mutex);
-    pthread_mutex_destroy(&pool->stats_mutex);
-    pthread_cond_destroy(&pool->queue_not_empty);
-    pthread_cond_destroy(&pool->queue_not_full);
-    
-    // Clean up queue
-    for (size_t i = 0; i < pool->queue_size; i++) {
-        size_t idx = (pool->head + i) % pool->queue_capacity;
-        free(pool->queue[idx].file_path);
+    pthread_mutex_destroy(&pool->adjust_mutex);
+    pthread_cond_destroy(&pool->resumed);
+    pthread_mutex_destroy(&pool->idle_mutex);
+    pthread_cond_destroy(&pool->work_available);
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        queue_destroy(&pool->queues[i]);
+        path_block_release(pool->workers[i].paths.block);
+        waver_stats_free(&pool->workers[i].stats);
+        free(pool->workers[i].costs);
     }
+    path_block_release(pool->paths.block);
+    pthread_mutex_destroy(&pool->paths_mutex);
+    if (pool->io_threads) {
+        pthread_cond_destroy(&pool->prefetch_wanted);
+        pthread_mutex_destroy(&pool->prefetch_mutex);
+        queue_destroy(&pool->prefetch_queue);
+        free(pool->io_threads);
+    }
+    waver_dedup_free(pool->dedup);
     
-    free(pool->threads);
-    free(pool->queue);
+    free(pool->queues);
+    free(pool->workers);
     free(pool);
     
     // Return true if all tasks completed successfully
@@ -362,57 +1232,549 @@ bool threadpool_destroy(threadpool_t *pool) {
 }
 
 /**
- * @brief Scan directory recursively and add all matching files to the thread pool
- * 
+ * @brief State shared by the directory tasks of one run
+ */
+typedef struct {
+    atomic_size_t files;       // Audio files added to the pool (or skipped as unchanged)
+    waver_watch_t *watch;      // Every directory scanned is added to it (--watch only)
+} discovery_t;
+
+/**
+ * @brief State shared by the directory tasks under one path from the command line
+ */
+typedef struct {
+    discovery_t *discovery;           // Shared by every root of the run
+    waver_manifest_t *manifest;       // Manifest of the root (--incremental only)
+    waver_tree_t *tree;               // Library index of the root (--tree only)
+    const waver_args_t *rebuild_args; // The same arguments with overwrite, for stale outputs
+} scan_root_t;
+
+static bool run_directory_task(threadpool_t *pool, const task_t *task);
+
+/**
+ * @brief Add a directory to the thread pool to be scanned
+ *
  * @param pool Thread pool
  * @param dir_path Path to the directory
+ * @param args Command-line arguments (shared)
+ * @param root State shared by the directory tasks under the same root
+ * @return true if successful, false otherwise
+ */
+static bool add_directory_task(threadpool_t *pool, const char *dir_path, const waver_args_t *args,
+                               scan_root_t *root) {
+    task_t task;
+    task.run = run_directory_task;
+    task.file_path = dir_path;
+    task.args = args;
+    task.cost = UINT64_MAX; // Scans come first, so largest-first sees every file early
+    task.context = root;
+    return threadpool_submit(pool, &task);
+}
+
+/**
+ * @brief State of a directory task carrying a directory over unread
+ */
+typedef struct {
+    threadpool_t *pool;       // Pool the subdirectories are added to
+    const task_t *task;       // Task of the directory carried over
+    bool success;             // Every subdirectory was added
+} carry_run_t;
+
+/**
+ * @brief Add one subdirectory of a directory carried over unread
+ *
+ * @param context carry_run_t
+ * @param path Path of the subdirectory
+ */
+static void add_carried_subdirectory(void *context, const char *path) {
+    carry_run_t *run = (carry_run_t *)context;
+    if (!add_directory_task(run->pool, path, run->task->args, (scan_root_t *)run->task->context)) {
+        run->success = false;
+    }
+}
+
+/**
+ * @brief Entries of a directory, read in one pass before any is handled
+ */
+typedef struct {
+    char *names;              // Every name, each NUL terminated
+    size_t names_size;        // Bytes used in names
+    size_t names_capacity;    // Bytes allocated for names
+    size_t *offsets;          // Start of each entry's name in names
+    unsigned char *types;     // d_type of each entry
+    size_t count;             // Number of entries
+    size_t capacity;          // Allocated entries
+    size_t *slots;            // Hash set of entry index + 1 by name, 0 if empty (NULL if not indexed)
+    size_t slot_mask;         // Number of slots minus one
+} dir_listing_t;
+
+/**
+ * @brief FNV-1a hash of a name
+ *
+ * @param name Name
+ * @return Hash
+ */
+static size_t name_hash(const char *name) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++) {
+        hash = (hash ^ *c) * 1099511628211ull;
+    }
+    return (size_t)hash;
+}
+
+/**
+ * @brief Read every entry of a directory but "." and ".."
+ *
+ * @param dir Open directory
+ * @param listing Receives the entries (free with free_listing())
+ * @param index Also build the set that listing_has() looks names up in
+ * @return true if successful, false on allocation failure
+ */
+static bool read_listing(DIR *dir, dir_listing_t *listing, bool index) {
+    memset(listing, 0, sizeof(*listing));
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        size_t length = strlen(entry->d_name) + 1;
+        if (listing->names_size + length > listing->names_capacity) {
+            size_t capacity = listing->names_capacity ? listing->names_capacity * 2 : 4096;
+            while (capacity < listing->names_size + length) {
+                capacity *= 2;
+            }
+            char *names = realloc(listing->names, capacity);
+            if (!names) {
+                return false;
+            }
+            listing->names = names;
+            listing->names_capacity = capacity;
+        }
+        if (listing->count == listing->capacity) {
+            size_t capacity = listing->capacity ? listing->capacity * 2 : 64;
+            size_t *offsets = realloc(listing->offsets, capacity * sizeof(size_t));
+            if (!offsets) {
+                return false;
+            }
+            listing->offsets = offsets;
+            unsigned char *types = realloc(listing->types, capacity);
+            if (!types) {
+                return false;
+            }
+            listing->types = types;
+            listing->capacity = capacity;
+        }
+        memcpy(listing->names + listing->names_size, entry->d_name, length);
+        listing->offsets[listing->count] = listing->names_size;
+        listing->types[listing->count] = entry->d_type;
+        listing->names_size += length;
+        listing->count++;
+    }
+    if (!index) {
+        return true;
+    }
+
+    // At most half full, so probes stay short
+    size_t slots = 16;
+    while (slots < listing->count * 2) {
+        slots *= 2;
+    }
+    listing->slots = calloc(slots, sizeof(size_t));
+    if (!listing->slots) {
+        return false;
+    }
+    listing->slot_mask = slots - 1;
+    for (size_t i = 0; i < listing->count; i++) {
+        size_t slot = name_hash(listing->names + listing->offsets[i]) & listing->slot_mask;
+        while (listing->slots[slot]) {
+            slot = (slot + 1) & listing->slot_mask;
+        }
+        listing->slots[slot] = i + 1;
+    }
+    return true;
+}
+
+/**
+ * @brief Whether a directory listing holds a name
+ *
+ * @param listing Listing read with its set
+ * @param name Name to look up
+ * @return true if the directory has an entry of that name
+ */
+static bool listing_has(const dir_listing_t *listing, const char *name) {
+    for (size_t slot = name_hash(name) & listing->slot_mask; listing->slots[slot];
+         slot = (slot + 1) & listing->slot_mask) {
+        if (strcmp(listing->names + listing->offsets[listing->slots[slot] - 1], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Free the entries of a directory listing
+ *
+ * @param listing Listing
+ */
+static void free_listing(dir_listing_t *listing) {
+    free(listing->names);
+    free(listing->offsets);
+    free(listing->types);
+    free(listing->slots);
+}
+
+/**
+ * @brief Whether every output of an audio file is in its directory
+ *
+ * The outputs are looked up in the listing the file came from; only an
+ * output spec whose suffix leads into another directory costs an
+ * fstatat().
+ *
+ * @param listing Listing of the directory, read with its set
+ * @param fd Descriptor of the directory
+ * @param name Name of the audio file
  * @param args Command-line arguments
- * @return true if all files were added to the pool, false otherwise
+ * @return true if every output exists
  */
-static bool scan_directory(threadpool_t *pool, const char *dir_path, const waver_args_t *args) {
-    DIR *dir = opendir(dir_path);
+static bool outputs_listed(const dir_listing_t *listing, int fd, const char *name, const waver_args_t *args) {
+    char output[MAX_PATH_LENGTH];
+    unsigned int count = args->output_spec_count > 0 ? args->output_spec_count : 1;
+    for (unsigned int i = 0; i < count; i++) {
+        const char *suffix = args->output_spec_count > 0 ? args->output_specs[i].suffix : ".png";
+        int result = snprintf(output, sizeof(output), "%s%s", name, suffix);
+        if (result < 0 || (size_t)result >= sizeof(output)) {
+            return false;
+        }
+        struct stat st;
+        bool found = strchr(suffix, '/') ? fstatat(fd, output, &st, 0) == 0 : listing_has(listing, output);
+        if (!found) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Scan one directory, adding audio files and subdirectories to the thread pool
+ *
+ * Subdirectories become tasks of their own, so a tree is walked by every
+ * worker at once while the files already found are being processed.  The
+ * entry type comes from readdir() where the filesystem provides it; only
+ * unknown types and symbolic links (which are followed) need an fstatat()
+ * relative to the open directory, plus audio files when largest-first
+ * scheduling needs their size.  Paths are only built for entries that
+ * become tasks.
+ *
+ * Under --incremental every audio file is stat()ed and checked against the
+ * manifest instead: unchanged files get no task at all and stale ones are
+ * drawn again even though their outputs exist.  The directory is read in
+ * full first, so a file whose outputs were deleted is found stale in the
+ * same listing.  With --trust-dir-mtimes a
+ * directory whose modification time has not moved is not even read.
+ *
+ * Under --atlas the audio files become tracks of the directory's atlas,
+ * which is written by whichever of the scan and its track tasks finishes
+ * last.  A directory that already has an atlas index gets no tasks for
+ * its files unless --overwrite is given.
+ * 
+ * @param pool Thread pool
+ * @param task Task holding the directory path and the scan_root_t
+ * @return true if every entry was handled, false otherwise
+ */
+static bool run_directory_task(threadpool_t *pool, const task_t *task) {
+    const char *dir_path = task->file_path;
+    const waver_args_t *args = task->args;
+    scan_root_t *root = (scan_root_t *)task->context;
+    discovery_t *discovery = root->discovery;
+
+    // The modification time is taken before reading, so a file added
+    // during the scan changes it for the next run
+    waver_manifest_dir_t *record = NULL;
+    if (root->manifest) {
+        double check_start = waver_stats_now();
+        struct stat dir_st;
+        if (stat(dir_path, &dir_st) == 0) {
+            record = waver_manifest_begin_dir(root->manifest, dir_path, waver_manifest_mtime_ns(&dir_st));
+        }
+        size_t carried = 0;
+        carry_run_t carry = {pool, task, true};
+        if (record && args->trust_dir_mtimes && !args->overwrite &&
+            waver_manifest_carry_dir(record, add_carried_subdirectory, &carry, &carried)) {
+            if (discovery->watch && !waver_watch_add(discovery->watch, dir_path)) {
+                waver_print_stderr(args, "Failed to watch directory: %s (on Linux, see fs.inotify.max_user_watches)",
+                                   dir_path);
+            }
+            atomic_fetch_add(&discovery->files, carried);
+            waver_manifest_add_check_time(root->manifest, waver_stats_now() - check_start);
+            return carry.success;
+        }
+        waver_manifest_add_check_time(root->manifest, waver_stats_now() - check_start);
+    }
+
+    int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
     if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (record) {
+            waver_manifest_fail(record);
+        }
         waver_print_stderr(args, "Failed to open directory: %s", dir_path);
         return false;
     }
+
+    // Watching before reading means nothing added during the scan is missed
+    if (discovery->watch && !waver_watch_add(discovery->watch, dir_path)) {
+        waver_print_stderr(args, "Failed to watch directory: %s (on Linux, see fs.inotify.max_user_watches)",
+                           dir_path);
+    }
     
+    // Read in full first, so the outputs of a file can be looked up among its neighbours
+    bool checking = record && !args->overwrite;
+    dir_listing_t listing;
+    if (!read_listing(dir, &listing, checking)) {
+        waver_print_stderr(args, "Failed to allocate memory for the entries of %s", dir_path);
+        free_listing(&listing);
+        closedir(dir);
+        if (record) {
+            waver_manifest_fail(record);
+        }
+        return false;
+    }
+
+    // Every file is seen here anyway, so the library index costs no extra walk
+    waver_tree_dir_t *tree_dir = root->tree ? waver_tree_begin_dir(root->tree, dir_path) : NULL;
+
+    // The files of the directory go into one atlas, unless it has one already
+    waver_atlas_t *atlas = NULL;
+    bool atlas_current = args->atlas && !args->overwrite && waver_atlas_exists(dir_path);
+    if (atlas_current) {
+        waver_print_verbose(args, "Atlas of '%s' already exists - use --overwrite", dir_path);
+    } else if (args->atlas) {
+        atlas = waver_atlas_new(dir_path, args);
+        if (!atlas) {
+            waver_print_stderr(args, "Failed to allocate memory for the atlas of %s", dir_path);
+            free_listing(&listing);
+            closedir(dir);
+            return false;
+        }
+    }
+
     bool success = true;
-    struct dirent *entry;
-    
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip "." and ".."
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+    double check_seconds = 0.0;
+
+    for (size_t i = 0; i < listing.count; i++) {
+        const char *name = listing.names + listing.offsets[i];
+        unsigned char type = listing.types[i];
+        bool is_dir = type == DT_DIR;
+        bool have_stat = false;
+        struct stat st;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            have_stat = fstatat(dirfd(dir), name, &st, 0) == 0;
+            is_dir = have_stat && S_ISDIR(st.st_mode);
+        }
+        if (tree_dir && !is_dir) {
+            waver_tree_add_file(tree_dir, name);
+        }
+        if (!is_dir && !has_any_extension(name, args->file_extensions, args->extension_count)) {
             continue;
         }
+
+        // An unchanged file is settled by its stat() alone
+        const waver_args_t *file_args = args;
+        if (!is_dir && checking) {
+            double check_start = waver_stats_now();
+            if (!have_stat) {
+                have_stat = fstatat(dirfd(dir), name, &st, 0) == 0;
+            }
+            waver_manifest_state_t state = WAVER_MANIFEST_NEW;
+            if (have_stat) {
+                waver_manifest_stamp_t stamp;
+                waver_manifest_stamp(&st, &stamp);
+                state = waver_manifest_check(record, name, &stamp, outputs_listed(&listing, dirfd(dir), name, args));
+            }
+            check_seconds += waver_stats_now() - check_start;
+            if (state == WAVER_MANIFEST_UNCHANGED) {
+                atomic_fetch_add(&discovery->files, 1);
+                continue;
+            }
+            if (state == WAVER_MANIFEST_CHANGED) {
+                file_args = root->rebuild_args;
+            }
+        }
+        if (!is_dir && !have_stat && pool->schedule == WAVER_SCHEDULE_LARGEST_FIRST) {
+            have_stat = fstatat(dirfd(dir), name, &st, 0) == 0;
+        }
+        uint64_t size = have_stat && st.st_size > 0 ? (uint64_t)st.st_size : 0;
         
         // Build full path
         char full_path[MAX_PATH_LENGTH];
-        int result = snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
+        int result = snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, name);
         if (result < 0 || (size_t)result >= sizeof(full_path)) {
-            waver_print_stderr(args, "Path too long or formatting error: %s/%s", dir_path, entry->d_name);
+            waver_print_stderr(args, "Path too long or formatting error: %s/%s", dir_path, name);
+            if (record) {
+                waver_manifest_fail(record);
+            }
             continue; // Skip this entry
         }
         
-        // Process subdirectories recursively
-        if (is_directory(full_path)) {
-            if (!scan_directory(pool, full_path, args)) {
+        // Subdirectories are scanned by whichever worker gets to them first
+        if (is_dir) {
+            if (!add_directory_task(pool, full_path, args, root)) {
                 success = false;
             }
         } 
-        // Add audio files to the thread pool
-        else if (has_any_extension(entry->d_name, args->file_extensions, args->extension_count)) {
-            if (!threadpool_add_task(pool, full_path, args)) {
+        // Add tracks to the atlas, each decoded by a task of its own
+        else if (args->atlas) {
+            waver_atlas_track_t *track = atlas ? waver_atlas_add(atlas, name) : NULL;
+            if (atlas_current || (track && add_atlas_task(pool, full_path, args, size, track))) {
+                atomic_fetch_add(&discovery->files, 1);
+            } else {
+                if (track) {
+                    waver_atlas_release(atlas); // The reference the task would have dropped
+                }
                 success = false;
             }
         }
+        // Add audio files to the thread pool
+        else if (add_file_task(pool, full_path, file_args, size, record)) {
+            atomic_fetch_add(&discovery->files, 1);
+        } else {
+            success = false;
+        }
     }
     
+    free_listing(&listing);
     closedir(dir);
+    if (atlas && !waver_atlas_release(atlas)) {
+        success = false;
+    }
+    if (record) {
+        if (!success) {
+            waver_manifest_fail(record);
+        }
+        waver_manifest_add_check_time(root->manifest, check_seconds);
+    }
+    return success;
+}
+
+// Set by SIGINT and SIGTERM to end --watch
+static volatile sig_atomic_t watch_stopping = 0;
+
+/**
+ * @brief Ask the watch loop to stop
+ *
+ * @param signal_number Signal received
+ */
+static void stop_watching(int signal_number) {
+    (void)signal_number;
+    watch_stopping = 1;
+}
+
+/**
+ * @brief State of the watch loop
+ */
+typedef struct {
+    threadpool_t *pool;               // Pool the changes are queued on
+    const waver_args_t *args;         // Settings for scanning directories
+    const waver_args_t *changed_args; // The same with overwrite, for changed files
+    discovery_t *discovery;           // Shared with the directory tasks
+    scan_root_t *root;                // Directories found while watching (no manifest)
+} watch_run_t;
+
+/**
+ * @brief Queue the work for one change in a watched directory
+ *
+ * A changed audio file is rendered again even if its outputs exist, since
+ * they show its old contents.  A new directory is scanned like one given
+ * on the command line, which also starts watching it.
+ *
+ * @param context watch_run_t
+ * @param event What changed
+ * @param path Path of the file or directory
+ */
+static void queue_change(void *context, waver_watch_event_t event, const char *path) {
+    watch_run_t *run = (watch_run_t *)context;
+    const waver_args_t *args = run->args;
+
+    if (event == WAVER_WATCH_FILE) {
+        if (!has_any_extension(path, args->file_extensions, args->extension_count)) {
+            return;
+        }
+        struct stat st;
+        uint64_t size = 0;
+        if (run->pool->schedule == WAVER_SCHEDULE_LARGEST_FIRST && stat(path, &st) == 0 && st.st_size > 0) {
+            size = (uint64_t)st.st_size;
+        }
+        waver_print_verbose(args, "Changed: %s", path);
+        if (threadpool_add_task(run->pool, path, run->changed_args, size)) {
+            atomic_fetch_add(&run->discovery->files, 1);
+        }
+    } else if (event == WAVER_WATCH_DIRECTORY) {
+        waver_print_verbose(args, "New directory: %s", path);
+        add_directory_task(run->pool, path, args, run->root);
+    } else {
+        // Only missing outputs are made; changes to files that have them are lost
+        waver_print_stderr(args, "Too many changes at once, scanning all directories again");
+        for (unsigned int i = 0; i < args->path_count; i++) {
+            struct stat st;
+            if (stat(args->audio_paths[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+                add_directory_task(run->pool, args->audio_paths[i], args, run->root);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Queue changes in the watched directories until SIGINT or SIGTERM
+ *
+ * The first signal only ends the loop, so the files already queued are
+ * still finished; a second one ends the process as usual.
+ *
+ * @param watch Watch filled by the directory tasks
+ * @param run State of the loop
+ * @return true if the loop ended on a signal, false on an error
+ */
+static bool watch_for_changes(waver_watch_t *watch, watch_run_t *run) {
+    struct sigaction action;
+    struct sigaction previous_int;
+    struct sigaction previous_term;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_watching;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    watch_stopping = 0;
+    sigaction(SIGINT, &action, &previous_int);
+    sigaction(SIGTERM, &action, &previous_term);
+
+    waver_print_stdout(run->args, "Watching for new and changed audio files (Ctrl-C to stop)");
+    bool success = true;
+    while (!watch_stopping && success) {
+        success = waver_watch_poll(watch, WATCH_POLL_MS, queue_change, run);
+    }
+    if (success) {
+        waver_print_stdout(run->args, "Stopping after the queued files (Ctrl-C again to quit now)");
+    } else {
+        waver_print_stderr(run->args, "Failed to read directory changes");
+    }
+    waver_print_verbose(run->args, "Watched %u directories", waver_watch_count(watch));
+
+    sigaction(SIGINT, &previous_int, NULL);
+    sigaction(SIGTERM, &previous_term, NULL);
     return success;
 }
 
 /**
  * @brief Process audio files or directories in parallel
+ *
+ * Directories are scanned by the workers themselves, so this returns to
+ * waiting as soon as the paths on the command line have been added.
+ * With --watch every directory scanned is watched as well, and changes are
+ * queued on the same pool until SIGINT or SIGTERM.  With --incremental
+ * each directory on the command line has its manifest loaded first and
+ * written once every task has finished, and so has the library index
+ * with --tree.
  * 
  * @param args Command-line arguments
  * @param num_threads Number of worker threads to use (0 for auto)
@@ -424,41 +1786,278 @@ bool waver_process_files_parallel(const waver_args_t *args, size_t num_threads)
     }
     
     // Create thread pool
-    threadpool_t *pool = threadpool_init(num_threads);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned int flags = THREADPOOL_ADAPTIVE | (args->pin_threads ? THREADPOOL_PIN : 0);
+    threadpool_t *pool = threadpool_init(num_threads, args->schedule, flags);
     if (!pool) {
         waver_print_stderr(args, "Failed to create thread pool");
         return false;
     }
     
-    waver_print_verbose(args, "Processing files using %zu threads", pool->num_threads);
-    
-    // Collect all audio files to process
+    waver_print_verbose(args, "Processing files using %zu threads (%s)", atomic_load(&pool->active_threads),
+                        args->schedule == WAVER_SCHEDULE_LARGEST_FIRST ? "largest first" : "in order found");
+    if (pool->adaptive) {
+        waver_print_verbose(args, "%zu CPUs available; adapting between 1 and %zu threads to the time files block",
+                            pool->cpus, pool->num_threads);
+    }
+    if (pool->pin) {
+        waver_print_verbose(args, "Pinning worker threads to CPUs");
+    }
+
+    // Optional stages before and after the workers
+    if (args->io_threads > 0) {
+        if (!threadpool_start_prefetch(pool, args->io_threads, args->prefetch_depth)) {
+            waver_print_stderr(args, "Failed to start the I/O threads");
+            threadpool_destroy(pool);
+            return false;
+        }
+        waver_print_verbose(args, "Reading ahead with %zu I/O threads, up to %zu files", pool->io_thread_count,
+                            pool->prefetch_depth);
+    }
+    if (args->write_threads > 0) {
+        size_t depth = args->write_depth ? args->write_depth : 4 * pool->num_threads;
+        pool->writer = waver_writer_new(args->write_threads, depth);
+        if (!pool->writer) {
+            waver_print_stderr(args, "Failed to start the writer threads");
+            threadpool_destroy(pool);
+            return false;
+        }
+        waver_print_verbose(args, "Writing with %u threads, up to %zu PNGs queued", args->write_threads, depth);
+    }
+    if (args->dedup != WAVER_DEDUP_OFF) {
+        pool->dedup = waver_dedup_new(args->dedup, waver_manifest_params(args));
+        if (!pool->dedup) {
+            waver_print_stderr(args, "Failed to allocate memory");
+            threadpool_destroy(pool);
+            return false;
+        }
+    }
+
+    discovery_t discovery;
+    atomic_init(&discovery.files, 0);
+    discovery.watch = NULL;
+    if (args->watch) {
+        discovery.watch = waver_watch_new();
+        if (!discovery.watch) {
+            waver_print_stderr(args, "Failed to set up watching directories");
+            threadpool_destroy(pool);
+            return false;
+        }
+    }
+
+    // Stale outputs are drawn again even though they exist
+    waver_args_t rebuild_args = *args;
+    rebuild_args.overwrite = true;
+
+    // One root per path, each with its own manifest under --incremental
+    scan_root_t *roots = calloc(args->path_count + 1, sizeof(scan_root_t));
+    if (!roots) {
+        waver_print_stderr(args, "Failed to allocate memory");
+        waver_watch_free(discovery.watch);
+        threadpool_destroy(pool);
+        return false;
+    }
+    for (unsigned int i = 0; i <= args->path_count; i++) {
+        roots[i].discovery = &discovery;
+        roots[i].rebuild_args = &rebuild_args;
+    }
+    uint64_t params = args->incremental ? waver_manifest_params(args) : 0;
     bool task_added = false;
+    bool manifests_ok = true;
+    bool tree_ok = true;
+    if (args->tree) {
+        roots[0].tree = waver_tree_new(args->audio_paths[0]);
+        if (!roots[0].tree) {
+            waver_print_stderr(args, "Failed to allocate memory");
+            tree_ok = false;
+        }
+    }
     
     // Process each path
     for (unsigned int i = 0; i < args->path_count; i++) {
-        if (is_directory(args->audio_paths[i])) {
-            // Scan directory and add files to the thread pool
-            if (scan_directory(pool, args->audio_paths[i], args)) {
+        struct stat st;
+        bool have_stat = stat(args->audio_paths[i], &st) == 0;
+        if (have_stat && S_ISDIR(st.st_mode)) {
+            if (args->incremental) {
+                roots[i].manifest = waver_manifest_open(args->audio_paths[i], params);
+                if (!roots[i].manifest) {
+                    waver_print_stderr(args, "Failed to load manifest: %s", args->audio_paths[i]);
+                    manifests_ok = false;
+                }
+            }
+
+            // Let the workers scan the directory
+            if (add_directory_task(pool, args->audio_paths[i], args, &roots[i])) {
                 task_added = true;
             }
         } else if (has_any_extension(args->audio_paths[i], args->file_extensions, args->extension_count)) {
             // Add file to the thread pool
-            if (threadpool_add_task(pool, args->audio_paths[i], args)) {
+            uint64_t size = have_stat && st.st_size > 0 ? (uint64_t)st.st_size : 0;
+            if (threadpool_add_task(pool, args->audio_paths[i], args, size)) {
+                atomic_fetch_add(&discovery.files, 1);
                 task_added = true;
             }
         }
     }
     
-    // Return false if no tasks were added
-    if (!task_added) {
+    // Changed files are drawn again even though their outputs exist; new
+    // directories go to the last root, which has no manifest
+    bool watched = true;
+    if (discovery.watch) {
+        watch_run_t run = {pool, args, &rebuild_args, &discovery, &roots[args->path_count]};
+        watched = watch_for_changes(discovery.watch, &run);
+    }
+
+    // Wait for all tasks (including the directory scans) to complete; the
+    // tasks queued with rebuild_args must finish while it exists
+    threadpool_wait(pool);
+    bool written = waver_writer_finish(pool->writer);
+    pool->writer = NULL;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (pool->adaptive) {
+        waver_print_verbose(args, "Active threads: %zu to %zu", pool->fewest_active, pool->most_active);
+    }
+    waver_dedup_report(pool->dedup, args);
+
+    // Manifests are only written once nothing can add to them
+    for (unsigned int i = 0; i < args->path_count; i++) {
+        if (!roots[i].manifest) {
+            continue;
+        }
+        if (!args->dry_run && !waver_manifest_write(roots[i].manifest)) {
+            waver_print_stderr(args, "Failed to write manifest: %s/%s", args->audio_paths[i], WAVER_MANIFEST_NAME);
+            manifests_ok = false;
+        }
+        waver_manifest_report(roots[i].manifest, args);
+        waver_manifest_free(roots[i].manifest);
+    }
+
+    // The index is complete once every directory task has run
+    if (roots[0].tree) {
+        if (args->dry_run) {
+            waver_print_verbose(args, "DryRun %s", args->tree);
+        } else if (waver_tree_write(roots[0].tree, args->tree)) {
+            if (strcmp(args->tree, "-") != 0) {
+                waver_print_stdout(args, "Created %s", args->tree);
+            }
+        } else {
+            waver_print_stderr(args, "Failed to write library index: %s", args->tree);
+            tree_ok = false;
+        }
+        waver_tree_free(roots[0].tree);
+    }
+    free(roots);
+
+    // Only a largest-first run records the costs the model replays
+    double modelled;
+    double lower_bound;
+    size_t modelled_workers;
+    if (args->verbose && args->schedule == WAVER_SCHEDULE_LARGEST_FIRST &&
+        threadpool_makespan(pool, &modelled, &lower_bound, &modelled_workers)) {
+        waver_print_verbose(args, "Makespan: actual %.3f s; largest-first model of the measured tasks "
+                            "on %zu thread%s %.3f s (lower bound %.3f s)", elapsed_seconds(&start, &end),
+                            modelled_workers, modelled_workers == 1 ? "" : "s", modelled, lower_bound);
+    }
+
+    // The per-worker timings are merged only now that the workers are gone
+    bool reported = true;
+    if (args->stats || args->stats_json) {
+        waver_stats_t stats = {0};
+        reported = threadpool_collect_stats(pool, &stats) &&
+                   waver_stats_report(args, &stats, elapsed_seconds(&start, &end),
+                                      atomic_load(&pool->peak_running));
+        waver_stats_free(&stats);
+    }
+    bool success = threadpool_destroy(pool) && written && reported && watched && manifests_ok && tree_ok;
+    waver_watch_free(discovery.watch);
+
+    // Return false if no files were found (a watch may simply have seen none)
+    size_t files = atomic_load(&discovery.files);
+    waver_print_verbose(args, "Found %zu files", files);
+    if (!args->watch && (!task_added || files == 0)) {
         waver_print_stderr(args, "No files to process");
-        threadpool_destroy(pool);
         return false;
     }
     
-    // Wait for all tasks to complete
-    bool success = threadpool_destroy(pool);
-    
     return success;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Busy benchmark task
+ *
+ * @param pool Thread pool running the task
+ * @param task Task whose cost is the number of iterations to spin
+ * @return true (unless the result happens to be zero, which the compiler cannot know)
+ */
+static bool run_spin_task(threadpool_t *pool, const task_t *task) {
+    (void)pool;
+    uint32_t state = 2463534242u;
+    for (uint64_t i = 0; i < task->cost; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+    }
+    return state != 0;
+}
+
+/**
+ * @brief Run one batch of benchmark tasks on a new pool
+ *
+ * @param num_threads Number of worker threads
+ * @param spin Iterations per task
+ * @param seconds Receives the wall time from the first submit to the last task
+ * @return true if successful, false otherwise
+ */
+static bool benchmark_run(size_t num_threads, uint64_t spin, double *seconds) {
+    threadpool_t *pool = threadpool_init(num_threads, WAVER_SCHEDULE_FIFO, 0);
+    if (!pool) {
+        return false;
+    }
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool success = true;
+    task_t task = {run_spin_task, NULL, NULL, spin, NULL, false};
+    for (size_t i = 0; success && i < BENCHMARK_TASKS; i++) {
+        success = threadpool_submit(pool, &task);
+    }
+    success = threadpool_destroy(pool) && success;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *seconds = elapsed_seconds(&start, &end);
+    return success;
+}
+
+/**
+ * @brief Measure how task throughput scales with the number of threads
+ *
+ * @param max_threads Largest pool to measure
+ * @return true if successful, false otherwise
+ */
+bool threadpool_benchmark(size_t max_threads) {
+    waver_console_flush();
+    printf("Scheduler benchmark: %d tasks per run, %zu available CPUs\n",
+           BENCHMARK_TASKS, threadpool_default_threads());
+    printf("threads  empty tasks/s  short tasks/s  speedup\n");
+
+    double base_seconds = 0.0;
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        double empty_seconds;
+        double short_seconds;
+        if (!benchmark_run(threads, 0, &empty_seconds) ||
+            !benchmark_run(threads, BENCHMARK_SPIN, &short_seconds)) {
+            fprintf(stderr, "Benchmark failed with %zu threads\n", threads);
+            return false;
+        }
+        if (threads == 1) {
+            base_seconds = short_seconds;
+        }
+        printf("%7zu  %13.0f  %13.0f  %7.2f\n", threads, BENCHMARK_TASKS / empty_seconds,
+               BENCHMARK_TASKS / short_seconds, base_seconds / short_seconds);
+        fflush(stdout);
+    }
+    return true;
+}
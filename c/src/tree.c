@@ -0,0 +1,506 @@
+/**
+ * @file tree.c
+ * @brief Library index for the web player, built during the scan (--tree)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "tree.h"
+#include "console.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PATH_LENGTH 1024
+
+// Written before the tree, as Music.py does
+#define TREE_HEADER "// Simple Web Audio Player - Copyright Michael Sinz\n\nconst mp3 = "
+
+/**
+ * @brief Record of one directory
+ */
+struct waver_tree_dir_t {
+    waver_tree_t *tree;    /**< Index the directory belongs to */
+    char *path;            /**< Path relative to the root ("" for the root itself) */
+    char **files;          /**< Names of its MP3 files without the extension */
+    size_t file_count;     /**< Entries in files */
+    size_t file_capacity;  /**< Allocated entries in files */
+    bool cover;            /**< Has a Cover.jpg */
+    bool back;             /**< Has a Back.jpg */
+    bool failed;           /**< A file could not be recorded */
+};
+
+/**
+ * @brief Index of one root directory
+ */
+struct waver_tree_t {
+    char *root;                 /**< Path of the root as given */
+    pthread_mutex_t mutex;      /**< Held to add a directory */
+    waver_tree_dir_t **dirs;    /**< Records in the order begun */
+    size_t count;               /**< Number of records */
+    size_t capacity;            /**< Allocated entries in dirs */
+    bool failed;                /**< A directory could not be recorded */
+};
+
+/**
+ * @brief Start an empty index of one root directory
+ *
+ * @param root Directory given on the command line
+ * @return New index or NULL on allocation failure
+ */
+waver_tree_t *waver_tree_new(const char *root) {
+    waver_tree_t *tree = calloc(1, sizeof(waver_tree_t));
+    if (!tree) {
+        return NULL;
+    }
+    tree->root = strdup(root);
+    if (!tree->root || pthread_mutex_init(&tree->mutex, NULL) != 0) {
+        free(tree->root);
+        free(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+/**
+ * @brief Path of a directory relative to the root, without repeated slashes
+ *
+ * @param tree Index of the root
+ * @param path Path of the directory
+ * @param buffer Receives the relative path
+ * @param size Size of buffer
+ * @return true if successful, false if the path is hidden, outside the root or too long
+ */
+static bool relative_path(const waver_tree_t *tree, const char *path, char *buffer, size_t size) {
+    size_t root_length = strlen(tree->root);
+    if (strncmp(path, tree->root, root_length) != 0) {
+        return false;
+    }
+
+    size_t length = 0;
+    bool component_start = true;
+    for (const char *c = path + root_length; *c; c++) {
+        if (*c == '/') {
+            component_start = true;
+            continue;
+        }
+        if (component_start) {
+            // Music.py does not descend into hidden directories
+            if (*c == '.') {
+                return false;
+            }
+            if (length > 0) {
+                buffer[length++] = '/';
+            }
+            component_start = false;
+        }
+        if (length + 2 > size) {
+            return false;
+        }
+        buffer[length++] = *c;
+    }
+    buffer[length] = '\0';
+    return true;
+}
+
+/**
+ * @brief Start the record of one directory
+ *
+ * @param tree Index of the root
+ * @param path Path of the directory (the root path or a path built from it)
+ * @return Record to add the directory's files to, or NULL if it is not indexed
+ */
+waver_tree_dir_t *waver_tree_begin_dir(waver_tree_t *tree, const char *path) {
+    char relative[MAX_PATH_LENGTH];
+    if (!relative_path(tree, path, relative, sizeof(relative))) {
+        return NULL;
+    }
+
+    waver_tree_dir_t *dir = calloc(1, sizeof(waver_tree_dir_t));
+    if (dir) {
+        dir->tree = tree;
+        dir->path = strdup(relative);
+    }
+
+    pthread_mutex_lock(&tree->mutex);
+    if (dir && dir->path && tree->count == tree->capacity) {
+        size_t capacity = tree->capacity ? tree->capacity * 2 : 64;
+        waver_tree_dir_t **dirs = realloc(tree->dirs, capacity * sizeof(waver_tree_dir_t *));
+        if (dirs) {
+            tree->dirs = dirs;
+            tree->capacity = capacity;
+        }
+    }
+    bool added = dir && dir->path && tree->count < tree->capacity;
+    if (added) {
+        tree->dirs[tree->count++] = dir;
+    } else {
+        tree->failed = true;
+    }
+    pthread_mutex_unlock(&tree->mutex);
+
+    if (!added) {
+        if (dir) {
+            free(dir->path);
+            free(dir);
+        }
+        return NULL;
+    }
+    return dir;
+}
+
+/**
+ * @brief Note one file (not a directory) of a directory
+ *
+ * @param dir Record of the directory
+ * @param name Name of the file
+ */
+void waver_tree_add_file(waver_tree_dir_t *dir, const char *name) {
+    if (name[0] == '.') {
+        return;
+    }
+    if (strcmp(name, "Cover.jpg") == 0) {
+        dir->cover = true;
+        return;
+    }
+    if (strcmp(name, "Back.jpg") == 0) {
+        dir->back = true;
+        return;
+    }
+    size_t length = strlen(name);
+    if (length < 4 || strcmp(name + length - 4, ".mp3") != 0) {
+        return;
+    }
+
+    if (dir->file_count == dir->file_capacity) {
+        size_t capacity = dir->file_capacity ? dir->file_capacity * 2 : 16;
+        char **files = realloc(dir->files, capacity * sizeof(char *));
+        if (!files) {
+            dir->failed = true;
+            return;
+        }
+        dir->files = files;
+        dir->file_capacity = capacity;
+    }
+    char *file = strndup(name, length - 4);
+    if (!file) {
+        dir->failed = true;
+        return;
+    }
+    dir->files[dir->file_count++] = file;
+}
+
+/**
+ * @brief One character of a path as it orders component by component
+ *
+ * The end of a component ranks below any character, so "a" and its
+ * subdirectories sort before "a b".
+ *
+ * @param c Character
+ * @return Rank of the character
+ */
+static unsigned int path_rank(char c) {
+    return c == '\0' ? 0u : c == '/' ? 1u : (unsigned int)(unsigned char)c + 2u;
+}
+
+/**
+ * @brief Order two records by path, component by component
+ *
+ * @param a First record pointer
+ * @param b Second record pointer
+ * @return Negative, zero or positive
+ */
+static int compare_dirs(const void *a, const void *b) {
+    const char *x = (*(const waver_tree_dir_t *const *)a)->path;
+    const char *y = (*(const waver_tree_dir_t *const *)b)->path;
+    while (*x && *x == *y) {
+        x++;
+        y++;
+    }
+    return (int)path_rank(*x) - (int)path_rank(*y);
+}
+
+/**
+ * @brief Order two file names as strcmp() does
+ *
+ * @param a First name pointer
+ * @param b Second name pointer
+ * @return Negative, zero or positive
+ */
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/**
+ * @brief Write a string as json.dumps(ensure_ascii=False) writes it
+ *
+ * @param file Output
+ * @param text NUL-terminated text
+ */
+static void write_json_string(FILE *file, const char *text) {
+    fputc('"', file);
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        switch (*c) {
+        case '"':  fputs("\\\"", file); break;
+        case '\\': fputs("\\\\", file); break;
+        case '\n': fputs("\\n", file); break;
+        case '\r': fputs("\\r", file); break;
+        case '\t': fputs("\\t", file); break;
+        case '\b': fputs("\\b", file); break;
+        case '\f': fputs("\\f", file); break;
+        default:
+            if (*c < 0x20) {
+                fprintf(file, "\\u%04x", *c);
+            } else {
+                fputc(*c, file);
+            }
+        }
+    }
+    fputc('"', file);
+}
+
+/**
+ * @brief Shape of the sorted records as a tree
+ */
+typedef struct {
+    size_t *first_child;  /**< First subdirectory of each record (SIZE_MAX for none) */
+    size_t *next_sibling; /**< Next subdirectory of the same parent (SIZE_MAX for none) */
+    bool *content;        /**< Whether there are MP3s in or below each record */
+} tree_shape_t;
+
+/**
+ * @brief Write the subdirectories with MP3s in or below them as a "Folders" object
+ *
+ * @param file Output
+ * @param dirs Sorted records
+ * @param shape Tree shape
+ * @param child First subdirectory (SIZE_MAX for none)
+ * @param separator Written before "Folders" if there is anything to write
+ */
+static void write_folders(FILE *file, waver_tree_dir_t *const *dirs, const tree_shape_t *shape, size_t child,
+                          const char *separator);
+
+/**
+ * @brief Write one directory as an object
+ *
+ * @param file Output
+ * @param dirs Sorted records
+ * @param shape Tree shape
+ * @param index Record to write
+ */
+static void write_dir(FILE *file, waver_tree_dir_t *const *dirs, const tree_shape_t *shape, size_t index) {
+    waver_tree_dir_t *dir = dirs[index];
+    const char *separator = "";
+    fputc('{', file);
+    if (dir->cover) {
+        fprintf(file, "\"Cover\":%d", dir->back ? 2 : 1);
+        separator = ",";
+    }
+    if (dir->file_count > 0) {
+        qsort(dir->files, dir->file_count, sizeof(char *), compare_names);
+        fprintf(file, "%s\"Files\":[", separator);
+        for (size_t i = 0; i < dir->file_count; i++) {
+            if (i > 0) {
+                fputc(',', file);
+            }
+            write_json_string(file, dir->files[i]);
+        }
+        fputc(']', file);
+        separator = ",";
+    }
+    write_folders(file, dirs, shape, shape->first_child[index], separator);
+    fputc('}', file);
+}
+
+static void write_folders(FILE *file, waver_tree_dir_t *const *dirs, const tree_shape_t *shape, size_t child,
+                          const char *separator) {
+    bool first = true;
+    for (; child != SIZE_MAX; child = shape->next_sibling[child]) {
+        if (!shape->content[child]) {
+            continue;
+        }
+        fprintf(file, first ? "%s\"Folders\":{" : ",", separator);
+        first = false;
+        const char *name = strrchr(dirs[child]->path, '/');
+        write_json_string(file, name ? name + 1 : dirs[child]->path);
+        fputc(':', file);
+        write_dir(file, dirs, shape, child);
+    }
+    if (!first) {
+        fputc('}', file);
+    }
+}
+
+/**
+ * @brief Write the whole tree as JSON
+ *
+ * @param tree Index of the root with its records sorted
+ * @param file Output
+ * @return true if successful, false on allocation failure
+ */
+static bool write_tree(waver_tree_t *tree, FILE *file) {
+    size_t count = tree->count;
+    tree_shape_t shape;
+    shape.first_child = malloc((count + 1) * sizeof(size_t));
+    shape.next_sibling = malloc((count + 1) * sizeof(size_t));
+    shape.content = calloc(count + 1, sizeof(bool));
+    size_t *stack = malloc((count + 1) * sizeof(size_t));
+    size_t *last_child = malloc((count + 1) * sizeof(size_t));
+    size_t *parent = malloc((count + 1) * sizeof(size_t));
+    bool success = shape.first_child && shape.next_sibling && shape.content && stack && last_child && parent;
+
+    // Entry count stands for the root, whose own files Music.py skips; the
+    // records are in depth-first order, so a record's parent is the closest
+    // record before it that is a prefix of its path
+    size_t root = count;
+    if (success) {
+        for (size_t i = 0; i <= count; i++) {
+            shape.first_child[i] = SIZE_MAX;
+            shape.next_sibling[i] = SIZE_MAX;
+            last_child[i] = SIZE_MAX;
+        }
+        size_t depth = 0;
+        for (size_t i = 0; i < count; i++) {
+            const char *path = tree->dirs[i]->path;
+            parent[i] = SIZE_MAX;
+            if (path[0] == '\0') {
+                continue;
+            }
+            while (depth > 0) {
+                const char *above = tree->dirs[stack[depth - 1]]->path;
+                size_t length = strlen(above);
+                if (strncmp(path, above, length) == 0 && path[length] == '/') {
+                    break;
+                }
+                depth--;
+            }
+            const char *slash = strrchr(path, '/');
+            size_t up = depth > 0 ? stack[depth - 1] : root;
+            size_t up_length = up == root ? 0 : strlen(tree->dirs[up]->path);
+            if ((slash ? (size_t)(slash - path) : 0) != up_length) {
+                continue; // Its parent was not read, so neither would Music.py
+            }
+            parent[i] = up;
+            if (last_child[up] == SIZE_MAX) {
+                shape.first_child[up] = i;
+            } else {
+                shape.next_sibling[last_child[up]] = i;
+            }
+            last_child[up] = i;
+            stack[depth++] = i;
+        }
+        for (size_t i = count; i-- > 0;) {
+            shape.content[i] = shape.content[i] || (parent[i] != SIZE_MAX && tree->dirs[i]->file_count > 0);
+            if (shape.content[i] && parent[i] != SIZE_MAX) {
+                shape.content[parent[i]] = true;
+            }
+        }
+
+        fputc('{', file);
+        write_folders(file, tree->dirs, &shape, shape.first_child[root], "");
+        fputc('}', file);
+    }
+
+    free(shape.first_child);
+    free(shape.next_sibling);
+    free(shape.content);
+    free(stack);
+    free(last_child);
+    free(parent);
+    return success;
+}
+
+/**
+ * @brief Write the index once every directory has been read
+ *
+ * The JSON is built in memory first, because Music.py breaks the line
+ * after every "}," of the finished text, names included.
+ *
+ * @param tree Index of the root
+ * @param path File to write ("-" for stdout)
+ * @return true if successful, false otherwise (also if a record ran out of memory)
+ */
+bool waver_tree_write(waver_tree_t *tree, const char *path) {
+    bool success = !tree->failed;
+    for (size_t i = 0; i < tree->count; i++) {
+        success = success && !tree->dirs[i]->failed;
+    }
+    if (!success) {
+        return false;
+    }
+    qsort(tree->dirs, tree->count, sizeof(waver_tree_dir_t *), compare_dirs);
+
+    char *json = NULL;
+    size_t json_size = 0;
+    FILE *memory = open_memstream(&json, &json_size);
+    if (!memory) {
+        return false;
+    }
+    success = write_tree(tree, memory);
+    success = fclose(memory) == 0 && success;
+    if (!success) {
+        free(json);
+        return false;
+    }
+
+    bool to_stdout = strcmp(path, "-") == 0;
+    char temp_path[MAX_PATH_LENGTH];
+    int result = snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE *file = to_stdout ? stdout
+                           : result >= 0 && (size_t)result < sizeof(temp_path) ? fopen(temp_path, "w") : NULL;
+    if (!file) {
+        free(json);
+        return false;
+    }
+    if (to_stdout) {
+        waver_console_flush();
+    }
+    fputs(TREE_HEADER, file);
+    for (const char *next = json, *end; *next; next = end + 2) {
+        end = strstr(next, "},");
+        if (!end) {
+            fputs(next, file);
+            break;
+        }
+        fwrite(next, 1, (size_t)(end - next), file);
+        fputs("},\n", file);
+    }
+    fputc(';', file);
+    free(json);
+
+    success = !ferror(file);
+    if (to_stdout) {
+        return fflush(file) == 0 && success;
+    }
+    success = fclose(file) == 0 && success;
+    success = success && rename(temp_path, path) == 0;
+    if (!success) {
+        remove(temp_path);
+    }
+    return success;
+}
+
+/**
+ * @brief Free an index
+ *
+ * @param tree Index (may be NULL)
+ */
+void waver_tree_free(waver_tree_t *tree) {
+    if (!tree) {
+        return;
+    }
+    for (size_t i = 0; i < tree->count; i++) {
+        for (size_t f = 0; f < tree->dirs[i]->file_count; f++) {
+            free(tree->dirs[i]->files[f]);
+        }
+        free(tree->dirs[i]->files);
+        free(tree->dirs[i]->path);
+        free(tree->dirs[i]);
+    }
+    free(tree->dirs);
+    pthread_mutex_destroy(&tree->mutex);
+    free(tree->root);
+    free(tree);
+}
@@ -0,0 +1,469 @@
+/**
+ * @file watch.c
+ * @brief Change notification for watched directories (--watch)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "watch.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Build with -DWAVER_WATCH_POLL to use the portable backend on Linux too
+#if defined(__linux__) && !defined(WAVER_WATCH_POLL)
+#define WATCH_INOTIFY 1
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#else
+#include <dirent.h>
+#endif
+
+#define MAX_PATH_LENGTH 4096
+
+#ifdef WATCH_INOTIFY
+
+// Files are reported once written and closed or renamed into place, never
+// while they are still being written; new directories as soon as they exist
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR)
+
+/**
+ * @brief Directories watched through one inotify instance
+ */
+struct waver_watch_t {
+    int fd;                 /**< inotify instance */
+    pthread_mutex_t mutex;  /**< Guards paths */
+    char **paths;           /**< Directory path by watch descriptor (NULL if unused) */
+    size_t capacity;        /**< Entries in paths */
+    unsigned int count;     /**< Directories being watched */
+};
+
+/**
+ * @brief Create an empty watch
+ *
+ * @return New watch or NULL on error (for example no inotify instances left)
+ */
+waver_watch_t *waver_watch_new(void) {
+    waver_watch_t *watch = calloc(1, sizeof(waver_watch_t));
+    if (!watch) {
+        return NULL;
+    }
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0 || pthread_mutex_init(&watch->mutex, NULL) != 0) {
+        if (watch->fd >= 0) {
+            close(watch->fd);
+        }
+        free(watch);
+        return NULL;
+    }
+    return watch;
+}
+
+/**
+ * @brief Start watching one directory (not its subdirectories)
+ *
+ * @param watch Watch
+ * @param path Path of the directory
+ * @return true if successful, false if the directory cannot be watched
+ */
+bool waver_watch_add(waver_watch_t *watch, const char *path) {
+    // Fails with ENOSPC when fs.inotify.max_user_watches is used up
+    int wd = inotify_add_watch(watch->fd, path, WATCH_MASK);
+    if (wd < 0) {
+        return false;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        return false;
+    }
+
+    pthread_mutex_lock(&watch->mutex);
+    if ((size_t)wd >= watch->capacity) {
+        size_t capacity = watch->capacity ? watch->capacity * 2 : 64;
+        while (capacity <= (size_t)wd) {
+            capacity *= 2;
+        }
+        char **paths = realloc(watch->paths, capacity * sizeof(char *));
+        if (!paths) {
+            pthread_mutex_unlock(&watch->mutex);
+            free(copy);
+            return false;
+        }
+        memset(paths + watch->capacity, 0, (capacity - watch->capacity) * sizeof(char *));
+        watch->paths = paths;
+        watch->capacity = capacity;
+    }
+
+    // The same directory (maybe under another name) keeps its descriptor
+    if (watch->paths[wd]) {
+        free(watch->paths[wd]);
+    } else {
+        watch->count++;
+    }
+    watch->paths[wd] = copy;
+    pthread_mutex_unlock(&watch->mutex);
+    return true;
+}
+
+/**
+ * @brief Report one inotify event
+ *
+ * @param watch Watch
+ * @param event Event read from the instance
+ * @param fn Receives the change
+ * @param context Passed to fn
+ */
+static void report_event(waver_watch_t *watch, const struct inotify_event *event, waver_watch_fn fn,
+                         void *context) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        fn(context, WAVER_WATCH_OVERFLOW, NULL);
+        return;
+    }
+
+    // The directory was deleted or unmounted
+    if (event->mask & IN_IGNORED) {
+        pthread_mutex_lock(&watch->mutex);
+        if (event->wd >= 0 && (size_t)event->wd < watch->capacity && watch->paths[event->wd]) {
+            free(watch->paths[event->wd]);
+            watch->paths[event->wd] = NULL;
+            watch->count--;
+        }
+        pthread_mutex_unlock(&watch->mutex);
+        return;
+    }
+
+    bool is_directory = (event->mask & IN_ISDIR) != 0;
+    waver_watch_event_t type;
+    if (is_directory && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+        type = WAVER_WATCH_DIRECTORY;
+    } else if (!is_directory && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))) {
+        type = WAVER_WATCH_FILE;
+    } else {
+        return;
+    }
+
+    // The path is copied so that fn runs without the lock
+    char path[MAX_PATH_LENGTH];
+    int length = -1;
+    pthread_mutex_lock(&watch->mutex);
+    if (event->len > 0 && event->wd >= 0 && (size_t)event->wd < watch->capacity && watch->paths[event->wd]) {
+        length = snprintf(path, sizeof(path), "%s/%s", watch->paths[event->wd], event->name);
+    }
+    pthread_mutex_unlock(&watch->mutex);
+    if (length > 0 && (size_t)length < sizeof(path)) {
+        fn(context, type, path);
+    }
+}
+
+/**
+ * @brief Wait for changes and report them
+ *
+ * @param watch Watch
+ * @param timeout_ms Longest time to wait for a change
+ * @param fn Receives every change
+ * @param context Passed to fn
+ * @return true if successful (also on a timeout or a signal), false on error
+ */
+bool waver_watch_poll(waver_watch_t *watch, int timeout_ms, waver_watch_fn fn, void *context) {
+    struct pollfd descriptor = {watch->fd, POLLIN, 0};
+    int ready = poll(&descriptor, 1, timeout_ms);
+    if (ready <= 0) {
+        return ready == 0 || errno == EINTR;
+    }
+
+    _Alignas(struct inotify_event) char buffer[65536];
+    for (;;) {
+        ssize_t length = read(watch->fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            return length == 0 || errno == EAGAIN || errno == EINTR;
+        }
+        for (char *next = buffer; next < buffer + length;) {
+            const struct inotify_event *event = (const struct inotify_event *)next;
+            report_event(watch, event, fn, context);
+            next += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+/**
+ * @brief Number of directories being watched
+ *
+ * @param watch Watch
+ * @return Number of directories
+ */
+unsigned int waver_watch_count(waver_watch_t *watch) {
+    pthread_mutex_lock(&watch->mutex);
+    unsigned int count = watch->count;
+    pthread_mutex_unlock(&watch->mutex);
+    return count;
+}
+
+/**
+ * @brief Stop watching and free a watch
+ *
+ * @param watch Watch (may be NULL)
+ */
+void waver_watch_free(waver_watch_t *watch) {
+    if (!watch) {
+        return;
+    }
+    close(watch->fd);
+    for (size_t i = 0; i < watch->capacity; i++) {
+        free(watch->paths[i]);
+    }
+    free(watch->paths);
+    pthread_mutex_destroy(&watch->mutex);
+    free(watch);
+}
+
+#else /* !WATCH_INOTIFY */
+
+// Files whose status changed less than this long ago may still be being
+// written, so they are left for a later poll
+#define WATCH_SETTLE_SECONDS 2
+
+/**
+ * @brief One polled directory
+ */
+typedef struct {
+    char *path;     /**< Path of the directory (NULL once it is gone) */
+    time_t mtime;   /**< Modification time when it was last read */
+    time_t since;   /**< Files changed after this have not been reported yet */
+    bool settling;  /**< Some files were too recent to report */
+} watched_directory_t;
+
+/**
+ * @brief Directories polled for changes
+ */
+struct waver_watch_t {
+    pthread_mutex_t mutex;             /**< Guards directories */
+    watched_directory_t *directories;  /**< Directories in the order added */
+    unsigned int used;                 /**< Entries in directories */
+    unsigned int capacity;             /**< Allocated entries */
+    unsigned int count;                /**< Directories still there */
+};
+
+/**
+ * @brief Create an empty watch
+ *
+ * @return New watch or NULL on error
+ */
+waver_watch_t *waver_watch_new(void) {
+    waver_watch_t *watch = calloc(1, sizeof(waver_watch_t));
+    if (!watch) {
+        return NULL;
+    }
+    if (pthread_mutex_init(&watch->mutex, NULL) != 0) {
+        free(watch);
+        return NULL;
+    }
+    return watch;
+}
+
+/**
+ * @brief Find a directory by path
+ *
+ * @param watch Watch (locked)
+ * @param path Path of the directory
+ * @return true if the directory is watched
+ */
+static bool is_watched(const waver_watch_t *watch, const char *path) {
+    for (unsigned int i = 0; i < watch->used; i++) {
+        if (watch->directories[i].path && strcmp(watch->directories[i].path, path) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Start watching one directory (not its subdirectories)
+ *
+ * @param watch Watch
+ * @param path Path of the directory
+ * @return true if successful, false if the directory cannot be watched
+ */
+bool waver_watch_add(waver_watch_t *watch, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return false;
+    }
+
+    bool ok = true;
+    pthread_mutex_lock(&watch->mutex);
+    if (!is_watched(watch, path)) {
+        if (watch->used == watch->capacity) {
+            unsigned int capacity = watch->capacity ? watch->capacity * 2 : 64;
+            watched_directory_t *directories = realloc(watch->directories,
+                                                       capacity * sizeof(watched_directory_t));
+            if (directories) {
+                watch->directories = directories;
+                watch->capacity = capacity;
+            }
+        }
+        char *copy = watch->used < watch->capacity ? strdup(path) : NULL;
+        if (copy) {
+            // The caller scans the directory right after this; a file changed
+            // within the same second may be reported by both
+            watched_directory_t *directory = &watch->directories[watch->used++];
+            directory->path = copy;
+            directory->mtime = st.st_mtime;
+            directory->since = time(NULL) - 1;
+            directory->settling = false;
+            watch->count++;
+        } else {
+            ok = false;
+        }
+    }
+    pthread_mutex_unlock(&watch->mutex);
+    return ok;
+}
+
+/**
+ * @brief Read a changed directory and report what changed in it
+ *
+ * @param watch Watch
+ * @param path Path of the directory
+ * @param since Files changed after this are reported
+ * @param now Current time
+ * @param fn Receives every change
+ * @param context Passed to fn
+ * @return true if some files were too recent to report
+ */
+static bool scan_directory(waver_watch_t *watch, const char *path, time_t since, time_t now,
+                           waver_watch_fn fn, void *context) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return false;
+    }
+
+    bool settling = false;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char full_path[MAX_PATH_LENGTH];
+        int length = snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (length < 0 || (size_t)length >= sizeof(full_path) || stat(full_path, &st) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            pthread_mutex_lock(&watch->mutex);
+            bool known = is_watched(watch, full_path);
+            pthread_mutex_unlock(&watch->mutex);
+            if (!known) {
+                fn(context, WAVER_WATCH_DIRECTORY, full_path);
+            }
+        } else if (S_ISREG(st.st_mode) && st.st_ctime > since) {
+            // The status change time also moves on a rename and cannot be
+            // set back like the modification time (cp -p, rsync -a)
+            if (st.st_ctime > now - WATCH_SETTLE_SECONDS) {
+                settling = true;
+            } else {
+                fn(context, WAVER_WATCH_FILE, full_path);
+            }
+        }
+    }
+    closedir(dir);
+    return settling;
+}
+
+/**
+ * @brief Wait for changes and report them
+ *
+ * Sleeps for the timeout, then reads every directory whose modification
+ * time moved (or that had files too recent to report) once more.
+ *
+ * @param watch Watch
+ * @param timeout_ms Time to wait before looking for changes
+ * @param fn Receives every change
+ * @param context Passed to fn
+ * @return true (a directory that cannot be read is skipped)
+ */
+bool waver_watch_poll(waver_watch_t *watch, int timeout_ms, waver_watch_fn fn, void *context) {
+    struct timespec delay = {timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+
+    pthread_mutex_lock(&watch->mutex);
+    unsigned int used = watch->used;
+    pthread_mutex_unlock(&watch->mutex);
+
+    // Entries are only ever appended, so indexes stay valid without the lock
+    for (unsigned int i = 0; i < used; i++) {
+        char path[MAX_PATH_LENGTH];
+        pthread_mutex_lock(&watch->mutex);
+        watched_directory_t directory = watch->directories[i];
+        if (directory.path) {
+            snprintf(path, sizeof(path), "%s", directory.path);
+        }
+        pthread_mutex_unlock(&watch->mutex);
+        if (!directory.path) {
+            continue;
+        }
+
+        struct stat st;
+        time_t now = time(NULL);
+        if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            pthread_mutex_lock(&watch->mutex);
+            free(watch->directories[i].path);
+            watch->directories[i].path = NULL;
+            watch->count--;
+            pthread_mutex_unlock(&watch->mutex);
+            continue;
+        }
+
+        // A change within the second of the last read leaves the time as it was
+        if (!directory.settling && st.st_mtime == directory.mtime &&
+            st.st_mtime < now - WATCH_SETTLE_SECONDS) {
+            continue;
+        }
+        bool settling = scan_directory(watch, path, directory.since, now, fn, context);
+
+        pthread_mutex_lock(&watch->mutex);
+        watch->directories[i].mtime = st.st_mtime;
+        watch->directories[i].since = now - WATCH_SETTLE_SECONDS;
+        watch->directories[i].settling = settling;
+        pthread_mutex_unlock(&watch->mutex);
+    }
+    return true;
+}
+
+/**
+ * @brief Number of directories being watched
+ *
+ * @param watch Watch
+ * @return Number of directories
+ */
+unsigned int waver_watch_count(waver_watch_t *watch) {
+    pthread_mutex_lock(&watch->mutex);
+    unsigned int count = watch->count;
+    pthread_mutex_unlock(&watch->mutex);
+    return count;
+}
+
+/**
+ * @brief Stop watching and free a watch
+ *
+ * @param watch Watch (may be NULL)
+ */
+void waver_watch_free(waver_watch_t *watch) {
+    if (!watch) {
+        return;
+    }
+    for (unsigned int i = 0; i < watch->used; i++) {
+        free(watch->directories[i].path);
+    }
+    free(watch->directories);
+    pthread_mutex_destroy(&watch->mutex);
+    free(watch);
+}
+
+#endif /* WATCH_INOTIFY */
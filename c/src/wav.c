@@ -0,0 +1,515 @@
+/**
+ * @file wav.c
+ * @brief PCM audio in WAV, RF64 and BW64 files, read in place
+ *
+ * There is nothing to decode: the samples are reduced to column peaks
+ * straight from the memory mapping.  16-bit little-endian samples are
+ * handed to the peak kernels where they lie, without a copy; 8, 24 and
+ * 32-bit integer and 32-bit float samples are narrowed to 16 bits a small
+ * block at a time, which stays in the L1 cache.  Long files are split
+ * into segments reduced on separate threads, since every sample can be
+ * found from its index.
+ */
+
+#include "format.h"
+#include "waver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// WAVE format tags (and the first two bytes of an extensible subformat GUID)
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_FLOAT 0x0003
+#define WAV_FORMAT_EXTENSIBLE 0xfffe
+
+// A 32-bit chunk size that means "see the ds64 chunk" in RF64 and BW64
+#define WAV_SIZE_IN_DS64 0xffffffffu
+
+// Samples narrowed to 16 bits per block
+#define NARROW_SAMPLES 4096
+
+// Sample frames handed to the peak kernels at once when no narrowing is needed
+#define DIRECT_FRAMES 65536
+
+// Shortest stretch of audio (sample frames) worth its own thread
+#define MIN_SEGMENT_FRAMES (1u << 20)
+
+// Bytes of a mapped input the reader moves past before they are released
+#define RELEASE_BYTES (1024 * 1024)
+
+/**
+ * @brief Where the samples of a WAV file are and how they are stored
+ */
+typedef struct {
+    const uint8_t *data;       /**< First sample frame */
+    uint64_t frames;           /**< Sample frames in the data chunk (clamped to the file) */
+    unsigned int channels;     /**< Interleaved channels */
+    unsigned int sample_rate;  /**< Sample rate in Hz */
+    unsigned int bytes;        /**< Bytes per sample (1 to 4) */
+    bool is_float;             /**< Samples are IEEE floats (32-bit only) */
+    unsigned int block_align;  /**< Bytes per sample frame */
+} wav_stream_t;
+
+/**
+ * @brief What parse_wav() found in a RIFF file
+ */
+typedef enum {
+    WAV_PARSED = 0,  /**< PCM or float samples this reader handles */
+    WAV_OTHER,       /**< A valid WAVE file holding something else, such as MP3 */
+    WAV_INVALID      /**< Not a WAVE file, or a damaged one */
+} wav_parse_t;
+
+/**
+ * @brief Read a little-endian 16-bit value
+ *
+ * @param p First byte
+ * @return Value
+ */
+static unsigned int read_le16(const uint8_t *p) {
+    return (unsigned int)p[0] | (unsigned int)p[1] << 8;
+}
+
+/**
+ * @brief Read a little-endian 32-bit value
+ *
+ * @param p First byte
+ * @return Value
+ */
+static uint32_t read_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * @brief Read a little-endian 64-bit value
+ *
+ * @param p First byte
+ * @return Value
+ */
+static uint64_t read_le64(const uint8_t *p) {
+    return (uint64_t)read_le32(p) | (uint64_t)read_le32(p + 4) << 32;
+}
+
+/**
+ * @brief Check for a RIFF, RF64 or BW64 header of type WAVE
+ *
+ * @param data First bytes of the file
+ * @param size Number of bytes in data
+ * @return true if the file is a WAVE file, false otherwise
+ */
+static bool probe_wav(const uint8_t *data, size_t size) {
+    return size >= 12 &&
+           (memcmp(data, "RIFF", 4) == 0 || memcmp(data, "RF64", 4) == 0 || memcmp(data, "BW64", 4) == 0) &&
+           memcmp(data + 8, "WAVE", 4) == 0;
+}
+
+/**
+ * @brief Find the format and the samples of a WAVE file
+ *
+ * Walks the chunks up to the data chunk.  RF64 and BW64 files keep the
+ * 64-bit data size in a ds64 chunk; a data chunk that claims more than the
+ * file holds (a recording that was never finished) is cut to the file.
+ *
+ * @param data The whole file
+ * @param size Size of the file in bytes
+ * @param wav Receives the layout of the samples
+ * @return Whether the file holds samples this reader handles
+ */
+static wav_parse_t parse_wav(const uint8_t *data, size_t size, wav_stream_t *wav) {
+    if (!probe_wav(data, size)) {
+        return WAV_INVALID;
+    }
+
+    uint64_t ds64_data_size = 0;
+    bool have_format = false;
+    unsigned int tag = 0;
+    unsigned int bits = 0;
+    memset(wav, 0, sizeof(*wav));
+
+    uint64_t offset = 12;
+    while (offset + 8 <= size) {
+        const uint8_t *chunk = data + offset;
+        uint64_t chunk_size = read_le32(chunk + 4);
+        uint64_t body = offset + 8;
+        uint64_t available = size - body;
+
+        if (memcmp(chunk, "ds64", 4) == 0 && chunk_size >= 24 && available >= 24) {
+            ds64_data_size = read_le64(chunk + 8 + 8);
+        } else if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16 && available >= 16) {
+            const uint8_t *fmt = chunk + 8;
+            tag = read_le16(fmt);
+            wav->channels = read_le16(fmt + 2);
+            wav->sample_rate = read_le32(fmt + 4);
+            wav->block_align = read_le16(fmt + 12);
+            bits = read_le16(fmt + 14);
+            if (tag == WAV_FORMAT_EXTENSIBLE && chunk_size >= 40 && available >= 40) {
+                tag = read_le16(fmt + 24);
+            }
+            have_format = true;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_format) {
+                return WAV_INVALID;
+            }
+            if (chunk_size == WAV_SIZE_IN_DS64 && ds64_data_size > 0) {
+                chunk_size = ds64_data_size;
+            }
+            if (chunk_size > available) {
+                chunk_size = available;
+            }
+            wav->data = data + body;
+
+            if (tag != WAV_FORMAT_PCM && tag != WAV_FORMAT_FLOAT) {
+                return WAV_OTHER;
+            }
+            wav->bytes = bits / 8;
+            wav->is_float = tag == WAV_FORMAT_FLOAT;
+            bool supported = wav->is_float ? bits == 32 : (bits == 8 || bits == 16 || bits == 24 || bits == 32);
+            if (!supported || wav->channels == 0 || wav->channels > NARROW_SAMPLES || wav->sample_rate == 0 ||
+                wav->block_align != wav->channels * wav->bytes) {
+                return WAV_INVALID;
+            }
+            wav->frames = chunk_size / wav->block_align;
+            return wav->frames > 0 ? WAV_PARSED : WAV_INVALID;
+        }
+
+        // Chunks are padded to an even size
+        offset = body + chunk_size + (chunk_size & 1);
+    }
+    return WAV_INVALID;
+}
+
+/**
+ * @brief Narrow the first two channels of a run of sample frames to 16 bits
+ *
+ * Integer samples keep their top 16 bits, as a decoder would produce them.
+ *
+ * @param wav Layout of the samples
+ * @param frame First sample frame of the run
+ * @param frames Number of sample frames
+ * @param channels Channels to keep (1 or 2)
+ * @param pcm Receives frames * channels interleaved samples
+ */
+static void narrow_samples(const wav_stream_t *wav, const uint8_t *frame, size_t frames, unsigned int channels,
+                           int16_t *pcm) {
+    size_t stride = wav->block_align;
+    if (wav->is_float) {
+        for (size_t i = 0; i < frames; i++, frame += stride) {
+            for (unsigned int c = 0; c < channels; c++) {
+                float f;
+                memcpy(&f, frame + 4 * c, sizeof(f));
+                f *= 32768.0f;
+                if (f != f) {
+                    *pcm++ = 0; // NaN
+                } else {
+                    *pcm++ = f >= 32767.0f ? 32767 : f <= -32768.0f ? -32768 : (int16_t)f;
+                }
+            }
+        }
+    } else if (wav->bytes == 1) {
+        // 8-bit samples are unsigned
+        for (size_t i = 0; i < frames; i++, frame += stride) {
+            for (unsigned int c = 0; c < channels; c++) {
+                *pcm++ = (int16_t)(((int)frame[c] - 128) * 256);
+            }
+        }
+    } else {
+        // The top two bytes of a little-endian sample of 2, 3 or 4 bytes
+        const uint8_t *top = frame + wav->bytes - 2;
+        for (size_t i = 0; i < frames; i++, top += stride) {
+            for (unsigned int c = 0; c < channels; c++) {
+                const uint8_t *sample = top + c * wav->bytes;
+                *pcm++ = (int16_t)(uint16_t)(sample[0] | sample[1] << 8);
+            }
+        }
+    }
+}
+
+/**
+ * @brief One range of sample frames reduced by its own thread
+ */
+typedef struct {
+    const wav_stream_t *wav;            /**< Layout of the samples */
+    const waver_input_t *input;         /**< Mapping the samples are in (pages are released behind the reader) */
+    size_t layout_count;                /**< Number of image widths */
+    waver_column_peaks_t *peaks;        /**< Column peaks of this segment, one per width */
+    uint64_t first_frame;               /**< First sample frame of the segment */
+    uint64_t end_frame;                 /**< One past the last sample frame */
+    bool build_sidecar;                 /**< Collect sidecar bins for the segment */
+    waver_sidecar_builder_t *sidecar;   /**< Sidecar bins of the segment */
+    bool timed;                         /**< Measure the phases of the segment */
+    waver_file_stats_t timing;          /**< Phase times of the segment */
+    bool success;                       /**< Result of the segment */
+} wav_segment_t;
+
+/**
+ * @brief Reduce one segment of a file to its own column peaks
+ *
+ * @param segment Segment to reduce
+ * @return true if successful, false otherwise
+ */
+static bool reduce_segment(wav_segment_t *segment) {
+    const wav_stream_t *wav = segment->wav;
+    unsigned int channels = wav->channels > 2 ? 2 : wav->channels;
+
+    // 16-bit samples in the host's order can be read where they are
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    bool direct = wav->bytes == 2 && !wav->is_float && ((uintptr_t)wav->data & 1) == 0;
+#else
+    bool direct = false;
+#endif
+
+    waver_peaks_t **peaks = calloc(segment->layout_count, sizeof(waver_peaks_t *));
+    bool success = peaks != NULL;
+    for (size_t i = 0; success && i < segment->layout_count; i++) {
+        peaks[i] = waver_peaks_new(segment->peaks[i].width, wav->frames, 1, segment->first_frame);
+        success = peaks[i] != NULL;
+    }
+    if (success && segment->build_sidecar) {
+        segment->sidecar = waver_sidecar_builder_new(channels, wav->sample_rate, segment->first_frame);
+        success = segment->sidecar != NULL;
+    }
+
+    int16_t buffer[NARROW_SAMPLES];
+    size_t block_frames = direct ? DIRECT_FRAMES : NARROW_SAMPLES / channels;
+    const uint8_t *released = wav->data + segment->first_frame * wav->block_align;
+    waver_file_stats_t *timing = segment->timed ? &segment->timing : NULL;
+    double mark = timing ? waver_stats_now() : 0.0;
+
+    for (uint64_t frame = segment->first_frame; success && frame < segment->end_frame;) {
+        size_t frames = segment->end_frame - frame < block_frames ? (size_t)(segment->end_frame - frame)
+                                                                  : block_frames;
+        const uint8_t *start = wav->data + frame * wav->block_align;
+        const int16_t *pcm = (const int16_t *)(const void *)start;
+        unsigned int stride = wav->channels;
+        if (!direct) {
+            narrow_samples(wav, start, frames, channels, buffer);
+            pcm = buffer;
+            stride = channels;
+            if (timing) {
+                double now = waver_stats_now();
+                timing->seconds[WAVER_PHASE_DECODE] += now - mark;
+                mark = now;
+            }
+        }
+
+        for (size_t i = 0; success && i < segment->layout_count; i++) {
+            success = waver_peaks_add(peaks[i], pcm, frames, stride);
+        }
+        if (success && segment->sidecar) {
+            success = waver_sidecar_builder_add(segment->sidecar, pcm, frames, stride);
+        }
+        frame += frames;
+        if (timing) {
+            double now = waver_stats_now();
+            timing->seconds[WAVER_PHASE_PEAKS] += now - mark;
+            mark = now;
+        }
+
+        const uint8_t *end = start + frames * wav->block_align;
+        if ((size_t)(end - released) >= RELEASE_BYTES) {
+            waver_input_release(segment->input, (size_t)(released - segment->input->data),
+                                (size_t)(end - segment->input->data));
+            released = end;
+        }
+    }
+
+    for (size_t i = 0; success && i < segment->layout_count; i++) {
+        waver_peaks_finish(peaks[i], segment->peaks[i].left, segment->peaks[i].right);
+    }
+    if (timing) {
+        timing->seconds[WAVER_PHASE_PEAKS] += waver_stats_now() - mark;
+    }
+    for (size_t i = 0; peaks && i < segment->layout_count; i++) {
+        waver_peaks_free(peaks[i]);
+    }
+    free(peaks);
+    return success;
+}
+
+/**
+ * @brief Thread entry point for a segment
+ *
+ * @param arg Segment
+ * @return NULL
+ */
+static void *segment_thread(void *arg) {
+    wav_segment_t *segment = (wav_segment_t *)arg;
+    segment->success = reduce_segment(segment);
+    return NULL;
+}
+
+/**
+ * @brief Reduce the samples of a parsed file, split over several threads if it is long
+ *
+ * @param wav Layout of the samples
+ * @param input Mapping the samples are in
+ * @param layouts Column peaks to fill, one per image width
+ * @param layout_count Number of layouts
+ * @param decode_threads Threads to use for this file
+ * @param sidecar Receives the sidecar bins of the file, or NULL
+ * @param timing Receives the phase times summed over the segments, or NULL
+ * @return true if successful, false otherwise
+ */
+static bool reduce_stream(const wav_stream_t *wav, const waver_input_t *input,
+                          waver_column_peaks_t *layouts, size_t layout_count, unsigned int decode_threads,
+                          waver_sidecar_builder_t **sidecar, waver_file_stats_t *timing) {
+    uint64_t count = decode_threads;
+    if (count > wav->frames / MIN_SEGMENT_FRAMES) {
+        count = wav->frames / MIN_SEGMENT_FRAMES;
+    }
+    unsigned int segment_count = count > 1 ? (unsigned int)count : 1;
+
+    wav_segment_t *segments = calloc(segment_count, sizeof(wav_segment_t));
+    pthread_t *threads = calloc(segment_count, sizeof(pthread_t));
+    bool *started = calloc(segment_count, sizeof(bool));
+    waver_column_peaks_t *peaks = calloc((size_t)segment_count * layout_count, sizeof(waver_column_peaks_t));
+    uint16_t **buffers = calloc(segment_count, sizeof(uint16_t *));
+    bool success = segments && threads && started && peaks && buffers;
+
+    for (unsigned int i = 0; success && i < segment_count; i++) {
+        segments[i].wav = wav;
+        segments[i].input = input;
+        segments[i].layout_count = layout_count;
+        segments[i].first_frame = wav->frames * i / segment_count;
+        segments[i].end_frame = wav->frames * (i + 1) / segment_count;
+        segments[i].build_sidecar = sidecar != NULL;
+        segments[i].timed = timing != NULL;
+        if (segment_count == 1) {
+            // A single segment fills the caller's columns directly
+            segments[i].peaks = layouts;
+        } else {
+            segments[i].peaks = peaks + (size_t)i * layout_count;
+            buffers[i] = waver_column_peaks_alloc(layouts, layout_count, segments[i].peaks);
+            success = buffers[i] != NULL;
+        }
+    }
+
+    if (success) {
+        for (unsigned int i = 1; i < segment_count; i++) {
+            started[i] = pthread_create(&threads[i], NULL, segment_thread, &segments[i]) == 0;
+        }
+
+        // This thread takes the first segment and any that failed to start
+        for (unsigned int i = 0; i < segment_count; i++) {
+            if (!started[i]) {
+                segment_thread(&segments[i]);
+            }
+        }
+        for (unsigned int i = 0; i < segment_count; i++) {
+            if (started[i]) {
+                pthread_join(threads[i], NULL);
+            }
+            if (!segments[i].success) {
+                success = false;
+            }
+            for (size_t phase = 0; timing && phase < WAVER_PHASE_COUNT; phase++) {
+                timing->seconds[phase] += segments[i].timing.seconds[phase];
+            }
+        }
+    }
+
+    // Merge the segments; a column split between segments takes the larger peak
+    double start = timing ? waver_stats_now() : 0.0;
+    for (size_t l = 0; success && segment_count > 1 && l < layout_count; l++) {
+        for (unsigned int x = 0; x < layouts[l].width; x++) {
+            uint16_t left = 0;
+            uint16_t right = 0;
+            for (unsigned int i = 0; i < segment_count; i++) {
+                const waver_column_peaks_t *segment = &segments[i].peaks[l];
+                left = segment->left[x] > left ? segment->left[x] : left;
+                right = segment->right[x] > right ? segment->right[x] : right;
+            }
+            layouts[l].left[x] = left;
+            layouts[l].right[x] = right;
+        }
+    }
+    if (timing) {
+        timing->seconds[WAVER_PHASE_PEAKS] += waver_stats_now() - start;
+    }
+
+    // Stitch the sidecar bins of the segments together in order
+    for (unsigned int i = 1; segments && i < segment_count; i++) {
+        if (success && sidecar && !waver_sidecar_builder_append(segments[0].sidecar, segments[i].sidecar)) {
+            success = false;
+        }
+        waver_sidecar_builder_free(segments[i].sidecar);
+    }
+    if (segments) {
+        if (success && sidecar) {
+            *sidecar = segments[0].sidecar;
+        } else {
+            waver_sidecar_builder_free(segments[0].sidecar);
+        }
+    }
+
+    for (unsigned int i = 0; buffers && i < segment_count; i++) {
+        free(buffers[i]);
+    }
+    free(buffers);
+    free(peaks);
+    free(segments);
+    free(threads);
+    free(started);
+    return success;
+}
+
+/**
+ * @brief Reduce a WAV file to column peaks for one or more image widths
+ *
+ * A file given without a mapping is mapped here, since the samples are
+ * only ever read in place.  A WAVE file that holds compressed audio, such
+ * as MP3 in a RIFF wrapper, is passed on to the MP3 decoder.
+ *
+ * @param input_path Path to the input audio file (NULL if input is the caller's memory)
+ * @param input Mapping of the file, or NULL to map it here
+ * @param layouts Column peaks to fill, one per image width
+ * @param layout_count Number of layouts
+ * @param options Decode threads (the other settings only apply to MP3)
+ * @param sidecar Receives the sidecar bins of the file, or NULL to skip them
+ * @param channel_count Receives the number of channels drawn (1 or 2)
+ * @param timing Receives the phase times, input size and audio length, or NULL
+ * @return true if successful, false otherwise
+ */
+static bool decode_wav(const char *input_path, const waver_input_t *input,
+                       waver_column_peaks_t *layouts, size_t layout_count,
+                       const waver_decode_options_t *options, waver_sidecar_builder_t **sidecar,
+                       unsigned int *channel_count, waver_file_stats_t *timing) {
+    double start = timing ? waver_stats_now() : 0.0;
+    waver_input_t mapped;
+    if (!input) {
+        if (!input_path || !waver_input_open(input_path, &mapped)) {
+            return false;
+        }
+        input = &mapped;
+    }
+
+    wav_stream_t wav;
+    wav_parse_t parsed = parse_wav(input->data, input->size, &wav);
+    if (timing) {
+        timing->seconds[WAVER_PHASE_OPEN] += waver_stats_now() - start;
+    }
+
+    bool success;
+    if (parsed == WAV_PARSED) {
+        if (timing) {
+            timing->input_bytes = input->size;
+            timing->audio_seconds = (double)wav.frames / wav.sample_rate;
+        }
+        *channel_count = wav.channels > 2 ? 2 : wav.channels;
+        success = reduce_stream(&wav, input, layouts, layout_count,
+                                options->decode_threads > 1 ? options->decode_threads : 1, sidecar, timing);
+    } else if (parsed == WAV_OTHER) {
+        success = waver_format_mp3.decode(input_path, input, layouts, layout_count, options, sidecar,
+                                          channel_count, timing);
+    } else {
+        success = false;
+    }
+
+    if (input == &mapped) {
+        waver_input_close(&mapped);
+    }
+    return success;
+}
+
+const waver_format_t waver_format_wav = {"wav", probe_wav, decode_wav};
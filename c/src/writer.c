@@ -0,0 +1,242 @@
+/**
+ * @file writer.c
+ * @brief Writer stage: threads that put finished PNGs on disk (--write-threads)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "writer.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// PNGs a writer thread takes from the queue at once
+#define WRITE_BATCH 16
+
+/**
+ * @brief One PNG waiting to be written
+ */
+typedef struct {
+    char *path;                /**< Path of the output file */
+    uint8_t *data;             /**< Encoded PNG */
+    size_t size;               /**< Size of the PNG */
+    const waver_args_t *args;  /**< Arguments for the messages */
+    char *note;                /**< Verbose line printed after "Created" (may be NULL) */
+} write_item_t;
+
+struct waver_writer_t {
+    pthread_t *threads;        /**< Writer threads */
+    size_t thread_count;       /**< Number of writer threads started */
+    write_item_t *items;       /**< Ring buffer of queued PNGs */
+    size_t depth;              /**< Capacity of the ring */
+    size_t head;               /**< Index of the oldest queued PNG */
+    size_t count;              /**< Number of queued PNGs */
+    bool stopping;             /**< No more PNGs are coming */
+    size_t failures;           /**< PNGs that could not be written */
+    pthread_mutex_t mutex;     /**< Guards the ring and the flags */
+    pthread_cond_t queued;     /**< Signalled when a PNG is queued or the stage stops */
+    pthread_cond_t room;       /**< Signalled when PNGs are taken from the ring */
+};
+
+/**
+ * @brief Free what a queued PNG holds
+ *
+ * @param item Queued PNG
+ */
+static void item_free(write_item_t *item) {
+    free(item->path);
+    free(item->data);
+    free(item->note);
+}
+
+/**
+ * @brief Write one PNG and report it
+ *
+ * @param item Queued PNG
+ * @return true if successful, false otherwise
+ */
+static bool write_item(const write_item_t *item) {
+    FILE *fp = fopen(item->path, "wb");
+    bool success = fp && fwrite(item->data, 1, item->size, fp) == item->size;
+    if (fp && fclose(fp) != 0) {
+        success = false;
+    }
+    if (!success) {
+        waver_print_stderr(item->args, "Failed to save PNG file: %s", item->path);
+        return false;
+    }
+    waver_print_stdout(item->args, "Created %s", item->path);
+    if (item->note) {
+        waver_print_verbose(item->args, "%s", item->note);
+    }
+    return true;
+}
+
+/**
+ * @brief Body of a writer thread: take batches of PNGs until the stage stops
+ *
+ * @param arg Writer stage
+ * @return NULL
+ */
+static void *writer_thread(void *arg) {
+    waver_writer_t *writer = arg;
+    write_item_t batch[WRITE_BATCH];
+
+    pthread_mutex_lock(&writer->mutex);
+    for (;;) {
+        while (writer->count == 0 && !writer->stopping) {
+            pthread_cond_wait(&writer->queued, &writer->mutex);
+        }
+        if (writer->count == 0) {
+            break;
+        }
+        size_t taken = 0;
+        while (writer->count > 0 && taken < WRITE_BATCH) {
+            batch[taken++] = writer->items[writer->head];
+            writer->head = (writer->head + 1) % writer->depth;
+            writer->count--;
+        }
+        pthread_cond_broadcast(&writer->room);
+        pthread_mutex_unlock(&writer->mutex);
+
+        size_t failed = 0;
+        for (size_t i = 0; i < taken; i++) {
+            if (!write_item(&batch[i])) {
+                failed++;
+            }
+            item_free(&batch[i]);
+        }
+
+        pthread_mutex_lock(&writer->mutex);
+        writer->failures += failed;
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return NULL;
+}
+
+/**
+ * @brief Start a writer stage
+ *
+ * @param threads Number of writer threads (at least 1)
+ * @param depth Number of PNGs that may wait to be written (at least 1)
+ * @return New stage or NULL on error
+ */
+waver_writer_t *waver_writer_new(size_t threads, size_t depth) {
+    if (threads == 0 || depth == 0) {
+        return NULL;
+    }
+    waver_writer_t *writer = calloc(1, sizeof(waver_writer_t));
+    if (!writer) {
+        return NULL;
+    }
+    writer->depth = depth;
+    writer->items = calloc(depth, sizeof(write_item_t));
+    writer->threads = calloc(threads, sizeof(pthread_t));
+    if (!writer->items || !writer->threads) {
+        free(writer->items);
+        free(writer->threads);
+        free(writer);
+        return NULL;
+    }
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->queued, NULL);
+    pthread_cond_init(&writer->room, NULL);
+
+    while (writer->thread_count < threads &&
+           pthread_create(&writer->threads[writer->thread_count], NULL, writer_thread, writer) == 0) {
+        writer->thread_count++;
+    }
+    if (writer->thread_count == 0) {
+        waver_writer_finish(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+/**
+ * @brief Append bytes to a PNG in memory (a waver_write_fn)
+ *
+ * @param context waver_writer_buffer_t to grow
+ * @param data Bytes to append
+ * @param size Number of bytes
+ * @return true if successful, false on allocation failure
+ */
+bool waver_writer_buffer_write(void *context, const void *data, size_t size) {
+    waver_writer_buffer_t *buffer = context;
+    if (size > buffer->capacity - buffer->size) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 16384;
+        while (capacity - buffer->size < size) {
+            capacity *= 2;
+        }
+        uint8_t *grown = realloc(buffer->data, capacity);
+        if (!grown) {
+            return false;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return true;
+}
+
+/**
+ * @brief Queue a PNG to be written, waiting while the queue is full
+ *
+ * @param writer Writer stage
+ * @param path Path of the output file
+ * @param buffer Encoded PNG (emptied)
+ * @param args Command-line arguments, for the messages (must outlive the stage)
+ * @param note Verbose line to print after "Created" (NULL for none)
+ * @return true if queued, false on allocation failure
+ */
+bool waver_writer_submit(waver_writer_t *writer, const char *path, waver_writer_buffer_t *buffer,
+                         const waver_args_t *args, const char *note) {
+    write_item_t item = {strdup(path), buffer->data, buffer->size, args, note ? strdup(note) : NULL};
+    buffer->data = NULL;
+    buffer->capacity = 0;
+    buffer->size = 0;
+    if (!item.path) {
+        item_free(&item);
+        return false;
+    }
+
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->count == writer->depth) {
+        pthread_cond_wait(&writer->room, &writer->mutex);
+    }
+    writer->items[(writer->head + writer->count) % writer->depth] = item;
+    writer->count++;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->mutex);
+    return true;
+}
+
+/**
+ * @brief Write everything still queued, stop the threads and free the stage
+ *
+ * @param writer Writer stage (may be NULL)
+ * @return true if every PNG was written, false otherwise
+ */
+bool waver_writer_finish(waver_writer_t *writer) {
+    if (!writer) {
+        return true;
+    }
+    pthread_mutex_lock(&writer->mutex);
+    writer->stopping = true;
+    pthread_cond_broadcast(&writer->queued);
+    pthread_mutex_unlock(&writer->mutex);
+    for (size_t i = 0; i < writer->thread_count; i++) {
+        pthread_join(writer->threads[i], NULL);
+    }
+
+    bool success = writer->failures == 0;
+    pthread_cond_destroy(&writer->room);
+    pthread_cond_destroy(&writer->queued);
+    pthread_mutex_destroy(&writer->mutex);
+    free(writer->items);
+    free(writer->threads);
+    free(writer);
+    return success;
+}